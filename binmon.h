@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "vpb.h"
+
+//
+// Binary monitor stream (ATBM): what the adapter sends instead of ELM text while binary
+// monitoring, and the decoder for host tools (shared like vpb.h)
+//
+//   record:  <sync 0xA5> <length:1> <delta usec:4> <flags:1> <payload: length bytes> <check:1>
+//
+// The check byte is the J1850 CRC of everything after the sync byte, so a reader that joins
+// mid-stream (or loses bytes) finds the next record by looking for a sync byte whose record
+// checks out.  The delta is relative to the previous record; a SYNC record carries an absolute
+// <sec:4> <usec:4> payload and starts the chain: one opens the stream, and the adapter sends
+// another whenever a delta would not fit (or would be negative, e.g. a notification stamped
+// after frames still queued).  Frames carry their mode in the flags; notifications and bus
+// errors ([BREAK], [BUS ERROR], ...) go out-of-band as TEXT records.  An END record closes the
+// stream, after which the adapter is back to text ("STOPPED" and the prompt).  Any input ends
+// binary monitoring, as with ATMA.
+//
+// ATBMC sends the same records compressed, for slow links such as Bluetooth.  The SYNC record
+// that opens it has the COMPRESSED flag, and the records after it are laid out as
+//
+//   compact: <sync 0xA5> <length:1> <flags:1> <delta usec: LEB128> <payload: length bytes> <check:1>
+//
+// (SYNC and END records keep the full layout).  Frames are compressed against the VPB2
+// dictionary (vpb.h), the last frame seen for each header: a frame identical to its entry is
+// sent as just the slot (REPEAT: COMPRESSED without FRAME), one of the same length as the slot,
+// a bitmask of the changed bytes and those bytes (DELTA: COMPRESSED with FRAME), and anything
+// else in full, replacing the entry.  Each record keeps its own delta, so the decoder restores
+// the exact stream, timestamps included.  Both sides clear the dictionary at every SYNC, which
+// the adapter repeats every BINMON_SYNC_INTERVAL seconds so a reader can join or recover.  A
+// periodic frame then costs 7 bytes, and one with a changed byte or two about 10.
+//
+// Multi-byte values are little-endian.
+//
+// Sustained rates (8N1, 10 bits per byte): a record is 8 bytes plus the frame, so a typical
+// 7-byte frame takes 15 bytes where ATH1 ATS1 ATTS1 ATVM1 text takes about 40.
+//
+//   link            bytes/s   7-byte frames/s   12-byte frames/s
+//   115200 UART       11520               768                576
+//   230400 UART       23040              1536               1152
+//   460800 UART       46080              3072               2304
+//   1M UART (ATBRD)  100000              6666               5000
+//   2M UART (ATBRD)  200000             13333              10000
+//   USB CDC         ~500000            ~33000             ~25000
+//
+// For comparison a saturated bus carries about 170 such frames/s at 1X and 700 at 4X, so even
+// 115200 baud keeps up with a busy 4X bus, which ELM text cannot.
+//
+
+#define BINMON_SYNC 0xA5
+#define BINMON_OVERHEAD 8   // sync, length, delta, flags and check
+
+#ifndef BINMON_SYNC_INTERVAL
+#define BINMON_SYNC_INTERVAL 5 // seconds between SYNC records in a compressed stream
+#endif
+
+enum binmonFlags : uint8_t {
+    BINMON_MODE_MASK = 0x03, // 0 = unspecified, 1 = 1X, 2 = 4X (as in VPB)
+    BINMON_FRAME     = 0x04, // payload is frame bytes
+    BINMON_TEXT      = 0x08, // payload is text: a notification or, with BINMON_ERROR, a bus error
+    BINMON_ERROR     = 0x10,
+    BINMON_SYNC_TIME = 0x20, // payload is an absolute timestamp
+    BINMON_END       = 0x40, // end of the stream
+    BINMON_COMPRESSED = 0x80 // SYNC: compressed records follow; otherwise REPEAT or DELTA (see above)
+};
+
+// the J1850 CRC (as J1850::CRC), computed bitwise so the host side needs no table
+inline uint8_t binmonCheck(const uint8_t* data, size_t size) {
+    uint8_t crc = 0xFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x1D : crc << 1;
+    }
+    return crc ^ 0xFF;
+}
+
+struct BinMonRecord {
+    uint8_t flags = 0;
+    uint32_t sec = 0;
+    uint32_t usec = 0;
+    std::vector<uint8_t> frame;
+    std::string text;
+
+    // 1 = 1X, 4 = 4X, 0 = unspecified (same as Message::mode)
+    uint8_t mode() const {
+        uint8_t m = flags & BINMON_MODE_MASK;
+        return m == 2 ? 4 : m;
+    }
+};
+
+class BinMonEncoder {
+private:
+    uint32_t lastSec = 0;
+    uint32_t lastUsec = 0;
+    uint32_t syncSec = 0;
+    VpbDictionary dictionary;
+
+    static void put32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out.push_back((value >> (8 * i)) & 0xFF);
+    }
+
+    void put(std::string& out, uint8_t flags, uint32_t delta, const uint8_t* payload, size_t size) {
+        size_t start = out.size();
+        out.push_back(BINMON_SYNC);
+        out.push_back(size);
+        put32(out, delta);
+        out.push_back(flags);
+        out.append((const char*)payload, size);
+        out.push_back(binmonCheck((const uint8_t*)out.data() + start + 1, out.size() - start - 1));
+        bytes += out.size() - start;
+    }
+
+    void putCompact(std::string& out, uint8_t flags, uint32_t delta, const uint8_t* payload, size_t size) {
+        size_t start = out.size();
+        out.push_back(BINMON_SYNC);
+        out.push_back(size);
+        out.push_back(flags);
+        do {
+            out.push_back((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0));
+            delta >>= 7;
+        } while (delta);
+        out.append((const char*)payload, size);
+        out.push_back(binmonCheck((const uint8_t*)out.data() + start + 1, out.size() - start - 1));
+        bytes += out.size() - start;
+    }
+
+public:
+    bool compress = false;  // ATBMC; takes effect at the next sync()
+
+    // instrumentation: what was sent, and what the full layout would have taken
+    uint64_t bytes = 0;
+    uint64_t plainBytes = 0;
+
+    void sync(std::string& out, uint32_t sec, uint32_t usec) {
+        uint8_t payload[8];
+        for (int i = 0; i < 4; i++) {
+            payload[i] = (sec >> (8 * i)) & 0xFF;
+            payload[4 + i] = (usec >> (8 * i)) & 0xFF;
+        }
+        put(out, BINMON_SYNC_TIME | (compress ? BINMON_COMPRESSED : 0), 0, payload, sizeof(payload));
+        plainBytes += BINMON_OVERHEAD + sizeof(payload);
+        lastSec = sec;
+        lastUsec = usec;
+        syncSec = sec;
+        dictionary.clear();
+    }
+
+    // appends a frame or text record (text longer than a record allows is cut)
+    void record(std::string& out, uint32_t sec, uint32_t usec, uint8_t mode, uint8_t flags, const uint8_t* payload, size_t size) {
+        int64_t delta = ((int64_t)sec - lastSec) * 1000000 + ((int64_t)usec - lastUsec);
+        if (delta < 0 || delta > UINT32_MAX || (compress && sec - syncSec >= BINMON_SYNC_INTERVAL)) {
+            sync(out, sec, usec);
+            delta = 0;
+        }
+        lastSec = sec;
+        lastUsec = usec;
+        flags |= (mode == 4 ? 2 : mode == 1 ? 1 : 0);
+        size = size < 0xFF ? size : 0xFF;
+        plainBytes += BINMON_OVERHEAD + size;
+        if (!compress)
+            return put(out, flags, (uint32_t)delta, payload, size);
+
+        int slot = (flags & BINMON_FRAME) ? dictionary.find(payload, size) : -1;
+        if (slot >= 0 && dictionary.length(slot) == size) {
+            // same header, same length: only what changed, if that's smaller than the frame
+            const uint8_t* previous = dictionary.frame(slot);
+            uint8_t changes[1 + (VPB_DICTIONARY_FRAME + 7) / 8 + VPB_DICTIONARY_FRAME] = { (uint8_t)slot };
+            uint8_t* mask = changes + 1;
+            size_t maskSize = (size + 7) / 8;
+            size_t changed = 0;
+            for (size_t i = 0; i < size; i++) {
+                if (payload[i] != previous[i]) {
+                    mask[i / 8] |= 1 << (i % 8);
+                    changes[1 + maskSize + changed++] = payload[i];
+                }
+            }
+            if (changed && 1 + maskSize + changed >= size) {
+                putCompact(out, flags, delta, payload, size);
+            } else if (changed)
+                putCompact(out, flags | BINMON_COMPRESSED, delta, changes, 1 + maskSize + changed);
+            else
+                putCompact(out, (flags & ~BINMON_FRAME) | BINMON_COMPRESSED, delta, changes, 1);
+            dictionary.update(slot, payload, size);
+            return;
+        }
+        putCompact(out, flags, delta, payload, size);
+        if (flags & BINMON_FRAME)
+            dictionary.update(slot, payload, size);
+    }
+
+    void end(std::string& out) {
+        put(out, BINMON_END, 0, nullptr, 0);
+        plainBytes += BINMON_OVERHEAD;
+    }
+};
+
+//
+// Host side: feed it whatever arrives; it calls back with each record that checks out (frames
+// decompressed) and skips anything else (text before the stream, corrupted or partial records)
+//
+class BinMonDecoder {
+private:
+    std::vector<uint8_t> buffer;
+    uint32_t lastSec = 0;
+    uint32_t lastUsec = 0;
+    bool compressed = false;    // since the last SYNC
+    bool synced = false;        // compressed records can't be decoded before a SYNC
+    VpbDictionary dictionary;
+
+    static uint32_t get32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    // a record of either layout at p (a sync byte); returns its size, 0 if it needs more
+    // bytes, -1 if it doesn't check out
+    int parse(const uint8_t* p, size_t available, BinMonRecord& record, uint32_t& delta, const uint8_t*& payload, size_t& length) {
+        if (available < 2)
+            return 0;
+        length = p[1];
+        if (compressed) {
+            // compact: flags, then the LEB128 delta
+            size_t i = 3;
+            delta = 0;
+            for (int shift = 0; i < available && shift < 35; shift += 7) {
+                delta |= (uint32_t)(p[i] & 0x7F) << shift;
+                if (!(p[i++] & 0x80))
+                    break;
+            }
+            size_t total = i + length + 1;
+            if (i >= available || total > available)
+                return 0;
+            if (binmonCheck(p + 1, total - 2) == p[total - 1]) {
+                record.flags = p[2];
+                payload = p + i;
+                return total;
+            }
+        }
+        size_t total = BINMON_OVERHEAD + length;
+        if (total > available)
+            return 0;
+        if (binmonCheck(p + 1, total - 2) != p[total - 1])
+            return -1;
+        // in a compressed stream only SYNC and END use the full layout
+        if (compressed && !(p[6] & (BINMON_SYNC_TIME | BINMON_END)))
+            return -1;
+        record.flags = p[6];
+        delta = get32(p + 2);
+        payload = p + 7;
+        return total;
+    }
+
+    // a record may have been lost: the dictionary can't be trusted until the next SYNC
+    void lost() {
+        if (compressed)
+            synced = false;
+    }
+
+public:
+    unsigned long records = 0;
+    unsigned long skipped = 0;      // bytes that were not part of a valid record
+    uint64_t bytes = 0;             // in valid records
+    uint64_t plainBytes = 0;        // the same records uncompressed (ATBM)
+    bool ended = false;             // END seen
+
+    // how much smaller the stream is than uncompressed ATBM
+    double ratio() const {
+        return bytes ? (double)plainBytes / bytes : 1;
+    }
+
+    template <class F>
+    void feed(const uint8_t* data, size_t size, F callback) {
+        buffer.insert(buffer.end(), data, data + size);
+        size_t i = 0;
+        while (i < buffer.size()) {
+            if (buffer[i] != BINMON_SYNC) {
+                i++;
+                skipped++;
+                lost();
+                continue;
+            }
+            BinMonRecord record;
+            uint32_t delta = 0;
+            const uint8_t* payload = nullptr;
+            size_t length = 0;
+            int total = parse(buffer.data() + i, buffer.size() - i, record, delta, payload, length);
+            if (total == 0)
+                break;
+            if (total < 0) {
+                i++;
+                skipped++;
+                lost();
+                continue;
+            }
+            i += total;
+            bytes += total;
+
+            if (record.flags & BINMON_SYNC_TIME) {
+                if (length >= 8) {
+                    lastSec = get32(payload);
+                    lastUsec = get32(payload + 4);
+                }
+                compressed = record.flags & BINMON_COMPRESSED;
+                synced = true;
+                dictionary.clear();
+            } else {
+                uint64_t usec = (uint64_t)lastUsec + delta;
+                lastSec += usec / 1000000;
+                lastUsec = usec % 1000000;
+            }
+            record.sec = lastSec;
+            record.usec = lastUsec;
+
+            if (compressed && (record.flags & BINMON_COMPRESSED) && !(record.flags & BINMON_SYNC_TIME)) {
+                // REPEAT or DELTA against the dictionary
+                int slot = length > 0 ? payload[0] : -1;
+                if (!synced || slot < 0 || slot >= VPB_DICTIONARY_SIZE || dictionary.length(slot) == 0) {
+                    bytes -= total;
+                    skipped += total;
+                    continue;
+                }
+                size_t frameSize = dictionary.length(slot);
+                record.frame.assign(dictionary.frame(slot), dictionary.frame(slot) + frameSize);
+                if (record.flags & BINMON_FRAME) {
+                    const uint8_t* mask = payload + 1;
+                    const uint8_t* changed = mask + (frameSize + 7) / 8;
+                    for (size_t b = 0; b < frameSize; b++) {
+                        if ((mask[b / 8] & (1 << (b % 8))) && changed < payload + length)
+                            record.frame[b] = *changed++;
+                    }
+                }
+                record.flags = (record.flags & ~BINMON_COMPRESSED) | BINMON_FRAME;
+                dictionary.update(slot, record.frame.data(), frameSize);
+            } else if (record.flags & BINMON_FRAME) {
+                record.frame.assign(payload, payload + length);
+                if (compressed)
+                    dictionary.update(dictionary.find(payload, length), payload, length);
+            } else if (record.flags & BINMON_TEXT) {
+                record.text.assign((const char*)payload, length);
+            }
+            if (record.flags & BINMON_END)
+                ended = true;
+            plainBytes += BINMON_OVERHEAD + (record.frame.size() ? record.frame.size() : (record.flags & BINMON_SYNC_TIME) ? 8 : record.text.size());
+            records++;
+            callback(record);
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + i);
+    }
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include "clock.h"
 #include "pixel.h"
 #include "vpw_led.h"
 
@@ -25,7 +26,7 @@ void fadePixels(bool decrement);
 
 void ledHandler(bool led, ledHandlerState state) {
   static uint now;
-  now = millis();
+  now = Clock::millis();
   
   if (state == LED_HANDLER_RECEIVE)
     return;
@@ -55,10 +56,10 @@ void fadePixels(bool decrement) {
   static byte targetR = 0;
   static byte targetG = 0;
   static byte targetB = 0;
-  static uint lastBlip = millis();
+  static uint lastBlip = Clock::millis();
   static bool blip = false;
   static uint now;
-  now = millis();
+  now = Clock::millis();
 
   if (!blip && now - lastBlip >= (BLIP_DELAY - 10)) {
     blip = true;
@@ -4,10 +4,17 @@
 #include "elm.h"
 #include "j1850.h"
 #include "message.h"
+#include "binmon.h"
+#include "histogram.h"
+#include "outputring.h"
+#include "timing.h"
 
 #ifdef USE_SD
 #include "sdlog.h"
 #endif
+#ifdef USE_FLASHLOG
+#include "flashlog.h"
+#endif
 
 class CLI {
 private:
@@ -16,16 +23,107 @@ private:
     MessageQueue messages;
     StringQueue notifications;
     uint queueSize = 0;
+    OutputRing output;          // the monitor lane, and everything in order when no monitor runs
+    OutputRing urgent;          // command output and notifications during a monitor
+    // command output that didn't fit its lane yet, moved in by drain() as the port takes the
+    // rest, so core 0 never waits for the port (see CLI::out)
+    static constexpr size_t SPILL_SIZE = 4096;
+    std::string outputSpill;
+    std::string urgentSpill;
+    std::string& spillOf(const OutputRing& lane) {
+        return &lane == &urgent ? urgentSpill : outputSpill;
+    }
+    void refill();
+    struct Unit {
+        size_t length;
+        bool preemptible;       // monitor output the urgent lane may go ahead of
+    };
+    std::deque<Unit> units;     // what's in the monitor lane
+    size_t unitLeft = 0;        // of the unit being sent
+    bool urgentOpen = false;    // urgent output still being written: the monitor lane waits
+    struct CommandMark {
+        const OutputRing* lane;
+        uint64_t end;
+        uint start;             // us
+    };
+    std::deque<CommandMark> commandMarks;
+    std::string rendered;       // the monitor line being rendered, reused
+    BinMonEncoder binmon;
+    bool binaryOpen = false;    // ATBM stream started
+
+    // the ELM's rules plus the ATMR/ATMT address, compiled; recompiled when any of them change
+    FrameFilter filter;
+    uint filterVersion = ~0u;
+    char filterMonitor = 0;
+    byte filterAddress = 0;
+    void compileFilter();
+
+    // overload handling (ATOL): the backlog, in time at the rate the port actually drains
+    static constexpr uint OVERLOAD_ENTER_MS = 500;
+    static constexpr uint OVERLOAD_EXIT_MS = 100;
+    static constexpr uint SUMMARY_MS = 1000;
+    static constexpr size_t SUMMARY_HEADERS = 32;
+    struct HeaderState {
+        uint32_t header;
+        std::shared_ptr<Message> shown;     // OVERLOAD_CHANGES: last printed
+        std::shared_ptr<Message> last;      // OVERLOAD_SUMMARY: last seen
+        ulong count = 0;                    // held back since the last summary
+    };
+    std::vector<HeaderState> headerStates;
+    uint drainWindowStart = 0;
+    ulong drainWindowBytes = 0;
+    bool drainWindowSaturated = false;
+    uint lineBytes = 32;        // average rendered frame
+    uint lastSummary = 0;
+    ulong unreportedDrops = 0;
+    ulong unchanged = 0;
+
+    void measureOverload();
+    bool overloadFilter(const std::shared_ptr<Message>& m);
+    void summarize();
+    bool marker(const std::string& text);
+    bool stalled = false;
+
+    // how long flush() waits on a port that takes nothing (DTR low, Bluetooth not connected, ...)
+    static constexpr uint OUTPUT_WAIT_MS = 100;
+    bool drain();
+    bool portStuck(ulong& sent, uint& since);
+    bool monitorRoom(size_t size) {
+        return outputSpill.empty() && size <= output.space();
+    }
+    bool monitorOut(const std::string& unit);
+    void out(const char* data, size_t length);
+    void out(const char* s) {
+        out(s, strlen(s));
+    }
+    void out(const std::string& s) {
+        out(s.data(), s.size());
+    }
+    void out(char c) {
+        out(&c, 1);
+    }
     
 protected:
-    CLI(HardwareSerial& port, uint queueSize) : port(port), queueSize(queueSize) { }
+    CLI(HardwareSerial& port, uint queueSize, size_t outputSize = 2048) : port(port), queueSize(queueSize), output(outputSize), urgent(512) { }
     
     virtual bool dtr() const = 0;
     virtual void dsr(bool value) = 0;
     bool inhibitOutput = false; // pause output during input
     bool waitMonitor = true;    // buffer messages until monitor command
     void printNotifications();
-    std::shared_ptr<J1850> lastSent = NULL;
+
+    // requests awaiting responses: the 'S' monitor's, or several at once with ATPL1
+    static constexpr size_t PIPELINE_DEPTH = 8;
+    struct PendingRequest {
+        uint id;
+        std::shared_ptr<J1850> request;
+        uint last;                  // sent, or the latest response (us)
+        ulong responses = 0;
+    };
+    std::deque<PendingRequest> pending;
+    uint nextRequestId = 1;
+    PendingRequest* correlate(const Message& m);
+    bool completeRequests(bool all = false);
     uint lastMessageTime = 0;
     uint messageCount = 0;    
     bool atPrompt = false;
@@ -35,9 +133,27 @@ protected:
     byte lastMode = 0x01;
     char lastC = 0x00;    
     
-    // for discarding remaining line, if applicable
-    bool monitorEnter = false;
-    bool monitorText = false;
+    // input, assembled into lines in bulk and run in order
+    static constexpr size_t INPUT_LINES = 16;
+    struct InputLine {
+        std::string text;
+        bool echoed;            // as it was typed
+        uint received;          // us
+    };
+    std::deque<InputLine> lines;
+    bool lineEchoed = false;
+    void assemble();
+    void runLines();
+    void stopMonitor();
+
+    // ATBRD: the new rate holds if a CR comes back within the ATBRT timeout, otherwise the old
+    // one is restored; a rate that holds is saved for the port
+    const char* portName = nullptr;
+    uint baudPrevious = 0;
+    uint baudTrialStart = 0;
+    bool baudTrial = false;
+    void startBaudTrial();
+    void baudTrialLoop();
 
     std::string cmd = "";
 
@@ -46,16 +162,68 @@ public:
     bool ready() const;
     virtual void push(const std::shared_ptr<Message>& message);
     virtual void notify(const std::shared_ptr<std::string>& notification);
+    void beginPort(const char* name, uint rate);
     bool begin(bool showPrompt);
     bool loop();
     void flush();
     void prompt(bool force = false);
     void process(std::string cmd);
-    void printSendError(sendVPW_status_t status) const;
+    void printSendError(sendVPW_status_t status);
     bool active = false; // gets set to true after input has been received
     ELM& getElm() {
         return elm;
     }
+
+    // instrumentation (ATGENS)
+    LatencyHistogram outputLag;     // bus timestamp to queued for output
+    LatencyHistogram commandLag;    // command line in to the last of its output sent
+    ulong dropped = 0;              // messages discarded with the queue full
+    ulong filtered = 0;             // messages the filter rules kept out of the queue
+    size_t queueHighWater = 0;
+    ulong bytesOut = 0;             // written to the port
+    uint statsStart = 0;
+    ulong stalls = 0;               // times the port stopped taking output
+    ulong blocked = 0;              // times command output didn't fit the ring and was spilled
+    ulong abandoned = 0;            // times command output was dropped with SPILL_SIZE waiting
+    ulong lagged = 0;               // monitor frames and markers dropped while lagging
+    bool lagging = false;           // not keeping up: monitor frames are dropped until the ring drains
+    uint drainRate = 11520;         // bytes/s the port took while saturated (its baud rate until measured)
+    uint backlogMs = 0;
+    bool overloaded = false;
+    ulong overloads = 0;
+    size_t queueDepth() {
+        return messages.size();
+    }
+    const OutputRing& outputRing() const {
+        return output;
+    }
+    const OutputRing& urgentRing() const {
+        return urgent;
+    }
+    const BinMonEncoder& binaryStream() const {
+        return binmon;
+    }
+    const FrameFilter& frameFilter() const {
+        return filter;
+    }
+    void clearStats() {
+        outputLag.clear();
+        commandLag.clear();
+        dropped = 0;
+        filtered = 0;
+        queueHighWater = messages.size();
+        bytesOut = 0;
+        statsStart = Clock::millis();
+        stalls = 0;
+        blocked = 0;
+        abandoned = 0;
+        lagged = 0;
+        overloads = 0;
+        output.highWater = output.size();
+        urgent.highWater = urgent.size();
+        binmon.bytes = 0;
+        binmon.plainBytes = 0;
+    }
 };
 
 
@@ -90,13 +258,18 @@ public:
         Message m(0, VPW::getTimestamp(), {}, *notification);
         sdlog.queue.push(m);
     }
+#elif defined(USE_FLASHLOG)
+    virtual void notify(const std::shared_ptr<std::string>& notification) {
+        CLI::notify(notification);
+        flashlog.note(*notification);
+    }
 #endif
 };
 
 class AltCLI : public CLI {
 protected:
     virtual bool dtr() const { return true; }    
-    virtual void dsr(bool value) { }
+    virtual void dsr(bool) { }
 public:
     AltCLI(HardwareSerial& port, uint queueSize) : CLI(port, queueSize) { }
 };
@@ -108,6 +281,7 @@ public:
     template <typename... Args>
     static void add(Args&&... cliList) {
         (all.push_back(std::forward<Args>(cliList)), ...);
+        (VPWMessageQueue.interest.add(&static_cast<CLI&>(cliList).frameFilter()), ...);
     }
     static void begin(bool showPrompt) {
         for (CLI& cli : all) cli.begin(showPrompt);
@@ -132,5 +306,38 @@ public:
         std::shared_ptr<std::string> ptr = std::make_shared<std::string>(notification);
         for (CLI& cli : all) cli.notify(ptr);
     }
+    static std::string stats(const char* newline) {
+        std::string ret;
+        for (size_t i = 0; i < all.size(); i++) {
+            CLI& cli = all[i];
+            if (i > 0)
+                ret += newline;
+            ret += "TERM " + std::to_string(i);
+            ret += " QUEUE " + std::to_string(cli.queueDepth()) + "/" + std::to_string(cli.queueHighWater);
+            ret += " DROPPED " + std::to_string(cli.dropped) + " FILTERED " + std::to_string(cli.filtered);
+            ret += " LAG AVG " + std::to_string(cli.outputLag.average()) + "us MAX " + std::to_string(cli.outputLag.worst) + "us";
+            uint seconds = max((Clock::millis() - cli.statsStart) / 1000, (uint)1);
+            ret += " OUT " + std::to_string(cli.bytesOut / seconds) + "B/s";
+            ret += " RING " + std::to_string(cli.outputRing().size()) + "/" + std::to_string(cli.outputRing().highWater) + "/" + std::to_string(cli.outputRing().capacity());
+            ret += " URGENT " + std::to_string(cli.urgentRing().size()) + "/" + std::to_string(cli.urgentRing().highWater) + "/" + std::to_string(cli.urgentRing().capacity());
+            ret += " CMD AVG " + std::to_string(cli.commandLag.average()) + "us MAX " + std::to_string(cli.commandLag.worst) + "us";
+            ret += " STALLS " + std::to_string(cli.stalls) + " BLOCKED " + std::to_string(cli.blocked);
+            ret += " ABANDONED " + std::to_string(cli.abandoned);
+            ret += " LAGGED " + std::to_string(cli.lagged) + (cli.lagging ? " LAGGING" : "");
+            ret += " DRAIN " + std::to_string(cli.drainRate) + "B/s BACKLOG " + std::to_string(cli.backlogMs) + "ms";
+            ret += " OVERLOADS " + std::to_string(cli.overloads) + (cli.overloaded ? " OVERLOADED" : "");
+            if (cli.binaryStream().bytes > 0) {
+                // ATBM/ATBMC: bytes sent, and how much smaller than uncompressed records
+                ret += " BINARY " + std::to_string(cli.binaryStream().bytes) + "B RATIO ";
+                ret += Util.dec((float)cli.binaryStream().plainBytes / cli.binaryStream().bytes, 1, 2);
+            }
+        }
+        ret += newline;
+        ret += "ASSEMBLY FILTERED " + std::to_string(VPWMessageQueue.filtered);
+        return ret;
+    }
+    static void clearStats() {
+        for (CLI& cli : all) cli.clearStats();
+    }
 };
 Terminals Terminals;
@@ -10,8 +10,8 @@
 
 void CLI::prompt(bool force) {
     if ((!atPrompt || force)) {
-        port.print('>');
-        port.flush();
+        out('>');
+        drain();
         atPrompt = true;
     }
     
@@ -29,6 +29,15 @@ void CLI::printNotifications() {
         if (!elm.notifications)
             continue;
 
+        if (elm.binaryMonitor) {
+            // out-of-band, as a text record
+            struct timeval tv = VPW::getTimestamp();
+            rendered.clear();
+            binmon.record(rendered, tv.tv_sec, tv.tv_usec, 0, BINMON_TEXT, (const uint8_t*)n->data(), n->size());
+            out(rendered);
+            continue;
+        }
+
         const size_t tsZeroes = 4;
         std::string line;
         line.reserve(n->size() + 24);
@@ -47,9 +56,9 @@ void CLI::printNotifications() {
         atPrompt = false;
         if (blank) {
             blank = false;
-            port.print(elm.newline());
+            out(elm.newline());
         }
-        port.print(line.c_str());
+        out(line);
     }
     if (needsPrompt)
         prompt();
@@ -59,10 +68,105 @@ bool CLI::ready() const {
     return dtr();
 }
 
+void CLI::compileFilter() {
+    char monitor = (elm.monitor == 'R' || elm.monitor == 'T') ? elm.monitor : 0;
+    byte address = (monitor == 'R') ? elm.monitorReceive : (monitor == 'T') ? elm.monitorTransmit : 0;
+    if (filterVersion == elm.filterVersion && filterMonitor == monitor && filterAddress == address)
+        return;
+    std::vector<FrameRule> rules = elm.filterRules;
+    if (monitor)
+        rules.push_back(FrameRule::address(monitor == 'R' ? 1 : 2, address, FILTER_REQUIRE));
+    filter.compile(rules);
+    filterVersion = elm.filterVersion;
+    filterMonitor = monitor;
+    filterAddress = address;
+}
+
+// The outstanding request a received frame answers: one the frame is addressed as a response
+// to (see ATAR), preferring the one whose PID (or, for a 7F, mode and PID) it echoes or that
+// had none, and of those one not answered yet; the oldest first.  Without ATAR, any frame but the request itself.
+CLI::PendingRequest* CLI::correlate(const Message& m) {
+    PendingRequest* first = nullptr;
+    PendingRequest* echoed = nullptr;
+    for (PendingRequest& r : pending) {
+        const J1850& q = *r.request;
+        if (q == m)
+            continue; // our own frame
+        if (!elm.autoReceive)
+            return &r;
+        if (!((q.target() == 0xFE && m.target() == 0xFE) || q.source() == m.target()))
+            continue;
+        bool negative = (m.secondaryAddress() == 0x7F);
+        if (!negative && m.secondaryAddress() != q.secondaryAddress() + 0x40)
+            continue;
+        if (m.isPhysical() != q.isPhysical())
+            continue;
+        // a physical request is answered by the module it went to
+        if (q.isPhysical() && q.target() != 0xFE && m.source() != q.target())
+            continue;
+        if (!first)
+            first = &r;
+        if (negative ? (m.size() > 5 && m[4] == q.secondaryAddress() && (q.size() < 6 || m.size() < 7 || m[5] == q[4]))
+                     : (q.size() < 6 || (m.size() > 5 && m[4] == q[4]))) {
+            if (r.responses == 0)
+                return &r;
+            if (!echoed)
+                echoed = &r;
+        }
+    }
+    return echoed ? echoed : first;
+}
+
+// Ends the requests that have all their responses (ATRC) or have waited long enough (ATST, or
+// less as learned with ATAT), or with 'all' every one now, the 'S' monitor's with the prompt;
+// true if it printed a pipelined (ATPL1) request's end
+bool CLI::completeRequests(bool all) {
+    bool printed = false;
+    uint now = Clock::micros();
+    uint timeout = 4000u * elm.monitorTimeout;
+    for (auto r = pending.begin(); r != pending.end(); ) {
+        bool complete = elm.responseCount > 0 && r->responses >= elm.responseCount;
+        uint wait = responseTiming.timeout(r->request->target(), elm.adaptiveTiming, timeout);
+        bool expired = now - r->last > wait;
+        if (!complete && !expired && !all) {
+            ++r;
+            continue;
+        }
+        if (!complete && expired && r->responses == 0 && wait < timeout)
+            responseTiming.miss(r->request->target());
+        if (elm.monitor == 'S') {
+            elm.monitor = 0x00;
+            if (r->responses == 0) {
+                out("NO DATA");
+                out(elm.newline());
+            }
+            prompt();
+        } else {
+            if (atPrompt)
+                out(elm.newline());
+            out("[" + std::to_string(r->id) + "] " + (r->responses > 0 ? "DONE" : "NO DATA"));
+            out(elm.newline());
+            atPrompt = false;
+            printed = true;
+        }
+        r = pending.erase(r);
+    }
+    return printed;
+}
+
 void CLI::push(const std::shared_ptr<Message>& message) {
-    while (messages.size() > queueSize)
+    if (!filter.accepts(message->rawByteArray(), message->size())) {
+        filtered++;
+        return;
+    }
+    while (messages.size() > queueSize) {
         messages.pop_front();
+        dropped++;
+        unreportedDrops++;
+    }
     messages.push_back(message);
+    if (messages.size() > queueHighWater)
+        queueHighWater = messages.size();
     dsr(true);
 }
 
@@ -71,9 +175,22 @@ void CLI::notify(const std::shared_ptr<std::string>& notification) {
     dsr(true);
 }
 
+// starts the port at its saved rate (ATBRD), or this one
+void CLI::beginPort(const char* name, uint rate) {
+    portName = name;
+    int saved = 0;
+    std::string setting = std::string("baud-") + name;
+    if (SettingsRepository.read(setting.c_str(), saved) > 0 && saved > 0)
+        rate = saved;
+    elm.startBaudRate = rate;
+    elm.setBaudRate(port, rate);
+    drainRate = rate / 10;
+}
+
 bool CLI::begin(bool showPrompt = true) {
-    port.print(elm.version());
-    port.print(elm.newline());
+    statsStart = Clock::millis();
+    out(elm.version());
+    out(elm.newline());
     printNotifications();
     if (showPrompt)
         prompt();
@@ -82,161 +199,495 @@ bool CLI::begin(bool showPrompt = true) {
 }
 
 void CLI::flush() {
-    port.print(""); // theoretically this should not be necessary, but without it sometimes we encounter a hang when flushing in multiple cores
+    urgentOpen = false;
+    ulong sent = bytesOut;
+    uint since = Clock::millis();
+    while (!drain() && !portStuck(sent, since))
+        ;
     port.flush();
 }
 
+// For a caller waiting on drain(): true once the port has taken nothing for OUTPUT_WAIT_MS
+bool CLI::portStuck(ulong& sent, uint& since) {
+    uint now = Clock::millis();
+    if (bytesOut != sent) {
+        sent = bytesOut;
+        since = now;
+    }
+    return now - since >= OUTPUT_WAIT_MS;
+}
+
+// Sends what the port can take without blocking; true once both lanes are empty.  The monitor
+// lane goes a unit at a time, and between units the urgent lane goes first, unless the next unit
+// was written in order with it (see CLI::out) or the urgent output being written isn't finished.
+bool CLI::drain() {
+    if (!port) {
+        // USB with no host: nobody to wait for
+        output.consume(output.size());
+        urgent.consume(urgent.size());
+        outputSpill.clear();
+        urgentSpill.clear();
+        units.clear();
+        unitLeft = 0;
+        commandMarks.clear();
+        return true;
+    }
+    for (refill(); !output.empty() || !urgent.empty(); refill()) {
+        bool preempt = (unitLeft == 0 && (units.empty() || units.front().preemptible));
+        if (preempt && urgent.empty()) {
+            if (urgentOpen || output.empty())
+                return !urgentOpen && output.empty();
+            preempt = false;
+        }
+        OutputRing& lane = preempt ? urgent : output;
+        int room = port.availableForWrite();
+        if (room <= 0) {
+            if (!stalled)
+                stalls++;
+            stalled = true;
+            drainWindowSaturated = true;
+            return false;
+        }
+        stalled = false;
+        if (!preempt && unitLeft == 0) {
+            unitLeft = units.empty() ? output.size() : units.front().length;
+            if (!units.empty())
+                units.pop_front();
+        }
+        const char* data;
+        size_t size = min(lane.peek(data), (size_t)room);
+        if (!preempt)
+            size = min(size, unitLeft);
+        size_t written = port.write((const uint8_t*)data, size);
+        lane.consume(written);
+        if (!preempt)
+            unitLeft -= written;
+        bytesOut += written;
+        drainWindowBytes += written;
+        while (!commandMarks.empty() && commandMarks.front().lane->consumed >= commandMarks.front().end) {
+            commandLag.record(Clock::micros() - commandMarks.front().start);
+            commandMarks.pop_front();
+        }
+        if (written < size)
+            return false;
+    }
+    return true;
+}
+
+// Moves spilled command output into its lane as far as there's room
+void CLI::refill() {
+    for (OutputRing* lane : { &urgent, &output }) {
+        std::string& spill = spillOf(*lane);
+        if (spill.empty())
+            continue;
+        size_t written = lane->write(spill.data(), spill.size());
+        if (lane == &output && written > 0) {
+            if (units.empty() || units.back().preemptible)
+                units.push_back({ 0, false });
+            units.back().length += written;
+        }
+        spill.erase(0, written);
+    }
+}
+
+// the drain rate (measured over windows in which the port was the bottleneck) and the backlog
+// it implies; entering and leaving overload
+void CLI::measureOverload() {
+    uint now = Clock::millis();
+    if (now - drainWindowStart >= 250) {
+        if (drainWindowSaturated && drainWindowBytes > 0)
+            drainRate = (drainRate * 3 + drainWindowBytes * 1000 / (now - drainWindowStart)) / 4;
+        drainWindowStart = now;
+        drainWindowBytes = 0;
+        drainWindowSaturated = false;
+    }
+    backlogMs = (uint)(((uint64_t)output.size() + messages.size() * lineBytes) * 1000 / max(drainRate, (uint)1));
+    if (!overloaded && backlogMs > OVERLOAD_ENTER_MS) {
+        overloaded = true;
+        overloads++;
+        lastSummary = now;
+    } else if (overloaded && backlogMs < OVERLOAD_EXIT_MS) {
+        overloaded = false;
+        summarize();
+        if (unchanged > 0)
+            marker("[UNCHANGED " + std::to_string(unchanged) + "]");
+        unchanged = 0;
+        headerStates.clear();
+    } else if (overloaded && elm.overloadPolicy == OVERLOAD_SUMMARY && now - lastSummary >= SUMMARY_MS) {
+        lastSummary = now;
+        summarize();
+    }
+}
+
+// false if the overload policy holds the frame back
+bool CLI::overloadFilter(const std::shared_ptr<Message>& m) {
+    if (!overloaded || elm.overloadPolicy == OVERLOAD_DROP || m->size() < 3)
+        return true;
+    uint32_t header = ((*m)[0] << 16) | ((*m)[1] << 8) | (*m)[2];
+    HeaderState* state = nullptr;
+    for (HeaderState& h : headerStates) {
+        if (h.header == header)
+            state = &h;
+    }
+    if (!state) {
+        if (headerStates.size() >= SUMMARY_HEADERS)
+            return true; // too many headers to track: shown as is
+        headerStates.push_back({ header, nullptr, nullptr });
+        state = &headerStates.back();
+    }
+    if (elm.overloadPolicy == OVERLOAD_SUMMARY) {
+        state->count++;
+        state->last = m;
+        return false;
+    }
+    if (state->shown && state->shown->rawBytes() == m->rawBytes()) {
+        unchanged++;
+        return false;
+    }
+    state->shown = m;
+    return true;
+}
+
+// OVERLOAD_SUMMARY: one line per header held back, with the count and the last frame
+void CLI::summarize() {
+    for (HeaderState& h : headerStates) {
+        if (h.count == 0)
+            continue;
+        marker("[SUMMARY " + std::to_string(h.count) + "x " + h.last->tostring(elm.timestampOffset, elm.showTimestamp, true, elm.spaces) + "]");
+        h.count = 0;
+    }
+}
+
+// in-band: a line in the monitor output, or a text record in a binary stream; false if dropped
+bool CLI::marker(const std::string& text) {
+    rendered.clear();
+    if (elm.binaryMonitor) {
+        struct timeval tv = VPW::getTimestamp();
+        binmon.record(rendered, tv.tv_sec, tv.tv_usec, 0, BINMON_TEXT, (const uint8_t*)text.data(), text.size());
+    } else {
+        rendered += text;
+        rendered += elm.newline();
+    }
+    if (!monitorOut(rendered))
+        return false;
+    atPrompt = false;
+    return true;
+}
+
+// Command output: what doesn't fit its lane is spilled for drain() to move in later, rather
+// than lost (monitor frames are dropped instead, see CLI::loop) or waited for with core 0 held
+// up; only past SPILL_SIZE is it dropped.  While a monitor runs, and until what it wrote then
+// has gone, it takes the urgent lane, ahead of the monitor's backlog; otherwise it's in order
+// in the monitor lane.
+void CLI::out(const char* data, size_t length) {
+    bool monitoring = elm.monitor && elm.monitor != 'S';
+    OutputRing& lane = (monitoring || !urgent.empty() || !urgentSpill.empty()) ? urgent : output;
+    std::string& spill = spillOf(lane);
+    if (&lane == &urgent)
+        urgentOpen = true;
+    else
+        urgentOpen = false; // nothing urgent is being written any more: don't hold the monitor lane back for it
+    // behind what's already spilled, to keep the order
+    size_t written = spill.empty() ? lane.write(data, length) : 0;
+    if (&lane == &output && written > 0) {
+        if (units.empty() || units.back().preemptible)
+            units.push_back({ 0, false });
+        units.back().length += written;
+    }
+    if (written == length)
+        return;
+    if (spill.empty())
+        blocked++;
+    if (spill.size() + length - written > SPILL_SIZE) {
+        abandoned++;
+        return;
+    }
+    spill.append(data + written, length - written);
+}
+
+// Monitor output: a frame, a marker, ... as one unit, which the urgent lane can go ahead of
+// (during a monitor; otherwise the unit keeps its place).  Without room once the port has
+// taken what it can, it's dropped like a frame (see CLI::loop) rather than waited for.
+bool CLI::monitorOut(const std::string& unit) {
+    bool preemptible = elm.monitor && elm.monitor != 'S';
+    if (!monitorRoom(unit.size()))
+        drain();
+    if (!monitorRoom(unit.size())) {
+        lagging = true;
+        lagged++;
+        return false;
+    }
+    size_t written = output.write(unit.data(), unit.size());
+    if (!preemptible && !units.empty() && !units.back().preemptible)
+        units.back().length += written;
+    else
+        units.push_back({ written, preemptible });
+    return true;
+}
+
 bool CLI::loop() {
     if (!initialized || !ready())
         return false;        
 
+    // what the last pass wrote to the urgent lane is complete
+    urgentOpen = false;
+    drain();
+    compileFilter();
+    if (elm.monitor)
+        measureOverload();
+    if (lagging && output.size() <= output.capacity() / 4)
+        lagging = false;
+
+#if defined(USE_SD) || defined(USE_FLASHLOG)
+    // LOG DOWNLOAD (ATLOG n): any input stops it, reporting where to resume
+    if (elm.logReader.active()) {
+        if (port.available()) {
+            while (port.available())
+                port.read();
+            uint32_t offset = elm.logReader.stop();
+            out(elm.newline());
+            out("--STOPPED " + elm.logReader.name() + " " + std::to_string(offset) + "--");
+            out(elm.newline());
+            prompt(true);
+        } else if (drain() && !elm.logReader.loop(port)) {
+            prompt(true);
+        }
+        return true;
+    }
+#endif
+
+    if (baudTrial) {
+        baudTrialLoop();
+        return true;
+    }
+
+    // ATBM: the stream opens with an absolute timestamp
+    if (elm.binaryMonitor && !binaryOpen) {
+        struct timeval tv = VPW::getTimestamp();
+        rendered.clear();
+        binmon.compress = elm.binaryCompress;
+        binmon.sync(rendered, tv.tv_sec, tv.tv_usec);
+        out(rendered);
+        binaryOpen = true;
+    }
+
     if (!inhibitOutput)
         printNotifications();
         
     // MONITOR
+    urgentOpen = false;
+    bool answered = false;      // pipelined (ATPL1) responses printed
     while (!inhibitOutput && messages.available()) {
         std::shared_ptr<Message> m = messages.pull();
             
-        if (elm.monitor == 'S') {
-            if (lastSent == NULL || *lastSent == *m)
+        PendingRequest* request = nullptr;
+        if (elm.monitor == 'S' || (!elm.monitor && !pending.empty())) {
+            request = correlate(*m);
+            if (!request)
                 continue;
-                
-            if (elm.autoReceive) {
-                bool relevant = false;
-                if ( (lastSent->target() == 0xFE && m->target() == 0xFE) || lastSent->source() == m->target() ) {
-                    if ( m->secondaryAddress() == 0x7F || m->secondaryAddress() == lastSent->secondaryAddress() + 0x40 ) {
-                        if (m->isPhysical() == lastSent->isPhysical()) {
-                            relevant = true;
-                        }
-                    }
-                }
-                if (!relevant)
-                    continue;
-            } else {
-                //
-                // TO-DO
-                //
-            }
-        } else if (elm.monitor == 'R') {
-            if (elm.monitorReceive != m->target())
-                continue;
-        } else if (elm.monitor == 'T') {
-            if (elm.monitorTransmit != m->source())
-                continue;
-        } else if (elm.monitor == 'A') {
-            // no filter
-        } else if (elm.monitor == 'B') {
-            // TO-DO: bi-directional, but we should still honour ATRS and ATSR
-        } else {
+        } else if (!elm.monitor) {
             continue;
         }
+        // frames queued before the rules or the monitor changed
+        if (!filter.accepts(m->rawByteArray(), m->size()))
+            continue;
+        if (request) {
+            uint now = Clock::micros();
+            responseTiming.record(request->request->target(), now - request->last);
+            request->responses++;
+            request->last = now;
+        }
         elm.monitorCount++;
         messageCount++;
-        if (m->mode != lastMode && !elm.showVpwMode) {
-            lastMode = m->mode;
-            port.print(m->mode == 1 ? "[MODE: 1X]" : "[MODE: 4X]");
-            port.print(elm.newline());
+        lastMessageTime = Clock::millis();
+        if (unreportedDrops > 0 && !lagging) {
+            if (marker("[DROPPED " + std::to_string(unreportedDrops) + "]"))
+                unreportedDrops = 0;
         }
-        port.print(m->tostring(elm.timestampOffset, elm.showTimestamp, elm.headers, elm.spaces, elm.allowLong, 4, elm.showVpwMode).c_str());
-        port.print(elm.newline());
-        atPrompt = false;
-        if (elm.monitor == 'B')
-            prompt();
-        lastMessageTime = millis();
-        //return;
-    }
-    if (elm.monitor == 'S') {
-        if (elm.responseCount > 0 && elm.responseCount == elm.monitorCount) {
-            elm.monitor = 0x00;
-            prompt();
-        } else if (millis() - lastMessageTime > (4 * elm.monitorTimeout)) {
-            elm.monitor = 0x00;
-            if (elm.monitorCount == 0) {
-                port.print("NO DATA");
-                port.print(elm.newline());
+        if (!overloadFilter(m))
+            continue;
+        rendered.clear();
+        if (elm.binaryMonitor) {
+            if (m->size() > 0)
+                binmon.record(rendered, m->timestamp.tv_sec, m->timestamp.tv_usec, m->mode, BINMON_FRAME, m->rawBytes().data(), m->size());
+            if (m->information.size() > 0) {
+                // without frame bytes it's a bus error ([BREAK], [BUS ERROR], ...)
+                binmon.record(rendered, m->timestamp.tv_sec, m->timestamp.tv_usec, m->mode, BINMON_TEXT | (m->size() > 0 ? 0 : BINMON_ERROR),
+                        (const uint8_t*)m->information.data(), m->information.size());
             }
+        } else {
+            if (m->mode != lastMode && !elm.showVpwMode) {
+                lastMode = m->mode;
+                rendered += (m->mode == 1 ? "[MODE: 1X]" : "[MODE: 4X]");
+                rendered += elm.newline();
+            }
+            if (request && elm.pipeline) {
+                if (atPrompt)
+                    rendered += elm.newline();
+                rendered += "[" + std::to_string(request->id) + "] ";
+                answered = true;
+            }
+            rendered += m->tostring(elm.timestampOffset, elm.showTimestamp, elm.headers, elm.spaces, elm.allowLong, 4, elm.showVpwMode);
+            rendered += elm.newline();
+        }
+        // a terminal that can't keep up drops frames (until its ring drains) rather than
+        // holding up core 0
+        if (lagging || !monitorRoom(rendered.size())) {
+            lagging = true;
+            lagged++;
+            unreportedDrops++;
+            continue;
+        }
+        if (elm.monitor == 'B') {
+            // the prompt goes with the frame
+            rendered += '>';
+        }
+        if (!monitorOut(rendered)) {
+            unreportedDrops++;
+            continue;
+        }
+        lineBytes = (lineBytes * 15 + rendered.size()) / 16;
+        struct timeval now = VPW::getTimestamp();
+        int64_t lag = (int64_t)(now.tv_sec - m->timestamp.tv_sec) * 1000000 + (now.tv_usec - m->timestamp.tv_usec);
+        outputLag.record((uint)max(lag, (int64_t)0));
+        atPrompt = false;
+        if (elm.monitor == 'B') {
+            atPrompt = true;
             prompt();
         }
+        //return;
     }
+    if (elm.monitor == 'S' || (!inhibitOutput && !pending.empty()))
+        answered = completeRequests() || answered;
+    if (answered && !elm.monitor)
+        prompt();
 
-    if (messageCount > 0 && elm.inactiveTime > 0 && millis() - lastMessageTime > (1000 * elm.inactiveTime)) {
+    if (messageCount > 0 && elm.inactiveTime > 0 && Clock::millis() - lastMessageTime > (1000 * elm.inactiveTime)) {
         static const std::shared_ptr<std::string> inactiveMessage = std::make_shared<std::string>(std::string("[INACTIVE]"));
         messageCount = 0;
         notify(inactiveMessage);
     }
 
-    if (!port.available()) {
-        if (millis() - lastInputTime >= (20 * 1000) && cmd.size() > 0) {
-            Serial.print("?");
-            Serial.print(elm.newline());
-            prompt(true);
-            cmd.clear();
-        }
-        return true;
+    assemble();
+    runLines();
+
+    if (cmd.size() > 0 && !port.available() && Clock::millis() - lastInputTime >= (20 * 1000)) {
+        Serial.print("?");
+        Serial.print(elm.newline());
+        prompt(true);
+        cmd.clear();
+        inhibitOutput = false;
     }
-        
-    char c = (char)port.read();
-    
-    lastInputTime = millis();
-    if (c == '\n' && lastC == '\r')
-        return true;
-    active = true;
-    atPrompt = false;
-    
-    if (elm.monitor && elm.monitor != 'B') {
-        while (port.available() > 0) {
-            c = (char) port.peek();
-            if (c == '\r' || c == '\n') {
-                monitorEnter = monitorText ? true : false;
+    return true;
+}
+
+// Reads all the input there is, in bulk, into lines queued to run in order.  Input that arrives
+// while a monitor runs (other than ATMB, and with no lines queued) stops it, and the rest of
+// that line, as far as it has arrived, is dropped.  A line is echoed as it's typed when it
+// would run right away, otherwise when it runs.
+void CLI::assemble() {
+    char buffer[64];
+    bool discarding = false;
+    bool discardText = false;
+    while (lines.size() < INPUT_LINES && port.available() > 0) {
+        size_t n = port.readBytes(buffer, min((size_t)port.available(), sizeof(buffer)));
+        if (n == 0)
+            break;
+        lastInputTime = Clock::millis();
+        active = true;
+        atPrompt = false;
+        for (size_t i = 0; i < n; i++) {
+            char c = buffer[i];
+            if (c == '\n' && lastC == '\r')
+                continue;
+            bool eol = (c == '\r' || c == '\n');
+            if (!discarding && elm.monitor && elm.monitor != 'B' && lines.empty()) {
+                stopMonitor();
+                discarding = true;
+                discardText = false;
+            }
+            if (discarding) {
+                if (eol && discardText)
+                    discarding = false;
+                discardText = discardText || !eol;
+            } else if (eol) {
+                if (cmd.empty())
+                    lineEchoed = lines.empty() && (!elm.monitor || elm.monitor == 'B');
+                lines.push_back({ cmd, lineEchoed, Clock::micros() });
+                cmd.clear();
+            } else if (c == 0x08) {
+                if (cmd.size() > 0) {
+                    if (elm.echo && lineEchoed)
+                        out(c);
+                    cmd.pop_back();
+                }
             } else {
-                if (monitorEnter)
-                    break;
-                monitorText = true;
+                if (c < 0x20 || c > 0x7E) {
+                    //Uncomment for debugging non-printable character inputs
+                    //port.print('{');
+                    //port.print(HexUtil.hex(c).c_str());
+                    //port.print('}');
+                }
+                if (cmd.empty())
+                    lineEchoed = lines.empty() && (!elm.monitor || elm.monitor == 'B');
+                if (elm.echo && lineEchoed)
+                    out(c);
+                cmd += c;
             }
-            port.read();
+            lastC = c;
         }
-        elm.monitor = 0x00;
-        port.print(elm.newline());
-        port.print("STOPPED");
-        port.print(elm.newline());
-        prompt();
-        return true;
     }
-    
-    if (c == '\r' || c == '\n') {
-        if (c == '\r' || lastC != '\r') {
-            inhibitOutput = false;
-            monitorEnter = false;
-            monitorText = false;
-            port.print(elm.newline());
-            this->process(cmd);
-            cmd.clear();
-            lastMessageTime = millis();            
-        }
-    } else if (c == 0x08) {
-        if (cmd.size() > 0) {
-            if (elm.echo) {
-                port.print(c);
-            }
-            cmd.pop_back();
-        }
-        inhibitOutput = (cmd.size() > 0);
-    } else {
-        if (c < 0x20 || c > 0x7E) {
-            //Uncomment for debugging non-printable character inputs
-            //port.print('{');
-            //port.print(HexUtil.hex(c).c_str());
-            //port.print('}');
-        }
-        if (elm.echo) {
-            port.print(c);
+    inhibitOutput = (cmd.size() > 0);
+}
+
+// Runs the queued lines; those after a request wait for its responses (the 'S' monitor), and
+// one that finds a monitor running stops it, as typing would
+void CLI::runLines() {
+    while (!lines.empty() && elm.monitor != 'S') {
+#if defined(USE_SD) || defined(USE_FLASHLOG)
+        if (elm.logReader.active())
+            break;
+#endif
+        InputLine line = std::move(lines.front());
+        lines.pop_front();
+        atPrompt = false;
+        if (elm.monitor && elm.monitor != 'B') {
+            stopMonitor();
+            continue;
         }
-        cmd += c;
-        inhibitOutput = true;
+        if (elm.echo && !line.echoed)
+            out(line.text);
+        out(elm.newline());
+        this->process(line.text);
+        compileFilter();
+        lastMessageTime = Clock::millis();
+        // for the round trip (ATGENS CMD): until the last of what it wrote has been sent
+        OutputRing& lane = (urgent.empty() && urgentSpill.empty()) ? output : urgent;
+        if (commandMarks.size() < INPUT_LINES)
+            commandMarks.push_back({ &lane, lane.written + spillOf(lane).size(), line.received });
     }
-    
-    lastC = c;
-    return true;
+}
+
+void CLI::stopMonitor() {
+    if (elm.monitor == 'S')
+        pending.clear();
+    elm.monitor = 0x00;
+    // the monitor's backlog isn't wanted any more
+    while (!units.empty() && units.back().preemptible) {
+        output.unwrite(units.back().length);
+        units.pop_back();
+    }
+    if (elm.binaryMonitor) {
+        rendered.clear();
+        binmon.end(rendered);
+        out(rendered);
+        elm.binaryMonitor = false;
+        binaryOpen = false;
+    }
+    out(elm.newline());
+    out("STOPPED");
+    out(elm.newline());
+    prompt();
 }
 
 void CLI::process(std::string input) {
@@ -269,6 +720,7 @@ void CLI::process(std::string input) {
     } else if (cmd.size() == 3 && cmd[0] == '\x25' && cmd[1] == '\x00' && cmd[2] == '\xDA') {
 
         // special case for DVI "reset back to boot" command
+        flush();
         elm.ATZ(port);
         while (port.available())
             port.read();
@@ -296,7 +748,9 @@ void CLI::process(std::string input) {
             // Try parsing cmd as J1850 data
             J1850 message(elm.replaceTT(isDXSD ? cmd : (elm.header + cmd)));
             ok = message.isValid();        
-            if (ok) {
+            if (ok && elm.pipeline && elm.responses && !elm.monitor && pending.size() >= PIPELINE_DEPTH) {
+                response = "BUFFER FULL";
+            } else if (ok) {
                 response.clear();
                 sendVPW_status_t status;
                 while (true) {
@@ -307,7 +761,6 @@ void CLI::process(std::string input) {
                 }
                 printSendError(status);
                 if (status == SEND_VPW_STATUS_OK) {
-                    lastSent = std::make_shared<J1850>(message);
                     if (message.isPhysical() && message.target() == 0xFE) {
                         // Special case for command to enter 4X mode
                         if (message.secondaryAddress() == 0xA1)
@@ -318,12 +771,22 @@ void CLI::process(std::string input) {
                     }
                     if (!elm.monitor) {
                         if (elm.responses) {
-                            elm.monitor = 'S';
-                            elm.monitorCount = 0;
-                            elm.monitorReceive = message.source();
-                            elm.monitorTransmit = message.target();
+                            // after ATPL0, what ATPL1 left outstanding ends before this request
+                            if (!elm.pipeline)
+                                completeRequests(true);
+                            PendingRequest request = { nextRequestId++, std::make_shared<J1850>(message), Clock::micros() };
+                            pending.push_back(request);
+                            if (elm.pipeline) {
+                                // answered asynchronously, tagged with this
+                                response = "[" + std::to_string(request.id) + "]";
+                            } else {
+                                elm.monitor = 'S';
+                                elm.monitorCount = 0;
+                                elm.monitorReceive = message.source();
+                                elm.monitorTransmit = message.target();
+                            }
                         } else {
-                            port.print(elm.newline());
+                            out(elm.newline());
                         }
                     }
                     this->waitMonitor = false;                    
@@ -335,6 +798,7 @@ void CLI::process(std::string input) {
 
             // Special pre-reset handling for ATZ
             if (cmd == "ATZ") {
+                flush();
                 #ifdef USE_SD
                     sdlog.close();
                 #endif
@@ -364,43 +828,90 @@ void CLI::process(std::string input) {
     }
     
     if (response.size() > 0) {
-        port.print(response.c_str());
-        port.print(elm.newline());
+        out(response);
+        out(elm.newline());
+    }
+
+    if (elm.baudRequest) {
+        startBaudTrial();
+        return; // the prompt comes at whichever rate holds
     }
 
 skip:
+#if defined(USE_SD) || defined(USE_FLASHLOG)
+    if (elm.logReader.active())
+        return; // CLI::loop sends the log, then the prompt
+#endif
     printNotifications();
     
     if (!elm.monitor || elm.monitor == 'B')
         prompt();
 }
 
-void CLI::printSendError(sendVPW_status_t status) const {
+// ATBRD, as an ELM327: OK at the old rate, then the ID at the new one, which the other end
+// confirms with a CR
+void CLI::startBaudTrial() {
+    baudPrevious = elm.getBaudRate();
+    flush();
+    elm.setBaudRate(port, elm.baudRequest);
+    elm.baudRequest = 0;
+    while (port.available())
+        port.read();
+    out(elm.version());
+    out(elm.CR);
+    flush();
+    baudTrial = true;
+    baudTrialStart = Clock::millis();
+}
+
+void CLI::baudTrialLoop() {
+    bool confirmed = false;
+    while (port.available() && !confirmed)
+        confirmed = (port.read() == '\r');
+    if (confirmed) {
+        baudTrial = false;
+        elm.startBaudRate = elm.getBaudRate();
+        drainRate = elm.getBaudRate() / 10;
+        if (portName) {
+            std::string setting = std::string("baud-") + portName;
+            SettingsRepository.write(setting.c_str(), std::to_string(elm.startBaudRate).c_str());
+        }
+        out("OK");
+        out(elm.newline());
+        prompt(true);
+    } else if (Clock::millis() - baudTrialStart > 5u * elm.baudTimeout) {
+        baudTrial = false;
+        elm.setBaudRate(port, baudPrevious);
+        prompt(true);
+    }
+}
+
+void CLI::printSendError(sendVPW_status_t status) {
     switch(status) {
         case SEND_VPW_STATUS_OK:
             // NOTHING TO SEE HERE, FOLKS!
             return;
         case SEND_VPW_STATUS_CONGESTION:
-            port.print("!CONGESTION");
+            out("!CONGESTION");
             break;
         case SEND_VPW_STATUS_INVALID_CRC:
-            port.print("!INVALID CRC");
+            out("!INVALID CRC");
             break;
         case SEND_VPW_STATUS_TOO_SHORT:
-            port.print("!TOO SHORT");
+            out("!TOO SHORT");
             break;
         case SEND_VPW_STATUS_TOO_LONG:
-            port.print("!TOO LONG");
+            out("!TOO LONG");
             break;
         case SEND_VPW_STATUS_NO_ECHO:
-            port.print("!NO ECHO");
+            out("!NO ECHO");
             break;
         case SEND_VPW_STATUS_STILL_SENDING:
-            port.print("!STILL SENDING");
+            out("!STILL SENDING");
             break;
         default:
-            port.print("!UNKNOWN STATUS");
+            out("!UNKNOWN STATUS");
             break;
     }
-    port.print(elm.newline());
+    out(elm.newline());
 }
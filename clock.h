@@ -0,0 +1,99 @@
+#pragma once
+
+#include <sys/time.h>
+
+//
+// CLOCK
+//
+// All of the firmware's timing reads the time through here: the millis() and micros()
+// counters (monitor and inactivity timeouts, SD flush and rotation, periodic messages, the
+// receive EOT), the wall clock that stamps frames and that ATTIME/ATUT set, and the few waits.
+// On the RP2040 these are the core's own calls.
+//
+// Built with VIRTUAL_CLOCK (the host build) the clock can be switched to virtual time, which
+// only moves when it is stepped (advance, advanceTo) and by readCostNs per read, so that busy
+// waits still end.  A simulation driving both loops from one thread then runs as fast as the
+// code allows and the same way every time.
+//
+
+class Clock {
+public:
+#ifdef VIRTUAL_CLOCK
+    static inline bool virtualTime = false;
+    static inline uint64_t virtualNs = 0;       // since boot
+    static inline int64_t epochUs = 0;          // wall clock at boot
+    static inline uint32_t readCostNs = 100;
+
+    static void advance(uint64_t us) {
+        virtualNs += us * 1000;
+    }
+    static void advanceTo(uint64_t us) {
+        if (us * 1000 > virtualNs)
+            virtualNs = us * 1000;
+    }
+#endif
+
+    static uint64_t micros64() {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime)
+            return (virtualNs += readCostNs) / 1000;
+#endif
+        return time_us_64();
+    }
+
+    static uint32_t micros() {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime)
+            return (uint32_t)micros64();
+#endif
+        return ::micros();
+    }
+
+    static uint32_t millis() {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime)
+            return (uint32_t)(micros64() / 1000);
+#endif
+        return ::millis();
+    }
+
+    static struct timeval now() {
+        struct timeval tv;
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime) {
+            int64_t us = epochUs + (int64_t)micros64();
+            tv.tv_sec = us / 1000000;
+            tv.tv_usec = us % 1000000;
+            return tv;
+        }
+#endif
+        gettimeofday(&tv, NULL);
+        return tv;
+    }
+
+    static bool set(const struct timeval& tv) {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime) {
+            epochUs = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - (int64_t)(virtualNs / 1000);
+            return true;
+        }
+#endif
+        return settimeofday(&tv, NULL) == 0;
+    }
+
+    static void delay(uint32_t ms) {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime)
+            return advance((uint64_t)ms * 1000);
+#endif
+        ::delay(ms);
+    }
+
+    static void delayMicroseconds(uint32_t us) {
+#ifdef VIRTUAL_CLOCK
+        if (virtualTime)
+            return advance(us);
+#endif
+        ::delayMicroseconds(us);
+    }
+};
@@ -11,17 +11,33 @@
 #include "stringutil.h"
 #include "cli.h"
 #include "automation.h"
+#include "emulation.h"
 #include "vpw.h"
+#include "clock.h"
+#include "filter.h"
+#include "timing.h"
 #include "rtc.h"
 
 #ifdef USE_SD
 #include "sdlog.h"
+#include "replay.h"
 #endif
+#ifdef USE_FLASHLOG
+#include "flashlog.h"
+#endif
+#include "recorder.h"
+#include "loadgen.h"
 
 #ifndef defaultBaudRate
 #define defaultBaudRate 115200
 #endif
 
+// ATBRD hh tries 4000000 / hh baud, as an ELM327 does, except that a standard rate within
+// BAUD_SNAP_PERCENT is used instead (the RP2040's UART divider is fractional, so 23 is
+// 115200 rather than 114286)
+#define BAUD_CLOCK 4000000
+#define BAUD_SNAP_PERCENT 3
+
 #ifndef DEVICE_DESCRIPTION
 #define DEVICE_DESCRIPTION (std::string("OBD2-Pico-VPW/") + BOARD_NAME)
 #endif
@@ -64,6 +80,7 @@
                     response = "?";                         \
             else {                                          \
                 monitor = type;                             \
+                binaryMonitor = false;                      \
                 monitorCount = 0;                           \
                 var = HexUtil.getByte(data);                \
                 response = "SEARCHING...";                  \
@@ -80,6 +97,13 @@
     }                           \
 }
 
+// what a terminal's monitor does while it can't keep up (ATOL, see CLI::loop)
+enum overloadPolicy_t : byte {
+    OVERLOAD_DROP    = 0, // drop the oldest frames, marked [DROPPED n]
+    OVERLOAD_CHANGES = 1, // only frames whose header's payload changed
+    OVERLOAD_SUMMARY = 2  // a summary line per header every second
+};
+
 #define CMDCASE(value, code) {                              \
             if (cmd.rfind(value, 0) == 0) {                 \
                 data = cmd.substr(strlen(value));           \
@@ -131,12 +155,17 @@ public:
     bool customHeader;
     bool headers;
     char monitor;
+    bool binaryMonitor = false; // ATBM: monitor all as a binary stream (binmon.h)
+    bool binaryCompress = false; // ATBMC: compressed
     ulong monitorCount;
     byte monitorTransmit;
     byte monitorReceive;
     byte monitorTimeout;
     byte adaptiveTiming;
     byte testerAddress;
+    uint startBaudRate = defaultBaudRate;   // the port's, or the last ATBRD confirmed
+    byte baudTimeout;                       // ATBRT: for the CR confirming a new rate (x 5ms)
+    uint baudRequest = 0;                   // ATBRD: the rate to try (see CLI::loop)
     
     // CUSTOM STUFF
     bool notifications;
@@ -148,10 +177,22 @@ public:
     byte inactiveTime;
     byte responseCount;
     bool waitSend;
+    byte overloadPolicy;
+    bool pipeline;              // ATPL: requests don't wait for the previous one's responses
+    std::vector<FrameRule> filterRules;     // ATCF, ATCFN, ATCRA
+    std::vector<byte> filterMask;           // ATCM: for the rules that follow
+    uint filterVersion = 0;                 // bumped when the rules change
+    std::string receiveRule;                // the rule ATCRA added, as tostring(); empty if none
     
+#ifdef USE_SD
+    SDLogReader logReader;    // ATLOG n download in progress
+#elif defined(USE_FLASHLOG)
+    FlashLogReader logReader; // ATLOG 0 readback in progress
+#endif
+
     timeval timestampOffset = { 0, 0 };
     void zeroTimestamp() {
-        gettimeofday(&timestampOffset, NULL);
+        timestampOffset = Clock::now();
     }
     void restoreTimestamp() {
         timestampOffset = {0, 0};
@@ -160,7 +201,7 @@ public:
     bool send4X() {
         if (vpwSpeed == 'A')
             return VPW::SEND_4X;
-        else if (vpwSpeed = '4')
+        else if (vpwSpeed == '4')
             return true;
         else
             return false;
@@ -192,6 +233,7 @@ public:
         dat += "CRC=" + (autoCRC               ? Y : N) + delim;
         dat += "W="   + (waitSend              ? Y : N) + delim;
         dat += "RC="  + HexUtil.hex(responseCount)      + delim;
+        dat += "PL="  + (pipeline              ? Y : N) + delim;
         dat += "VPW=" + std::string(1, vpwSpeed);       /* LAST PARAM HAS NO DELIM */       
         return dat;
     }
@@ -272,6 +314,8 @@ public:
                     responseCount = HexUtil.getByte(value);
                 else if (key == "W")
                     waitSend = (value == Y);
+                else if (key == "PL")
+                    pipeline = (value == Y);
 
                 else
                     found--;
@@ -307,12 +351,14 @@ public:
         customHeader = false;
         headers      = false;
         monitor      = 0x00;
+        binaryMonitor = false;
         monitorCount = 0;
         monitorTransmit = 0x00;
         monitorReceive  = 0x00;
         monitorTimeout  = 0x32;
         adaptiveTiming  = 0x01;
         testerAddress   = 0xF1;
+        baudTimeout     = 0x0F;
         
         notifications = true;
         allowInvalid  = false;
@@ -323,6 +369,12 @@ public:
         vpwSpeed      = 'A';
         inactiveTime  = 0;
         responseCount = 0;
+        overloadPolicy = OVERLOAD_DROP;
+        pipeline      = false;
+        filterRules.clear();
+        filterMask.clear();
+        filterVersion++;
+        receiveRule.clear();
         
         restoreTimestamp();
     }
@@ -344,9 +396,8 @@ public:
     
     void ATZ(HardwareSerial& port) {
         // According to the ELM documentation, ATZ is also supposed to reset the baud rate
-        baudRate = defaultBaudRate;
-        port.flush();
-        port.begin(baudRate);
+        // (to the one saved for the port, see CLI::beginPort)
+        setBaudRate(port, startBaudRate);
         
         // Warm start
         ATWS();
@@ -356,6 +407,26 @@ public:
         ATWS();
     }
 
+    uint getBaudRate() const {
+        return baudRate;
+    }
+
+    void setBaudRate(HardwareSerial& port, uint rate) {
+        baudRate = rate;
+        port.flush();
+        port.begin(baudRate);
+    }
+
+    static uint baudForDivisor(byte divisor) {
+        static const uint standard[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 500000, 921600, 1000000, 2000000, 4000000 };
+        uint rate = BAUD_CLOCK / divisor;
+        for (uint s : standard) {
+            if (rate * 100 >= s * (100 - BAUD_SNAP_PERCENT) && rate * 100 <= s * (100 + BAUD_SNAP_PERCENT))
+                return s;
+        }
+        return rate;
+    }
+
     //
     // Programmed response: i.e. if XXXXXX is received then send YYYY,ZZZZZZ
     //
@@ -515,6 +586,221 @@ public:
         }
     }
     
+    //
+    // Emulated module tables: <address><key>=<hex data> (empty data removes the entry)
+    //
+    void EMU(std::string& response, std::string_view data, size_t keyBytes, std::function<bool(byte, uint, const std::vector<byte>&)> set) {
+        size_t eq = data.find('=');
+        std::vector<byte> key = HexUtil.bytes(data.substr(0, eq));
+        std::vector<byte> value;
+        if (eq != std::string_view::npos && eq + 1 < data.size()) {
+            value = HexUtil.bytes(data.substr(eq + 1));
+            if (value.size() == 0) {
+                response = "?";
+                return;
+            }
+        }
+        if (eq == std::string_view::npos || eq != (keyBytes + 1) * 2 || key.size() != keyBytes + 1) {
+            response = "?";
+            return;
+        }
+        uint k = 0;
+        for (size_t i = 1; i < key.size(); i++)
+            k = (k << 8) | key[i];
+        if (!set(key[0], k, value))
+            response = "!ERROR";
+    }
+
+#ifdef USE_SD
+    //
+    // Framed binary log download: <n> [O<offset>] [T<start>[-<end>]] [H<hdr>[,<hdr>...]]
+    //
+    void LOGD(std::string& response, std::string_view data) {
+        size_t pos = 0;
+        auto number = [&]() {
+            size_t start = pos;
+            while (pos < data.size() && isdigit(data[pos]))
+                pos++;
+            return (uint32_t)strtoul(std::string(data.substr(start, pos - start)).c_str(), nullptr, 10);
+        };
+        bool ok = data.size() > 0 && isdigit(data[0]);
+        size_t index = number();
+        uint32_t offset = 0;
+        LogFilter filter;
+        while (ok && pos < data.size()) {
+            char key = data[pos++];
+            if (key == 'O') {
+                offset = number();
+            } else if (key == 'T') {
+                filter.start = number();
+                if (pos < data.size() && data[pos] == '-') {
+                    pos++;
+                    filter.end = number();
+                }
+            } else if (key == 'H') {
+                do {
+                    size_t start = pos;
+                    while (pos < data.size() && isxdigit(data[pos]))
+                        pos++;
+                    std::vector<byte> header = HexUtil.bytes(data.substr(start, pos - start));
+                    ok = header.size() > 0 && header.size() <= 3 && filter.headerCount < LOGFILTER_HEADERS;
+                    if (ok) {
+                        memcpy(filter.headers[filter.headerCount], header.data(), header.size());
+                        filter.headerLengths[filter.headerCount++] = header.size();
+                    }
+                } while (ok && pos < data.size() && data[pos] == ',' && ++pos);
+            } else {
+                ok = false;
+            }
+        }
+        if (!ok)
+            response = "?";
+        else if (logReader.begin(index, offset, newline(), response, true, filter))
+            response.clear();
+    }
+
+    //
+    // Log replay onto the bus: <n> [S<speed %>] [A<src>[,<src>...]] [X<src>[,<src>...]]
+    //
+    void RP(std::string& response, std::string_view data) {
+        size_t pos = 0;
+        auto number = [&]() {
+            size_t start = pos;
+            while (pos < data.size() && isdigit(data[pos]))
+                pos++;
+            return (uint)strtoul(std::string(data.substr(start, pos - start)).c_str(), nullptr, 10);
+        };
+        bool ok = data.size() > 0 && isdigit(data[0]);
+        size_t index = number();
+        ReplayFilter filter;
+        while (ok && pos < data.size()) {
+            char key = data[pos++];
+            if (key == 'S') {
+                filter.speed = number();
+                ok = filter.speed > 0;
+            } else if (key == 'A' || key == 'X') {
+                byte* list = (key == 'A') ? filter.only : filter.exclude;
+                size_t& count = (key == 'A') ? filter.onlyCount : filter.excludeCount;
+                do {
+                    ok = pos + 2 <= data.size() && isxdigit(data[pos]) && isxdigit(data[pos + 1]) && count < REPLAY_ADDRESSES;
+                    if (ok) {
+                        list[count++] = HexUtil.getByte(data.substr(pos, 2));
+                        pos += 2;
+                    }
+                } while (ok && pos < data.size() && data[pos] == ',' && ++pos);
+            } else {
+                ok = false;
+            }
+        }
+        if (!ok)
+            response = "?";
+        else
+            replay.begin(index, filter, response);
+    }
+#endif
+
+    //
+    // Monitor filter rules (filter.h): ? lists them, no argument clears them
+    //
+    void CF(std::string& response, std::string_view data, filterRule_t kind) {
+        if (data == "?") {
+            std::string list;
+            for (size_t i = 0; i < filterRules.size(); i++) {
+                if (i > 0)
+                    list += ',';
+                list += filterRules[i].tostring();
+            }
+            response = list;
+        } else if (data.size() == 0) {
+            filterRules.clear();
+            filterVersion++;
+        } else {
+            FrameRule rule;
+            if (filterRules.size() >= FILTER_RULES || !rule.parse(data, filterMask, kind)) {
+                response = "?";
+            } else {
+                filterRules.push_back(rule);
+                filterVersion++;
+            }
+        }
+    }
+
+    //
+    // Synthetic load: [R<frames/s> | L<bus %>] [M1|M4] [SF|SP] [D<min>[-<max>]] [H<hdr>[:<weight>][,...]] [T<s>]
+    //
+    void GEN(std::string& response, std::string_view data) {
+        size_t pos = 0;
+        auto number = [&]() {
+            size_t start = pos;
+            while (pos < data.size() && isdigit(data[pos]))
+                pos++;
+            return (uint)strtoul(std::string(data.substr(start, pos - start)).c_str(), nullptr, 10);
+        };
+        // parsed into locals, so a rejected command leaves the generator as it was
+        uint rate = loadgen.rate, load = loadgen.load, duration = loadgen.duration;
+        bool mode4X = loadgen.mode4X, pulseStage = loadgen.pulseStage;
+        uint minPayload = loadgen.minPayload, maxPayload = loadgen.maxPayload;
+        std::vector<std::pair<std::vector<byte>, uint>> headers;
+        bool newHeaders = false;
+        bool ok = true;
+        while (ok && pos < data.size()) {
+            char key = data[pos++];
+            char next = pos < data.size() ? data[pos] : 0;
+            if (key == 'R') {
+                rate = number();
+                ok = rate > 0;
+            } else if (key == 'L') {
+                rate = 0;
+                load = number();
+                ok = load > 0 && load <= 100;
+            } else if (key == 'M' && (next == '1' || next == '4')) {
+                mode4X = (next == '4');
+                pos++;
+            } else if (key == 'S' && (next == 'F' || next == 'P')) {
+                pulseStage = (next == 'P');
+                pos++;
+            } else if (key == 'D') {
+                minPayload = maxPayload = number();
+                if (pos < data.size() && data[pos] == '-' && ++pos)
+                    maxPayload = number();
+                ok = minPayload <= maxPayload && maxPayload <= 0xFF - 4;
+            } else if (key == 'H') {
+                newHeaders = true;
+                do {
+                    auto header = HexUtil.bytes(data.substr(pos, 6));
+                    ok = pos + 6 <= data.size() && header.size() == 3;
+                    pos += 6;
+                    uint weight = 1;
+                    if (ok && pos < data.size() && data[pos] == ':' && ++pos)
+                        weight = number();
+                    ok = ok && weight > 0 && headers.size() < LOADGEN_HEADERS;
+                    headers.emplace_back(std::move(header), weight);
+                } while (ok && pos < data.size() && data[pos] == ',' && ++pos);
+            } else if (key == 'T') {
+                duration = number();
+            } else {
+                ok = false;
+            }
+        }
+        if (!ok) {
+            response = "?";
+            return;
+        }
+        loadgen.rate = rate;
+        loadgen.load = load;
+        loadgen.duration = duration;
+        loadgen.mode4X = mode4X;
+        loadgen.pulseStage = pulseStage;
+        loadgen.minPayload = minPayload;
+        loadgen.maxPayload = maxPayload;
+        if (newHeaders) {
+            loadgen.clearHeaders();
+            for (auto& [header, weight] : headers)
+                loadgen.addHeader(header.data(), weight);
+        }
+        loadgen.begin();
+    }
+
     bool process(std::string& response, std::string_view cmd, std::string_view input, HardwareSerial& port) {
         std::string_view data;
         
@@ -525,6 +811,34 @@ public:
         CMDCASE("ATAI",  TOGGLE_FN(allowInvalid));
         CMDCASE("ATAL",  SET_FN(allowLong, true));
         CMDCASE("ATAR",  SET_FN(autoReceive, true));
+        CMDCASE("ATATS", NOARGS(response = responseTiming.stats(newline(), adaptiveTiming, 4000u * monitorTimeout)));
+        CMDCASE("ATAT",  {
+            if (data == "?")
+                response = std::to_string(adaptiveTiming);
+            else if (data.size() == 1 && data[0] >= '0' && data[0] <= '2')
+                adaptiveTiming = data[0] - '0';
+            else
+                response = "?";
+        });
+        CMDCASE("ATBMC", {
+            MONITOR_FN('A', monitorReceive);
+            binaryMonitor = (response != "?");
+            binaryCompress = true;
+        });
+        CMDCASE("ATBM",  {
+            MONITOR_FN('A', monitorReceive);
+            binaryMonitor = (response != "?");
+            binaryCompress = false;
+        });
+        CMDCASE("ATBRD", {
+            if (data == "?")
+                response = std::to_string(baudRate);
+            else if (data.size() != 2 || !isxdigit(data[0]) || !isxdigit(data[1]) || HexUtil.getByte(data) == 0)
+                response = "?";
+            else
+                baudRequest = baudForDivisor(HexUtil.getByte(data));
+        });
+        CMDCASE("ATBRT", BYTE_FN(baudTimeout));
         CMDCASE("ATCH",  {
             TOGGLE_FN(customHeader));
             if (data == "1") {
@@ -545,12 +859,59 @@ public:
                 response = "?";
             }
         });
+        CMDCASE("ATCFN", CF(response, data, FILTER_EXCLUDE));
+        CMDCASE("ATCF",  CF(response, data, FILTER_INCLUDE));
+        CMDCASE("ATCM",  {
+            if (data == "?") {
+                std::string mask;
+                for (byte b : filterMask)
+                    mask += HexUtil.hex(b);
+                response = mask;
+            } else if (data.size() == 0) {
+                filterMask.clear();
+            } else {
+                auto mask = HexUtil.bytes(data);
+                if (data.size() % 2 != 0 || data.size() > 2 * FILTER_BYTES || !std::all_of(data.begin(), data.end(), ::isxdigit))
+                    response = "?";
+                else
+                    filterMask = mask;
+            }
+        });
+        CMDCASE("ATCRA", {
+            // ELM: frames to this address only (one include rule here, replaced by the next ATCRA);
+            // no argument removes just that rule, leaving ATCF/ATCFN ones alone
+            if (data == "?")
+                CF(response, data, FILTER_INCLUDE);
+            else if (data.size() == 0 || (data.size() == 2 && isxdigit(data[0]) && isxdigit(data[1]))) {
+                auto own = std::find_if(filterRules.rbegin(), filterRules.rend(),
+                                        [&](const FrameRule& rule) { return rule.tostring() == receiveRule; });
+                if (!receiveRule.empty() && own != filterRules.rend()) {
+                    filterRules.erase(std::next(own).base());
+                    filterVersion++;
+                }
+                receiveRule.clear();
+                size_t before = filterRules.size();
+                if (data.size() > 0)
+                    CF(response, std::string("XX") + std::string(data), FILTER_INCLUDE);
+                if (filterRules.size() > before)
+                    receiveRule = filterRules.back().tostring();
+            } else
+                response = "?";
+        });
         CMDCASE("ATCRC", TOGGLE_FN(autoCRC));
         CMDCASE("ATCT",  NOARGS(CONST_FN(std::to_string(Util.getCpuTemperature()))));
         CMDCASE("ATDPN", CONST_FN("2"));
         CMDCASE("ATDP",  CONST_FN("SAE J1850 VPW"));
         CMDCASE("ATD",   NOARGS(ATD()));
         CMDCASE("ATE",   TOGGLE_FN(echo));
+        CMDCASE("ATGENQ", NOARGS(loadgen.stop()));
+        CMDCASE("ATGENS", NOARGS(response = loadgen.stats(newline())));
+        CMDCASE("ATGEN", {
+            if (data == "?")
+                response = loadgen.status();
+            else
+                GEN(response, data);
+        });
         CMDCASE("ATH",   TOGGLE_FN(headers));
         CMDCASE("ATIA",  BYTE_FN(inactiveTime));
         CMDCASE("ATID",  NOARGS(CONST_FN(Util.getUniqueBoardId())));
@@ -565,6 +926,7 @@ public:
             }
         });
 #ifdef USE_SD
+        CMDCASE("ATLOGD", LOGD(response, data));
         CMDCASE("ATLOG", {
             if (data == "") {
                 response = std::to_string(sdlog.index);
@@ -576,13 +938,55 @@ public:
                 response += std::to_string(sdlog.index);
             } else if (data == "+") {
                 sdlog.open();
-            } else if (Util.isNumeric(data)) {
-                sdlog.print(atoi(data.data()), port, newline());
+            } else if (data == "S") {
+                response = sdlog.stats(newline());
+            } else if (data == "S0") {
+                sdlog.clearStats();
+            } else if (data == "B?") {
+                response = sdlog.binary ? "1" : "0";
+            } else if (data == "B1" || data == "B0") {
+                sdlog.setBinary(data == "B1");
+            } else if (data == "P?") {
+                response = sdlog.preallocate ? "1" : "0";
+            } else if (data == "P1" || data == "P0") {
+                sdlog.setPreallocate(data == "P1");
+            } else if (Util.isNumeric(data.substr(0, data.find(',')))) {
+                // ATLOG n[,offset]: sent from CLI::loop; offset resumes an interrupted download
+                size_t comma = data.find(',');
+                uint32_t offset = (comma == std::string::npos) ? 0 : strtoul(data.data() + comma + 1, nullptr, 10);
+                if (logReader.begin(atoi(data.data()), offset, newline(), response))
+                    response.clear();
             } else if (data.size() > 0 && data[0] == '#') {
                 std::string line(input);
                 line.erase(0, 5);
-                line.append(newline());
-                sdlog.write(line);
+                sdlog.note(line);
+            } else {
+                response = "?";
+            }
+        });
+#elif defined(USE_FLASHLOG)
+        CMDCASE("ATLOG", {
+            if (data == "") {
+                response = "0:";
+                response += std::to_string(flashlog.recordsLogged);
+            } else if (data == "?") {
+                response = flashlog.info();
+            } else if (data == "+") {
+                flashlog.rotate();
+            } else if (data == "S") {
+                response = flashlog.stats(newline());
+            } else if (data == "S0") {
+                flashlog.clearStats();
+            } else if (Util.isNumeric(data.substr(0, data.find(',')))) {
+                // ATLOG 0[,offset]: the whole flash log, oldest first, as text
+                size_t comma = data.find(',');
+                uint32_t offset = (comma == std::string::npos) ? 0 : strtoul(data.data() + comma + 1, nullptr, 10);
+                if (logReader.begin(atoi(data.data()), offset, newline(), response))
+                    response.clear();
+            } else if (data.size() > 0 && data[0] == '#') {
+                std::string line(input);
+                line.erase(0, 5);
+                flashlog.note(line);
             } else {
                 response = "?";
             }
@@ -606,12 +1010,95 @@ public:
         CMDCASE("ATMT",  MONITOR_FN('T', monitorTransmit));
         CMDCASE("ATNL",  SET_FN(allowLong, false));
         CMDCASE("ATN",   TOGGLE_FN(notifications));
+        CMDCASE("ATOL",  {
+            if (data == "?")
+                response = std::to_string(overloadPolicy);
+            else if (data.size() == 1 && data[0] >= '0' && data[0] <= '2')
+                overloadPolicy = data[0] - '0';
+            else
+                response = "?";
+        });
+        CMDCASE("ATPL",  TOGGLE_FN(pipeline));
         CMDCASE("ATPR",  ATPR(response, data));
         CMDCASE("ATRA",  {
             BYTE_FN(monitorReceive);
             autoReceive = false;
         });
         CMDCASE("ATRC",  BYTE_FN(responseCount));
+#ifdef USE_SD
+        CMDCASE("ATRPQ", NOARGS(replay.stop()));
+        CMDCASE("ATRPS", {
+            if (data == "0")
+                replay.clearStats();
+            else if (data.size() == 0)
+                response = replay.stats(newline());
+            else
+                response = "?";
+        });
+        CMDCASE("ATRP",  {
+            if (data.size() == 0 || data == "?")
+                response = replay.status();
+            else
+                RP(response, data);
+        });
+#endif
+        CMDCASE("ATRECB", {
+            if (data == "?")
+                response = std::to_string(recorder.budget);
+            else if (data.size() == 0 || !Util.isNumeric(data))
+                response = "?";
+            else if (!recorder.setBudget(atoi(data.data())))
+                response = "!ERROR";
+        });
+        CMDCASE("ATRECE", {
+            if (data == "?")
+                response = HexUtil.hex(recorder.events);
+            else if (data.size() == 0 || data.size() > 2)
+                response = "?";
+            else
+                recorder.setEvents(HexUtil.getByte(data));
+        });
+        CMDCASE("ATRECM", {
+            if (data == "?")
+                response = recorder.listPatterns();
+            else if (data.size() == 0)
+                recorder.clearPatterns();
+            else if (!recorder.addPattern(data))
+                response = "?";
+        });
+        CMDCASE("ATRECS", {
+            if (data == "0")
+                recorder.clearStats();
+            else if (data.size() == 0)
+                response = recorder.stats(newline());
+            else
+                response = "?";
+        });
+        CMDCASE("ATRECT", NOARGS({
+            if (!recorder.trigger())
+                response = recorder.state == RECORDER_OFF ? "!OFF" : "!BUSY";
+        }));
+        CMDCASE("ATRECW", {
+            // ATRECW pre,post (seconds)
+            size_t comma = data.find(',');
+            if (data == "?")
+                response = std::to_string(recorder.preSeconds) + "," + std::to_string(recorder.postSeconds);
+            else if (comma == std::string_view::npos || comma == 0 || comma + 1 == data.size() || !Util.isNumeric(data.substr(0, comma)) || !Util.isNumeric(data.substr(comma + 1)))
+                response = "?";
+            else
+                recorder.setWindow(atoi(data.data()), atoi(data.data() + comma + 1));
+        });
+        CMDCASE("ATREC", {
+            if (data == "")
+                response = recorder.status();
+            else if (data == "?")
+                response = recorder.state == RECORDER_OFF ? "0" : "1";
+            else if (data == "1" || data == "0") {
+                if (!recorder.enable(data == "1"))
+                    response = "!ERROR";
+            } else
+                response = "?";
+        });
         CMDCASE("ATRTC", {
             if (data == "B") {
                 if (rtc.begin())
@@ -690,12 +1177,7 @@ public:
             if (data.size() != 0 && data != "?") {
                 response = "?";
             } else {
-                struct timeval tv;
-                if (gettimeofday(&tv, nullptr) != 0) {
-                    response = "ERROR";
-                } else {
-                    response = Util.timevalToString(tv);
-                }
+                response = Util.timevalToString(Clock::now());
             }
         });
         CMDCASE("ATTP",  {
@@ -741,17 +1223,13 @@ public:
         });
         CMDCASE("ATUT", {
             if (data == "?") {
-                struct timeval tv;
-                if (gettimeofday(&tv, nullptr) != 0) {
-                    response = "ERROR";
-                } else {
-                    response = std::to_string(tv.tv_sec) + "." + std::to_string(tv.tv_usec);
-                }
+                struct timeval tv = Clock::now();
+                response = std::to_string(tv.tv_sec) + "." + std::to_string(tv.tv_usec);
             } else if (Util.isNumeric(data)) {
                 struct timeval tv;
                 tv.tv_sec = atol(data.data());
                 tv.tv_usec = 0;
-                if (settimeofday(&tv, nullptr) != 0) {
+                if (!Clock::set(tv)) {
                     response = "ERROR";
                 } else {
                     rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
@@ -823,6 +1301,52 @@ public:
          * ADDITIONAL GM COMMANDS
          */
          
+        CMDCASE("EMU3C", EMU(response, data, 1, [](byte a, uint k, const std::vector<byte>& v) { return Emulation.setBlock(a, k, v); }));
+        CMDCASE("EMU22", EMU(response, data, 2, [](byte a, uint k, const std::vector<byte>& v) { return Emulation.setPid(a, k, v); }));
+        CMDCASE("EMUPM", {
+            std::vector<byte> bytes = HexUtil.bytes(data);
+            if (data.size() != 6 || bytes.size() != 3)
+                response = "?";
+            else if (!Emulation.setPowerMask(bytes[0], (bytes[1] << 8) | bytes[2]))
+                response = "!ERROR";
+        });
+        CMDCASE("EMUP",  EMU(response, data, 2, [](byte a, uint k, const std::vector<byte>& v) { return Emulation.setPeriodic(a, k, v); }));
+        CMDCASE("EMUSTAT", {
+            if (data == "0")
+                Emulation.clearStats();
+            else if (data.size() == 0)
+                response = Emulation.stats(newline());
+            else
+                response = "?";
+        });
+        CMDCASE("EMUSAVE", {
+            if (data.size() == 1) {
+                if (!Emulation.save(HexUtil.getByte(data)))
+                    response = "!ERROR";
+            } else {
+                response = "?";
+            }
+        });
+        CMDCASE("EMULOAD", {
+            if (data.size() == 1) {
+                if (!Emulation.load(HexUtil.getByte(data)))
+                    response = "!ERROR";
+            } else {
+                response = "?";
+            }
+        });
+        CMDCASE("EMUD",  {
+            if (data.size() == 0)
+                Emulation.clear();
+            else if (data.size() != 2 || !Emulation.remove(HexUtil.getByte(data)))
+                response = "?";
+        });
+        CMDCASE("EMU",   {
+            if (data == "?")
+                response = std::string(Emulation.enabled ? "1:" : "0:") + std::to_string(Emulation.size());
+            else
+                TOGGLE_FN(Emulation.enabled);
+        });
         CMDCASE("GMTP",  TOGGLE_FN(Automation.sendTesterPresent));
         CMDCASE("GMPM",  {
             if (data == "?") {
@@ -0,0 +1,540 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "settings.h"
+#include "message.h"
+#include "vpw.h"
+#include "util.h"
+#include "hexutil.h"
+
+//
+// EMULATION
+//
+// Hosts several virtual modules on the bus.  Each module answers mode $3C (block read)
+// and mode $22 (PID read) requests sent to its physical address, and transmits its own
+// periodic broadcasts.  A module only participates while the current power mode (taken
+// from the BCM's functional $06 broadcast) is set in its power mode mask.
+//
+// Profiles are stored as compact binary files in SETTINGS_PATH (emu-0, emu-1, ...):
+//
+//   "EMU1" <enabled:1> <moduleCount:1>
+//   per module:  <address:1> <powerMask:2> <blockCount:1> <pidCount:1> <periodicCount:1>
+//     block:     <block:1> <length:1> <data...>
+//     pid:       <pid:2> <length:1> <data...>
+//     periodic:  <interval ms:2> <length:1> <frame without CRC...>
+//
+// Multi-byte values are little-endian.  Counts and lengths are single bytes, and every reply
+// has to fit in EMU_MAX_FRAME: the commands refuse anything else, and so do save() and load().
+//
+
+#ifndef EMU_QUEUE_SIZE
+#define EMU_QUEUE_SIZE 32
+#endif
+
+#ifndef EMU_MAX_MODULES
+#define EMU_MAX_MODULES 32
+#endif
+
+#ifndef EMU_MAX_FRAME
+#define EMU_MAX_FRAME 12 // bytes, with CRC: J1850's limit
+#endif
+
+#ifndef EMU_RESPONSE_DEADLINE_US
+#define EMU_RESPONSE_DEADLINE_US 100000 // J2190 P2 maximum (100ms)
+#endif
+
+struct EmulatedPeriodic {
+    uint16_t interval = 1000;
+    std::vector<byte> frame; // without CRC
+    uint last = 0;
+};
+
+struct EmulatedModule {
+    byte address = 0x00;
+    uint16_t powerMask = 0xFFFF;
+    std::map<byte, std::vector<byte>> blocks;
+    std::map<uint16_t, std::vector<byte>> pids;
+    std::vector<EmulatedPeriodic> periodic;
+
+    // response latency statistics (request SOF to end of response transmission)
+    ulong requests = 0;
+    ulong responses = 0;
+    ulong late = 0;
+    ulong dropped = 0;
+    ulong congestion = 0;
+    uint64_t latencyTotal = 0;
+    uint latencyMin = 0;
+    uint latencyMax = 0;
+
+    bool powered(byte powerMode) const {
+        return powerMode < 16 && (powerMask & (1 << powerMode));
+    }
+
+    void clearStats() {
+        requests = responses = late = dropped = congestion = 0;
+        latencyTotal = 0;
+        latencyMin = latencyMax = 0;
+    }
+
+    void recordLatency(uint us) {
+        if (responses == 0 || us < latencyMin)
+            latencyMin = us;
+        if (us > latencyMax)
+            latencyMax = us;
+        if (us > EMU_RESPONSE_DEADLINE_US)
+            late++;
+        latencyTotal += us;
+        responses++;
+    }
+};
+
+class Emulation {
+private:
+    static constexpr byte NONE = 0xFF;
+    // bytes of a reply besides the data: header, mode, block or PID, CRC (a periodic frame: CRC)
+    static constexpr size_t BLOCK_OVERHEAD = 6;
+    static constexpr size_t PID_OVERHEAD = 7;
+    static constexpr size_t PERIODIC_OVERHEAD = 1;
+    static constexpr size_t MAX_COUNT = 0xFF;
+
+    struct Pending {
+        std::shared_ptr<J1850> frame;
+        struct timeval requested;
+        byte module;
+        bool response;
+    };
+
+    recursive_mutex_t mutex;
+    std::vector<EmulatedModule> modules;
+    std::array<byte, 0x100> index;  // physical address -> module, for O(1) dispatch
+    std::deque<Pending> queue;
+    Pending current;                // being sent by loop(), outside the lock
+    uint generation = 0;            // bumped whenever modules or queue are replaced
+    byte powerMode = 0x00;
+
+    void reindex() {
+        generation++;
+        index.fill(NONE);
+        for (size_t i = 0; i < modules.size(); i++)
+            index[modules[i].address] = (byte)i;
+    }
+
+    EmulatedModule* module(byte address) {
+        if (index[address] == NONE) {
+            if (modules.size() >= EMU_MAX_MODULES)
+                return nullptr;
+            modules.emplace_back();
+            modules.back().address = address;
+            reindex();
+        }
+        return &modules[index[address]];
+    }
+
+    void enqueue(std::vector<byte>&& raw, const struct timeval& requested, byte module, bool response) {
+        if (queue.size() >= EMU_QUEUE_SIZE) {
+            modules[module].dropped++;
+            return;
+        }
+        queue.push_back({std::make_shared<J1850>(raw, true), requested, module, response});
+    }
+
+    static void put16(std::vector<byte>& out, uint16_t value) {
+        out.push_back(value & 0xFF);
+        out.push_back(value >> 8);
+    }
+
+    static void putData(std::vector<byte>& out, const std::vector<byte>& data) {
+        out.push_back((byte)data.size());
+        out.insert(out.end(), data.begin(), data.end());
+    }
+
+    static bool fits(const std::vector<byte>& data, size_t overhead) {
+        return data.size() + overhead <= EMU_MAX_FRAME && data.size() <= 0xFF;
+    }
+
+    // what save() can write and load() will read back
+    static bool valid(const EmulatedModule& mod) {
+        if (mod.blocks.size() > MAX_COUNT || mod.pids.size() > MAX_COUNT || mod.periodic.size() > MAX_COUNT)
+            return false;
+        for (auto& [block, data] : mod.blocks) {
+            if (data.empty() || !fits(data, BLOCK_OVERHEAD))
+                return false;
+        }
+        for (auto& [pid, data] : mod.pids) {
+            if (data.empty() || !fits(data, PID_OVERHEAD))
+                return false;
+        }
+        for (const EmulatedPeriodic& p : mod.periodic) {
+            if (p.interval == 0 || p.frame.size() < 4 || !fits(p.frame, PERIODIC_OVERHEAD))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    bool enabled = false;
+
+    Emulation() {
+        recursive_mutex_init(&mutex);
+        index.fill(NONE);
+    }
+
+    size_t size() {
+        recursive_lock_guard lock(mutex);
+        return modules.size();
+    }
+
+    byte getPowerMode() const {
+        return powerMode;
+    }
+
+    void clear() {
+        recursive_lock_guard lock(mutex);
+        modules.clear();
+        queue.clear();
+        reindex();
+    }
+
+    bool remove(byte address) {
+        recursive_lock_guard lock(mutex);
+        if (index[address] == NONE)
+            return false;
+        modules.erase(modules.begin() + index[address]);
+        queue.clear();
+        reindex();
+        return true;
+    }
+
+    bool setPowerMask(byte address, uint16_t mask) {
+        recursive_lock_guard lock(mutex);
+        EmulatedModule* m = module(address);
+        if (!m)
+            return false;
+        m->powerMask = mask;
+        return true;
+    }
+
+    bool setBlock(byte address, byte block, const std::vector<byte>& data) {
+        if (!fits(data, BLOCK_OVERHEAD))
+            return false;
+        recursive_lock_guard lock(mutex);
+        EmulatedModule* m = module(address);
+        if (!m)
+            return false;
+        if (data.size() == 0)
+            m->blocks.erase(block);
+        else if (m->blocks.size() >= MAX_COUNT && !m->blocks.count(block))
+            return false;
+        else
+            m->blocks[block] = data;
+        return true;
+    }
+
+    bool setPid(byte address, uint16_t pid, const std::vector<byte>& data) {
+        if (!fits(data, PID_OVERHEAD))
+            return false;
+        recursive_lock_guard lock(mutex);
+        EmulatedModule* m = module(address);
+        if (!m)
+            return false;
+        if (data.size() == 0)
+            m->pids.erase(pid);
+        else if (m->pids.size() >= MAX_COUNT && !m->pids.count(pid))
+            return false;
+        else
+            m->pids[pid] = data;
+        return true;
+    }
+
+    // replaces any periodic frame with the same header and secondary address; interval 0 removes it
+    bool setPeriodic(byte address, uint16_t interval, const std::vector<byte>& frame) {
+        if (frame.size() < 4 || !fits(frame, PERIODIC_OVERHEAD))
+            return false;
+        recursive_lock_guard lock(mutex);
+        EmulatedModule* m = module(address);
+        if (!m)
+            return false;
+        for (auto it = m->periodic.begin(); it != m->periodic.end(); ++it) {
+            if (std::equal(frame.begin(), frame.begin() + 4, it->frame.begin())) {
+                m->periodic.erase(it);
+                break;
+            }
+        }
+        if (interval > 0) {
+            if (m->periodic.size() >= MAX_COUNT)
+                return false;
+            m->periodic.push_back({interval, frame, 0});
+        }
+        return true;
+    }
+
+    //
+    // Called (on core 1) for every frame received from the bus
+    //
+    void receive(const Message& m) {
+        if (!enabled || !m.isValid())
+            return;
+
+        recursive_lock_guard lock(mutex);
+        const byte* raw = m.rawByteArray();
+        size_t size = m.size();
+
+        if (m.isFunctional()) {
+            // track power mode from BCM broadcast (28 FF 40 06 <mode> <key> <xx>)
+            if (m.secondaryAddress() == 0x06 && size == 8)
+                powerMode = raw[4];
+            return;
+        }
+
+        byte i = index[m.target()];
+        if (i == NONE || m.source() == m.target())
+            return;
+        EmulatedModule& mod = modules[i];
+        if (!mod.powered(powerMode))
+            return;
+
+        byte sa = m.secondaryAddress();
+        const std::vector<byte>* found = nullptr;
+        std::vector<byte> reply;
+        reply.reserve(size + 8);
+        reply = {m.hdr(), m.source(), m.target()};
+
+        switch (sa) {
+            case 0x3C: {
+                if (size < 6)
+                    return;
+                auto it = mod.blocks.find(raw[4]);
+                if (it != mod.blocks.end())
+                    found = &it->second;
+                break;
+            }
+            case 0x22: {
+                if (size < 7)
+                    return;
+                auto it = mod.pids.find((raw[4] << 8) | raw[5]);
+                if (it != mod.pids.end())
+                    found = &it->second;
+                break;
+            }
+            default:
+                return;
+        }
+
+        mod.requests++;
+        if (found) {
+            reply.push_back(sa + 0x40);
+            reply.insert(reply.end(), raw + 4, raw + (sa == 0x3C ? 5 : 6));
+            reply.insert(reply.end(), found->begin(), found->end());
+        } else {
+            // negative response: request out of range
+            reply.push_back(0x7F);
+            reply.insert(reply.end(), raw + 3, raw + size - 1);
+            reply.push_back(0x31);
+        }
+        enqueue(std::move(reply), m.timestamp, i, true);
+    }
+
+    //
+    // Called (on core 1) every loop; queues periodic broadcasts and transmits at most one frame
+    //
+    void loop(uint now) {
+        if (!enabled)
+            return;
+
+        uint sending;
+        {
+            recursive_lock_guard lock(mutex);
+            // responses have priority over periodic broadcasts
+            if (queue.empty()) {
+                for (size_t i = 0; i < modules.size(); i++) {
+                    EmulatedModule& mod = modules[i];
+                    if (!mod.powered(powerMode))
+                        continue;
+                    for (EmulatedPeriodic& p : mod.periodic) {
+                        if (now - p.last >= p.interval) {
+                            p.last = now;
+                            enqueue(std::vector<byte>(p.frame), VPW::getTimestamp(), i, false);
+                        }
+                    }
+                }
+            }
+            if (queue.empty())
+                return;
+            current = queue.front();
+            sending = generation;
+        }
+
+        // send outside the lock so commands on the other core are not held up by the bus
+        sendVPW_status_t status = vpw.send(*current.frame, false);
+
+        recursive_lock_guard lock(mutex);
+        if (sending != generation || queue.empty())
+            return; // profile changed while sending
+        if (status == SEND_VPW_STATUS_STILL_SENDING)
+            return;
+        if (status == SEND_VPW_STATUS_CONGESTION) {
+            modules[current.module].congestion++;
+            return; // retry next loop
+        }
+        if (current.response && (status == SEND_VPW_STATUS_OK || status == SEND_VPW_STATUS_NO_ECHO)) {
+            struct timeval tv = VPW::getTimestamp();
+            int64_t us = (int64_t)(tv.tv_sec - current.requested.tv_sec) * 1000000 + (tv.tv_usec - current.requested.tv_usec);
+            modules[current.module].recordLatency((uint)max(us, (int64_t)0));
+        }
+        queue.pop_front();
+    }
+
+    std::string stats(const char* newline) {
+        recursive_lock_guard lock(mutex);
+        std::string ret;
+        ret += "PM ";
+        ret += HexUtil.hex(powerMode);
+        ret += " QUEUE ";
+        ret += std::to_string(queue.size());
+        for (EmulatedModule& mod : modules) {
+            ret += newline;
+            ret += HexUtil.hex(mod.address);
+            ret += mod.powered(powerMode) ? ": ON " : ": OFF";
+            ret += " REQ " + std::to_string(mod.requests);
+            ret += " RSP " + std::to_string(mod.responses);
+            ret += " AVG " + std::to_string(mod.responses ? (uint)(mod.latencyTotal / mod.responses) : 0);
+            ret += " MIN " + std::to_string(mod.latencyMin);
+            ret += " MAX " + std::to_string(mod.latencyMax);
+            ret += " LATE " + std::to_string(mod.late);
+            ret += " DROP " + std::to_string(mod.dropped);
+            ret += " CONG " + std::to_string(mod.congestion);
+        }
+        return ret;
+    }
+
+    void clearStats() {
+        recursive_lock_guard lock(mutex);
+        for (EmulatedModule& mod : modules)
+            mod.clearStats();
+    }
+
+    bool save(byte profile) {
+        std::vector<byte> out;
+        {
+            recursive_lock_guard lock(mutex);
+            if (modules.size() > EMU_MAX_MODULES)
+                return false;
+            out = {'E', 'M', 'U', '1', (byte)enabled, (byte)modules.size()};
+            for (const EmulatedModule& mod : modules) {
+                if (!valid(mod))
+                    return false; // rather than a profile that won't load back
+                out.push_back(mod.address);
+                put16(out, mod.powerMask);
+                out.push_back((byte)mod.blocks.size());
+                out.push_back((byte)mod.pids.size());
+                out.push_back((byte)mod.periodic.size());
+                for (auto& [block, data] : mod.blocks) {
+                    out.push_back(block);
+                    putData(out, data);
+                }
+                for (auto& [pid, data] : mod.pids) {
+                    put16(out, pid);
+                    putData(out, data);
+                }
+                for (const EmulatedPeriodic& p : mod.periodic) {
+                    put16(out, p.interval);
+                    putData(out, p.frame);
+                }
+            }
+        }
+        std::string filename = "emu-" + HexUtil.hex(profile);
+        File f = SettingsRepository.open(filename.c_str(), "w");
+        if (!f)
+            return false;
+        size_t written = f.write(out.data(), out.size());
+        f.close();
+        return written == out.size();
+    }
+
+    bool load(byte profile) {
+        std::string filename = "emu-" + HexUtil.hex(profile);
+        File f = SettingsRepository.open(filename.c_str(), "r");
+        if (!f)
+            return false;
+        std::vector<byte> in(f.size());
+        size_t length = f.readBytes((char*)in.data(), in.size());
+        f.close();
+        if (length != in.size() || length < 6 || memcmp(in.data(), "EMU1", 4) != 0)
+            return false;
+
+        size_t pos = 6;
+        auto take = [&](size_t n) -> const byte* {
+            if (pos + n > length)
+                return nullptr;
+            pos += n;
+            return in.data() + pos - n;
+        };
+        auto takeData = [&](std::vector<byte>& data) -> bool {
+            const byte* n = take(1);
+            const byte* p = n ? take(*n) : nullptr;
+            if (!p)
+                return false;
+            data.assign(p, p + *n);
+            return true;
+        };
+
+        // what the EMU commands would accept, or none of it
+        if (in[5] > EMU_MAX_MODULES)
+            return false;
+        std::vector<EmulatedModule> loaded(in[5]);
+        std::array<bool, 0x100> seen{};
+        for (EmulatedModule& mod : loaded) {
+            const byte* h = take(6);
+            if (!h || seen[h[0]])
+                return false;
+            seen[h[0]] = true;
+            mod.address = h[0];
+            mod.powerMask = h[1] | (h[2] << 8);
+            for (byte i = 0; i < h[3]; i++) {
+                const byte* b = take(1);
+                if (!b || mod.blocks.count(*b) || !takeData(mod.blocks[*b]) || mod.blocks[*b].empty())
+                    return false;
+            }
+            for (byte i = 0; i < h[4]; i++) {
+                const byte* p = take(2);
+                uint16_t pid = p ? p[0] | (p[1] << 8) : 0;
+                if (!p || mod.pids.count(pid) || !takeData(mod.pids[pid]) || mod.pids[pid].empty())
+                    return false;
+            }
+            mod.periodic.resize(h[5]);
+            for (size_t i = 0; i < mod.periodic.size(); i++) {
+                EmulatedPeriodic& periodic = mod.periodic[i];
+                const byte* p = take(2);
+                if (!p || !takeData(periodic.frame) || periodic.frame.size() < 4)
+                    return false;
+                periodic.interval = p[0] | (p[1] << 8);
+                if (periodic.interval == 0)
+                    return false;
+                for (size_t j = 0; j < i; j++) {
+                    if (std::equal(periodic.frame.begin(), periodic.frame.begin() + 4, mod.periodic[j].frame.begin()))
+                        return false;
+                }
+            }
+        }
+        if (pos != length)
+            return false;
+        for (const EmulatedModule& mod : loaded) {
+            if (!valid(mod))
+                return false;
+        }
+
+        recursive_lock_guard lock(mutex);
+        modules = std::move(loaded);
+        queue.clear();
+        reindex();
+        enabled = in[4];
+        return true;
+    }
+};
+
+Emulation Emulation;
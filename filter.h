@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "hexutil.h"
+
+//
+// FRAME FILTER
+//
+// Rules over the first bytes of a frame: byte 0 (priority and type), the target, the source,
+// the secondary address and the payload.  A rule is hex with X for any nibble (like ATRECM),
+// optionally under a mask (ATCM), so e.g. pattern 60 with mask E0 is priority 3.  A frame
+// passes if it matches every REQUIRE rule, any INCLUDE rule (when there are some) and no
+// EXCLUDE rule; frames without bytes ([BREAK], [BUS ERROR]) always pass.
+//
+// Compiled, each byte a rule constrains becomes the 256-bit set of values it accepts there, so
+// a rule costs one bit test per constrained byte however it was written.
+//
+
+#define FILTER_RULES 8
+#define FILTER_BYTES 12
+
+enum filterRule_t : byte {
+    FILTER_INCLUDE,     // ATCF, ATCRA
+    FILTER_EXCLUDE,     // ATCFN
+    FILTER_REQUIRE      // ATMR, ATMT
+};
+
+struct FrameRule {
+    byte value[FILTER_BYTES];
+    byte mask[FILTER_BYTES];
+    byte length = 0;
+    filterRule_t kind = FILTER_INCLUDE;
+
+    bool parse(std::string_view hex, const std::vector<byte>& extraMask, filterRule_t kind) {
+        if (hex.size() == 0 || hex.size() % 2 != 0 || hex.size() > 2 * FILTER_BYTES)
+            return false;
+        this->kind = kind;
+        length = hex.size() / 2;
+        for (size_t i = 0; i < hex.size(); i++) {
+            byte nibble = 0, bits = 0x0F;
+            if (hex[i] == 'X')
+                bits = 0;
+            else if (isxdigit(hex[i]))
+                nibble = isdigit(hex[i]) ? hex[i] - '0' : toupper(hex[i]) - 'A' + 10;
+            else
+                return false;
+            if (i % 2 == 0) {
+                value[i / 2] = nibble << 4;
+                mask[i / 2] = bits << 4;
+            } else {
+                value[i / 2] |= nibble;
+                mask[i / 2] |= bits;
+            }
+        }
+        for (size_t i = 0; i < length && i < extraMask.size(); i++)
+            mask[i] &= extraMask[i];
+        for (size_t i = 0; i < length; i++)
+            value[i] &= mask[i];
+        return true;
+    }
+
+    // a single byte, e.g. the target for ATMR
+    static FrameRule address(byte position, byte address, filterRule_t kind) {
+        FrameRule rule;
+        rule.kind = kind;
+        rule.length = position + 1;
+        memset(rule.mask, 0, sizeof(rule.mask));
+        memset(rule.value, 0, sizeof(rule.value));
+        rule.mask[position] = 0xFF;
+        rule.value[position] = address;
+        return rule;
+    }
+
+    std::string tostring() const {
+        std::string ret(kind == FILTER_EXCLUDE ? "-" : "");
+        bool nibbles = true;
+        for (size_t i = 0; i < length; i++) {
+            std::string h = HexUtil.hex(value[i]);
+            if (!(mask[i] & 0xF0))
+                h[0] = 'X';
+            if (!(mask[i] & 0x0F))
+                h[1] = 'X';
+            ret += h;
+            byte high = mask[i] >> 4, low = mask[i] & 0x0F;
+            nibbles = nibbles && (high == 0 || high == 0x0F) && (low == 0 || low == 0x0F);
+        }
+        if (!nibbles) {
+            ret += '/';
+            for (size_t i = 0; i < length; i++)
+                ret += HexUtil.hex(mask[i]);
+        }
+        return ret;
+    }
+};
+
+class FrameFilter {
+private:
+    struct ByteSet {
+        uint32_t bits[8];
+        bool test(byte v) const {
+            return (bits[v >> 5] >> (v & 31)) & 1;
+        }
+    };
+    struct CompiledRule {
+        filterRule_t kind;
+        byte count = 0;                     // bytes constrained
+        byte positions[FILTER_BYTES];
+        ByteSet sets[FILTER_BYTES];
+
+        bool matches(const byte* raw, size_t size) const {
+            for (byte i = 0; i < count; i++) {
+                if (positions[i] >= size || !sets[i].test(raw[positions[i]]))
+                    return false;
+            }
+            return true;
+        }
+    };
+    std::vector<CompiledRule> rules;
+    bool includes = false;
+
+public:
+    void compile(const std::vector<FrameRule>& source) {
+        rules.clear();
+        rules.reserve(source.size());
+        includes = false;
+        for (const FrameRule& rule : source) {
+            CompiledRule& c = rules.emplace_back();
+            c.kind = rule.kind;
+            includes = includes || rule.kind == FILTER_INCLUDE;
+            for (byte i = 0; i < rule.length; i++) {
+                if (rule.mask[i] == 0)
+                    continue;
+                ByteSet& set = c.sets[c.count];
+                memset(set.bits, 0, sizeof(set.bits));
+                for (uint v = 0; v < 0x100; v++) {
+                    if ((v & rule.mask[i]) == rule.value[i])
+                        set.bits[v >> 5] |= 1u << (v & 31);
+                }
+                c.positions[c.count++] = i;
+            }
+        }
+    }
+
+    bool empty() const {
+        return rules.empty();
+    }
+
+    bool accepts(const byte* raw, size_t size) const {
+        if (rules.empty() || size == 0)
+            return true;
+        bool included = !includes;
+        for (const CompiledRule& rule : rules) {
+            switch (rule.kind) {
+                case FILTER_REQUIRE:
+                    if (!rule.matches(raw, size))
+                        return false;
+                    break;
+                case FILTER_EXCLUDE:
+                    if (rule.matches(raw, size))
+                        return false;
+                    break;
+                case FILTER_INCLUDE:
+                    included = included || rule.matches(raw, size);
+                    break;
+            }
+        }
+        return included;
+    }
+};
+
+//
+// What the consumers of assembled frames want, for VPWMessageQueue: a frame none of them would
+// take is dropped before it is made into a Message and fanned out
+//
+class FrameInterest {
+private:
+    std::vector<const FrameFilter*> filters;
+
+public:
+    uint everything = 0;    // consumers that take every frame
+
+    void add(const FrameFilter* filter) {
+        filters.push_back(filter);
+    }
+
+    bool wants(const byte* raw, size_t size) const {
+        if (everything > 0 || filters.empty())
+            return true;
+        for (const FrameFilter* filter : filters) {
+            if (filter->accepts(raw, size))
+                return true;
+        }
+        return false;
+    }
+};
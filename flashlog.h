@@ -0,0 +1,604 @@
+#pragma once
+#ifdef USE_FLASHLOG
+
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include "pico/lock_core.h"
+#include "clock.h"
+#include "histogram.h"
+#include "message.h"
+#include "util.h"
+#include "vpb.h"
+#include <string>
+
+//
+// Log backend for boards without an SD card: a circular log of .vpb records (see vpb.h) in a
+// reserved region of the internal flash, between the end of the sketch and the LittleFS
+// settings filesystem.
+//
+//   sector (4KB):  "VPFL" <sequence:4> <SYNC record> <records> ... (erased 0xFF to the end)
+//
+// Sectors are written in sequence order and wrap around, which levels wear across the
+// region.  Every sector starts with a SYNC record, so it decodes on its own; a SYNC record is
+// also inserted after a reboot or a dropped record.  Records never span sectors.
+//
+// Records are copied into a ring of page-sized RAM buffers; service() (on the logging core)
+// programs at most one page per call.  Programming or erasing flash stops XIP, so the other
+// core, which decodes the bus, is parked in RAM (rp2040.idleOtherCore) for the duration:
+// about 0.5ms for a page, but 40ms+ for a sector erase, while the receive FIFO holds well
+// under a millisecond of pulses.  So pages are only programmed once the bus has been quiet
+// for FLASHLOG_PROGRAM_QUIET_US, and sectors only erased (ahead of the writer, or when it
+// catches up) once it has been quiet for FLASHLOG_ERASE_IDLE_MS; the RAM ring covers busy
+// stretches.  Receive FIFO overruns during flash work are counted (ATLOGS).
+//
+
+#define FLASHLOG_MAGIC  "VPFL"
+#define FLASHLOG_HEADER 8
+#define FLASHLOG_SECTOR FLASH_SECTOR_SIZE // 4096
+#define FLASHLOG_PAGE   FLASH_PAGE_SIZE   // 256
+
+#ifndef FLASHLOG_SIZE
+#define FLASHLOG_SIZE (1024 * 1024)
+#endif
+
+#ifndef FLASHLOG_PAGES
+#define FLASHLOG_PAGES 64 // 16KB of RAM buffering: a couple of seconds of a busy bus
+#endif
+
+#ifndef FLASHLOG_ERASE_AHEAD
+#define FLASHLOG_ERASE_AHEAD 4 // sectors kept erased ahead of the writer
+#endif
+
+#ifndef FLASHLOG_PROGRAM_QUIET_US
+#define FLASHLOG_PROGRAM_QUIET_US 2000 // no pulses for this long before a page is programmed
+#endif
+
+#ifndef FLASHLOG_ERASE_IDLE_MS
+#define FLASHLOG_ERASE_IDLE_MS 250
+#endif
+
+#ifndef FLASHLOG_FLUSH_IDLE_MS
+#define FLASHLOG_FLUSH_IDLE_MS 1000 // program a partly filled page once the bus is this quiet
+#endif
+
+extern "C" uint8_t _FS_start;
+extern "C" uint8_t __flash_binary_end;
+
+struct FlashPage {
+    alignas(4) uint8_t data[FLASHLOG_PAGE];
+    uint32_t address = 0;       // flash offset
+    uint32_t sequence = 0;      // of the sector it belongs to
+    uint16_t length = 0;
+    uint16_t programmed = 0;    // bytes already in flash
+};
+
+class FlashLog {
+    friend class FlashLogReader;
+private:
+    static inline bool mutexInitialized = false;
+    static inline recursive_mutex_t mutex;
+    static inline uint32_t base = 0;            // flash offset of the region
+    static inline uint32_t sectors = 0;
+    static inline uint32_t headSequence = 0;    // sector being written (sequences start at 1)
+    static inline uint32_t sectorPosition = FLASHLOG_SECTOR;
+    static inline uint32_t erasedThrough = 0;   // sectors up to this sequence are erased
+    static inline FlashPage pages[FLASHLOG_PAGES];
+    static inline uint head = 0;                // page being filled
+    static inline uint tail = 0;                // oldest page not yet programmed
+    static inline VpbEncoder encoder;
+    static inline std::vector<uint8_t> record;
+    static inline bool sync = true;
+
+    // instrumentation
+    static inline uint statsStart = 0;
+    static inline uint rateSecond = 0;
+    static inline ulong rateCount = 0;
+
+    static uint32_t address(uint32_t sequence) {
+        return base + (sequence % sectors) * FLASHLOG_SECTOR;
+    }
+
+    static const uint8_t* memory(uint32_t offset) {
+        return (const uint8_t*)(uintptr_t)(XIP_BASE + offset);
+    }
+
+    // sequence number in the sector header at the given offset, or 0 if there is none
+    static uint32_t sequenceAt(uint32_t offset) {
+        const uint8_t* p = memory(offset);
+        if (memcmp(p, FLASHLOG_MAGIC, 4) != 0)
+            return 0;
+        return p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+    }
+
+    static bool erased(uint32_t offset) {
+        const uint32_t* p = (const uint32_t*)memory(offset);
+        for (size_t i = 0; i < FLASHLOG_SECTOR / 4; i++) {
+            if (p[i] != 0xFFFFFFFF)
+                return false;
+        }
+        return true;
+    }
+
+    static uint pendingPages() {
+        return (head + FLASHLOG_PAGES - tail) % FLASHLOG_PAGES;
+    }
+
+    // starts a new page in the ring at the current write position
+    static bool nextPage() {
+        if (pages[head].length > 0) {
+            if (pendingPages() >= FLASHLOG_PAGES - 1)
+                return false;
+            head = (head + 1) % FLASHLOG_PAGES;
+        }
+        FlashPage& page = pages[head];
+        memset(page.data, 0xFF, sizeof(page.data));
+        page.address = address(headSequence) + sectorPosition;
+        page.sequence = headSequence;
+        page.length = 0;
+        page.programmed = 0;
+        return true;
+    }
+
+    // bytes that can be appended before the ring is full
+    static size_t room() {
+        size_t free = FLASHLOG_PAGES - 1 - pendingPages();
+        return (FLASHLOG_PAGE - pages[head].length) + free * FLASHLOG_PAGE;
+    }
+
+    static void append(const uint8_t* data, size_t size) {
+        while (size > 0) {
+            if (pages[head].length == FLASHLOG_PAGE)
+                nextPage();
+            FlashPage& page = pages[head];
+            size_t n = min(size, (size_t)(FLASHLOG_PAGE - page.length));
+            memcpy(page.data + page.length, data, n);
+            page.length += n;
+            sectorPosition += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    static bool startSector() {
+        if (room() < FLASHLOG_PAGE + FLASHLOG_HEADER)
+            return false;
+        headSequence++;
+        sectorPosition = 0;
+        nextPage();
+        uint8_t header[FLASHLOG_HEADER];
+        memcpy(header, FLASHLOG_MAGIC, 4);
+        for (int i = 0; i < 4; i++)
+            header[4 + i] = (headSequence >> (8 * i)) & 0xFF;
+        append(header, sizeof(header));
+        sync = true;
+        return true;
+    }
+
+    static bool write(const struct timeval& tv, byte mode, const std::vector<byte>& frame, const std::string& text);
+
+    static void flashOp(uint32_t offset, const uint8_t* data) {
+        ulong before = VPW::rxOverruns();
+        noInterrupts();
+        rp2040.idleOtherCore();
+        if (data)
+            flash_range_program(offset, data, FLASHLOG_PAGE);
+        else
+            flash_range_erase(offset, FLASHLOG_SECTOR);
+        rp2040.resumeOtherCore();
+        interrupts();
+        if (VPW::rxOverruns() != before)
+            overruns++;
+    }
+
+    static bool busQuiet() {
+        return Clock::micros() - VPW::lastActivity >= FLASHLOG_PROGRAM_QUIET_US;
+    }
+
+    static void erase(uint32_t sequence, bool forced) {
+        uint start = Clock::micros();
+        flashOp(address(sequence), nullptr);
+        eraseLatency.record(Clock::micros() - start);
+        erases++;
+        if (forced)
+            forcedErases++;
+        erasedThrough = sequence;
+    }
+
+    static void program(const FlashPage& page) {
+        uint start = Clock::micros();
+        flashOp(page.address, page.data);
+        programLatency.record(Clock::micros() - start);
+        bytesProgrammed += FLASHLOG_PAGE;
+    }
+
+public:
+    static inline bool ready = false;
+
+    // instrumentation
+    static inline LatencyHistogram programLatency;
+    static inline LatencyHistogram eraseLatency;
+    static inline ulong recordsLogged = 0;
+    static inline ulong recordsDropped = 0;
+    static inline ulong bytesLogged = 0;
+    static inline ulong bytesProgrammed = 0;
+    static inline ulong erases = 0;
+    static inline ulong forcedErases = 0;
+    static inline ulong peakRate = 0;
+    static inline ulong overruns = 0;           // flash operations that lost receive pulses
+    static inline ulong deferred = 0;           // times flash work waited for a quiet bus
+
+    static bool begin();
+    static bool log(const Message& m);
+    static bool backlogged();
+    static bool note(const std::string& text);
+    static bool service(uint idle);
+    static void rotate();
+    static std::string info();
+    static std::string stats(const char* newline);
+    static void clearStats();
+};
+
+bool FlashLog::begin() {
+    if (!mutexInitialized) {
+        recursive_mutex_init(&mutex);
+        mutexInitialized = true;
+    }
+    recursive_lock_guard lock(mutex);
+    uint32_t end = ((uintptr_t)&_FS_start - XIP_BASE) & ~(FLASHLOG_SECTOR - 1);
+    if (end < FLASHLOG_SIZE || end - FLASHLOG_SIZE < (uintptr_t)&__flash_binary_end - XIP_BASE)
+        return ready = false; // the sketch is in the way
+    base = end - FLASHLOG_SIZE;
+    sectors = FLASHLOG_SIZE / FLASHLOG_SECTOR;
+
+    // the newest sector is the one with the highest sequence number
+    headSequence = 0;
+    for (uint32_t i = 0; i < sectors; i++) {
+        uint32_t sequence = sequenceAt(base + i * FLASHLOG_SECTOR);
+        if (sequence != 0xFFFFFFFF && sequence > headSequence && address(sequence) == base + i * FLASHLOG_SECTOR)
+            headSequence = sequence;
+    }
+
+    erasedThrough = headSequence;
+    while (erasedThrough < headSequence + FLASHLOG_ERASE_AHEAD && erased(address(erasedThrough + 1)))
+        erasedThrough++;
+
+    head = tail = 0;
+    if (headSequence == 0) {
+        sectorPosition = FLASHLOG_SECTOR; // first record starts sector 1
+        pages[head].length = 0;
+    } else {
+        // carry on after the last record in the head sector (starting with a SYNC record)
+        const uint8_t* p = memory(address(headSequence));
+        uint32_t position = FLASHLOG_HEADER;
+        while (position < FLASHLOG_SECTOR && p[position] != 0xFF)
+            position += 1 + p[position];
+        sectorPosition = min(position, (uint32_t)FLASHLOG_SECTOR);
+        FlashPage& page = pages[head];
+        uint32_t pageStart = sectorPosition & ~(FLASHLOG_PAGE - 1);
+        memset(page.data, 0xFF, sizeof(page.data));
+        page.address = address(headSequence) + pageStart;
+        page.sequence = headSequence;
+        page.length = sectorPosition - pageStart;
+        page.programmed = page.length;
+        memcpy(page.data, p + pageStart, page.length);
+    }
+    sync = true;
+    statsStart = Clock::millis();
+    return ready = true;
+}
+
+bool FlashLog::write(const struct timeval& tv, byte mode, const std::vector<byte>& frame, const std::string& text) {
+    recursive_lock_guard lock(mutex);
+    if (!ready)
+        return false;
+    size_t textSize = min(text.size(), (size_t)0xF0);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        record.clear();
+        if (sync)
+            encoder.sync(record, tv.tv_sec, tv.tv_usec);
+        size_t start = record.size();
+        // a length byte of 0xFF would read as erased flash
+        if (!encoder.record(record, tv.tv_sec, tv.tv_usec, mode, frame.data(), frame.size(), text.data(), textSize) || record[start] == 0xFF) {
+            recordsDropped++;
+            sync = true;
+            return false;
+        }
+        if (sectorPosition + record.size() <= FLASHLOG_SECTOR)
+            break;
+        // doesn't fit: the rest of the sector stays erased, and the record goes in the next
+        if (attempt > 0 || !startSector()) {
+            recordsDropped++;
+            sync = true;
+            return false;
+        }
+    }
+    if (record.size() > room()) {
+        recordsDropped++;
+        sync = true; // the next record can't be a delta of one that was dropped
+        return false;
+    }
+    append(record.data(), record.size());
+    sync = false;
+    bytesLogged += record.size();
+    recordsLogged++;
+
+    uint second = Clock::millis() / 1000;
+    if (second != rateSecond) {
+        rateSecond = second;
+        rateCount = 0;
+    }
+    if (++rateCount > peakRate)
+        peakRate = rateCount;
+    return true;
+}
+
+bool FlashLog::log(const Message& m) {
+    return write(m.timestamp, m.mode, m.rawBytes(), m.information);
+}
+
+bool FlashLog::note(const std::string& text) {
+    std::string trimmed(text);
+    trimmed.erase(trimmed.find_last_not_of("\r\n") + 1);
+    return write(VPW::getTimestamp(), 0, {}, trimmed);
+}
+
+// true while half the page ring is waiting to be programmed (bulk writers should hold off)
+bool FlashLog::backlogged() {
+    recursive_lock_guard lock(mutex);
+    return pendingPages() >= FLASHLOG_PAGES / 2;
+}
+
+// Called on the logging core only.  idle is the time (ms) since the last frame on the bus.
+// Returns true if it did any flash work.
+bool FlashLog::service(uint idle) {
+    if (!ready)
+        return false;
+    FlashPage page;
+    uint index;
+    {
+        recursive_lock_guard lock(mutex);
+        if (tail != head) {
+            index = tail;
+            page = pages[tail];
+        } else if (pages[head].length > pages[head].programmed && idle >= FLASHLOG_FLUSH_IDLE_MS) {
+            index = head;
+            page = pages[head];
+        } else if (erasedThrough < headSequence + FLASHLOG_ERASE_AHEAD && idle >= FLASHLOG_ERASE_IDLE_MS) {
+            page.length = 0;
+        } else {
+            return false;
+        }
+    }
+    // flash work happens outside the lock, with the other core parked: only while the bus is
+    // quiet, so the decoder has nothing to lose meanwhile
+    if (page.length == 0) {
+        erase(erasedThrough + 1, false);
+        return true;
+    }
+    if (erasedThrough < page.sequence) {
+        // the writer caught up with the erased sectors
+        if (idle < FLASHLOG_ERASE_IDLE_MS) {
+            deferred++;
+            return false;
+        }
+        erase(erasedThrough + 1, true);
+        return true;
+    }
+    if (!busQuiet()) {
+        deferred++;
+        return false;
+    }
+    program(page);
+    recursive_lock_guard lock(mutex);
+    if (page.length == FLASHLOG_PAGE || index != head) {
+        // a full (or closed) page: done
+        tail = (index + 1) % FLASHLOG_PAGES;
+    } else {
+        // only what was copied is in flash; anything appended since still needs programming
+        pages[index].programmed = page.length;
+    }
+    return true;
+}
+
+// ATLOG+: the next record starts a new sector
+void FlashLog::rotate() {
+    recursive_lock_guard lock(mutex);
+    sectorPosition = FLASHLOG_SECTOR;
+}
+
+std::string FlashLog::info() {
+    recursive_lock_guard lock(mutex);
+    if (!ready)
+        return "N/A";
+    uint32_t used = min(headSequence, sectors - FLASHLOG_ERASE_AHEAD);
+    std::string ret = "FLASH ";
+    char at[12];
+    snprintf(at, sizeof(at), "%06lX", (unsigned long)base);
+    ret += std::to_string(FLASHLOG_SIZE / 1024) + "KB @" + at;
+    ret += " " + std::to_string(used * 100 / sectors) + "% SECTOR #" + std::to_string(headSequence);
+    return ret;
+}
+
+std::string FlashLog::stats(const char* newline) {
+    recursive_lock_guard lock(mutex);
+    uint seconds = max((Clock::millis() - statsStart) / 1000, (uint)1);
+    std::string ret;
+    ret += "FLASH RECORDS " + std::to_string(recordsLogged);
+    ret += " DROPPED " + std::to_string(recordsDropped);
+    ret += " BYTES/RECORD " + Util.dec(recordsLogged ? (float)bytesLogged / recordsLogged : 0.0f, 0, 1);
+    ret += newline;
+    ret += "RATE " + Util.dec((float)recordsLogged / seconds, 0, 1) + "/S PEAK " + std::to_string(peakRate) + "/S";
+    ret += " PENDING " + std::to_string(pendingPages()) + "/" + std::to_string(FLASHLOG_PAGES);
+    ret += newline;
+    ret += "PROGRAMMED " + std::to_string(bytesProgrammed);
+    ret += " AMPLIFICATION " + Util.dec(bytesLogged ? (float)bytesProgrammed / bytesLogged : 0.0f, 0, 2);
+    ret += " ERASES " + std::to_string(erases) + " FORCED " + std::to_string(forcedErases);
+    ret += newline;
+    ret += "DEFERRED " + std::to_string(deferred) + " RX OVERRUNS " + std::to_string(overruns);
+    ret += " (" + std::to_string(VPW::rxOverruns()) + " IN ALL)";
+    if (programLatency.samples > 0) {
+        ret += newline;
+        ret += "PROGRAM ";
+        ret += programLatency.tostring(newline);
+    }
+    if (eraseLatency.samples > 0) {
+        ret += newline;
+        ret += "ERASE ";
+        ret += eraseLatency.tostring(newline);
+    }
+    return ret;
+}
+
+void FlashLog::clearStats() {
+    recursive_lock_guard lock(mutex);
+    programLatency.clear();
+    eraseLatency.clear();
+    recordsLogged = recordsDropped = bytesLogged = bytesProgrammed = 0;
+    erases = forcedErases = peakRate = overruns = deferred = 0;
+    statsStart = Clock::millis();
+}
+
+FlashLog flashlog;
+
+//
+// Incremental readback of the flash log as text (ATLOG 0), oldest sector first, with the
+// same interface and resume offsets as SDLogReader.  Only what has been programmed is read;
+// if the sector being read is erased for reuse meanwhile, it skips to the next one.
+//
+class FlashLogReader {
+private:
+    struct SectorSource {
+        FlashLogReader& reader;
+        int operator()() {
+            if (reader.position >= FLASHLOG_SECTOR)
+                return -1;
+            return FlashLog::memory(FlashLog::address(reader.sequence))[reader.position++];
+        }
+    };
+
+    std::string filename = "flash";
+    uint32_t sequence = 0;  // sector being read
+    uint32_t last = 0;      // newest sector when the download started
+    uint32_t position = 0;  // within the sector
+    bool reading = false;
+    bool sending = false;
+    uint32_t skip = 0;
+    uint32_t sent = 0;
+    std::string pending;
+    size_t pendingPosition = 0;
+    size_t dataStart = 0;
+    size_t dataEnd = 0;
+    const char* newline = "\r\n";
+    SectorSource source{*this};
+    std::unique_ptr<VpbReader<SectorSource>> vpb;
+
+    void queue(const std::string& data) {
+        size_t dropped = min((size_t)skip, data.size());
+        skip -= dropped;
+        pending.append(data, dropped, std::string::npos);
+    }
+
+    bool openSector() {
+        while (sequence <= last) {
+            if (FlashLog::sequenceAt(FlashLog::address(sequence)) == sequence) {
+                position = FLASHLOG_HEADER;
+                vpb.reset(new VpbReader<SectorSource>(source, true));
+                return true;
+            }
+            sequence++;
+        }
+        return false;
+    }
+
+    void fill() {
+        pending.clear();
+        pendingPosition = 0;
+        dataStart = 0;
+        VpbRecord r;
+        while (pending.size() < FLASHLOG_PAGE && reading) {
+            bool valid = FlashLog::sequenceAt(FlashLog::address(sequence)) == sequence;
+            const uint8_t* p = FlashLog::memory(FlashLog::address(sequence));
+            if (!valid || position >= FLASHLOG_SECTOR || p[position] == 0xFF || !vpb->next(r)) {
+                sequence++;
+                reading = openSector();
+                continue;
+            }
+            if (r.flags & VPB_SYNC)
+                continue;
+            queue(vpbText(r) + newline);
+        }
+        dataEnd = pending.size();
+        if (!reading) {
+            vpb.reset();
+            pending += "--END " + filename + "--" + newline;
+        }
+    }
+
+public:
+    bool active() const {
+        return sending;
+    }
+
+    bool begin(size_t index, uint32_t offset, const char* newline, std::string& response) {
+        if (!FlashLog::ready || index != 0) {
+            response = "!ERROR OPENING " + std::to_string(index);
+            return false;
+        }
+        stop();
+        this->newline = newline;
+        {
+            recursive_lock_guard lock(FlashLog::mutex);
+            last = FlashLog::headSequence;
+            uint32_t span = FlashLog::sectors - FLASHLOG_ERASE_AHEAD;
+            sequence = last > span ? last - span + 1 : 1;
+        }
+        skip = offset;
+        sent = offset;
+        pending = (offset ? "--RESUME " + filename + " " + std::to_string(offset) + "--" : "--BEGIN " + filename + "--") + newline;
+        pendingPosition = 0;
+        dataStart = dataEnd = pending.size();
+        reading = openSector();
+        sending = true;
+        return true;
+    }
+
+    bool loop(Print& port) {
+        while (sending) {
+            if (pendingPosition >= pending.size()) {
+                if (!reading) {
+                    sending = false;
+                    break;
+                }
+                fill();
+                continue;
+            }
+            int room = port.availableForWrite();
+            if (room <= 0)
+                break;
+            size_t size = min((size_t)room, pending.size() - pendingPosition);
+            size_t written = port.write((const uint8_t*)pending.data() + pendingPosition, size);
+            size_t from = max(pendingPosition, dataStart);
+            size_t to = min(pendingPosition + written, dataEnd);
+            if (to > from)
+                sent += to - from;
+            pendingPosition += written;
+            if (written < size)
+                break;
+        }
+        return sending;
+    }
+
+    uint32_t stop() {
+        vpb.reset();
+        reading = sending = false;
+        pending.clear();
+        pendingPosition = 0;
+        return sent;
+    }
+
+    const std::string& name() const {
+        return filename;
+    }
+};
+
+#endif
@@ -11,7 +11,7 @@ struct HexUtil {
     /* specify hexLen = -1 for auto (based on variable type), or 0 to not pad */
     std::string hex(const I& w, size_t hexLen = -1) {
         bool trim = (hexLen == 0);
-        if (hexLen == 0 || hexLen == -1)
+        if (hexLen == 0 || hexLen == (size_t)-1)
             hexLen = sizeof(I) << 1;
         std::string ret(hexLen, '0');
         for (size_t i = 0, j = (hexLen - 1) * 4; i < hexLen; ++i, j -= 4)
@@ -32,7 +32,7 @@ struct HexUtil {
         std::vector<byte> ret;
         
         uint hLen = hex.size();
-        if (offset < 0 || offset >= hLen)
+        if (offset >= hLen)
             return ret;
 
         bool odd = (hLen % 2 != 0);
@@ -44,12 +44,12 @@ struct HexUtil {
         
         char buffer[3];
         buffer[2] = 0;
-        for (int i = offset; i < byteCount * 2; i += 2) {
-            if (odd && i == offset) {
+        for (int i = offset; i < (int)byteCount * 2; i += 2) {
+            if (odd && i == (int)offset) {
                 buffer[0] = '0';
                 buffer[1] = hex[i];
                 i--;
-            } else if (i >= hLen) {
+            } else if (i >= (int)hLen) {
                 break;
             } else {
                 buffer[0] = hex[i];
@@ -90,7 +90,7 @@ struct HexUtil {
     }
     
     std::string tostring(const std::vector<byte>& input, int offset, int length = INT_MAX, bool spaces = false) {
-        if (length <= 0 || offset >= input.size())
+        if (length <= 0 || (size_t)offset >= input.size())
             return "";
         return tostring(input.data() + offset, min(length, input.size() - offset), spaces);
     }
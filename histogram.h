@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include "util.h"
+
+//
+// Power-of-two latency histogram in microseconds: bucket 0 counts samples up to 128us,
+// each following bucket doubles the bound, and the last bucket is open-ended
+//
+class LatencyHistogram {
+public:
+    static constexpr size_t BUCKETS = 12;
+    static constexpr uint FIRST = 128;
+
+    ulong counts[BUCKETS] = {};
+    ulong samples = 0;
+    uint64_t total = 0;
+    uint worst = 0;
+
+    void record(uint us) {
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && us > (FIRST << bucket))
+            bucket++;
+        counts[bucket]++;
+        samples++;
+        total += us;
+        if (us > worst)
+            worst = us;
+    }
+
+    void clear() {
+        *this = LatencyHistogram();
+    }
+
+    uint average() const {
+        return samples ? (uint)(total / samples) : 0;
+    }
+
+    std::string tostring(const char* newline) const {
+        std::string ret;
+        ret += "N " + std::to_string(samples);
+        ret += " AVG " + std::to_string(average());
+        ret += " MAX " + std::to_string(worst);
+        for (size_t i = 0; i < BUCKETS; i++) {
+            if (counts[i] == 0)
+                continue;
+            ret += newline;
+            ret += (i == BUCKETS - 1) ? ">" : "<=";
+            ret += std::to_string(FIRST << (i == BUCKETS - 1 ? i - 1 : i));
+            ret += "us ";
+            ret += std::to_string(counts[i]);
+        }
+        return ret;
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+//
+// Host stand-in for the Arduino-Pico core: just the API the firmware uses, on Linux
+// (see host/Makefile).  Serial ports are file descriptors (the pty masters of vpwpty), pins
+// are an array, and the clock is the process' monotonic time.
+//
+
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/time.h>
+#include <time.h>
+
+typedef uint8_t byte;
+
+// the host build is a Feather: SD logging (to a directory) and an RTC
+#define ARDUINO_ADAFRUIT_FEATHER_RP2040 1
+#define BOARD_NAME "HOST"
+#define PICO_DEFAULT_WS2812_PIN 16
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// Util::reboot() writes the AIRCR register here; on the host it's harmless memory
+extern uint8_t hostPPB[0x10000];
+#define PPB_BASE ((uintptr_t)hostPPB)
+
+#define F(x) x
+
+template <class T, class L>
+auto min(const T& a, const L& b) -> decltype((b < a) ? b : a) {
+    return (b < a) ? b : a;
+}
+
+template <class T, class L>
+auto max(const T& a, const L& b) -> decltype((b < a) ? b : a) {
+    return (a < b) ? b : a;
+}
+
+// 32 bits, wrapping like the RP2040's
+uint32_t millis();
+uint32_t micros();
+uint64_t time_us_64();
+uint32_t time_us_32();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(int pin, int mode);
+bool digitalReadFast(int pin);
+void digitalWriteFast(int pin, bool value);
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// the firmware sets the clock from the RTC and ATTIME; on the host that moves an offset
+// instead of the system clock
+int hostSettimeofday(const struct timeval* tv, const void* tz);
+int hostGettimeofday(struct timeval* tv, void* tz);
+#define settimeofday hostSettimeofday
+#define gettimeofday hostGettimeofday
+
+class String : public std::string {
+public:
+    using std::string::string;
+    String() {}
+    String(const std::string& s) : std::string(s) {}
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* buffer, size_t size) {
+        return write((const uint8_t*)buffer, size);
+    }
+    virtual int availableForWrite() {
+        return 0;
+    }
+    virtual void flush() {}
+
+    size_t print(const char* s);
+    size_t print(char c);
+    size_t print(const String& s);
+    size_t print(int n, int base = 10);
+    size_t print(unsigned int n, int base = 10);
+    size_t print(long n, int base = 10);
+    size_t print(unsigned long n, int base = 10);
+    size_t print(double n, int digits = 2);
+    size_t println(const char* s = "");
+    size_t println(const String& s);
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long ms) {}
+    long parseInt();
+    float parseFloat();
+    String readString();
+    String readStringUntil(char terminator);
+    size_t readBytes(char* buffer, size_t length);
+    size_t readBytes(uint8_t* buffer, size_t length) {
+        return readBytes((char*)buffer, length);
+    }
+};
+
+//
+// A UART or USB CDC port on a file descriptor (non-blocking).  Output blocks while a client
+// is connected and not reading, like a full TX FIFO; with nobody connected it's discarded.
+// A paced port (the UARTs in vpwpty) also takes no more than its baud rate allows, on the
+// firmware's clock.
+//
+class HardwareSerial : public Stream {
+private:
+    std::deque<uint8_t> input;
+    void fill();
+    double credit = 0;          // bytes the line could have sent (paced)
+    uint64_t creditTime = 0;
+    int paced();
+
+public:
+    int fd = -1;
+    unsigned long baud = 0;
+
+    void begin(unsigned long baud) {
+        this->baud = baud;
+    }
+    void end() {}
+    void setTX(int pin) {}
+    void setRX(int pin) {}
+    void setFIFOSize(size_t size) {}
+    operator bool() {
+        return true;
+    }
+
+    bool connected() const;
+    // host: as if typed by the client
+    void hostInput(const std::string& text) {
+        input.insert(input.end(), text.begin(), text.end());
+    }
+    bool hostInputEmpty() const {
+        return input.empty();
+    }
+    int hostLastOutput = -1;
+    bool hostPaced = false;
+    unsigned long hostBaud = 0; // pace at this rate instead of begin()'s
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+    int availableForWrite() override;
+};
+
+extern HardwareSerial Serial, Serial1, Serial2;
+
+struct RP2040 {
+    void idleOtherCore() {}
+    void resumeOtherCore() {}
+};
+extern RP2040 rp2040;
+
+// host: what vpwpty sets up before setup() runs
+extern std::string hostDataDir;     // SD card and LittleFS contents
+void hostSetPin(int pin, bool value);
@@ -0,0 +1,78 @@
+#pragma once
+
+//
+// Host stand-in for the Arduino-Pico filesystems: each one is a subdirectory of hostDataDir
+//
+
+#include <Arduino.h>
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+namespace fs {
+
+struct FileImpl;
+
+class File : public Stream {
+public:
+    std::shared_ptr<FileImpl> impl;
+
+    File() {}
+    operator bool() const {
+        return (bool)impl;
+    }
+
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t size);
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+    void flush() override;
+
+    size_t size() const;
+    size_t position() const;
+    bool seek(uint32_t position, SeekMode mode = SeekSet);
+    bool truncate(uint32_t size);
+    bool preallocate(uint64_t size);
+    void close();
+    const char* name() const;
+
+    bool isDirectory();
+    File openNextFile();
+    void rewindDirectory();
+};
+
+struct FSInfo {
+    uint64_t totalBytes;
+    uint64_t usedBytes;
+};
+
+class FS {
+protected:
+    const char* directory;
+
+public:
+    FS(const char* directory) : directory(directory) {}
+
+    std::string path(const char* name) const;
+    bool begin();
+    File open(const char* name, const char* mode = "r");
+    File open(const char* name, int flags);
+    bool mkdir(const char* name);
+    bool exists(const char* name);
+    bool remove(const char* name);
+    bool rename(const char* from, const char* to);
+    bool info(FSInfo& info);
+};
+
+}
+
+using fs::File;
+using fs::FSInfo;
+
+extern fs::FS LittleFS;
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <hardware/pio.h>
+
+class NeoPixelConnect {
+public:
+    NeoPixelConnect(int pin, int pixels, PIO pio, int sm) {}
+    void neoPixelSetValue(int pixel, int r, int g, int b, bool show) {}
+};
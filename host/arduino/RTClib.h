@@ -0,0 +1,68 @@
+#pragma once
+
+//
+// Host stand-in for RTClib: the RTC is the firmware's clock (virtual time included)
+//
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include "clock.h"
+
+class DateTime {
+private:
+    time_t t;
+    struct tm tm;
+
+public:
+    DateTime(uint32_t t = 0) : t(t) {
+        gmtime_r(&this->t, &tm);
+    }
+    // from __DATE__ and __TIME__
+    DateTime(const char* date, const char* time) : t(0) {
+        struct tm parsed = {};
+        std::string s = std::string(date) + " " + time;
+        if (strptime(s.c_str(), "%b %d %Y %H:%M:%S", &parsed))
+            t = timegm(&parsed);
+        gmtime_r(&t, &tm);
+    }
+    bool isValid() const {
+        return t != 0;
+    }
+    uint32_t unixtime() const {
+        return t;
+    }
+    int year() const {
+        return tm.tm_year + 1900;
+    }
+    int month() const {
+        return tm.tm_mon + 1;
+    }
+    int day() const {
+        return tm.tm_mday;
+    }
+    int hour() const {
+        return tm.tm_hour;
+    }
+    int minute() const {
+        return tm.tm_min;
+    }
+    int second() const {
+        return tm.tm_sec;
+    }
+};
+
+class RTC_PCF8523 {
+public:
+    bool begin() {
+        return true;
+    }
+    void start() {}
+    bool lostPower() {
+        return false;
+    }
+    DateTime now() {
+        return DateTime(Clock::now().tv_sec);
+    }
+    void adjust(const DateTime& dt) {}
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <LittleFS.h>
+
+#define FILE_READ "r"
+#define FILE_WRITE "a"
+#define O_WRITE O_WRONLY
+
+#define FAT_DATE(y, m, d) (((y) - 1980) << 9 | (m) << 5 | (d))
+#define FAT_TIME(h, m, s) ((h) << 11 | (m) << 5 | (s) >> 1)
+
+enum {
+    SD_CARD_TYPE_SD1 = 1,
+    SD_CARD_TYPE_SD2,
+    SD_CARD_TYPE_SDHC
+};
+
+struct SdFile {
+    static void dateTimeCallback(void (*callback)(uint16_t* date, uint16_t* time)) {}
+};
+
+class SDClass : public fs::FS {
+public:
+    SDClass() : fs::FS("sd") {}
+
+    bool begin(int csPin, uint32_t speed = 0) {
+        return fs::FS::begin();
+    }
+    int type() {
+        return SD_CARD_TYPE_SDHC;
+    }
+    int fatType() {
+        return 32;
+    }
+    uint64_t size() {
+        return 32ull << 30;
+    }
+    uint64_t size64() {
+        return size();
+    }
+};
+
+extern SDClass SD;
+extern fs::FS SDFS;
@@ -0,0 +1,11 @@
+#pragma once
+
+class SPIClassRP2040 {
+public:
+    void setRX(int pin) {}
+    void setTX(int pin) {}
+    void setCS(int pin) {}
+    void setSCK(int pin) {}
+};
+
+extern SPIClassRP2040 SPI;
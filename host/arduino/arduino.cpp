@@ -0,0 +1,621 @@
+//
+// Host implementations of the Arduino-Pico and SDK functions the firmware uses
+//
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <SD.h>
+#include <SPI.h>
+#include "hardware/adc.h"
+#include "hardware/pio.h"
+#include "pico/lock_core.h"
+#include "pico/unique_id.h"
+#include "clock.h"
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#undef settimeofday
+#undef gettimeofday
+
+std::string hostDataDir = ".";
+uint8_t hostPPB[0x10000];
+RP2040 rp2040;
+
+// Util::getFreeMemory() subtracts these; there is no such thing on the host
+char __StackLimit, __bss_end__;
+
+//
+// TIME
+//
+static const auto start = std::chrono::steady_clock::now();
+static int64_t clockOffset = 0;     // us, from settimeofday
+
+uint64_t time_us_64() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint32_t time_us_32() {
+    return (uint32_t)time_us_64();
+}
+
+uint32_t micros() {
+    return (uint32_t)time_us_64();
+}
+
+uint32_t millis() {
+    return (uint32_t)(time_us_64() / 1000);
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+    uint64_t until = time_us_64() + us;
+    while (time_us_64() < until)
+        ;
+}
+
+int hostGettimeofday(struct timeval* tv, void* tz) {
+    int result = gettimeofday(tv, nullptr);
+    int64_t us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec + clockOffset;
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+    return result;
+}
+
+int hostSettimeofday(const struct timeval* tv, const void* tz) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    clockOffset = ((int64_t)tv->tv_sec - now.tv_sec) * 1000000 + (tv->tv_usec - now.tv_usec);
+    return 0;
+}
+
+//
+// PINS
+//
+static volatile bool pins[64];
+
+void pinMode(int pin, int mode) {
+    if (mode == INPUT_PULLUP)
+        pins[pin] = true;
+}
+
+bool digitalReadFast(int pin) {
+    return pins[pin];
+}
+
+void digitalWriteFast(int pin, bool value) {
+    pins[pin] = value;
+}
+
+void hostSetPin(int pin, bool value) {
+    pins[pin] = value;
+}
+
+//
+// PRINT / STREAM
+//
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (size--)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(const char* s) {
+    return write((const uint8_t*)s, strlen(s));
+}
+
+size_t Print::print(char c) {
+    return write((uint8_t)c);
+}
+
+size_t Print::print(const String& s) {
+    return write((const uint8_t*)s.data(), s.size());
+}
+
+static std::string number(unsigned long n, int base) {
+    char buffer[72];
+    char* p = buffer + sizeof(buffer) - 1;
+    *p = 0;
+    do {
+        int digit = n % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        n /= base;
+    } while (n);
+    return p;
+}
+
+size_t Print::print(int n, int base) {
+    return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base) {
+    if (n < 0 && base == 10)
+        return print('-') + print((unsigned long)-n, base);
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+    return print(number(n, base).c_str());
+}
+
+size_t Print::print(double n, int digits) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+    return print(buffer);
+}
+
+size_t Print::println(const char* s) {
+    return print(s) + print("\r\n");
+}
+
+size_t Print::println(const String& s) {
+    return print(s) + print("\r\n");
+}
+
+long Stream::parseInt() {
+    std::string s;
+    int c;
+    while ((c = peek()) >= 0 && (isdigit(c) || c == '-'))
+        s += (char)read();
+    return atol(s.c_str());
+}
+
+float Stream::parseFloat() {
+    std::string s;
+    int c;
+    while ((c = peek()) >= 0 && (isdigit(c) || c == '-' || c == '.'))
+        s += (char)read();
+    return atof(s.c_str());
+}
+
+String Stream::readString() {
+    String s;
+    int c;
+    while ((c = read()) >= 0)
+        s += (char)c;
+    return s;
+}
+
+String Stream::readStringUntil(char terminator) {
+    String s;
+    int c;
+    while ((c = read()) >= 0 && c != terminator)
+        s += (char)c;
+    return s;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+    size_t n = 0;
+    int c;
+    while (n < length && (c = read()) >= 0)
+        buffer[n++] = c;
+    return n;
+}
+
+//
+// SERIAL
+//
+HardwareSerial Serial, Serial1, Serial2;
+
+// a pty master reports POLLHUP while no client has the other side open
+bool HardwareSerial::connected() const {
+    if (fd < 0)
+        return false;
+    struct pollfd p = { fd, 0, 0 };
+    return poll(&p, 1, 0) >= 0 && !(p.revents & POLLHUP);
+}
+
+void HardwareSerial::fill() {
+    if (fd < 0 || !input.empty())
+        return;
+    uint8_t buffer[256];
+    ssize_t n = ::read(fd, buffer, sizeof(buffer));
+    if (n > 0)
+        input.insert(input.end(), buffer, buffer + n);
+}
+
+int HardwareSerial::available() {
+    fill();
+    return input.size();
+}
+
+int HardwareSerial::read() {
+    fill();
+    if (input.empty())
+        return -1;
+    int c = input.front();
+    input.pop_front();
+    return c;
+}
+
+int HardwareSerial::peek() {
+    fill();
+    return input.empty() ? -1 : input.front();
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+// what the line can take now: 10 bits per byte at the baud rate, up to a 32-byte FIFO
+int HardwareSerial::paced() {
+    uint64_t now = Clock::micros64();
+    unsigned long rate = hostBaud ? hostBaud : baud;
+    credit = std::min(credit + (now - creditTime) * rate / 10e6, 32.0);
+    creditTime = now;
+    return credit >= 1 ? (int)credit : 0;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+    if (size > 0)
+        hostLastOutput = buffer[size - 1];
+    if (hostPaced) {
+        paced();
+        credit -= size;
+    }
+    size_t done = 0;
+    while (fd >= 0 && done < size) {
+        ssize_t n = ::write(fd, buffer + done, size - done);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            break;
+        } else if (!connected()) {
+            break;
+        } else {
+            struct pollfd p = { fd, POLLOUT, 0 };
+            poll(&p, 1, 10);
+        }
+    }
+    return size;
+}
+
+int HardwareSerial::availableForWrite() {
+    int room = 256;     // nobody connected: discarded, see write()
+    if (fd >= 0 && connected()) {
+        struct pollfd p = { fd, POLLOUT, 0 };
+        if (!(poll(&p, 1, 0) > 0 && (p.revents & POLLOUT)))
+            room = 0;
+    }
+    return hostPaced ? std::min(room, paced()) : room;
+}
+
+//
+// FILESYSTEMS
+//
+namespace fs {
+
+struct FileImpl {
+    FILE* f = nullptr;
+    DIR* dir = nullptr;
+    std::string path;
+
+    ~FileImpl() {
+        if (f)
+            fclose(f);
+        if (dir)
+            closedir(dir);
+    }
+};
+
+int File::available() {
+    return impl->f ? (int)(size() - position()) : 0;
+}
+
+int File::read() {
+    return fgetc(impl->f);
+}
+
+int File::read(uint8_t* buffer, size_t size) {
+    return fread(buffer, 1, size, impl->f);
+}
+
+int File::peek() {
+    int c = fgetc(impl->f);
+    if (c >= 0)
+        ungetc(c, impl->f);
+    return c;
+}
+
+size_t File::write(uint8_t c) {
+    return fputc(c, impl->f) == EOF ? 0 : 1;
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+    return fwrite(buffer, 1, size, impl->f);
+}
+
+void File::flush() {
+    if (impl && impl->f)
+        fflush(impl->f);
+}
+
+size_t File::size() const {
+    struct stat st;
+    fflush(impl->f);
+    return fstat(fileno(impl->f), &st) == 0 ? st.st_size : 0;
+}
+
+size_t File::position() const {
+    return ftell(impl->f);
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+    return fseek(impl->f, position, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+bool File::truncate(uint32_t size) {
+    fflush(impl->f);
+    return ftruncate(fileno(impl->f), size) == 0;
+}
+
+bool File::preallocate(uint64_t size) {
+    return true;
+}
+
+void File::close() {
+    impl.reset();
+}
+
+const char* File::name() const {
+    size_t slash = impl->path.rfind('/');
+    return impl->path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+bool File::isDirectory() {
+    return impl && impl->dir;
+}
+
+File File::openNextFile() {
+    File next;
+    if (!impl || !impl->dir)
+        return next;
+    while (struct dirent* entry = readdir(impl->dir)) {
+        if (entry->d_name[0] == '.')
+            continue;
+        std::string path = impl->path + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        next.impl = std::make_shared<FileImpl>();
+        next.impl->path = path;
+        if (S_ISDIR(st.st_mode))
+            next.impl->dir = opendir(path.c_str());
+        else
+            next.impl->f = fopen(path.c_str(), "rb");
+        return next;
+    }
+    return next;
+}
+
+void File::rewindDirectory() {
+    if (impl && impl->dir)
+        rewinddir(impl->dir);
+}
+
+std::string FS::path(const char* name) const {
+    return hostDataDir + "/" + directory + (name[0] == '/' ? "" : "/") + name;
+}
+
+bool FS::begin() {
+    ::mkdir(hostDataDir.c_str(), 0777);
+    ::mkdir((hostDataDir + "/" + directory).c_str(), 0777);
+    return true;
+}
+
+File FS::open(const char* name, const char* mode) {
+    File file;
+    std::string p = path(name);
+    struct stat st;
+    if (stat(p.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        file.impl = std::make_shared<FileImpl>();
+        file.impl->path = p;
+        file.impl->dir = opendir(p.c_str());
+        return file;
+    }
+    std::string m = mode;
+    if (m == "r")
+        m = "rb";
+    else if (m == "w")
+        m = "w+b";
+    else if (m == "a")
+        m = "a+b";
+    FILE* f = fopen(p.c_str(), m.c_str());
+    if (!f)
+        return file;
+    file.impl = std::make_shared<FileImpl>();
+    file.impl->f = f;
+    file.impl->path = p;
+    return file;
+}
+
+File FS::open(const char* name, int flags) {
+    if ((flags & O_ACCMODE) == O_RDWR && !(flags & O_APPEND)) {
+        if (!(flags & O_TRUNC)) {
+            File file = open(name, "r+b");
+            if (file)
+                return file;
+        }
+        return open(name, "w");
+    }
+    if (flags & O_TRUNC)
+        return open(name, "w");
+    if (flags & (O_APPEND | O_CREAT))
+        return open(name, "a");
+    return open(name, "r");
+}
+
+bool FS::mkdir(const char* name) {
+    return ::mkdir(path(name).c_str(), 0777) == 0;
+}
+
+bool FS::exists(const char* name) {
+    struct stat st;
+    return stat(path(name).c_str(), &st) == 0;
+}
+
+bool FS::remove(const char* name) {
+    return ::remove(path(name).c_str()) == 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+    return ::rename(path(from).c_str(), path(to).c_str()) == 0;
+}
+
+bool FS::info(FSInfo& info) {
+    info.totalBytes = 32ull << 30;
+    info.usedBytes = 0;
+    return true;
+}
+
+}
+
+fs::FS LittleFS("littlefs");
+SDClass SD;
+fs::FS SDFS("sd");
+SPIClassRP2040 SPI;
+
+//
+// SDK
+//
+thread_local unsigned hostCore = 0;
+
+void recursive_mutex_init(recursive_mutex_t* mutex) {
+    mutex->lock = new std::recursive_mutex;
+}
+
+void recursive_mutex_enter_blocking(recursive_mutex_t* mutex) {
+    ((std::recursive_mutex*)mutex->lock)->lock();
+}
+
+bool recursive_mutex_try_enter(recursive_mutex_t* mutex, uint32_t* owner) {
+    return ((std::recursive_mutex*)mutex->lock)->try_lock();
+}
+
+void recursive_mutex_exit(recursive_mutex_t* mutex) {
+    ((std::recursive_mutex*)mutex->lock)->unlock();
+}
+
+bool watchdog_enable_caused_reboot() {
+    return false;
+}
+
+void watchdog_enable(uint32_t ms, bool pauseOnDebug) {}
+
+void watchdog_update() {}
+
+unsigned get_core_num() {
+    return hostCore;
+}
+
+void pico_get_unique_board_id(pico_unique_board_id_t* id) {
+    memcpy(id->id, "HOSTVPW0", PICO_UNIQUE_BOARD_ID_SIZE_BYTES);
+}
+
+void adc_init() {}
+void adc_set_temp_sensor_enabled(bool enabled) {}
+void adc_select_input(unsigned input) {}
+
+uint16_t adc_read() {
+    return 876; // 27C
+}
+
+//
+// PIO
+//
+static pio_hw_t pioBlocks[2] = { { 0, 0, 0 }, { 1, 0, 0 } };
+PIO pio0 = &pioBlocks[0];
+PIO pio1 = &pioBlocks[1];
+HostPio* hostPio = nullptr;
+
+static irq_handler_t irqHandlers[32];
+static bool irqEnabled[32];
+
+uint32_t clock_get_hz(enum clock_index clock) {
+    return 133000000;
+}
+
+pio_sm_config pio_get_default_sm_config() {
+    return { 1.0f };
+}
+
+void sm_config_set_wrap(pio_sm_config* c, unsigned target, unsigned wrap) {}
+
+void sm_config_set_clkdiv(pio_sm_config* c, float div) {
+    c->clkdiv = div;
+}
+
+void sm_config_set_fifo_join(pio_sm_config* c, enum pio_fifo_join join) {}
+void sm_config_set_in_shift(pio_sm_config* c, bool right, bool autopush, unsigned threshold) {}
+void sm_config_set_out_shift(pio_sm_config* c, bool right, bool autopull, unsigned threshold) {}
+void sm_config_set_jmp_pin(pio_sm_config* c, unsigned pin) {}
+void sm_config_set_in_pins(pio_sm_config* c, unsigned base) {}
+void sm_config_set_set_pins(pio_sm_config* c, unsigned base, unsigned count) {}
+
+bool pio_can_add_program(PIO pio, const pio_program* program) {
+    return true;
+}
+
+unsigned pio_add_program(PIO pio, const pio_program* program) {
+    return 0;
+}
+
+int pio_claim_unused_sm(PIO pio, bool required) {
+    return pio->claimed < 4 ? pio->claimed++ : -1;
+}
+
+void pio_gpio_init(PIO pio, unsigned pin) {}
+void pio_sm_set_consecutive_pindirs(PIO pio, unsigned sm, unsigned base, unsigned count, bool out) {}
+
+void pio_sm_init(PIO pio, unsigned sm, unsigned offset, const pio_sm_config* c) {
+    pio_sm_set_clkdiv(pio, sm, c->clkdiv);
+}
+
+void pio_sm_set_enabled(PIO pio, unsigned sm, bool enabled) {}
+
+void pio_sm_set_clkdiv(PIO pio, unsigned sm, float div) {
+    if (hostPio)
+        hostPio->clkdiv(pio, sm, div);
+}
+
+void pio_set_irq1_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled) {}
+void pio_interrupt_clear(PIO pio, unsigned irq) {}
+
+void pio_sm_put_blocking(PIO pio, unsigned sm, uint32_t data) {
+    if (hostPio)
+        hostPio->put(pio, sm, data);
+}
+
+uint32_t pio_sm_get_blocking(PIO pio, unsigned sm) {
+    return hostPio ? hostPio->get(pio, sm) : 0;
+}
+
+bool pio_sm_is_rx_fifo_empty(PIO pio, unsigned sm) {
+    return hostPio ? hostPio->rxEmpty(pio, sm) : true;
+}
+
+void irq_set_exclusive_handler(unsigned num, irq_handler_t handler) {
+    irqHandlers[num] = handler;
+}
+
+void irq_set_enabled(unsigned num, bool enabled) {
+    irqEnabled[num] = enabled;
+}
+
+void hostIrq(unsigned num) {
+    if (irqEnabled[num] && irqHandlers[num])
+        irqHandlers[num]();
+}
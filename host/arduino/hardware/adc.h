@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+
+void adc_init();
+void adc_set_temp_sensor_enabled(bool enabled);
+void adc_select_input(unsigned input);
+uint16_t adc_read();
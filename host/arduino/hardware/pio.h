@@ -0,0 +1,98 @@
+#pragma once
+
+//
+// Host stand-in for the PIO SDK: the programs don't run (tools/pioemu.h does that); instead
+// the state machines' FIFOs are handed to a HostPio (host/hostvpw.h), which models what the
+// VPW programs do with them on a simulated bus.
+//
+
+#include <cstdint>
+
+typedef struct pio_hw {
+    int index;
+    int claimed;
+    uint32_t fdebug;    // never set: the host FIFOs don't overflow
+} pio_hw_t;
+
+#define PIO_FDEBUG_RXSTALL_LSB 0
+typedef pio_hw_t* PIO;
+
+extern PIO pio0, pio1;
+
+typedef struct {
+    float clkdiv;
+} pio_sm_config;
+
+struct pio_program {
+    const uint16_t* instructions;
+    uint8_t length;
+    int8_t origin;
+};
+
+enum pio_fifo_join {
+    PIO_FIFO_JOIN_NONE = 0,
+    PIO_FIFO_JOIN_TX = 1,
+    PIO_FIFO_JOIN_RX = 2
+};
+
+enum pio_interrupt_source {
+    pis_interrupt0 = 8,
+    pis_interrupt1 = 9
+};
+
+enum {
+    PIO0_IRQ_0 = 7,
+    PIO0_IRQ_1 = 8,
+    PIO1_IRQ_0 = 9,
+    PIO1_IRQ_1 = 10
+};
+
+enum clock_index {
+    clk_sys = 5
+};
+
+uint32_t clock_get_hz(enum clock_index clock);
+
+pio_sm_config pio_get_default_sm_config();
+void sm_config_set_wrap(pio_sm_config* c, unsigned target, unsigned wrap);
+void sm_config_set_clkdiv(pio_sm_config* c, float div);
+void sm_config_set_fifo_join(pio_sm_config* c, enum pio_fifo_join join);
+void sm_config_set_in_shift(pio_sm_config* c, bool right, bool autopush, unsigned threshold);
+void sm_config_set_out_shift(pio_sm_config* c, bool right, bool autopull, unsigned threshold);
+void sm_config_set_jmp_pin(pio_sm_config* c, unsigned pin);
+void sm_config_set_in_pins(pio_sm_config* c, unsigned base);
+void sm_config_set_set_pins(pio_sm_config* c, unsigned base, unsigned count);
+
+bool pio_can_add_program(PIO pio, const pio_program* program);
+unsigned pio_add_program(PIO pio, const pio_program* program);
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_gpio_init(PIO pio, unsigned pin);
+void pio_sm_set_consecutive_pindirs(PIO pio, unsigned sm, unsigned base, unsigned count, bool out);
+void pio_sm_init(PIO pio, unsigned sm, unsigned offset, const pio_sm_config* c);
+void pio_sm_set_enabled(PIO pio, unsigned sm, bool enabled);
+void pio_sm_set_clkdiv(PIO pio, unsigned sm, float div);
+void pio_set_irq1_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled);
+void pio_interrupt_clear(PIO pio, unsigned irq);
+
+void pio_sm_put_blocking(PIO pio, unsigned sm, uint32_t data);
+uint32_t pio_sm_get_blocking(PIO pio, unsigned sm);
+bool pio_sm_is_rx_fifo_empty(PIO pio, unsigned sm);
+
+typedef void (*irq_handler_t)();
+void irq_set_exclusive_handler(unsigned num, irq_handler_t handler);
+void irq_set_enabled(unsigned num, bool enabled);
+
+// host: the other side of the FIFOs
+class HostPio {
+public:
+    virtual ~HostPio() {}
+    virtual void clkdiv(PIO pio, unsigned sm, float div) {}
+    virtual void put(PIO pio, unsigned sm, uint32_t data) = 0;
+    virtual uint32_t get(PIO pio, unsigned sm) = 0;
+    virtual bool rxEmpty(PIO pio, unsigned sm) = 0;
+};
+
+extern HostPio* hostPio;
+
+// runs an enabled interrupt's handler, as the NVIC would
+void hostIrq(unsigned num);
@@ -0,0 +1,30 @@
+#pragma once
+
+//
+// Host stand-in for the SDK's locks and core functions.  The two cores are threads (see
+// vpwpty.cpp), so the recursive mutexes are real ones.  The firmware copies a
+// recursive_mutex_t in places (Automation::getMutex), so it only points at the lock.
+//
+
+#include <cstdint>
+
+typedef struct {
+    void* lock;
+} recursive_mutex_t;
+
+void recursive_mutex_init(recursive_mutex_t* mutex);
+void recursive_mutex_enter_blocking(recursive_mutex_t* mutex);
+bool recursive_mutex_try_enter(recursive_mutex_t* mutex, uint32_t* owner);
+void recursive_mutex_exit(recursive_mutex_t* mutex);
+
+bool watchdog_enable_caused_reboot();
+void watchdog_enable(uint32_t ms, bool pauseOnDebug);
+void watchdog_update();
+
+unsigned get_core_num();
+extern thread_local unsigned hostCore;  // set by each core's thread
+
+uint64_t time_us_64();
+uint32_t time_us_32();
+
+#define __not_in_flash_func(f) f
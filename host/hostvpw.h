@@ -0,0 +1,164 @@
+#pragma once
+
+//
+// hostvpw: the adapter's VPW transceiver on a simulated bus, behind the PIO FIFOs
+//
+// The bus (tools/vpwscenario.h) runs on the firmware's clock (clock.h), real or virtual: every
+// access advances it to the current time.  Frames written to the send state machine's TX FIFO (as VPW::sendRaw writes them: the
+// length byte, the frame bytes, padded to whole words) go out from an "adapter" node that,
+// like the send program, waits for an idle bus and gives up on losing arbitration; the
+// result (1 sent, 0 congestion) is what the next pio_sm_get_blocking returns.  Every edge on
+// the bus, the adapter's own frames included, becomes a receive word in the receive state
+// machine's RX FIFO and raises its interrupt, which is serviced on core 0 (as on the RP2040)
+// from poll() or while core 0 waits for a send result.  On virtual time that wait steps the
+// clock from one bus event to the next.
+//
+
+#include <Arduino.h>
+#include "hardware/pio.h"
+#include "pico/lock_core.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "../clock.h"
+#include "../tools/vpwscenario.h"
+
+class HostVpw : public HostPio {
+private:
+    class Adapter : public VpwTransmitter {
+    protected:
+        void sent(VpwBus&, const VpwFrame&, uint64_t) override {
+            results.push_back(1);
+        }
+        void lost(VpwBus&, const VpwFrame&) override {
+            results.push_back(0);
+        }
+
+    public:
+        std::deque<uint32_t> results;
+
+        Adapter() : VpwTransmitter("adapter") {
+            retry = false;  // sendRaw retries
+            jitter = 0;
+        }
+    };
+
+    std::recursive_mutex mutex;
+    VpwScenario& scenario;
+    Adapter adapter;
+    std::deque<uint32_t> rx;
+    std::vector<uint8_t> tx;        // length byte + frame, as written
+    bool send4X = false;
+
+    // brings the bus up to the current time
+    void advance() {
+        uint64_t now = Clock::micros64() * VPW_US;
+        if (now > scenario.bus.now)
+            scenario.bus.run(now);
+    }
+
+    void interrupt() {
+        bool pending;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            pending = !rx.empty();
+        }
+        if (pending)
+            hostIrq(PIO0_IRQ_1);
+    }
+
+public:
+    ulong framesSent = 0;
+    ulong congestion = 0;
+    size_t rxHighWater = 0;
+
+    HostVpw(VpwScenario& scenario) : scenario(scenario) {
+        scenario.bus.add(adapter);
+        scenario.bus.words = [this](uint32_t word, uint64_t) {
+            rx.push_back(word);
+            rxHighWater = std::max(rxHighWater, rx.size());
+        };
+    }
+
+    // core 0, every loop: what arrived since the last call goes to VPW::receiveHandler
+    void poll() {
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            advance();
+        }
+        interrupt();
+    }
+
+    void clkdiv(PIO pio, unsigned, float div) override {
+        if (pio == pio1)
+            send4X = div < 300; // 532 at 1X, 133 at 4X
+    }
+
+    void put(PIO pio, unsigned, uint32_t data) override {
+        if (pio != pio1)
+            return;
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (int shift = 24; shift >= 0; shift -= 8)
+            tx.push_back(data >> shift);
+        if (tx.size() < (size_t)tx[0] + 1)
+            return;
+        VpwFrame frame;
+        frame.bytes.assign(tx.begin() + 1, tx.begin() + 1 + tx[0]);
+        frame.mode4X = send4X;
+        tx.clear();
+        advance();
+        adapter.send(scenario.bus, frame, scenario.bus.now);
+    }
+
+    uint32_t get(PIO pio, unsigned) override {
+        if (pio == pio0) {
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            if (rx.empty())
+                return 0;
+            uint32_t word = rx.front();
+            rx.pop_front();
+            return word;
+        }
+        // the send result: the frame goes out in real time
+        while (true) {
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                advance();
+                if (!adapter.results.empty()) {
+                    uint32_t result = adapter.results.front();
+                    adapter.results.pop_front();
+                    if (result)
+                        framesSent++;
+                    else
+                        congestion++;
+                    return result;
+                }
+            }
+            if (get_core_num() == 0)
+                interrupt();
+            if (Clock::virtualTime)
+                Clock::advanceTo(std::min(nextEvent(), Clock::micros64() + 1000));
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+
+    // us
+    uint64_t nextEvent() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        uint64_t next = scenario.bus.next();
+        return next == VPW_NEVER ? VPW_NEVER : (next + VPW_US - 1) / VPW_US;
+    }
+
+    bool rxEmpty(PIO pio, unsigned) override {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return pio != pio0 || rx.empty();
+    }
+
+    template <class F>
+    void locked(F f) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        f();
+    }
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+//
+// What the Arduino builder generates: prototypes of the functions defined in the .ino files,
+// so each file can call the others' regardless of the order they are concatenated in
+//
+
+#include "pico/lock_core.h"
+
+void setup();
+void loop();
+void setup1();
+void loop1();
+
+void debug(char text);
+void debug(const char* text);
+void push2byte(byte b);
+void push2(byte b);
+void push2encoded(byte b);
+void push2timestamp();
+void vpw_reset();
+void vpw_sof();
+void vpw_eod();
+void vpw_eof();
+void vpw_break();
+void vpw_bit(bool b);
+void PIXEL_SHOW();
@@ -0,0 +1,377 @@
+//
+// ptybench: times the adapter's full command path (command in, frame out, response text back)
+// over a serial port, e.g. a vpwpty pty or a real adapter
+//
+//   make -C host ptybench
+//
+//   ptybench [-n requests] [-r request] [-h header] [-c responses] [-p depth] [-m seconds [-q]] [-b seconds [-z]] [-B rates] <port>
+//
+//   -n  requests to time (default 500)
+//   -r  the request, as typed (default 010C)
+//   -h  header for ATSH (default 6C10F1)
+//   -c  responses to wait for (ATRC; default 1, 0 waits for the ATST timeout)
+//   -p  then the requests again pipelined (ATPL1), this many outstanding at a time (at most 8)
+//   -m  then monitor (ATMA) for this many seconds and report the output rate
+//   -q  with -m, monitor with ATMB and time an ATI typed every 250ms (command round trip under load)
+//   -b  then binary monitor (ATBM, see binmon.h) for this many seconds and report the rate
+//   -z  with -b, compressed (ATBMC), also reporting the compression ratio
+//   -B  then for each of these baud rates (e.g. 115200,1000000,4000000) switch to it with ATBRD,
+//       confirming with a CR as an ELM327 scan tool does, and report ATMA output under ATGEN
+//       traffic for 3 seconds; then back to the rate it started at
+//
+// Latency is from writing the request to receiving the prompt after its response.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "../binmon.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static int port = -1;
+
+static bool send(const std::string& text) {
+    std::string line = text + "\r";
+    return write(port, line.data(), line.size()) == (ssize_t)line.size();
+}
+
+// reads until the prompt (or the timeout); false on timeout
+static bool prompt(std::string& response, int timeoutMs) {
+    response.clear();
+    auto end = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (Clock::now() < end) {
+        struct pollfd p = { port, POLLIN, 0 };
+        if (poll(&p, 1, 10) <= 0)
+            continue;
+        char buffer[4096];
+        ssize_t n = read(port, buffer, sizeof(buffer));
+        if (n <= 0)
+            continue;
+        response.append(buffer, n);
+        if (response.back() == '>')
+            return true;
+    }
+    return false;
+}
+
+static bool command(const std::string& text) {
+    std::string response;
+    return send(text) && prompt(response, 2000);
+}
+
+// the local side of a real serial port follows; a pty doesn't care
+static void setSpeed(int rate) {
+    static const struct { int rate; speed_t speed; } speeds[] = {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 },
+        { 1000000, B1000000 }, { 2000000, B2000000 }, { 4000000, B4000000 }
+    };
+    for (auto& s : speeds) {
+        if (s.rate == rate) {
+            struct termios t;
+            tcgetattr(port, &t);
+            cfsetspeed(&t, s.speed);
+            tcsetattr(port, TCSADRAIN, &t);
+        }
+    }
+}
+
+// ATBRD: OK, then the ID at the new rate, confirmed with a CR, then OK again; the rate in use
+// after, 0 if it didn't hold
+static int switchBaud(int rate) {
+    char brd[16];
+    snprintf(brd, sizeof(brd), "ATBRD%02X", std::clamp((4000000 + rate / 2) / rate, 1, 255));
+    send(brd);
+    std::string text;
+    auto end = Clock::now() + std::chrono::seconds(2);
+    while (Clock::now() < end && text.find("ELM327") == std::string::npos) {
+        struct pollfd p = { port, POLLIN, 0 };
+        if (poll(&p, 1, 1) <= 0)
+            continue;
+        char buffer[256];
+        ssize_t n = read(port, buffer, sizeof(buffer));
+        if (n <= 0)
+            continue;
+        if (text.empty() && memchr(buffer, 'O', n))
+            setSpeed(rate);
+        text.append(buffer, n);
+    }
+    std::string response;
+    if (!send("") || !prompt(response, 2000) || response.find("OK") == std::string::npos)
+        return 0;
+    if (!send("ATBRD?") || !prompt(response, 2000))
+        return 0;
+    return atoi(response.c_str());
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p / 100 * v.size()))];
+}
+
+int main(int argc, char** argv) {
+    int requests = 500;
+    std::string request = "010C";
+    std::string header = "6C10F1";
+    int responses = 1;
+    int depth = 0;
+    int monitorSeconds = 0;
+    bool probe = false;
+    int binarySeconds = 0;
+    bool compressed = false;
+    std::vector<int> rates;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:h:c:p:m:qb:zB:")) != -1) {
+        switch (opt) {
+            case 'n': requests = atoi(optarg); break;
+            case 'r': request = optarg; break;
+            case 'h': header = optarg; break;
+            case 'c': responses = atoi(optarg); break;
+            case 'p': depth = atoi(optarg); break;
+            case 'm': monitorSeconds = atoi(optarg); break;
+            case 'q': probe = true; break;
+            case 'b': binarySeconds = atoi(optarg); break;
+            case 'z': compressed = true; break;
+            case 'B': {
+                std::istringstream list(optarg);
+                std::string rate;
+                while (std::getline(list, rate, ','))
+                    rates.push_back(atoi(rate.c_str()));
+                break;
+            }
+            default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n requests] [-r request] [-h header] [-c responses] [-p depth] [-m seconds [-q]] [-b seconds [-z]] [-B rates] <port>\n", argv[0]);
+        return 2;
+    }
+
+    port = open(argv[optind], O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (port < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    struct termios t;
+    tcgetattr(port, &t);
+    cfmakeraw(&t);
+    tcsetattr(port, TCSANOW, &t);
+    tcflush(port, TCIOFLUSH);
+
+    char rc[16];
+    snprintf(rc, sizeof(rc), "ATRC%02X", responses);
+    std::string response;
+    send("");
+    prompt(response, 1000);
+    if (!command("ATE0") || !command("ATH1") || !command("ATSH" + header) || !command(rc)) {
+        fprintf(stderr, "no prompt from the adapter\n");
+        return 1;
+    }
+
+    std::vector<double> latencies;
+    int missing = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < requests; i++) {
+        auto t0 = Clock::now();
+        if (!send(request) || !prompt(response, 5000)) {
+            fprintf(stderr, "timed out waiting for the prompt\n");
+            return 1;
+        }
+        latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+        if (response.find("NO DATA") != std::string::npos || response.find(header.substr(4, 2)) == std::string::npos)
+            missing++;
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    double total = 0;
+    for (double l : latencies)
+        total += l;
+    printf("%d requests in %.2fs: %.1f/s, %d without a response\n", requests, elapsed, requests / elapsed, missing);
+    printf("latency avg %.2fms, p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", total / requests,
+            percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99), percentile(latencies, 100));
+
+    if (depth > 0) {
+        // requests typed ahead, each answered by tagged lines ending in "[id] DONE" or "[id] NO DATA"
+        command("ATPL1");
+        int sent = 0, done = 0, unanswered = 0;
+        std::string line;
+        auto start = Clock::now();
+        auto progress = start;
+        while (done < requests && Clock::now() - progress < std::chrono::seconds(5)) {
+            while (sent < requests && sent - done < depth) {
+                send(request);
+                sent++;
+            }
+            struct pollfd p = { port, POLLIN, 0 };
+            if (poll(&p, 1, 10) <= 0)
+                continue;
+            char buffer[4096];
+            ssize_t n = read(port, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < n; i++) {
+                if (buffer[i] != '\r' && buffer[i] != '\n') {
+                    line += buffer[i];
+                    continue;
+                }
+                if (line.find("] DONE") != std::string::npos || line.find("] NO DATA") != std::string::npos) {
+                    done++;
+                    unanswered += (line.find("NO DATA") != std::string::npos);
+                    progress = Clock::now();
+                }
+                line.clear();
+            }
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        command("ATPL0");
+        printf("pipelined, %d outstanding: %d requests in %.2fs: %.1f/s, %d without a response\n", depth, done, elapsed,
+                done / elapsed, unanswered);
+        if (done < requests) {
+            fprintf(stderr, "timed out waiting for pipelined responses\n");
+            return 1;
+        }
+    }
+
+    if (monitorSeconds > 0) {
+        send(probe ? "ATMB" : "ATMA");
+        size_t bytes = 0, lines = 0;
+        auto end = Clock::now() + std::chrono::seconds(monitorSeconds);
+        // -q: ATI's response is the only line with the version in it
+        std::vector<double> probes;
+        std::string text;
+        auto probeSent = Clock::now();
+        bool probing = false;
+        while (Clock::now() < end) {
+            if (probe && !probing && Clock::now() - probeSent > std::chrono::milliseconds(250)) {
+                send("ATI");
+                probeSent = Clock::now();
+                probing = true;
+                text.clear();
+            }
+            struct pollfd p = { port, POLLIN, 0 };
+            if (poll(&p, 1, 1) <= 0)
+                continue;
+            char buffer[4096];
+            ssize_t n = read(port, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < n; i++) {
+                if (buffer[i] == '\n')
+                    lines++;
+            }
+            bytes += std::max<ssize_t>(n, 0);
+            if (probing && n > 0) {
+                text.append(buffer, n);
+                if (text.find("ELM327") != std::string::npos) {
+                    probes.push_back(std::chrono::duration<double, std::milli>(Clock::now() - probeSent).count());
+                    probing = false;
+                } else if (text.size() > 65536) {
+                    text.erase(0, text.size() - 16);
+                }
+            }
+        }
+        if (probe)
+            command("ATMA"); // stops ATMB; the next input stops this
+        send("");
+        prompt(response, 2000);
+        printf("monitor: %zu lines, %.0f lines/s, %.0f bytes/s\n", lines, lines / (double)monitorSeconds,
+                bytes / (double)monitorSeconds);
+        if (probe) {
+            printf("command round trip while monitoring: %zu, p50 %.2fms, p90 %.2fms, max %.2fms\n", probes.size(),
+                    percentile(probes, 50), percentile(probes, 90), percentile(probes, 100));
+        }
+    }
+
+    if (binarySeconds > 0) {
+        send(compressed ? "ATBMC" : "ATBM");
+        BinMonDecoder decoder;
+        size_t bytes = 0, frames = 0, texts = 0;
+        auto end = Clock::now() + std::chrono::seconds(binarySeconds);
+        auto callback = [&](const BinMonRecord& r) {
+            if (r.flags & BINMON_FRAME)
+                frames++;
+            else if (r.flags & BINMON_TEXT)
+                texts++;
+        };
+        while (Clock::now() < end) {
+            struct pollfd p = { port, POLLIN, 0 };
+            if (poll(&p, 1, 10) <= 0)
+                continue;
+            uint8_t buffer[4096];
+            ssize_t n = read(port, buffer, sizeof(buffer));
+            if (n > 0) {
+                bytes += n;
+                decoder.feed(buffer, n, callback);
+            }
+        }
+        send("");
+        // the END record, then text again
+        response.clear();
+        while (!decoder.ended || response.empty() || response.back() != '>') {
+            struct pollfd p = { port, POLLIN, 0 };
+            if (poll(&p, 1, 2000) <= 0)
+                break;
+            uint8_t buffer[4096];
+            ssize_t n = read(port, buffer, sizeof(buffer));
+            if (n <= 0)
+                break;
+            if (!decoder.ended)
+                decoder.feed(buffer, n, callback);
+            response.append((const char*)buffer, n);
+        }
+        printf("binary monitor: %zu frames, %.0f frames/s, %.0f bytes/s, %.1f bytes/frame, %zu text records, %lu bytes skipped%s\n",
+                frames, frames / (double)binarySeconds, bytes / (double)binarySeconds, frames ? (double)decoder.bytes / frames : 0.0,
+                texts, decoder.skipped, decoder.ended ? "" : ", no END record");
+        if (compressed)
+            printf("compression ratio %.2f against ATBM\n", decoder.ratio());
+    }
+
+    if (!rates.empty()) {
+        std::string response;
+        send("ATBRD?");
+        prompt(response, 2000);
+        int original = atoi(response.c_str());
+        const int seconds = 3;
+        for (int rate : rates) {
+            int actual = switchBaud(rate);
+            if (actual == 0) {
+                fprintf(stderr, "%d baud: no confirmation, back at the old rate\n", rate);
+                setSpeed(original);
+                command("");
+                continue;
+            }
+            // more frames than 4 Mbaud carries as text
+            command("ATGEN R 20000 SF D 2-8");
+            send("ATMA");
+            size_t bytes = 0, lines = 0;
+            auto end = Clock::now() + std::chrono::seconds(seconds);
+            while (Clock::now() < end) {
+                struct pollfd p = { port, POLLIN, 0 };
+                if (poll(&p, 1, 10) <= 0)
+                    continue;
+                char buffer[4096];
+                ssize_t n = read(port, buffer, sizeof(buffer));
+                for (ssize_t i = 0; i < n; i++) {
+                    if (buffer[i] == '\n')
+                        lines++;
+                }
+                bytes += std::max<ssize_t>(n, 0);
+            }
+            send("");
+            prompt(response, 2000);
+            command("ATGENQ");
+            printf("%d baud (ATBRD to %d): %zu lines, %.0f lines/s, %.0f bytes/s, %.0f%% of the line\n", rate, actual, lines,
+                    lines / (double)seconds, bytes / (double)seconds, bytes / (double)seconds * 1000 / actual);
+        }
+        if (original > 0)
+            switchBaud(original);
+    }
+    return missing ? 1 : 0;
+}
@@ -0,0 +1,243 @@
+//
+// vpwpty: the adapter firmware on Linux, with its serial ports on pseudo-terminals and the
+// VPW bus simulated (tools/vpwscenario.h) or replayed from a log
+//
+//   make -C host
+//
+//   vpwpty [-d dir] [-l prefix] [-s script] [-r log] [-L load%] [-n glitches/s] [-i us] [-u baud] [-v]
+//          [-t seconds [-e commands] [-o file]]
+//
+//   -d  data directory: the SD card (sd/) and LittleFS (littlefs/) (default vpwpty-data)
+//   -l  also link the ptys as <prefix>host, <prefix>bt and <prefix>usb
+//   -s  bus scenario script (ECUs, traffic, noise, ...; see tools/vpwscenario.h)
+//   -r  replay an SD log (.log or .vpb) onto the bus, looping
+//   -L  background traffic from a broadcaster, as a share of the bus
+//   -n  noise glitches per second
+//   -i  how long each core sleeps between loops (default 50us); with -t, the virtual time
+//       between loops (default 1000us)
+//   -u  the UART terminals (host and bt) send at this rate instead of the baud rate set
+//   -v  print bus and adapter statistics every 10 seconds
+//   -t  instead of the ptys, run this many seconds on virtual time (clock.h) and report the
+//       simulated seconds per wall second
+//   -e  with -t, commands typed on the host terminal, separated by ';', each after the
+//       prompt that ends the previous one
+//   -o  with -t, where the host terminal's output goes (default discarded)
+//
+// Without -s the bus has a PCM (10) and a TCM (18) answering physical requests (mode + $40,
+// the request's data and two more bytes).  The three terminals are the firmware's: the host
+// UART (Serial1), Bluetooth (Serial2) and USB (Serial), each on its own pty; the UARTs send no
+// faster than their baud rate.  Core 0 (setup,
+// loop) runs on the main thread and core 1 (setup1, loop1) on a second one.
+//
+// With -t both loops run in turn on the main thread and the clock only moves when stepped, by
+// -i after every pair of loops (the bus delivers what happened meanwhile in one batch, as a
+// deeper RX FIFO would).  The wall clock starts at 2024-01-01 00:00 UTC, so
+// a run (SD logs included) is the same every time.
+//
+
+#include <Arduino.h>
+#include "pico/lock_core.h"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <thread>
+#include <termios.h>
+#include <unistd.h>
+#include "hostvpw.h"
+
+void setup();
+void loop();
+void setup1();
+void loop1();
+
+static std::atomic<bool> stopping{false};
+static std::vector<std::string> links;
+
+static int openPty(const char* name, const std::string& prefix) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    const char* path = ptsname(fd);
+
+    // raw, so the client sees exactly what the firmware writes (settings outlive the open)
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if (slave >= 0) {
+        struct termios t;
+        tcgetattr(slave, &t);
+        cfmakeraw(&t);
+        tcsetattr(slave, TCSANOW, &t);
+        close(slave);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    printf("%-5s %s", name, path);
+    if (!prefix.empty()) {
+        std::string link = prefix + name;
+        unlink(link.c_str());
+        if (symlink(path, link.c_str()) == 0) {
+            links.push_back(link);
+            printf(" (%s)", link.c_str());
+        }
+    }
+    printf("\n");
+    return fd;
+}
+
+static void stop(int) {
+    stopping = true;
+}
+
+// -t: both cores on this thread, on virtual time
+static void simulate(HostVpw& transceiver, VpwScenario& scenario, double seconds, unsigned step,
+        const std::string& commands) {
+    Clock::virtualTime = true;
+    Clock::epochUs = 1704067200LL * 1000000;
+    setup();
+    setup1();
+    std::string pending = commands;
+
+    uint64_t end = Clock::micros64() + (uint64_t)(seconds * 1e6);
+    unsigned long loops = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (!stopping && Clock::micros64() < end) {
+        // the next command once the previous one has been answered (typing stops ATMA & co)
+        if (!pending.empty() && Serial1.hostInputEmpty() && Serial1.hostLastOutput == '>') {
+            size_t end = std::min(pending.find(';'), pending.size());
+            Serial1.hostInput(pending.substr(0, end) + "\r");
+            pending.erase(0, end + 1);
+            Serial1.hostLastOutput = -1;
+        }
+        transceiver.poll();
+        loop();
+        loop1();
+        loops++;
+        Clock::advance(step);
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double simulated = Clock::micros64() / 1e6;
+    printf("%.1f simulated s in %.2f wall s: %.0fx, %lu loops\n", simulated, wall, simulated / wall, loops);
+    printf("bus load %.1f%% frames %zu | adapter sent %lu congestion %lu rx high %zu\n",
+            scenario.bus.load(), scenario.bus.sent.size(),
+            transceiver.framesSent, transceiver.congestion, transceiver.rxHighWater);
+}
+
+int main(int argc, char** argv) {
+    std::string prefix;
+    const char* script = nullptr;
+    const char* replay = nullptr;
+    unsigned load = 0;
+    double noise = 0;
+    unsigned idle = 0;
+    unsigned long baud = 0;
+    bool verbose = false;
+    double seconds = 0;
+    std::string commands;
+    const char* output = nullptr;
+    hostDataDir = "vpwpty-data";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:l:s:r:L:n:i:u:vt:e:o:")) != -1) {
+        switch (opt) {
+            case 'd': hostDataDir = optarg; break;
+            case 'l': prefix = optarg; break;
+            case 's': script = optarg; break;
+            case 'r': replay = optarg; break;
+            case 'L': load = strtoul(optarg, nullptr, 10); break;
+            case 'n': noise = atof(optarg); break;
+            case 'i': idle = strtoul(optarg, nullptr, 10); break;
+            case 'u': baud = strtoul(optarg, nullptr, 10); break;
+            case 'v': verbose = true; break;
+            case 't': seconds = atof(optarg); break;
+            case 'e': commands = optarg; break;
+            case 'o': output = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-d dir] [-l prefix] [-s script] [-r log] [-L load%%] [-n glitches/s] [-i us] [-u baud] [-v] [-t seconds [-e commands] [-o file]]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    static VpwScenario scenario;
+    std::string error;
+    if (script) {
+        if (!scenario.parse(script, error)) {
+            fprintf(stderr, "%s: %s\n", script, error.c_str());
+            return 2;
+        }
+    } else {
+        scenario.defaults(load);
+    }
+    if (replay) {
+        VpwLogPlayer* player = scenario.add(new VpwLogPlayer("replay"));
+        player->loop = true;
+        if (!player->load(replay)) {
+            fprintf(stderr, "%s: no frames\n", replay);
+            return 1;
+        }
+        player->start(scenario.bus, VPW_MS);
+    }
+    if (noise > 0)
+        scenario.noise.rate = noise;
+    static HostVpw transceiver(scenario);
+    scenario.start();
+    hostPio = &transceiver;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    Serial1.hostPaced = Serial2.hostPaced = true;
+    Serial1.hostBaud = Serial2.hostBaud = baud;
+
+    if (seconds > 0) {
+        Serial1.fd = output ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open("/dev/null", O_WRONLY);
+        Serial2.fd = open("/dev/null", O_WRONLY);
+        Serial.fd = open("/dev/null", O_WRONLY);
+        if (Serial1.fd < 0) {
+            perror(output);
+            return 1;
+        }
+        simulate(transceiver, scenario, seconds, idle ? idle : 1000, commands);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (!idle)
+        idle = 50;
+
+    Serial1.fd = openPty("host", prefix);
+    Serial2.fd = openPty("bt", prefix);
+    Serial.fd = openPty("usb", prefix);
+    fflush(stdout);
+
+    std::thread core1([idle]() {
+        hostCore = 1;
+        setup1();
+        while (true) {
+            loop1();
+            std::this_thread::sleep_for(std::chrono::microseconds(idle));
+        }
+    });
+    core1.detach();
+
+    setup();
+    uint32_t lastReport = millis();
+    while (!stopping) {
+        transceiver.poll();
+        loop();
+        std::this_thread::sleep_for(std::chrono::microseconds(idle));
+
+        if (verbose && millis() - lastReport >= 10000) {
+            lastReport = millis();
+            transceiver.locked([]() {
+                fprintf(stderr, "bus %.1fs load %.1f%% frames %zu | adapter sent %lu congestion %lu rx high %zu\n",
+                        scenario.bus.now / 1e9, scenario.bus.load(), scenario.bus.sent.size(),
+                        transceiver.framesSent, transceiver.congestion, transceiver.rxHighWater);
+            });
+        }
+    }
+
+    for (const std::string& link : links)
+        unlink(link.c_str());
+    // core 1 is still running: leave without static destructors
+    _exit(0);
+}
@@ -5,6 +5,7 @@
 #include "hexutil.h"
 
 class J1850 {
+    friend class LoadGenerator;
 private:
     bool valid = false;
 
@@ -84,6 +85,10 @@ public:
     J1850(const std::string& hex, bool autoCRC = true) : raw(addCRC(HexUtil.bytes(hex), autoCRC)) {
         this->valid = this->validate(!autoCRC);
     }
+
+    J1850(const std::vector<byte>& raw, bool autoCRC) : raw(addCRC(std::vector<byte>(raw), autoCRC)) {
+        this->valid = this->validate(!autoCRC);
+    }
     
     ~J1850() {
         // free memory here as needed
@@ -117,7 +122,7 @@ public:
         return {raw.begin() + prefixSize, raw.end() - 1};        
     }
 
-    const size_t size() const {
+    size_t size() const {
         return raw.size();
     }
 
@@ -130,57 +135,57 @@ public:
         return valid;
     }
 
-    const byte operator[](size_t index) const {
+    byte operator[](size_t index) const {
         if (index >= raw.size())
-            return (const byte)0x00;
+            return 0x00;
         return raw[index];
     }
 
-    const size_t headerLength() const {
+    size_t headerLength() const {
         return (raw[0] & 0x10) ? 1 : 3;
     }
 
-    const byte hdr() const {
+    byte hdr() const {
         return raw[0];
     }
 
-    const byte target() const {
+    byte target() const {
         return raw[1];
     }
 
-    const byte source() const {
+    byte source() const {
         return raw[2];
     }
 
-    const byte secondaryAddress() const {
+    byte secondaryAddress() const {
         return raw[3];
     }
 
-    const byte extendedAddress() const {
+    byte extendedAddress() const {
         return isExtended() ? raw[4] : 0x00;
     }
     
-    const uint8_t priority() const {
+    uint8_t priority() const {
         return raw[0] >> 5;
     }
 
-    const bool ifr() const {
+    bool ifr() const {
         return (raw[0] & 8) == 0;
     }
     
-    const bool isFunctional() const {
+    bool isFunctional() const {
         return (raw[0] & 4) == 0;
     }
 
-    const bool isPhysical() const {
+    bool isPhysical() const {
         return (raw[0] & 4) != 0;
     }
 
-    const bool isExtended() const {
+    bool isExtended() const {
         return ((raw[0] >> 1) & 5) == 5; // functional message, type 2 or 3, with no IFR
     }
     
-    const uint8_t type() const {
+    uint8_t type() const {
         return (raw[0] & 3);
     }
 };
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "clock.h"
+#include "j1850.h"
+#include "message.h"
+#include "util.h"
+#include "vpw.h"
+#include <string>
+#include <vector>
+
+//
+// LOAD GENERATOR
+//
+// Injects synthetic frames into the receive pipeline at a fixed rate (frames/s) or bus load
+// (% of the bus time the frames would take), to see how decoding, the terminals and logging
+// hold up.  Frames are either pushed into VPWMessageQueue as if just assembled (FRAME stage),
+// or turned into the pulses the receive PIO program would report and fed to the decoder
+// (PULSE stage).  Headers are picked from a weighted list and payload lengths are uniform
+// between a minimum and maximum; payload bytes are pseudo-random.
+//
+// While it runs, loop() and loop1() report the time spent in each stage and the depth of each
+// queue; the terminals keep their own queue depth, drop count and output lag (bus timestamp
+// to printed).  Each stage is timed from a single core, so no locking is needed.
+//
+
+#ifndef LOADGEN_HEADERS
+#define LOADGEN_HEADERS 8
+#endif
+
+#define LOADGEN_BATCH     16     // frames injected per loop at most
+#define LOADGEN_MAX_BEHIND 100000 // us; further behind than this, frames are skipped
+
+enum loadStage : byte {
+    LOAD_GENERATE,
+    LOAD_DECODE,      // VPW::receiveLoop
+    LOAD_ASSEMBLE,    // VPWMessageQueue.process
+    LOAD_FANOUT,      // Terminals.push, class2.push
+    LOAD_OUTPUT,      // Terminals.loop
+    LOAD_CLASS2,      // core 1: per-frame handling (logging queues, automation)
+    LOAD_LOG,         // core 1: SD/flash writes
+    LOAD_STAGES
+};
+
+enum loadQueue : byte {
+    LOAD_QUEUE_RAW,
+    LOAD_QUEUE_ENCODED,
+    LOAD_QUEUE_ASSEMBLED,
+    LOAD_QUEUE_CLASS2,
+    LOAD_QUEUES
+};
+
+class LoadGenerator {
+private:
+    struct WeightedHeader {
+        byte header[3];
+        uint weight;
+    };
+
+    WeightedHeader headers[LOADGEN_HEADERS];
+    size_t headerCount = 0;
+    uint totalWeight = 0;
+    uint32_t seed = 0x2545F491;
+    uint64_t start = 0;         // 64-bit: with no duration it runs past the 32-bit micros() wrap
+    uint64_t scheduled = 0;     // us after start that the next frame is due
+    uint64_t busTime = 0;       // us the generated frames would take on the bus
+    std::vector<byte> frame;
+    std::vector<uint> pulses;
+
+    uint32_t random() {
+        // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    // a pulse in the receive program's format: duration (us) << 1 | active
+    void pulse(uint us, bool active) {
+        pulses.push_back((us << 1) | (active ? 1 : 0));
+        busTime += us;
+    }
+
+    // SOF, then bits alternating passive/active (passive: 1 = long; active: 0 = long), then
+    // the EOF/IFS gap; all a quarter as long at 4X
+    uint encode() {
+        uint div = mode4X ? 4 : 1;
+        uint64_t before = busTime;
+        pulses.clear();
+        pulse(200 / div, true);
+        bool active = false;
+        for (byte b : frame) {
+            for (int bit = 7; bit >= 0; bit--) {
+                bool one = (b >> bit) & 1;
+                pulse(((one != active) ? 128 : 64) / div, active);
+                active = !active;
+            }
+        }
+        pulse(300 / div, false);
+        return busTime - before;
+    }
+
+    void generate() {
+        uint pick = random() % totalWeight;
+        size_t h = 0;
+        while (pick >= headers[h].weight)
+            pick -= headers[h++].weight;
+        size_t length = minPayload + (maxPayload > minPayload ? random() % (maxPayload - minPayload + 1) : 0);
+        frame.assign(headers[h].header, headers[h].header + 3);
+        for (size_t i = 0; i < length; i++)
+            frame.push_back(random() & 0xFF);
+        frame.push_back(J1850::CRC(frame.data(), frame.size()));
+    }
+
+public:
+    bool running = false;
+    bool pulseStage = false;
+    bool mode4X = false;
+    uint rate = 0;              // frames/s, or 0 to use load
+    uint load = 100;            // % of bus time
+    uint minPayload = 1;
+    uint maxPayload = 8;
+    uint duration = 10;         // s, 0 = until ATGENQ
+
+    // instrumentation
+    uint64_t stageTime[LOAD_STAGES] = {};
+    size_t queueHighWater[LOAD_QUEUES] = {};
+    ulong generated = 0;
+    ulong skipped = 0;          // the generator couldn't keep up
+    ulong delivered = 0;        // reached the fan-out stage
+    uint64_t elapsed = 0;
+    std::string (*terminalStats)(const char* newline) = nullptr; // set in setup(): Terminals is declared after this
+    void (*clearTerminalStats)() = nullptr;
+
+    LoadGenerator() {
+        frame.reserve(0x100);
+        pulses.reserve(0x100 * 8 + 2);
+    }
+
+    void clearHeaders() {
+        headerCount = 0;
+        totalWeight = 0;
+    }
+
+    bool addHeader(const byte* header, uint weight) {
+        if (headerCount >= LOADGEN_HEADERS || weight == 0)
+            return false;
+        memcpy(headers[headerCount].header, header, 3);
+        headers[headerCount++].weight = weight;
+        totalWeight += weight;
+        return true;
+    }
+
+    void begin() {
+        if (headerCount == 0) {
+            // functional broadcasts, a diagnostic request and its response
+            static const byte defaults[][3] = { { 0x48, 0x6B, 0x10 }, { 0x68, 0x6A, 0xF1 }, { 0x6C, 0x10, 0xF1 }, { 0x6C, 0xF1, 0x10 } };
+            static const uint weights[] = { 4, 1, 1, 1 };
+            for (size_t i = 0; i < 4; i++)
+                addHeader(defaults[i], weights[i]);
+        }
+        for (uint64_t& t : stageTime)
+            t = 0;
+        for (size_t& q : queueHighWater)
+            q = 0;
+        generated = skipped = delivered = 0;
+        busTime = 0;
+        scheduled = 0;
+        elapsed = 0;
+        if (clearTerminalStats)
+            clearTerminalStats();
+        start = Clock::micros64();
+        running = true;
+    }
+
+    void stop() {
+        if (running)
+            elapsed = Clock::micros64() - start;
+        running = false;
+    }
+
+    // Called on core 0 every loop, before the receive stages
+    void loop() {
+        if (!running)
+            return;
+        if (!rate && !load) {
+            running = false; // nothing to pace frames by
+            return;
+        }
+        uint now = Clock::micros();
+        elapsed = Clock::micros64() - start;
+        if (duration > 0 && elapsed >= duration * 1000000ULL) {
+            running = false;
+            return;
+        }
+        if (elapsed > scheduled + LOADGEN_MAX_BEHIND) {
+            uint64_t cost = rate ? 1000000 / rate : (generated ? busTime / generated * 100 / load : 1000);
+            skipped += (elapsed - scheduled) / cost;
+            scheduled = elapsed;
+        }
+        for (int n = 0; n < LOADGEN_BATCH && scheduled <= elapsed; n++) {
+            generate();
+            uint us = encode();
+            if (pulseStage)
+                VPW::inject(pulses.data(), pulses.size());
+            else
+                VPWMessageQueue.push(Message(mode4X ? 4 : 1, VPW::getTimestamp(), frame));
+            generated++;
+            scheduled += rate ? 1000000 / rate : (uint64_t)us * 100 / load;
+        }
+        sample(LOAD_QUEUE_RAW, VPW::rawDepth());
+        sample(LOAD_QUEUE_ENCODED, VPW::encodedDepth());
+        sample(LOAD_QUEUE_ASSEMBLED, VPWMessageQueue.depth());
+        time(LOAD_GENERATE, now);
+    }
+
+    // adds the time since 'since' to a stage; returns the current time, to start the next stage
+    uint time(loadStage stage, uint since) {
+        uint now = Clock::micros();
+        if (running)
+            stageTime[stage] += now - since;
+        return now;
+    }
+
+    void sample(loadQueue queue, size_t depth) {
+        if (running && depth > queueHighWater[queue])
+            queueHighWater[queue] = depth;
+    }
+
+    void deliver() {
+        if (running)
+            delivered++;
+    }
+
+    std::string status() {
+        if (!running)
+            return generated ? "DONE" : "STOPPED";
+        return "RUNNING " + std::to_string(elapsed / 1000000) + "S " + std::to_string(generated) + " FRAMES";
+    }
+
+    std::string stats(const char* newline) {
+        static const char* stages[] = { "GEN", "DECODE", "ASSEMBLE", "FANOUT", "OUTPUT", "CLASS2", "LOG" };
+        static const char* queues[] = { "RAW", "ENCODED", "ASSEMBLED", "CLASS2" };
+        float seconds = max(elapsed, (uint64_t)1) / 1000000.0f;
+        std::string ret;
+        ret += std::string(pulseStage ? "PULSE" : "FRAME") + (mode4X ? " 4X" : " 1X");
+        ret += " GENERATED " + std::to_string(generated);
+        ret += " SKIPPED " + std::to_string(skipped);
+        ret += " DELIVERED " + std::to_string(delivered);
+        ret += newline;
+        ret += "RATE " + Util.dec(generated / seconds, 0, 0) + "/S";
+        ret += " BUS " + Util.dec(busTime / 10000.0f / seconds, 0, 1) + "%";
+        ret += newline;
+        ret += "QUEUE MAX";
+        for (size_t i = 0; i < LOAD_QUEUES; i++)
+            ret += std::string(" ") + queues[i] + " " + std::to_string(queueHighWater[i]);
+        ret += newline;
+        ret += "CPU";
+        for (size_t i = 0; i < LOAD_STAGES; i++)
+            ret += std::string(" ") + stages[i] + " " + Util.dec(stageTime[i] / 10000.0f / seconds, 0, 1) + "%";
+        if (terminalStats) {
+            ret += newline;
+            ret += terminalStats(newline);
+        }
+        return ret;
+    }
+};
+
+LoadGenerator loadgen;
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+//
+// Framed binary log download (ATLOGD), shared by the firmware and tools/logfetch.cpp
+//
+//   block:  "LB" <type:1> <offset:4> <length:2> <payload> <crc:4>
+//
+// The CRC (CRC-32, as used by zip and Ethernet) covers everything from the type byte to the
+// end of the payload.  offset is the position of the payload in the download stream, which
+// is also the offset ATLOGD takes to resume.  Multi-byte values are little-endian.
+//
+//   H  begin:  <file size:4> <flags:1> <file name>   (offset is where this download starts)
+//   D  data
+//   E  end:    <stream length:4>
+//
+// Anything outside a block (command echo, the prompt, --STOPPED) is skipped by the reader.
+//
+
+#define LOGBLOCK_MAGIC    "LB"
+#define LOGBLOCK_HEADER   9  // magic, type, offset, length
+#define LOGBLOCK_OVERHEAD 13 // header + CRC
+
+enum logBlockType : uint8_t {
+    LOGBLOCK_BEGIN = 'H',
+    LOGBLOCK_DATA  = 'D',
+    LOGBLOCK_END   = 'E'
+};
+
+enum logBlockFlags : uint8_t {
+    LOGBLOCK_VPB      = 0x01, // the stream is a .vpb file (otherwise .log text)
+    LOGBLOCK_FILTERED = 0x02  // only the records matching the time/header filter
+};
+
+class LogBlock {
+private:
+    static void put(std::string& out, size_t at, uint32_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++)
+            out[at + i] = (char)((value >> (8 * i)) & 0xFF);
+    }
+
+public:
+    static uint32_t crc(const uint8_t* data, size_t size, uint32_t crc = 0) {
+        // half-byte table: 64 bytes instead of 1KB
+        static const uint32_t table[16] = {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+        };
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+            crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+        }
+        return ~crc;
+    }
+
+    // starts a block in out (its payload is appended after this); returns where it starts
+    static size_t open(std::string& out) {
+        size_t at = out.size();
+        out.append(LOGBLOCK_HEADER, '\0');
+        return at;
+    }
+
+    // fills in the header of the block started at 'at' and appends its CRC
+    static void close(std::string& out, size_t at, uint8_t type, uint32_t offset) {
+        size_t length = out.size() - at - LOGBLOCK_HEADER;
+        out[at] = LOGBLOCK_MAGIC[0];
+        out[at + 1] = LOGBLOCK_MAGIC[1];
+        out[at + 2] = type;
+        put(out, at + 3, offset, 4);
+        put(out, at + 7, length, 2);
+        uint32_t value = crc((const uint8_t*)out.data() + at + 2, out.size() - at - 2);
+        out.append(4, '\0');
+        put(out, out.size() - 4, value, 4);
+    }
+
+    struct Parsed {
+        int status = 0; // 1 = block, -1 = block with a bad CRC, 0 = none (yet)
+        uint8_t type = 0;
+        uint32_t offset = 0;
+        const uint8_t* payload = nullptr;
+        size_t length = 0;
+    };
+
+    // Looks for the next block in data.  Returns the number of bytes used up (anything
+    // skipped, plus the block if one was found); a partial block is left for the next call.
+    static size_t parse(const uint8_t* data, size_t size, Parsed& block) {
+        block.status = 0;
+        size_t start = 0;
+        while (start + 1 < size && !(data[start] == LOGBLOCK_MAGIC[0] && data[start + 1] == LOGBLOCK_MAGIC[1]))
+            start++;
+        if (start + LOGBLOCK_HEADER > size)
+            return start;
+        const uint8_t* p = data + start;
+        block.type = p[2];
+        block.offset = p[3] | (p[4] << 8) | (p[5] << 16) | ((uint32_t)p[6] << 24);
+        block.length = p[7] | (p[8] << 8);
+        if (block.type != LOGBLOCK_BEGIN && block.type != LOGBLOCK_DATA && block.type != LOGBLOCK_END)
+            return start + 1; // not a block after all
+        if (start + LOGBLOCK_OVERHEAD + block.length > size)
+            return start;
+        const uint8_t* c = p + LOGBLOCK_HEADER + block.length;
+        uint32_t expected = c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t)c[3] << 24);
+        block.payload = p + LOGBLOCK_HEADER;
+        if (crc(p + 2, LOGBLOCK_HEADER - 2 + block.length) != expected) {
+            block.status = -1;
+            return start + 1;
+        }
+        block.status = 1;
+        return start + LOGBLOCK_OVERHEAD + block.length;
+    }
+};
@@ -3,6 +3,7 @@
 #include "j1850.h"
 #include "vpw.h"
 #include "util.h"
+#include "filter.h"
 
 #define MessagePtr std::shared_ptr<Message>
 
@@ -103,6 +104,10 @@ public:
         recursive_lock_guard lock(mutex);
         return this->size() > 0;
     }
+    size_t depth() {
+        recursive_lock_guard lock(mutex);
+        return this->size();
+    }
 };
 
 class StringQueue : public QueueOf<std::string> { };
@@ -116,6 +121,8 @@ private:
     timeval tv;
     
 public:
+    FrameInterest interest;     // frames no consumer wants aren't made into messages
+    ulong filtered = 0;
 
     VPWMessageQueue() {
         buffer.reserve(0x100);
@@ -146,16 +153,20 @@ public:
                     break;
                 case W_EOF:
                     {
-                        Message message(mode, tv, buffer);
-                        this->push(message);
-                        if (message.isPhysical() && message.target() == 0xFE) {
-                            // Special case for command to enter 4X mode
-                            if (message.secondaryAddress() == 0xA1)
+                        // Special cases for the commands to enter 4X mode and return to normal,
+                        // whether or not anyone wants the frame
+                        if (buffer.size() > 3 && (buffer[0] & 4) && buffer[1] == 0xFE) {
+                            if (buffer[3] == 0xA1)
                                 VPW::SEND_4X = true;
-                            // Special case for command to return to normal
-                            if (message.secondaryAddress() == 0x20)
+                            if (buffer[3] == 0x20)
                                 VPW::SEND_4X = false;
                         }
+                        if (!interest.wants(buffer.data(), buffer.size())) {
+                            filtered++;
+                            break;
+                        }
+                        Message message(mode, tv, buffer);
+                        this->push(message);
                         break;
                     }
                 case W_EOT:
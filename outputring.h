@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+//
+// Byte ring for a terminal's output: the terminal renders into it and drains it into the
+// port in whatever bulk the port can take without blocking
+//
+class OutputRing {
+private:
+    std::vector<char> buffer;
+    size_t head = 0;    // oldest byte
+    size_t count = 0;
+
+public:
+    size_t highWater = 0;
+    uint64_t written = 0;       // bytes ever written
+    uint64_t consumed = 0;      // and taken out
+
+    OutputRing(size_t size) : buffer(size) { }
+
+    size_t capacity() const {
+        return buffer.size();
+    }
+    size_t size() const {
+        return count;
+    }
+    size_t space() const {
+        return buffer.size() - count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+
+    // as much of data as fits; returns how much that was
+    size_t write(const char* data, size_t length) {
+        length = min(length, space());
+        size_t tail = (head + count) % buffer.size();
+        size_t first = min(length, buffer.size() - tail);
+        memcpy(buffer.data() + tail, data, first);
+        memcpy(buffer.data(), data + first, length - first);
+        count += length;
+        written += length;
+        if (count > highWater)
+            highWater = count;
+        return length;
+    }
+
+    // the oldest bytes, as one contiguous run
+    size_t peek(const char*& data) const {
+        data = buffer.data() + head;
+        return min(count, buffer.size() - head);
+    }
+
+    void consume(size_t length) {
+        head = (head + length) % buffer.size();
+        count -= length;
+        consumed += length;
+    }
+
+    // takes back the newest bytes, not yet sent
+    void unwrite(size_t length) {
+        length = min(length, count);
+        count -= length;
+        written -= length;
+    }
+};
@@ -0,0 +1,510 @@
+#pragma once
+
+#include "pico/lock_core.h"
+#include "clock.h"
+#include "histogram.h"
+#include "hexutil.h"
+#include "message.h"
+#include "settings.h"
+#include "util.h"
+#ifdef USE_SD
+#include "sdlog.h"
+#endif
+#ifdef USE_FLASHLOG
+#include "flashlog.h"
+#endif
+#include <new>
+#include <string>
+
+//
+// FLIGHT RECORDER
+//
+// Keeps the last few seconds of bus traffic in a RAM ring and, when a trigger fires, saves the
+// pre-trigger window plus the next few seconds as one capture: a new log file on the SD card, or
+// a [CAPTURE n] ... [CAPTURE END] run of records in the flash log.  While the recorder is on,
+// frames are only logged as part of a capture.
+//
+//   entry:  <size:2> <mode:1> <text length:1> <sec:4> <usec:4> <frame> <text>
+//
+// The ring is allocated once, when the budget is set (ATRECB).  Recording a frame copies it in
+// and drops the oldest entries to make room, whatever is buffered, and never allocates.  Entries
+// from the start of a capture on are kept until they are saved, a few per loop1 pass; if the
+// ring fills up first, the post-trigger window ends early.
+//
+// Triggers: a frame starting with one of the ATRECM patterns (hex, X matches any nibble), a
+// [BREAK] or [BUS ERROR], a power mode change (ATRECE selects which of these), or ATRECT.
+//
+
+#ifndef RECORDER_KB
+#define RECORDER_KB 32
+#endif
+
+#ifndef RECORDER_MAX_KB
+#define RECORDER_MAX_KB 128
+#endif
+
+#ifndef RECORDER_PRE_S
+#define RECORDER_PRE_S 10
+#endif
+
+#ifndef RECORDER_POST_S
+#define RECORDER_POST_S 5
+#endif
+
+#define RECORDER_PATTERNS      4
+#define RECORDER_PATTERN_BYTES 8
+#define RECORDER_HEADER        12
+#define RECORDER_TEXT          31  // longest notification kept
+#define RECORDER_SAVE_BATCH    16  // entries saved per service() call
+
+enum recorderEvent : byte {
+    RECORDER_MATCH = 0x01,
+    RECORDER_ERROR = 0x02,  // [BREAK], [BUS ERROR]
+    RECORDER_POWER = 0x04
+};
+
+enum recorderState : byte {
+    RECORDER_OFF,
+    RECORDER_ARMED,
+    RECORDER_POST,          // triggered, recording the post-trigger window
+    RECORDER_SAVING
+};
+
+struct RecorderPattern {
+    byte value[RECORDER_PATTERN_BYTES];
+    byte mask[RECORDER_PATTERN_BYTES];
+    byte length = 0;
+
+    bool matches(const byte* frame, size_t size) const {
+        if (size < length)
+            return false;
+        for (size_t i = 0; i < length; i++) {
+            if ((frame[i] & mask[i]) != value[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool parse(std::string_view hex) {
+        if (hex.size() == 0 || hex.size() % 2 != 0 || hex.size() > 2 * RECORDER_PATTERN_BYTES)
+            return false;
+        length = hex.size() / 2;
+        for (size_t i = 0; i < hex.size(); i++) {
+            byte nibble = 0, bits = 0x0F;
+            if (hex[i] == 'X')
+                bits = 0;
+            else if (isxdigit(hex[i]))
+                nibble = isdigit(hex[i]) ? hex[i] - '0' : toupper(hex[i]) - 'A' + 10;
+            else
+                return false;
+            if (i % 2 == 0) {
+                value[i / 2] = nibble << 4;
+                mask[i / 2] = bits << 4;
+            } else {
+                value[i / 2] |= nibble;
+                mask[i / 2] |= bits;
+            }
+        }
+        return true;
+    }
+
+    std::string tostring() const {
+        std::string ret;
+        for (size_t i = 0; i < length; i++) {
+            std::string h = HexUtil.hex(value[i]);
+            if (!(mask[i] & 0xF0))
+                h[0] = 'X';
+            if (!(mask[i] & 0x0F))
+                h[1] = 'X';
+            ret += h;
+        }
+        return ret;
+    }
+};
+
+class FlightRecorder {
+private:
+    static inline bool mutexInitialized = false;
+    static inline recursive_mutex_t mutex;
+    static inline byte* buffer = nullptr;
+    static inline uint32_t capacity = 0;
+    static inline uint32_t head = 0;         // where the next entry goes
+    static inline uint32_t tail = 0;         // oldest entry
+    static inline uint32_t used = 0;
+    static inline uint32_t entries = 0;
+    static inline uint32_t cursor = 0;       // next entry of the capture to save
+    static inline uint32_t captureEnd = 0;
+    static inline uint32_t newest = 0;       // time of the last entry (ms)
+    static inline ulong sequence = 0;        // captures since boot
+    static inline bool captureOpened = false;
+    static inline uint postUntil = 0;
+    static inline struct timeval triggerTime = { 0, 0 };
+    static inline const char* reason = "";
+    static inline RecorderPattern patterns[RECORDER_PATTERNS];
+
+    static void put(uint32_t at, const void* data, size_t size) {
+        size_t first = min(size, (size_t)(capacity - at));
+        memcpy(buffer + at, data, first);
+        memcpy(buffer, (const byte*)data + first, size - first);
+    }
+
+    static void get(uint32_t at, void* data, size_t size) {
+        size_t first = min(size, (size_t)(capacity - at));
+        memcpy(data, buffer + at, first);
+        memcpy((byte*)data + first, buffer, size - first);
+    }
+
+    static uint16_t sizeAt(uint32_t at) {
+        uint16_t size;
+        get(at, &size, sizeof(size));
+        return size;
+    }
+
+    static uint32_t millisAt(uint32_t at) {
+        int32_t tv[2];
+        get((at + 4) % capacity, tv, sizeof(tv));
+        return (uint32_t)tv[0] * 1000 + tv[1] / 1000;
+    }
+
+    static void evict() {
+        uint16_t size = sizeAt(tail);
+        tail = (tail + size) % capacity;
+        used -= size;
+        entries--;
+    }
+
+    static bool fire(const char* why, const struct timeval& tv);
+    static void save(const Message& m);
+    static bool saveReady();
+
+public:
+    static inline recorderState state = RECORDER_OFF;
+    static inline uint budget = RECORDER_KB;
+    static inline uint preSeconds = RECORDER_PRE_S;
+    static inline uint postSeconds = RECORDER_POST_S;
+    static inline byte events = RECORDER_MATCH | RECORDER_ERROR | RECORDER_POWER;
+    static inline size_t patternCount = 0;
+
+    // instrumentation
+    static inline LatencyHistogram recordLatency;
+    static inline ulong framesRecorded = 0;
+    static inline ulong framesDropped = 0;   // no room: the capture being saved has the ring
+    static inline ulong captures = 0;
+    static inline ulong triggersIgnored = 0; // fired while a capture was in progress
+    static inline ulong capturesTruncated = 0;
+
+    static void begin();
+    static bool enable(bool on);
+    static bool setBudget(uint kb);
+    static void setWindow(uint pre, uint post);
+    static void setEvents(byte mask);
+    static bool addPattern(std::string_view hex);
+    static void clearPatterns();
+    static std::string listPatterns();
+    static const char* record(const Message& m);
+    static const char* event(recorderEvent type, const char* why);
+    static bool trigger(const char* why = "MANUAL");
+    static bool service();
+    static std::string status();
+    static std::string stats(const char* newline);
+    static void clearStats();
+};
+
+void FlightRecorder::begin() {
+    if (!mutexInitialized) {
+        recursive_mutex_init(&mutex);
+        mutexInitialized = true;
+    }
+    bool on = false;
+    int value;
+    if (SettingsRepository.read("rec-kb", value) > 0 && value > 0 && value <= RECORDER_MAX_KB)
+        budget = value;
+    if (SettingsRepository.read("rec-pre", value) > 0 && value >= 0)
+        preSeconds = value;
+    if (SettingsRepository.read("rec-post", value) > 0 && value >= 0)
+        postSeconds = value;
+    if (SettingsRepository.read("rec-events", value) > 0)
+        events = value;
+    std::string list;
+    if (SettingsRepository.read("rec-match", list) > 0) {
+        size_t start = 0;
+        while (start < list.size() && patternCount < RECORDER_PATTERNS) {
+            size_t comma = list.find(',', start);
+            if (comma == std::string::npos)
+                comma = list.size();
+            if (patterns[patternCount].parse(std::string_view(list).substr(start, comma - start)))
+                patternCount++;
+            start = comma + 1;
+        }
+    }
+    SettingsRepository.read("rec", on);
+    if (on)
+        enable(true);
+}
+
+bool FlightRecorder::enable(bool on) {
+    recursive_lock_guard lock(mutex);
+    if (on && !buffer) {
+        buffer = new (std::nothrow) byte[budget * 1024];
+        if (!buffer)
+            return false;
+        capacity = budget * 1024;
+    }
+    if (on != (state != RECORDER_OFF))
+        SettingsRepository.write("rec", on ? "1" : "0");
+    head = tail = used = entries = 0;
+    state = on ? RECORDER_ARMED : RECORDER_OFF;
+    return true;
+}
+
+bool FlightRecorder::setBudget(uint kb) {
+    recursive_lock_guard lock(mutex);
+    if (kb == 0 || kb > RECORDER_MAX_KB)
+        return false;
+    if (kb != budget) {
+        SettingsRepository.write("rec-kb", std::to_string(kb).c_str());
+        budget = kb;
+        delete[] buffer;
+        buffer = nullptr;
+        capacity = 0;
+        if (state != RECORDER_OFF)
+            return enable(true);
+    }
+    return true;
+}
+
+void FlightRecorder::setWindow(uint pre, uint post) {
+    recursive_lock_guard lock(mutex);
+    preSeconds = pre;
+    postSeconds = post;
+    SettingsRepository.write("rec-pre", std::to_string(pre).c_str());
+    SettingsRepository.write("rec-post", std::to_string(post).c_str());
+}
+
+void FlightRecorder::setEvents(byte mask) {
+    recursive_lock_guard lock(mutex);
+    events = mask;
+    SettingsRepository.write("rec-events", std::to_string(mask).c_str());
+}
+
+bool FlightRecorder::addPattern(std::string_view hex) {
+    recursive_lock_guard lock(mutex);
+    if (patternCount >= RECORDER_PATTERNS || !patterns[patternCount].parse(hex))
+        return false;
+    patternCount++;
+    SettingsRepository.write("rec-match", listPatterns().c_str());
+    return true;
+}
+
+void FlightRecorder::clearPatterns() {
+    recursive_lock_guard lock(mutex);
+    patternCount = 0;
+    SettingsRepository.write("rec-match", "");
+}
+
+std::string FlightRecorder::listPatterns() {
+    recursive_lock_guard lock(mutex);
+    std::string ret;
+    for (size_t i = 0; i < patternCount; i++) {
+        if (i > 0)
+            ret += ',';
+        ret += patterns[i].tostring();
+    }
+    return ret;
+}
+
+// Called on the logging core for every frame and notification.  Returns the trigger reason if it fired.
+const char* FlightRecorder::record(const Message& m) {
+    recursive_lock_guard lock(mutex);
+    if (state == RECORDER_OFF)
+        return nullptr;
+    uint start = Clock::micros();
+    size_t frameSize = m.size();
+    size_t textSize = min(m.information.size(), (size_t)RECORDER_TEXT);
+    size_t size = RECORDER_HEADER + frameSize + textSize;
+    uint32_t now = (uint32_t)m.timestamp.tv_sec * 1000 + m.timestamp.tv_usec / 1000;
+
+    // entries before the capture being recorded/saved can go; the capture itself can't
+    bool capturing = (state == RECORDER_POST || state == RECORDER_SAVING);
+    if (!capturing) {
+        while (entries > 0 && now - millisAt(tail) > preSeconds * 1000)
+            evict();
+    }
+    while (capacity - used < size && entries > 0 && !(capturing && tail == cursor))
+        evict();
+    if (capacity - used < size) {
+        framesDropped++;
+        if (state == RECORDER_POST) {
+            capturesTruncated++;
+            captureEnd = head;
+            state = RECORDER_SAVING;
+        }
+        recordLatency.record(Clock::micros() - start);
+        return nullptr;
+    }
+
+    byte header[RECORDER_HEADER];
+    uint16_t entrySize = size;
+    int32_t tv[2] = { (int32_t)m.timestamp.tv_sec, (int32_t)m.timestamp.tv_usec };
+    memcpy(header, &entrySize, 2);
+    header[2] = m.mode;
+    header[3] = textSize;
+    memcpy(header + 4, tv, sizeof(tv));
+    put(head, header, RECORDER_HEADER);
+    put((head + RECORDER_HEADER) % capacity, m.rawByteArray(), frameSize);
+    put((head + RECORDER_HEADER + frameSize) % capacity, m.information.data(), textSize);
+    head = (head + size) % capacity;
+    used += size;
+    entries++;
+    newest = now;
+    framesRecorded++;
+
+    const char* fired = nullptr;
+    if (state == RECORDER_ARMED) {
+        if (frameSize == 0 && (events & RECORDER_ERROR) && (m.information == "[BREAK]" || m.information == "[BUS ERROR]")) {
+            if (fire(m.information == "[BREAK]" ? "BREAK" : "BUS ERROR", m.timestamp))
+                fired = reason;
+        }
+        for (size_t i = 0; !fired && (events & RECORDER_MATCH) && i < patternCount; i++) {
+            if (patterns[i].matches(m.rawByteArray(), frameSize) && fire("MATCH", m.timestamp))
+                fired = reason;
+        }
+    }
+    recordLatency.record(Clock::micros() - start);
+    return fired;
+}
+
+// A condition seen outside the frames themselves (e.g. a power mode change)
+const char* FlightRecorder::event(recorderEvent type, const char* why) {
+    recursive_lock_guard lock(mutex);
+    if (!(events & type) || state == RECORDER_OFF)
+        return nullptr;
+    return fire(why, VPW::getTimestamp()) ? reason : nullptr;
+}
+
+// ATRECT
+bool FlightRecorder::trigger(const char* why) {
+    recursive_lock_guard lock(mutex);
+    return state != RECORDER_OFF && fire(why, VPW::getTimestamp());
+}
+
+bool FlightRecorder::fire(const char* why, const struct timeval& tv) {
+    if (state != RECORDER_ARMED) {
+        triggersIgnored++;
+        return false;
+    }
+    reason = why;
+    triggerTime = tv;
+    cursor = tail;
+    postUntil = Clock::millis() + postSeconds * 1000;
+    captureOpened = false;
+    sequence++;
+    state = RECORDER_POST;
+    return true;
+}
+
+#if defined(USE_SD)
+bool FlightRecorder::saveReady() {
+    return !sdlog.queue.available();
+}
+
+void FlightRecorder::save(const Message& m) {
+    if (!captureOpened) {
+        sdlog.increment(); // a file of its own
+        captureOpened = true;
+    }
+    sdlog.queue.push(m);
+}
+#elif defined(USE_FLASHLOG)
+bool FlightRecorder::saveReady() {
+    return flashlog.ready && !flashlog.backlogged();
+}
+
+void FlightRecorder::save(const Message& m) {
+    if (!captureOpened) {
+        flashlog.rotate();
+        captureOpened = true;
+    }
+    flashlog.log(m);
+}
+#else
+bool FlightRecorder::saveReady() {
+    return true;
+}
+
+void FlightRecorder::save(const Message& m) {
+}
+#endif
+
+// Called on the logging core every pass: ends the post-trigger window and saves the capture.
+// Returns true when a capture has just been saved.
+bool FlightRecorder::service() {
+    recursive_lock_guard lock(mutex);
+    if (state == RECORDER_POST && (int)(Clock::millis() - postUntil) >= 0) {
+        captureEnd = head;
+        state = RECORDER_SAVING;
+    }
+    if (state != RECORDER_SAVING || !saveReady())
+        return false;
+    if (!captureOpened)
+        save(Message(0, triggerTime, {}, "[CAPTURE " + std::to_string(sequence) + ": " + reason + "]"));
+    for (int i = 0; i < RECORDER_SAVE_BATCH && cursor != captureEnd; i++) {
+        byte header[RECORDER_HEADER];
+        get(cursor, header, RECORDER_HEADER);
+        uint16_t size;
+        int32_t tv[2];
+        memcpy(&size, header, 2);
+        memcpy(tv, header + 4, sizeof(tv));
+        size_t frameSize = size - RECORDER_HEADER - header[3];
+        std::vector<byte> frame(frameSize);
+        std::string text(header[3], '\0');
+        get((cursor + RECORDER_HEADER) % capacity, frame.data(), frameSize);
+        get((cursor + RECORDER_HEADER + frameSize) % capacity, text.data(), text.size());
+        save(Message(header[2], { tv[0], tv[1] }, frame, text));
+        cursor = (cursor + size) % capacity;
+    }
+    if (cursor != captureEnd)
+        return false;
+    save(Message(0, VPW::getTimestamp(), {}, "[CAPTURE END]"));
+    captures++;
+    state = RECORDER_ARMED;
+    return true;
+}
+
+std::string FlightRecorder::status() {
+    recursive_lock_guard lock(mutex);
+    static const char* names[] = { "OFF", "ARMED", "TRIGGERED", "SAVING" };
+    std::string ret = names[state];
+    if (state == RECORDER_OFF)
+        return ret;
+    ret += " " + std::to_string(entries) + " FRAMES";
+    if (entries > 0)
+        ret += " " + Util.dec((newest - millisAt(tail)) / 1000.0f, 0, 1) + "S";
+    ret += " " + std::to_string(used / 1024) + "/" + std::to_string(capacity / 1024) + "KB";
+    ret += " CAPTURES " + std::to_string(captures);
+    return ret;
+}
+
+std::string FlightRecorder::stats(const char* newline) {
+    recursive_lock_guard lock(mutex);
+    std::string ret;
+    ret += "RECORDED " + std::to_string(framesRecorded);
+    ret += " DROPPED " + std::to_string(framesDropped);
+    ret += " CAPTURES " + std::to_string(captures);
+    ret += " TRUNCATED " + std::to_string(capturesTruncated);
+    ret += " IGNORED " + std::to_string(triggersIgnored);
+    if (recordLatency.samples > 0) {
+        ret += newline;
+        ret += "RECORD ";
+        ret += recordLatency.tostring(newline);
+    }
+    return ret;
+}
+
+void FlightRecorder::clearStats() {
+    recursive_lock_guard lock(mutex);
+    recordLatency.clear();
+    framesRecorded = framesDropped = captures = triggersIgnored = capturesTruncated = 0;
+}
+
+FlightRecorder recorder;
@@ -0,0 +1,355 @@
+#pragma once
+#ifdef USE_SD
+
+#include "pico/lock_core.h"
+#include "clock.h"
+#include "histogram.h"
+#include "hexutil.h"
+#include "j1850.h"
+#include "sdlog.h"
+#include "vpb.h"
+#include "vpw.h"
+#include <string>
+
+//
+// LOG REPLAY
+//
+// Transmits the frames of a stored log (.log or .vpb) onto the bus at their original relative
+// timing, for reproducing a drive on the bench.  The log is read a sector at a time on its own
+// file handle (as SDLogReader does); loop() runs on core 1 and, once the next frame is due
+// within REPLAY_SPIN_US, waits for it and sends it through VPW::send in the mode (1X/4X) it
+// was recorded in.  Notifications in the log are skipped.
+//
+// Speed is a percentage (200 = twice as fast).  Frames can be limited to, or exclude, a set of
+// source addresses, e.g. to leave out the modules that are really on the bench.
+//
+// Timing error is the actual SOF (from VPW::lastSOF) minus the scheduled one.  A frame that
+// falls behind does not move the schedule, so lateness doesn't accumulate.
+//
+
+#ifndef REPLAY_SPIN_US
+#define REPLAY_SPIN_US 2000 // longest busy-wait for a frame; anything later is left to the next loop
+#endif
+
+#define REPLAY_ADDRESSES 8
+#define REPLAY_LATE_US   1000
+
+struct ReplayFilter {
+    uint speed = 100;                  // percent
+    byte only[REPLAY_ADDRESSES];       // source addresses to send (none = all)
+    size_t onlyCount = 0;
+    byte exclude[REPLAY_ADDRESSES];    // source addresses to leave out
+    size_t excludeCount = 0;
+
+    bool matches(byte source) const {
+        for (size_t i = 0; i < excludeCount; i++) {
+            if (exclude[i] == source)
+                return false;
+        }
+        if (onlyCount == 0)
+            return true;
+        for (size_t i = 0; i < onlyCount; i++) {
+            if (only[i] == source)
+                return true;
+        }
+        return false;
+    }
+};
+
+class LogReplay {
+private:
+    struct ChunkSource {
+        LogReplay& replay;
+        int operator()() {
+            if (replay.chunkPosition >= replay.chunkSize && !replay.readChunk())
+                return -1;
+            return replay.chunk[replay.chunkPosition++];
+        }
+    };
+
+    recursive_mutex_t mutex;
+    fs::File file;
+    std::string filename;
+    size_t fileIndex = 0;
+    bool binary = false;
+    uint32_t fileSize = 0;
+    uint32_t filePosition = 0;
+    uint8_t chunk[SDLOG_SECTOR_SIZE];
+    size_t chunkSize = 0;
+    size_t chunkPosition = 0;
+    std::string line;
+    ChunkSource source{*this};
+    std::unique_ptr<VpbReader<ChunkSource>> vpb;
+    ReplayFilter filter;
+    uint generation = 0;
+
+    // the next frame to send
+    bool havePending = false;
+    std::vector<byte> frame;
+    bool send4X = false;
+    int64_t frameTime = 0;  // us, from the log
+    int64_t firstTime = -1;
+    uint startMicros = 0;
+
+    uint32_t limit() {
+        recursive_lock_guard lock(SDLog::cardMutex);
+        uint32_t size = file.size();
+        if (fileIndex == (size_t)SDLog::index && SDLog::file)
+            size = min(size, SDLog::writePosition);
+        return size;
+    }
+
+    bool readChunk() {
+        recursive_lock_guard lock(SDLog::cardMutex);
+        uint32_t size = limit();
+        chunkPosition = 0;
+        chunkSize = 0;
+        if (filePosition >= size)
+            return false;
+        file.seek(filePosition);
+        int n = file.read(chunk, min((uint32_t)sizeof(chunk), size - filePosition));
+        if (n <= 0)
+            return false;
+        chunkSize = n;
+        filePosition += n;
+        return true;
+    }
+
+    // "<sec>.<usec>\t[1X] 48 6B 10 ...[\t<text>]"; false for lines without a frame
+    bool parseLine() {
+        const char* p = line.c_str();
+        char* end;
+        int64_t sec = strtoll(p, &end, 10);
+        if (end == p || *end != '.')
+            return false;
+        int64_t usec = strtoll(end + 1, &end, 10);
+        if (*end != '\t')
+            return false;
+        p = end + 1;
+        send4X = false;
+        if (p[0] == '[' && p[1] && p[2] == 'X' && p[3] == ']') {
+            send4X = (p[1] == '4');
+            p += 4;
+        } else if (strncmp(p, "[--]", 4) == 0) {
+            p += 4;
+        }
+        frame.clear();
+        while (*p == ' ')
+            p++;
+        while (isxdigit(p[0]) && isxdigit(p[1]) && (p[2] == ' ' || p[2] == '\t' || p[2] == '\r' || p[2] == '\n' || p[2] == 0)) {
+            frame.push_back(HexUtil.getByte(std::string_view(p, 2)));
+            p += 2;
+            while (*p == ' ')
+                p++;
+        }
+        frameTime = sec * 1000000 + usec;
+        return frame.size() > 0;
+    }
+
+    // reads ahead to the next frame that passes the filter
+    bool next() {
+        while (true) {
+            if (binary) {
+                VpbRecord r;
+                if (!vpb->next(r))
+                    return false;
+                if ((r.flags & VPB_SYNC) || r.frame.empty())
+                    continue;
+                frame = std::move(r.frame);
+                send4X = (r.mode() == 4);
+                frameTime = (int64_t)r.sec * 1000000 + r.usec;
+            } else {
+                line.clear();
+                int c;
+                while ((c = source()) >= 0 && c != '\n' && c != '\0')
+                    line += (char)c;
+                if (c < 0 && line.empty())
+                    return false;
+                if (c == '\0')
+                    return false; // zero-filled tail of a preallocated file
+                if (!parseLine())
+                    continue;
+            }
+            if (frame.size() >= 3 && !filter.matches(frame[2])) {
+                framesSkipped++;
+                continue;
+            }
+            return true;
+        }
+    }
+
+    void close() {
+        recursive_lock_guard lock(SDLog::cardMutex);
+        if (file)
+            file.close();
+        vpb.reset();
+    }
+
+public:
+    bool running = false;
+
+    // instrumentation
+    LatencyHistogram timingError;   // |actual - scheduled SOF|
+    int64_t errorTotal = 0;         // signed, for the average
+    int errorWorst = 0;
+    ulong framesSent = 0;
+    ulong framesSkipped = 0;        // filtered out
+    ulong framesFailed = 0;
+    ulong framesNoEcho = 0;
+    ulong framesLate = 0;           // SOF more than REPLAY_LATE_US after schedule
+    ulong congestionRetries = 0;
+
+    LogReplay() {
+        recursive_mutex_init(&mutex);
+    }
+
+    // returns false (with an error in response) if the file can't be opened
+    bool begin(size_t index, const ReplayFilter& filter, std::string& response) {
+        recursive_lock_guard lock(mutex);
+        stop();
+        {
+            recursive_lock_guard lock(SDLog::cardMutex);
+            filename = std::to_string(index) + SDLog::extension();
+            file = SD.open(filename.c_str(), FILE_READ);
+            if (!file || file.size() == 0) {
+                filename = std::to_string(index) + (SDLog::binary ? ".log" : ".vpb");
+                file = SD.open(filename.c_str(), FILE_READ);
+            }
+            if (!file) {
+                response = "!ERROR OPENING " + filename;
+                return false;
+            }
+            fileIndex = index;
+            fileSize = limit();
+        }
+        binary = filename.rfind(".vpb") != std::string::npos;
+        filePosition = 0;
+        chunkSize = chunkPosition = 0;
+        if (binary) {
+            VpbHeader header;
+            vpb.reset(new VpbReader<ChunkSource>(source));
+            if (!vpb->header(header)) {
+                close();
+                response = "!CORRUPT " + filename;
+                return false;
+            }
+        }
+        this->filter = filter;
+        firstTime = -1;
+        havePending = false;
+        running = true;
+        generation++;
+        clearStats();
+        return true;
+    }
+
+    void stop() {
+        recursive_lock_guard lock(mutex);
+        close();
+        running = false;
+        havePending = false;
+        generation++;
+    }
+
+    // Called on core 1 every loop.  Returns true while replaying.
+    bool loop() {
+        std::vector<byte> sending;
+        bool mode4X;
+        uint scheduled;
+        uint current;
+        {
+            recursive_lock_guard lock(mutex);
+            if (!running)
+                return false;
+            if (!havePending) {
+                if (!next()) {
+                    close();
+                    running = false;
+                    return false;
+                }
+                havePending = true;
+                if (firstTime < 0) {
+                    firstTime = frameTime;
+                    startMicros = Clock::micros() + REPLAY_SPIN_US;
+                }
+            }
+            scheduled = startMicros + (uint)((frameTime - firstTime) * 100 / filter.speed);
+            uint lead = send4X ? VPW_SOF_DELAY_US / 4 : VPW_SOF_DELAY_US;
+            if ((int)(scheduled - lead - Clock::micros()) > REPLAY_SPIN_US)
+                return true; // not due yet
+            sending = frame;
+            mode4X = send4X;
+            current = generation;
+            while ((int)(scheduled - lead - Clock::micros()) > 0);
+        }
+
+        // send outside the lock so ATRPQ on the other core is not held up by the bus
+        ulong retries = VPW::congestionRetries;
+        sendVPW_status_t status = VPW::send(J1850(sending), false, mode4X);
+
+        recursive_lock_guard lock(mutex);
+        if (current != generation)
+            return running; // stopped or restarted while sending
+        if (status == SEND_VPW_STATUS_STILL_SENDING)
+            return true; // another sender has the bus; try again
+        havePending = false;
+        congestionRetries += VPW::congestionRetries - retries;
+        if (status != SEND_VPW_STATUS_OK && status != SEND_VPW_STATUS_NO_ECHO) {
+            framesFailed++;
+            return true;
+        }
+        if (status == SEND_VPW_STATUS_NO_ECHO)
+            framesNoEcho++;
+        framesSent++;
+        int error = (int)(VPW::lastSOF - scheduled);
+        timingError.record(abs(error));
+        errorTotal += error;
+        if (abs(error) > abs(errorWorst))
+            errorWorst = error;
+        if (error > REPLAY_LATE_US)
+            framesLate++;
+        return true;
+    }
+
+    std::string status() {
+        recursive_lock_guard lock(mutex);
+        if (!running)
+            return "STOPPED";
+        std::string ret = "REPLAYING " + filename;
+        ret += " " + std::to_string(fileSize ? (uint)((uint64_t)filePosition * 100 / fileSize) : 100) + "%";
+        ret += " SENT " + std::to_string(framesSent);
+        return ret;
+    }
+
+    std::string stats(const char* newline) {
+        recursive_lock_guard lock(mutex);
+        std::string ret;
+        ret += "SENT " + std::to_string(framesSent);
+        ret += " SKIPPED " + std::to_string(framesSkipped);
+        ret += " FAILED " + std::to_string(framesFailed);
+        ret += " NO ECHO " + std::to_string(framesNoEcho);
+        ret += " CONGESTION " + std::to_string(congestionRetries);
+        ret += newline;
+        ret += "TIMING AVG " + std::to_string(framesSent ? (int)(errorTotal / (int64_t)framesSent) : 0) + "us";
+        ret += " WORST " + std::to_string(errorWorst) + "us";
+        ret += " LATE " + std::to_string(framesLate);
+        if (timingError.samples > 0) {
+            ret += newline;
+            ret += "ERROR ";
+            ret += timingError.tostring(newline);
+        }
+        return ret;
+    }
+
+    void clearStats() {
+        recursive_lock_guard lock(mutex);
+        timingError.clear();
+        errorTotal = 0;
+        errorWorst = 0;
+        framesSent = framesSkipped = framesFailed = framesNoEcho = framesLate = congestionRetries = 0;
+    }
+};
+
+LogReplay replay;
+
+#endif
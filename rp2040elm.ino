@@ -2,6 +2,8 @@
 
 #if ARDUINO_ADAFRUIT_FEATHER_RP2040
 #define USE_SD
+#else
+#define USE_FLASHLOG // no SD card: log to the internal flash instead
 #endif
 
 #include "cli.h"
@@ -9,9 +11,14 @@
 #include "vpw.h"
 #include "rtc.h"
 #include "sdlog.h"
+#include "replay.h"
+#include "flashlog.h"
+#include "recorder.h"
+#include "loadgen.h"
 #include "util.h"
 #include "stringutil.h"
 #include "automation.h"
+#include "emulation.h"
 
 // CONFIGURATION:
 // Board: "Waveshare RP2040 Zero" or "Adafruit Feather RP2040"
@@ -36,26 +43,28 @@ volatile bool setupComplete = false;
 
 void setup() {
     Terminals.add(cliHost, cliBT, cliUSB);
+    // class2 (core 1): the log, the flight recorder, power mode, emulation and automation see every frame
+    VPWMessageQueue.interest.everything++;
 
     setPixel(4, 4, 4);
 
     Serial1.setTX(PIN_UART0_TX);
     Serial1.setRX(PIN_UART0_RX);
-    Serial1.begin(115200);
+    cliHost.beginPort("host", defaultBaudRate);
 
     Serial2.setTX(PIN_UART1_TX);
     Serial2.setRX(PIN_UART1_RX);
-    Serial2.begin(115200);
+    cliBT.beginPort("bt", defaultBaudRate);
 
-    Serial.begin(115200 * 4);
+    cliUSB.beginPort("usb", defaultBaudRate * 4);
 
     for (int i = 0; i < 40; i++) {
         if (Serial)
             break;
         setPixel(0, 0, 0);
-        delay(50);
+        Clock::delay(50);
         setPixel(4, 4, 4);
-        delay(50);
+        Clock::delay(50);
     }
     setPixel(0, 0, 0);
     
@@ -79,12 +88,23 @@ void setup() {
     }
     
     #ifdef USE_SD
+        sdlog.settings = []() { return cliHost.getElm().serialize(','); };
         bool sdOK = sdlog.begin(&Serial2);
         if (!sdOK) {
             Terminals.notify("[SD FAIL]");
         }
     #endif
+    #ifdef USE_FLASHLOG
+        if (!flashlog.begin())
+            Terminals.notify("[FLASHLOG FAIL]");
+    #endif
+    recorder.begin();
+    loadgen.terminalStats = [](const char* newline) { return Terminals.stats(newline); };
+    loadgen.clearTerminalStats = []() { Terminals.clearStats(); };
     
+    if (Emulation.load(0) && Emulation.enabled)
+        Terminals.notify(std::string("[EMULATING ") + std::to_string(Emulation.size()) + " MODULES]");
+
     bool vpwOK = vpw.begin();
     if (vpwOK)
         vpw.setReceiveLedHandler(ledHandler);
@@ -105,16 +125,24 @@ void loop() {
     
     fadePixels(true);
 
+    loadgen.loop();
+
+    uint t = Clock::micros();
     vpw.receiveLoop();
+    t = loadgen.time(LOAD_DECODE, t);
     VPWMessageQueue.process();
+    t = loadgen.time(LOAD_ASSEMBLE, t);
 
     while (VPWMessageQueue.available()) {
         const std::shared_ptr<Message> ptr = VPWMessageQueue.pull();
         Terminals.push(ptr);
         class2.push(*ptr); // dereference to make copy for thread safety
+        loadgen.deliver();
     }
+    t = loadgen.time(LOAD_FANOUT, t);
 
     Terminals.loop();
+    loadgen.time(LOAD_OUTPUT, t);
 }
 
 void setup1() {
@@ -133,12 +161,15 @@ void loop1() {
     
     static uint  lastMessageTime = 0;
     static ulong messageCount = 0;
-    static uint  logRotateGraceTime = 0;
+    [[maybe_unused]] static uint logRotateGraceTime = 0; // only the SD log rotates on it
 
     if (!setupComplete)
         return;
 
-    now = millis();
+    now = Clock::millis();
+
+    loadgen.sample(LOAD_QUEUE_CLASS2, class2.depth());
+    uint t = Clock::micros();
 
     if (class2.available()) {
         MessagePtr m = class2.pull();
@@ -147,11 +178,20 @@ void loop1() {
         if (messageCount++ == 0)
             messageCount++;
         
+        // with the flight recorder on, frames are only logged as part of a capture
+        bool logging = (recorder.state == RECORDER_OFF);
         #ifdef USE_SD
-            sdlog.queue.push(m);
+            if (logging)
+                sdlog.queue.push(m);
             if (logRotateGraceTime > 0)
                 logRotateGraceTime = now;
         #endif
+        #ifdef USE_FLASHLOG
+            if (logging)
+                flashlog.log(*m);
+        #endif
+        if (const char* fired = recorder.record(*m))
+            Terminals.notify(std::string("[TRIGGERED: ") + fired + "]");
 
         if (m->isValid()) {            
 
@@ -170,10 +210,14 @@ void loop1() {
                     case 0x06: {
                         if (data.size() == 3) { // sanity check
                             if (powerMode != data[0] || keyPosition != data[1]) {
+                                bool known = (powerMode != 0x00 || keyPosition != 0x00);
                                 powerMode = data[0];
                                 keyPosition = data[1];
                                 lastPowerMode = now;
                                 Terminals.notify(std::string("[POWER MODE: ") + HexUtil.hex(powerMode) + " " + HexUtil.hex(keyPosition) + "]");
+                                const char* fired = known ? recorder.event(RECORDER_POWER, "POWER MODE") : nullptr;
+                                if (fired)
+                                    Terminals.notify(std::string("[TRIGGERED: ") + fired + "]");
                                 if (powerMode >= 0x01 && powerMode <= 0x03 && keyPosition == 0x00) {
                                     Terminals.notify("[POWER OFF]");
                                     logRotateGraceTime = now;
@@ -228,6 +272,7 @@ void loop1() {
                             break;
                         case 0x02:
                             res += HexUtil.hex(Automation.vin.at(0x05)) + HexUtil.hex(Automation.vin.at(0x06)) + HexUtil.hex(Automation.vin.at(0x07)) + HexUtil.hex(Automation.vin.at(0x08)) + HexUtil.hex(Automation.vin.at(0x09)) + HexUtil.hex(Automation.vin.at(0x0A));
+                            break;
                         case 0x03:
                             res += HexUtil.hex(Automation.vin.at(0x0B)) + HexUtil.hex(Automation.vin.at(0x0C)) + HexUtil.hex(Automation.vin.at(0x0D)) + HexUtil.hex(Automation.vin.at(0x0E)) + HexUtil.hex(Automation.vin.at(0x0F)) + HexUtil.hex(Automation.vin.at(0x10));
                             break;
@@ -240,6 +285,9 @@ void loop1() {
                 }
             }
 
+            // Emulated modules
+            Emulation.receive(*m);
+
             // Automated Responses
             if (Automation.programmaticResponsesEnabled) {
                 std::string sansCrc = static_cast<J1850>(*m).tostring(true, false, false);
@@ -254,13 +302,15 @@ void loop1() {
                 }
                 for (const std::string& entry : responses) {
                     J1850 reply(entry, true);
-                    sendVPW_status_t status = vpw.send(reply, false);
+                    vpw.send(reply, false);
                 }
             }
             
         }
     }
 
+    t = loadgen.time(LOAD_CLASS2, t);
+
     if (messageCount > 0 && now - lastMessageTime > (10 * 1000)) {
         digitalWriteFast(PIN_ACCESSORY, false);
         messageCount = 0;
@@ -286,22 +336,24 @@ void loop1() {
                 if (sdlog.file) {
                     MessagePtr m = sdlog.queue.pull();
                     sdlog.messageCount++;
-                    std::string s = m->tostring(cliHost.getElm().timestampOffset, true, true, true, true, 10, true);
-                    s.append("\r\n");
-                    if (!sdlog.write(s)) {
+                    if (!sdlog.log(*m, cliHost.getElm().timestampOffset)) {
                         // TO-DO: if write fails, retry next loop
                     }
                     lastLog = now;
                 }
             } else {
-                if (sdlog.dirty && now - lastLog >= 1000) {
+                if (sdlog.dirty() && now - lastLog >= 1000) {
                     sdlog.flush();
                 }
             }
+            // Write out at most one full sector per pass so automation isn't held up by the card,
+            // and only grow a preallocated file when there is nothing else to write
+            if (!sdlog.service())
+                sdlog.extend();
             // Auto-close log after 10 seconds of inactivity
             if (lastLog > 0 && now - lastLog >= 10000) {
                 sdlog.flush();
-                sdlog.write("[INACTIVE]\r\n\r\n");
+                sdlog.note("[INACTIVE]\r\n");
                 sdlog.flush();
                 //sdlog.close();
                 lastLog = 0;
@@ -314,6 +366,15 @@ void loop1() {
         }
     #endif
 
+    #ifdef USE_FLASHLOG
+        // programs at most one page (or erases one sector while the bus is quiet) per pass
+        flashlog.service(now - lastMessageTime);
+    #endif
+    loadgen.time(LOAD_LOG, t);
+
+    if (recorder.service())
+        Terminals.notify("[CAPTURE SAVED]");
+
     // AUTOMATION
 
     static uint lastTesterPresent = 0;
@@ -338,6 +399,12 @@ void loop1() {
         }
     }
 
+    Emulation.loop(now);
+
+    #ifdef USE_SD
+        replay.loop();
+    #endif
+
     if (Automation.sendPowerMode) {
         if (now - lastPowerMode >= 2000) {
             J1850 mPowerMode(std::string("28FF4006") + HexUtil.hex(Automation.powerMode) + HexUtil.hex(Automation.keyPosition) + std::string("0B"), true);
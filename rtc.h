@@ -1,6 +1,7 @@
 #pragma once
 
 #include "RTClib.h"
+#include "clock.h"
 RTC_PCF8523 rtc;
 
 bool setTimeFromRTC() {
@@ -9,6 +10,5 @@ bool setTimeFromRTC() {
         return false;
     uint unix = dt.unixtime();
     struct timeval tv = { .tv_sec = unix, .tv_usec = 0 };
-    settimeofday(&tv, NULL);
-    return true;
+    return Clock::set(tv);
 }
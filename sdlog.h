@@ -4,14 +4,37 @@
 #include "pins.h"
 #include "pixel.h"
 #include "blinkenlights.h"
+#include "clock.h"
 #include "message.h"
 #include "rtc.h"
+#include "histogram.h"
+#include "settings.h"
+#include "vpb.h"
+#include "logblock.h"
 #include <SPI.h>
 #include <SD.h>
 #include <string>
 
 #define APPEND    (O_CREAT | O_WRITE | O_APPEND)
 #define OVERWRITE (O_CREAT | O_WRITE | O_TRUNC)
+#define PREALLOCATED_APPEND    (O_CREAT | O_RDWR)
+#define PREALLOCATED_OVERWRITE (O_CREAT | O_RDWR | O_TRUNC)
+
+#ifndef SDLOG_SECTOR_SIZE
+#define SDLOG_SECTOR_SIZE 512
+#endif
+
+#ifndef SDLOG_SECTORS
+#define SDLOG_SECTORS 16 // 8KB of buffering for SD card write stalls
+#endif
+
+#ifndef SDLOG_PREALLOCATE_SIZE
+#define SDLOG_PREALLOCATE_SIZE (16 * 1024 * 1024)
+#endif
+
+#ifndef SDLOG_PREALLOCATE_CHUNK
+#define SDLOG_PREALLOCATE_CHUNK 4096
+#endif
 
 extern uint fadeSave;
 extern short ledSave;
@@ -22,13 +45,48 @@ void fatDateTime(uint16_t* date, uint16_t* time) {
  *time = FAT_TIME(now.hour(), now.minute(), now.second());
 }
 
+//
+// Log data is copied into a ring of sector-sized buffers.  Writers only hold the (short)
+// buffer lock; full sectors are written to the card one at a time by service() on the
+// logging core, so a slow card only fills the ring instead of stalling the callers.  When
+// the ring is full, incoming data is dropped and counted rather than waited for.
+//
+struct SDSector {
+  alignas(4) char data[SDLOG_SECTOR_SIZE];
+  uint16_t length = 0;
+  uint16_t limit = SDLOG_SECTOR_SIZE;
+};
+
 class SDLog {
+  friend class SDLogReader;
+  friend class LogReplay;
 private:
   static inline bool mutexInitialized = false;
-  static inline recursive_mutex_t mutex;
-  static inline std::deque<char> buffer;
-  static inline int initialCHUNK_SIZE = 0;
+  static inline recursive_mutex_t mutex;        // the logger's file and state
+  static inline recursive_mutex_t bufferMutex;  // sector ring
+  static inline recursive_mutex_t cardMutex;    // each call into SD/SPI, so readers on core 0 wait for one at most
+  static inline SDSector sectors[SDLOG_SECTORS];
+  static inline uint head = 0;                  // sector being filled
+  static inline uint tail = 0;                  // oldest sector not yet written to the card
+  static inline uint32_t headPosition = 0;      // file offset of the start of the head sector
+  static inline uint32_t writePosition = 0;     // logical end of the file on the card
+  static inline uint32_t allocated = 0;         // physical (zero-filled) size of a preallocated file
   static inline HardwareSerial* debug = nullptr;
+
+  // binary (.vpb) format state
+  static inline VpbEncoder encoder;
+  static inline std::vector<uint8_t> record;
+  static inline std::vector<VpbIndexEntry> vpbIndex;
+  static inline uint vpbIndexInterval = VPB_INDEX_INTERVAL;
+  static inline bool vpbSync = true;
+
+  static void resetBuffer(uint32_t position);
+  static bool writeSector(SDSector& sector);
+  static bool writeRecord(const struct timeval& tv, byte mode, const std::vector<byte>& frame, const std::string& text);
+  static void writeIndex();
+  static uint32_t recoverLength();
+  static uint32_t recoverVpbLength(uint32_t limit);
+  static bool recoverLast();
   
 public:
 
@@ -41,6 +99,9 @@ public:
   static inline int index = -1;
   static inline fs::File file = fs::File();
   static inline bool empty = true;
+  static inline bool binary = false;                   // write .vpb instead of .log (see vpb.h)
+  static inline std::string (*settings)() = nullptr;   // snapshot stored in .vpb headers
+  static inline bool preallocate = false;              // zero-fill files ahead of the data (see extend())
   
   static bool begin(HardwareSerial* port);
   static void increment();
@@ -49,19 +110,47 @@ public:
   static void close();
   static bool write(const char* data, bool flush = false);
   static bool write(const std::string& data, bool flush = false);
-  static void print(size_t index, Stream& stream, const char* newline);
+  static bool write(const char* data, size_t size, bool flush);
+  static bool log(const Message& m, struct timeval timestampOffset);
+  static bool note(const std::string& text);
+  static void setBinary(bool binary);
+  static const char* extension() { return binary ? ".vpb" : ".log"; }
+  static uint32_t position();
+  static bool service();
+  static bool extend();
+  static void setPreallocate(bool preallocate);
+  static uint32_t fileSize();
   static ulong bytesFree();
   
   static std::string info();
+  static std::string stats(const char* newline);
+  static void clearStats();
   static const char* cardType();
 
+  // instrumentation (write latency is kept separately with and without preallocation)
+  static inline LatencyHistogram writeLatency[2];
+  static inline LatencyHistogram extendLatency;
+  static inline LatencyHistogram encodeLatency;  // per .vpb record
+  static inline ulong bytesText = 0;             // what the .vpb records would have taken as text
+  static inline ulong bytesWritten = 0;
+  static inline ulong bytesDropped = 0;
+  static inline ulong bytesLogged = 0;
+  static inline ulong recordsLogged = 0;
+  static inline uint sectorsHighWater = 0;
+
   static bool dirty() {
-    return buffer.size() > 0;
+    recursive_lock_guard lock(bufferMutex);
+    return head != tail || sectors[head].length > 0;
+  }
+
+  static uint sectorsPending() {
+    recursive_lock_guard lock(bufferMutex);
+    return (head + SDLOG_SECTORS - tail) % SDLOG_SECTORS;
   }
 
   static void clearBuffer() {
     recursive_lock_guard lock(mutex);
-    buffer.clear();
+    resetBuffer(file ? fileSize() : 0);
   }
   
   SDLog& operator << (const std::string& text) {
@@ -72,6 +161,8 @@ public:
   SDLog() {
     if (!mutexInitialized) {
       recursive_mutex_init(&mutex);
+      recursive_mutex_init(&bufferMutex);
+      recursive_mutex_init(&cardMutex);
       mutexInitialized = true;
     }
   }
@@ -84,12 +175,15 @@ public:
 
 bool SDLog::begin(HardwareSerial* port) {
   recursive_lock_guard lock(mutex);
+  recursive_lock_guard cardLock(cardMutex);
   ready = false;
   index = -1;
   empty = true;
-  buffer.clear();
+  resetBuffer(0);
   
   debug = port;
+  SettingsRepository.read("sdlog-vpb", binary);
+  SettingsRepository.read("sdlog-prealloc", preallocate);
   
   SPI.setRX(PIN_SD_MISO);
   SPI.setTX(PIN_SD_MOSI);
@@ -115,7 +209,7 @@ bool SDLog::begin(HardwareSerial* port) {
     }
     const char* filename = entry.name();
     const char* ext = strrchr(filename, '.');
-    if (ext && strcmp(ext, ".log") == 0) {
+    if (ext && (strcmp(ext, ".log") == 0 || strcmp(ext, ".vpb") == 0)) {
         int number = 0;
         const char* ptr = filename;
         while (ptr < ext) {
@@ -131,12 +225,12 @@ bool SDLog::begin(HardwareSerial* port) {
     }
     entry.close();
   }
-  index++;
-  
-  open(true);
-  if (file && file.size() > 0)
-    increment();
-  close();
+  // a new file for this session, unless the last one never got any data; it's created when
+  // the first record is written
+  if (!recoverLast())
+    index = max(index, 0);
+  else
+    index++;
   if (debug) debug->println((std::string(" OK (LOG #") + std::to_string(index) + ")").c_str());
   
   ready = true;
@@ -144,7 +238,7 @@ bool SDLog::begin(HardwareSerial* port) {
 }
 
 const char* SDLog::cardType() {
-  recursive_lock_guard lock(mutex);
+  recursive_lock_guard lock(cardMutex);
   if (!ready)
     return "N/A";
   switch (SD.type()) 
@@ -160,37 +254,8 @@ const char* SDLog::cardType() {
   }    
 }
 
-void SDLog::print(size_t index, Stream& stream, const char* newline) {
-  recursive_lock_guard lock(mutex);
-  close();
-  std::string filename = std::to_string(index) + ".log";
-  fs::File fileIndex = SD.open(filename.c_str(), FILE_READ);
-  if (fileIndex) {
-    stream.print("--BEGIN ");
-    stream.print(filename.c_str());
-    stream.print("--");
-    stream.print(newline);
-    while (fileIndex.available()) 
-    {
-      String line = fileIndex.readStringUntil('\n');
-      stream.print(line);
-      stream.print(newline);
-    }
-    fileIndex.close();
-    stream.print("--END ");
-    stream.print(filename.c_str());
-    stream.print("--");
-    stream.print(newline);
-  } else {
-    stream.print("!ERROR OPENING ");
-    stream.print(filename.c_str());
-    stream.print(newline);
-  }
-  open(true);
-}
-
 std::string SDLog::cardInfo() {
-    recursive_lock_guard lock(mutex);
+    recursive_lock_guard lock(cardMutex);
     if (!ready)
         return "N/A";
     std::string ret;
@@ -212,8 +277,38 @@ std::string SDLog::cardInfo() {
     return ret;
 }
 
+// The last file (at index) as a power loss left it: a preallocated one is cut back to its
+// data, and one with no data is deleted so its number is used again; true if it has data.
+bool SDLog::recoverLast() {
+  if (index < 0)
+    return false;
+  bool wasBinary = binary;
+  bool data = false;
+  for (const char* ext : { ".log", ".vpb" }) {
+    std::string filename = std::to_string(index) + ext;
+    if (!SD.exists(filename.c_str()))
+      continue;
+    file = SD.open(filename.c_str(), PREALLOCATED_APPEND);
+    if (!file)
+      continue;
+    binary = (strcmp(ext, ".vpb") == 0);
+    uint32_t length = recoverLength();
+    if (length > 0 && length < file.size())
+      file.truncate(length);
+    file.close();
+    file = fs::File();
+    if (length == 0)
+      SD.remove(filename.c_str());
+    data = data || length > 0;
+  }
+  binary = wasBinary;
+  return data;
+}
+
 void SDLog::increment() {
   recursive_lock_guard lock(mutex);
+  if (binary && file)
+    writeIndex();
   close();
 
   index++;
@@ -223,81 +318,895 @@ void SDLog::increment() {
 void SDLog::open(bool reopen) {
   recursive_lock_guard lock(mutex);
 
-  if (!reopen && file && (!empty || file.size() > 0))
+  if (!reopen && file && (!empty || fileSize() > 0))
     increment();
 
   setTimeFromRTC();
 
-  std::string filename = std::to_string(index) + ".log";
-  file = SD.open(filename.c_str(), (reopen ? APPEND : OVERWRITE));
+  // rare (rotation): the card for the whole of it
+  recursive_lock_guard cardLock(cardMutex);
+  std::string filename = std::to_string(index) + extension();
+  if (preallocate)
+    file = SD.open(filename.c_str(), (reopen ? PREALLOCATED_APPEND : PREALLOCATED_OVERWRITE));
+  else
+    file = SD.open(filename.c_str(), (reopen ? APPEND : OVERWRITE));
   if (!file) {
     ready = false;
     if (debug) debug->println("[OPEN FAIL]");
     return;    
   }
   empty = true;
+  allocated = file.size();
+  // a preallocated file that wasn't closed (power loss) still has its zero-filled tail
+  writePosition = preallocate ? recoverLength() : allocated;
+
+  // keep sector writes aligned to the card's sectors
+  {
+    recursive_lock_guard bufferLock(bufferMutex);
+    if (head == tail && sectors[head].length == 0)
+      resetBuffer(writePosition);
+  }
+
+  if (binary) {
+    vpbSync = true;
+    if (writePosition == 0) {
+      vpbIndex.clear();
+      vpbIndexInterval = VPB_INDEX_INTERVAL;
+      struct timeval tv = VPW::getTimestamp();
+      record.clear();
+      encoder.compress = true;
+      VpbEncoder::header(record, tv.tv_sec, tv.tv_usec, std::string(BOARD_NAME " " __DATE__ " " __TIME__), settings ? settings() : std::string(), encoder.compress);
+      write((const char*)record.data(), record.size(), false);
+    } else {
+      // keep appending in the format the file was started in
+      char magic[4] = {};
+      fs::File existing = SD.open(filename.c_str(), FILE_READ);
+      if (existing)
+        existing.read((uint8_t*)magic, sizeof(magic));
+      encoder.compress = memcmp(magic, VPB_MAGIC_DELTA, 4) == 0;
+    }
+  }
 }
 
 void SDLog::flush() {
   recursive_lock_guard lock(mutex);
   write("", true);
-  file.flush();
 }
 
 void SDLog::close() {
   recursive_lock_guard lock(mutex);
   if (file) {
     flush();
+    recursive_lock_guard cardLock(cardMutex);
+    if (allocated > writePosition)
+      file.truncate(writePosition);
+    allocated = 0;
     file.close();
     file = fs::File();
   }
 }
 
 bool SDLog::write(const char* data, bool flush) {
-  return write(std::string(data), flush);
+  return write(data, strlen(data), flush);
 }
 
 bool SDLog::write(const std::string& data, bool flush) {
-  recursive_lock_guard lock(mutex);
-  
+  return write(data.data(), data.size(), flush);
+}
+
+bool SDLog::write(const char* data, size_t size, bool flush) {
   if (!file) {
+    recursive_lock_guard lock(mutex);
     //if (debug) debug->println("[OPEN]");
     open();
     if (!file)
       return false;
   }
 
-  if (data.size() > 0)
+  size_t remaining = size;
+  if (remaining > 0) {
+    recursive_lock_guard lock(bufferMutex);
+    // all or nothing, so a full ring never leaves a partial line or record in the file
+    uint pending = (head + SDLOG_SECTORS - tail) % SDLOG_SECTORS;
+    size_t available = (sectors[head].limit - sectors[head].length) + (SDLOG_SECTORS - 1 - pending) * SDLOG_SECTOR_SIZE;
+    if (available < size) {
+      bytesDropped += size;
+      return false;
+    }
     empty = false;
+    const char* p = data;
+    while (remaining > 0) {
+      SDSector* sector = &sectors[head];
+      if (sector->length == sector->limit) {
+        uint next = (head + 1) % SDLOG_SECTORS;
+        if (next == tail)
+          break; // ring full; the card has fallen behind
+        headPosition += sector->length;
+        head = next;
+        sector = &sectors[head];
+        sector->length = 0;
+        sector->limit = SDLOG_SECTOR_SIZE - (headPosition % SDLOG_SECTOR_SIZE);
+        sectorsHighWater = max(sectorsHighWater, (head + SDLOG_SECTORS - tail) % SDLOG_SECTORS);
+      }
+      size_t n = min(remaining, (size_t)(sector->limit - sector->length));
+      memcpy(sector->data + sector->length, p, n);
+      sector->length += n;
+      p += n;
+      remaining -= n;
+    }
+  }
+
+  if (flush) {
+    recursive_lock_guard lock(mutex);
+    while (service());
+    {
+      // write out the partially filled sector, then start a new one at the new file position
+      recursive_lock_guard bufferLock(bufferMutex);
+      if (head == tail && sectors[head].length > 0) {
+        if (!writeSector(sectors[head]))
+          return false;
+        resetBuffer(headPosition + sectors[head].length);
+      }
+    }
+    recursive_lock_guard cardLock(cardMutex);
+    uint start = Clock::micros();
+    file.flush();
+    writeLatency[preallocate].record(Clock::micros() - start);
+  }
 
-  for (char c : data)
-    buffer.push_back(c);
+  return remaining == 0;
+}
 
-  size_t bufferSize = buffer.size();
-  size_t chunkSize = 4096;
-  
-  if (flush == true)
-    chunkSize = bufferSize;
-  
-  if (chunkSize > 0 && (bufferSize >= chunkSize || flush == true)) {
-    ledSave = MAX_INTENSITY;
-    fadeSave = millis();
-    char toWrite[chunkSize];
-    std::copy(buffer.begin(), buffer.begin() + chunkSize, toWrite);
-    buffer.erase(buffer.begin(), buffer.begin() + chunkSize);
-    size_t written = file.write(toWrite, chunkSize);
-    if (flush)
-        file.flush();
-    if (written != chunkSize) {
-        ready = false;
-        if (debug) debug->println("[SD WRITE FAIL]");
-        return false;
+// Writes the oldest full sector to the card; returns false when there is nothing (more) to write
+bool SDLog::service() {
+  recursive_lock_guard lock(mutex);
+  SDSector* sector;
+  {
+    recursive_lock_guard bufferLock(bufferMutex);
+    if (head == tail)
+      return false;
+    sector = &sectors[tail];
+  }
+  if (!file)
+    return false;
+  if (!writeSector(*sector))
+    return false;
+  recursive_lock_guard bufferLock(bufferMutex);
+  tail = (tail + 1) % SDLOG_SECTORS;
+  return true;
+}
+
+// When preallocation is on and there is nothing waiting to be written, grows the file by one
+// zero-filled chunk, so cluster allocation and FAT updates happen while the logger is idle
+// rather than in the middle of a burst of log writes.  Only an open file: the next one isn't
+// created until something is logged to it.
+bool SDLog::extend() {
+  recursive_lock_guard lock(mutex);
+  if (!preallocate || !ready || !file)
+    return false;
+  if (allocated >= SDLOG_PREALLOCATE_SIZE || sectorsPending() > 0)
+    return false;
+
+  static const uint8_t zeroes[512] = {};
+  uint start = Clock::micros();
+  size_t written = 0;
+  for (size_t i = 0; i < SDLOG_PREALLOCATE_CHUNK / sizeof(zeroes); i++) {
+    // a sector at a time, so readers aren't held up for the whole chunk
+    recursive_lock_guard cardLock(cardMutex);
+    file.seek(allocated + written);
+    written += file.write(zeroes, sizeof(zeroes));
+  }
+  extendLatency.record(Clock::micros() - start);
+  allocated += written;
+  return written == SDLOG_PREALLOCATE_CHUNK;
+}
+
+uint32_t SDLog::fileSize() {
+  if (preallocate)
+    return writePosition;
+  recursive_lock_guard lock(cardMutex);
+  return file.size();
+}
+
+// Logical length of a preallocated file.  Data is never zero for a whole sector (text has no
+// NULs, a .vpb record is at most 256 bytes and starts with a non-zero length byte), so binary
+// search for the first all-zero sector: the data ends before it.  Text then ends at the last
+// non-zero byte; .vpb records can end in zero bytes, so they're walked (see recoverVpbLength).
+uint32_t SDLog::recoverLength() {
+  recursive_lock_guard lock(cardMutex);
+  uint32_t size = file.size();
+  if (size == 0)
+    return 0;
+  uint8_t buffer[SDLOG_SECTOR_SIZE];
+  auto zeroSector = [&](uint32_t sector, size_t& length) {
+    file.seek(sector * SDLOG_SECTOR_SIZE);
+    length = file.read(buffer, min((uint32_t)SDLOG_SECTOR_SIZE, size - sector * SDLOG_SECTOR_SIZE));
+    while (length > 0 && buffer[length - 1] == 0)
+      length--;
+    return length == 0;
+  };
+  size_t length;
+  uint32_t sectorCount = (size + SDLOG_SECTOR_SIZE - 1) / SDLOG_SECTOR_SIZE;
+  if (!zeroSector(sectorCount - 1, length)) {
+    // closed properly
+    return binary ? recoverVpbLength(size) : (sectorCount - 1) * SDLOG_SECTOR_SIZE + length;
+  }
+  uint32_t lo = 0, hi = sectorCount - 1;  // first all-zero sector is in [lo, hi]
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (zeroSector(mid, length))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo == 0)
+    return 0;
+  if (binary)
+    return recoverVpbLength(lo * SDLOG_SECTOR_SIZE);
+  zeroSector(lo - 1, length);
+  return (lo - 1) * SDLOG_SECTOR_SIZE + length;
+}
+
+// The end of the .vpb data before limit: after the index trailer if the file has one, otherwise
+// after the last record that fits (one cut short by power loss is dropped)
+uint32_t SDLog::recoverVpbLength(uint32_t limit) {
+  uint8_t buffer[SDLOG_SECTOR_SIZE];
+  uint32_t cached = UINT32_MAX;
+  auto at = [&](uint32_t offset) -> int {
+    if (offset >= limit)
+      return -1;
+    uint32_t sector = offset / SDLOG_SECTOR_SIZE;
+    if (sector != cached) {
+      file.seek(sector * SDLOG_SECTOR_SIZE);
+      if (file.read(buffer, min((uint32_t)SDLOG_SECTOR_SIZE, limit - sector * SDLOG_SECTOR_SIZE)) == 0)
+        return -1;
+      cached = sector;
     }
+    return buffer[offset % SDLOG_SECTOR_SIZE];
+  };
+
+  if (limit >= 8) {
+    char trailer[4];
+    for (int i = 0; i < 4; i++)
+      trailer[i] = (char)at(limit - 4 + i);
+    if (memcmp(trailer, VPB_TRAILER_MAGIC, 4) == 0)
+      return limit;
+  }
+
+  // the header: magic, seconds, microseconds, firmware (length byte), settings (16-bit length)
+  if (at(0) != 'V')
+    return 0;
+  int fw = at(12);
+  int st0 = fw < 0 ? -1 : at(13 + fw);
+  int st1 = fw < 0 ? -1 : at(14 + fw);
+  if (st0 < 0 || st1 < 0)
+    return 0;
+  uint32_t position = 15 + fw + (st0 | (st1 << 8));
+  if (position > limit)
+    return 0;
+  while (true) {
+    int length = at(position);
+    if (length <= 0 || position + 1 + length > limit)
+      return position;
+    position += 1 + length;
+  }
+}
+
+void SDLog::setPreallocate(bool value) {
+  recursive_lock_guard lock(mutex);
+  if (value == preallocate)
+    return;
+  SettingsRepository.write("sdlog-prealloc", value ? "1" : "0");
+  bool reopen = (bool)file;
+  close();
+  preallocate = value;
+  if (reopen)
+    open(true);
+}
+
+bool SDLog::writeSector(SDSector& sector) {
+  ledSave = MAX_INTENSITY;
+  fadeSave = Clock::millis();
+  uint start = Clock::micros();
+  size_t written;
+  {
+    recursive_lock_guard lock(cardMutex);
+    if (preallocate)
+      file.seek(writePosition);
+    written = file.write((const uint8_t*)sector.data, sector.length);
+  }
+  writeLatency[preallocate].record(Clock::micros() - start);
+  bytesWritten += written;
+  writePosition += written;
+  allocated = max(allocated, writePosition);
+  if (written != sector.length) {
+    ready = false;
+    if (debug) debug->println("[SD WRITE FAIL]");
+    return false;
   }
-  
   return true;
 }
 
+void SDLog::resetBuffer(uint32_t position) {
+  recursive_lock_guard lock(bufferMutex);
+  head = tail = 0;
+  headPosition = position;
+  sectors[head].length = 0;
+  sectors[head].limit = SDLOG_SECTOR_SIZE - (position % SDLOG_SECTOR_SIZE);
+}
+
+uint32_t SDLog::position() {
+  recursive_lock_guard lock(bufferMutex);
+  return headPosition + sectors[head].length;
+}
+
+// Logs one bus message (or notification) in the current format
+bool SDLog::log(const Message& m, struct timeval timestampOffset) {
+  bool ok;
+  if (binary) {
+    ok = writeRecord(m.timestamp, m.mode, m.rawBytes(), m.information);
+  } else {
+    std::string s = m.tostring(timestampOffset, true, true, true, true, 10, true);
+    s.append("\r\n");
+    ok = write(s);
+    if (ok)
+      bytesLogged += s.size();
+  }
+  if (ok)
+    recordsLogged++;
+  return ok;
+}
+
+// Logs a line of text that isn't from the bus, e.g. [INACTIVE] or ATLOG# comments
+bool SDLog::note(const std::string& text) {
+  if (!binary)
+    return write(text + "\r\n");
+  std::string trimmed(text);
+  trimmed.erase(trimmed.find_last_not_of("\r\n") + 1);
+  return writeRecord(VPW::getTimestamp(), 0, {}, trimmed);
+}
+
+bool SDLog::writeRecord(const struct timeval& tv, byte mode, const std::vector<byte>& frame, const std::string& text) {
+  recursive_lock_guard lock(mutex);
+  if (!file) {
+    open();
+    if (!file)
+      return false;
+  }
+  record.clear();
+  if (vpbSync || (uint32_t)tv.tv_sec - (vpbIndex.empty() ? 0 : vpbIndex.back().sec) >= vpbIndexInterval) {
+    // index point: absolute timestamp that decoding can start from
+    if (vpbIndex.size() >= VPB_INDEX_SIZE) {
+      // index full: keep every other entry and halve the rate from now on
+      for (size_t i = 0; i < vpbIndex.size() / 2; i++)
+        vpbIndex[i] = vpbIndex[i * 2 + 1];
+      vpbIndex.resize(vpbIndex.size() / 2);
+      vpbIndexInterval *= 2;
+    }
+    vpbIndex.push_back({position(), (uint32_t)tv.tv_sec, (uint32_t)tv.tv_usec});
+    encoder.sync(record, tv.tv_sec, tv.tv_usec);
+    vpbSync = false;
+  }
+  uint start = Clock::micros();
+  size_t textSize = min(text.size(), (size_t)0xF0);
+  if (!encoder.record(record, tv.tv_sec, tv.tv_usec, mode, frame.data(), frame.size(), text.data(), textSize))
+    return false;
+  encodeLatency.record(Clock::micros() - start);
+  bytesLogged += record.size();
+  // timestamp + tab, "[4X] " and hex with spaces, tab before any text, CRLF
+  bytesText += 18 + (frame.size() ? 5 + frame.size() * 3 - 1 : 0) + (frame.size() && textSize ? 1 : 0) + textSize + 2;
+  if (!write((const char*)record.data(), record.size(), false)) {
+    vpbSync = true; // the delta chain is broken if a record was dropped
+    return false;
+  }
+  return true;
+}
+
+// Ends the records and appends the time index (at rotation, since nothing may follow it)
+void SDLog::writeIndex() {
+  recursive_lock_guard lock(mutex);
+  if (vpbIndex.empty())
+    return;
+  record.clear();
+  VpbEncoder::index(record, position(), vpbIndex);
+  write((const char*)record.data(), record.size(), false);
+  vpbIndex.clear();
+}
+
+void SDLog::setBinary(bool value) {
+  recursive_lock_guard lock(mutex);
+  if (value == binary)
+    return;
+  SettingsRepository.write("sdlog-vpb", value ? "1" : "0");
+  if (file) {
+    // start a new file in the new format
+    increment();
+    binary = value;
+    open();
+  } else {
+    binary = value;
+  }
+}
+
+std::string SDLog::stats(const char* newline) {
+  std::string ret;
+  ret += std::string(binary ? "VPB" : "LOG") + " RECORDS " + std::to_string(recordsLogged);
+  ret += " BYTES/RECORD " + Util.dec(recordsLogged ? (float)bytesLogged / recordsLogged : 0.0f, 0, 1);
+  if (bytesText > 0) {
+    ret += " RATIO " + Util.dec(bytesLogged ? (float)bytesText / bytesLogged : 0.0f, 0, 2) + ":1";
+    ret += newline;
+    ret += "ENCODE ";
+    ret += encodeLatency.tostring(newline);
+  }
+  ret += newline;
+  ret += "WRITTEN " + std::to_string(bytesWritten);
+  ret += " DROPPED " + std::to_string(bytesDropped);
+  ret += " PENDING " + std::to_string(sectorsPending()) + "/" + std::to_string(SDLOG_SECTORS);
+  ret += " PEAK " + std::to_string(sectorsHighWater);
+  if (preallocate)
+    ret += " ALLOCATED " + std::to_string(allocated);
+  for (int i = 0; i < 2; i++) {
+    if (writeLatency[i].samples == 0)
+      continue;
+    ret += newline;
+    ret += i ? "PREALLOCATED " : "APPEND ";
+    ret += writeLatency[i].tostring(newline);
+  }
+  if (extendLatency.samples > 0) {
+    ret += newline;
+    ret += "EXTEND ";
+    ret += extendLatency.tostring(newline);
+  }
+  return ret;
+}
+
+void SDLog::clearStats() {
+  writeLatency[0].clear();
+  writeLatency[1].clear();
+  extendLatency.clear();
+  encodeLatency.clear();
+  bytesText = 0;
+  bytesLogged = 0;
+  recordsLogged = 0;
+  bytesWritten = 0;
+  bytesDropped = 0;
+  sectorsHighWater = 0;
+}
+
 SDLog sdlog;
 
+//
+// Record filter for log downloads, evaluated on the device: a time window (epoch seconds,
+// inclusive) and up to LOGFILTER_HEADERS header prefixes.  Lines without a frame (notes) only
+// pass when no headers are given.
+//
+#ifndef LOGFILTER_HEADERS
+#define LOGFILTER_HEADERS 8
+#endif
+
+struct LogFilter {
+  uint32_t start = 0;
+  uint32_t end = UINT32_MAX;
+  uint8_t headers[LOGFILTER_HEADERS][3];
+  uint8_t headerLengths[LOGFILTER_HEADERS];
+  size_t headerCount = 0;
+
+  bool any() const {
+    return start > 0 || end < UINT32_MAX || headerCount > 0;
+  }
+
+  bool matches(uint32_t sec, const uint8_t* frame, size_t size) const {
+    if (sec < start || sec > end)
+      return false;
+    if (headerCount == 0)
+      return true;
+    for (size_t i = 0; i < headerCount; i++) {
+      if (size >= headerLengths[i] && memcmp(frame, headers[i], headerLengths[i]) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  // a text log line: "<sec>.<usec>\t[1X] 48 6B 10 ..." (only the first 3 bytes are needed)
+  bool matches(const char* line, size_t size) const {
+    uint32_t sec = strtoul(line, nullptr, 10);
+    const char* p = (const char*)memchr(line, '\t', size);
+    uint8_t frame[3];
+    size_t frameSize = 0;
+    if (p) {
+      p++;
+      const char* end = line + size;
+      if (end - p >= 5 && p[0] == '[' && p[2] == 'X' && p[3] == ']')
+        p += 5;
+      while (frameSize < sizeof(frame) && end - p >= 2 && isxdigit(p[0]) && isxdigit(p[1]) && (end - p == 2 || !isxdigit(p[2]))) {
+        frame[frameSize++] = strtoul(std::string(p, 2).c_str(), nullptr, 16);
+        p += (end - p >= 3) ? 3 : 2;
+      }
+    }
+    return matches(sec, frame, frameSize);
+  }
+};
+
+//
+// Incremental readback of a log file (ATLOG n, ATLOGD) on its own file handle.  loop() is
+// called from the terminal loop; it sends only what the port can take without blocking and
+// reads the card one sector at a time, holding the card lock for just that read, so logging
+// on the other core carries on during a download.  The active file is read up to what has
+// reached the card.
+//
+// ATLOG n decodes .vpb files to text.  ATLOGD sends the file as stored, in CRC-checked
+// blocks (see logblock.h); with a filter, only matching lines (.log) or records (.vpb,
+// re-encoded) are sent, and the start of the time window is found by binary search (.log) or
+// the time index (.vpb) rather than by reading the whole file.
+//
+// The resume offset counts the bytes sent between the --BEGIN and --END lines, or the block
+// payloads.  Unfiltered, this is the file offset (except when decoding a .vpb to text);
+// otherwise the output is regenerated and the first bytes are skipped.
+//
+class SDLogReader {
+private:
+  struct ChunkSource {
+    SDLogReader& reader;
+    int operator()() {
+      if (reader.chunkPosition >= reader.chunkSize && !reader.readChunk())
+        return -1;
+      return reader.chunk[reader.chunkPosition++];
+    }
+  };
+
+  fs::File file;
+  std::string filename;
+  size_t fileIndex = 0;
+  bool binary = false;
+  bool framed = false;    // ATLOGD
+  bool raw = false;       // send the file's bytes as they are
+  LogFilter filter;
+  bool reading = false;   // still has file data to send
+  bool sending = false;   // still has output to send (reading, or the trailer)
+  uint32_t filePosition = 0;
+  uint32_t skip = 0;      // output bytes to drop before sending (regenerated output)
+  uint32_t queued = 0;    // stream offset of the next byte queued
+  uint32_t sent = 0;      // output bytes sent so far, i.e. the resume offset
+  uint8_t chunk[SDLOG_SECTOR_SIZE];
+  size_t chunkSize = 0;
+  size_t chunkPosition = 0;
+  std::string pending;
+  size_t pendingPosition = 0;
+  size_t dataStart = 0;   // the part of pending that counts towards the resume offset
+  size_t dataEnd = 0;
+  std::string line;       // partial text line (filtering a .log)
+  const char* newline = "\r\n";
+  ChunkSource source{*this};
+  std::unique_ptr<VpbReader<ChunkSource>> vpb;
+  VpbEncoder encoder;
+  std::vector<uint8_t> record;
+  bool resync = true;
+
+  uint32_t limit() {
+    recursive_lock_guard lock(SDLog::cardMutex);
+    uint32_t size = file.size();
+    if (fileIndex == (size_t)SDLog::index && SDLog::file)
+      size = min(size, SDLog::writePosition);
+    return size;
+  }
+
+  bool readChunk() {
+    recursive_lock_guard lock(SDLog::cardMutex);
+    uint32_t size = limit();
+    chunkPosition = 0;
+    chunkSize = 0;
+    if (filePosition >= size)
+      return false;
+    file.seek(filePosition);
+    int n = file.read(chunk, min((uint32_t)sizeof(chunk), size - filePosition));
+    if (n <= 0)
+      return false;
+    chunkSize = n;
+    filePosition += n;
+    return true;
+  }
+
+  void seek(uint32_t position) {
+    filePosition = position;
+    chunkSize = chunkPosition = 0;
+  }
+
+  // first second of the text line starting at or after position (UINT32_MAX at the end)
+  uint32_t lineTime(uint32_t position, uint32_t& lineStart) {
+    seek(position);
+    int c = 0;
+    if (position > 0) {
+      while ((c = source()) >= 0 && c != '\n');
+    }
+    lineStart = filePosition - (chunkSize - chunkPosition);
+    char digits[11] = {};
+    for (size_t i = 0; i < 10 && (c = source()) >= 0 && isdigit(c); i++)
+      digits[i] = c;
+    return digits[0] ? strtoul(digits, nullptr, 10) : UINT32_MAX;
+  }
+
+  // start of the first text line at or after the filter's start time
+  uint32_t seekText() {
+    uint32_t lo = 0, hi = limit(), lineStart = 0;
+    while (hi - lo > SDLOG_SECTOR_SIZE) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (lineTime(mid, lineStart) < filter.start)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    lineTime(lo, lineStart);
+    return lineStart;
+  }
+
+  // offset of the last index point at or before the filter's start time (0 = no index)
+  uint32_t seekIndex() {
+    if (fileIndex == (size_t)SDLog::index && SDLog::file)
+      return 0; // the active file has no index yet
+    recursive_lock_guard lock(SDLog::cardMutex);
+    uint32_t size = limit();
+    uint8_t trailer[8];
+    auto get32 = [](const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); };
+    if (size < 8 || !file.seek(size - 8) || file.read(trailer, 8) != 8 || memcmp(trailer + 4, VPB_TRAILER_MAGIC, 4) != 0)
+      return 0;
+    uint8_t entry[12];
+    if (!file.seek(get32(trailer)) || file.read(entry, 8) != 8 || memcmp(entry, VPB_INDEX_MAGIC, 4) != 0)
+      return 0;
+    uint32_t offset = 0;
+    for (uint32_t i = 0, count = get32(entry + 4); i < count; i++) {
+      if (file.read(entry, 12) != 12 || get32(entry + 4) > filter.start)
+        break;
+      offset = get32(entry);
+    }
+    return offset;
+  }
+
+  // queues output (after skipping anything already sent before a resume)
+  void queue(const char* data, size_t size) {
+    size_t dropped = min((size_t)skip, size);
+    skip -= dropped;
+    pending.append(data + dropped, size - dropped);
+    queued += size;
+  }
+
+  void produce() {
+    if (raw) {
+      if (chunkPosition >= chunkSize && !readChunk()) {
+        reading = false;
+      } else {
+        // zero-filled tail of a preallocated file that wasn't closed
+        const char* end = binary ? nullptr : (const char*)memchr(chunk + chunkPosition, 0, chunkSize - chunkPosition);
+        size_t size = end ? (const uint8_t*)end - (chunk + chunkPosition) : chunkSize - chunkPosition;
+        queue((const char*)chunk + chunkPosition, size);
+        chunkPosition = chunkSize;
+        if (end)
+          reading = false;
+      }
+    } else if (binary) {
+      // decode (and re-encode, for ATLOGD) about a sector's worth at a time
+      VpbRecord r;
+      size_t start = pending.size();
+      while (pending.size() - start < SDLOG_SECTOR_SIZE && reading) {
+        if (!vpb->next(r)) {
+          reading = false;
+          break;
+        }
+        if (r.flags & VPB_SYNC) {
+          resync = true;
+          continue;
+        }
+        if (r.sec > filter.end) {
+          reading = false;
+          break;
+        }
+        if (!filter.matches(r.sec, r.frame.data(), r.frame.size()))
+          continue;
+        if (framed) {
+          record.clear();
+          if (resync)
+            encoder.sync(record, r.sec, r.usec);
+          resync = false;
+          encoder.record(record, r.sec, r.usec, r.mode(), r.frame.data(), r.frame.size(), r.text.data(), r.text.size());
+          queue((const char*)record.data(), record.size());
+        } else {
+          std::string text = vpbText(r);
+          text += newline;
+          queue(text.data(), text.size());
+        }
+      }
+    } else {
+      // filtered text: whole lines only
+      if (chunkPosition >= chunkSize && !readChunk()) {
+        reading = false;
+        return;
+      }
+      for (; chunkPosition < chunkSize && reading; chunkPosition++) {
+        char c = chunk[chunkPosition];
+        if (c == '\0') {
+          reading = false;
+          break;
+        }
+        line += c;
+        if (c != '\n')
+          continue;
+        if (strtoul(line.c_str(), nullptr, 10) > filter.end)
+          reading = false;
+        else if (filter.matches(line.data(), line.size()))
+          queue(line.data(), line.size());
+        line.clear();
+      }
+    }
+  }
+
+  void fill() {
+    pending.clear();
+    pendingPosition = 0;
+    size_t block = framed ? LogBlock::open(pending) : 0;
+    dataStart = pending.size();
+    produce();
+    dataEnd = pending.size();
+    if (framed) {
+      if (dataEnd > dataStart)
+        LogBlock::close(pending, block, LOGBLOCK_DATA, queued - (dataEnd - dataStart));
+      else
+        pending.clear();
+    }
+    if (!reading) {
+      close();
+      if (framed) {
+        size_t end = LogBlock::open(pending);
+        pending.append(4, '\0');
+        for (int i = 0; i < 4; i++)
+          pending[pending.size() - 4 + i] = (queued >> (8 * i)) & 0xFF;
+        LogBlock::close(pending, end, LOGBLOCK_END, queued);
+      } else {
+        pending += "--END " + filename + "--" + newline;
+      }
+    }
+  }
+
+  void close() {
+    recursive_lock_guard lock(SDLog::cardMutex);
+    if (file)
+      file.close();
+    vpb.reset();
+  }
+
+public:
+  bool active() const {
+    return sending;
+  }
+
+  // returns false (with an error in response) if the file can't be opened
+  bool begin(size_t index, uint32_t offset, const char* newline, std::string& response, bool framed = false, const LogFilter& filter = LogFilter()) {
+    recursive_lock_guard lock(SDLog::cardMutex);
+    stop();
+    this->newline = newline;
+    // either format may exist for an index; try the current one first
+    filename = std::to_string(index) + SDLog::extension();
+    file = SD.open(filename.c_str(), FILE_READ);
+    if (!file || file.size() == 0) {
+      filename = std::to_string(index) + (SDLog::binary ? ".log" : ".vpb");
+      file = SD.open(filename.c_str(), FILE_READ);
+    }
+    if (!file) {
+      response = "!ERROR OPENING " + filename;
+      return false;
+    }
+    fileIndex = index;
+    binary = filename.rfind(".vpb") != std::string::npos;
+    this->framed = framed;
+    this->filter = filter;
+    raw = framed ? !filter.any() : !binary;
+    seek(0);
+    line.clear();
+    encoder = VpbEncoder();
+    resync = true;
+    skip = raw ? 0 : offset;
+    queued = raw ? offset : 0;
+    sent = offset;
+    pending.clear();
+    pendingPosition = 0;
+    if (framed) {
+      size_t block = LogBlock::open(pending);
+      uint32_t size = limit();
+      for (int i = 0; i < 4; i++)
+        pending += (char)((size >> (8 * i)) & 0xFF);
+      pending += (char)((binary ? LOGBLOCK_VPB : 0) | (raw ? 0 : LOGBLOCK_FILTERED));
+      pending += filename;
+      LogBlock::close(pending, block, LOGBLOCK_BEGIN, offset);
+    } else {
+      pending = (offset ? "--RESUME " + filename + " " + std::to_string(offset) + "--" : "--BEGIN " + filename + "--") + newline;
+    }
+    dataStart = dataEnd = pending.size();
+
+    std::string header;
+    if (binary) {
+      vpb.reset(new VpbReader<ChunkSource>(source));
+      VpbHeader h;
+      if (!vpb->header(h)) {
+        stop();
+        response = "!CORRUPT " + filename;
+        return false;
+      }
+      if (!framed) {
+        header = "#" + h.firmware + " " + h.settings + newline;
+      } else if (!raw) {
+        std::vector<uint8_t> out;
+        VpbEncoder::header(out, h.sec, h.usec, h.firmware, h.settings, encoder.compress);
+        header.assign((const char*)out.data(), out.size());
+      }
+      if (!raw && filter.start > 0) {
+        uint32_t position = seekIndex();
+        if (position > 0)
+          seek(position);
+      }
+    } else if (!raw && filter.start > 0) {
+      seek(seekText());
+    }
+    if (raw) {
+      seek(offset);
+    } else if (header.size() > 0) {
+      // the regenerated header is sent (or skipped) in the first block
+      std::string first = pending;
+      pending.clear();
+      size_t block = framed ? LogBlock::open(pending) : 0;
+      dataStart = pending.size();
+      queue(header.data(), header.size());
+      dataEnd = pending.size();
+      if (framed) {
+        if (dataEnd > dataStart)
+          LogBlock::close(pending, block, LOGBLOCK_DATA, queued - (dataEnd - dataStart));
+        else
+          pending.clear();
+      }
+      dataStart += first.size();
+      dataEnd += first.size();
+      pending.insert(0, first);
+    }
+    reading = sending = true;
+    return true;
+  }
+
+  // sends as much as the port can take without blocking; returns false once finished
+  bool loop(Print& port) {
+    while (sending) {
+      if (pendingPosition >= pending.size()) {
+        if (!reading) {
+          sending = false;
+          break;
+        }
+        fill();
+        continue;
+      }
+      int room = port.availableForWrite();
+      if (room <= 0)
+        break;
+      size_t size = min((size_t)room, pending.size() - pendingPosition);
+      size_t written = port.write((const uint8_t*)pending.data() + pendingPosition, size);
+      size_t from = max(pendingPosition, dataStart);
+      size_t to = min(pendingPosition + written, dataEnd);
+      if (to > from)
+        sent += to - from;
+      pendingPosition += written;
+      if (written < size)
+        break;
+    }
+    return sending;
+  }
+
+  // abandons the download; returns the offset to resume from
+  uint32_t stop() {
+    close();
+    reading = sending = false;
+    pending.clear();
+    pendingPosition = 0;
+    return sent;
+  }
+
+  const std::string& name() const {
+    return filename;
+  }
+};
+
 #endif
@@ -150,14 +150,14 @@ public:
     template <typename... Args>
     bool load(Args&&... args) {
         bool ok = true;
-        (void)std::initializer_list<int>{(ok == ok && args.load(), 0)...};
+        (void)std::initializer_list<int>{((ok &= args.load()), 0)...};
         return ok;
     }
 
     template <typename... Args>
     bool save(Args&&... args) {
         bool ok = true;
-        (void)std::initializer_list<int>{(ok == ok && args.load(), 0)...};
+        (void)std::initializer_list<int>{((ok &= args.save()), 0)...};
         return ok;
     }
     
@@ -20,7 +20,7 @@ struct StringUtil {
         bool first = true;
         for (const std::string& element : input) {
             if (!first)
-                ss << ",";
+                ss << delimiter;
             else
                 first = false;
             ss << element;
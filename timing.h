@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include "util.h"
+#include "hexutil.h"
+
+//
+// RESPONSE TIMING
+//
+// How long each module (by the address a request went to) takes to answer: an EWMA of the
+// time from the request, or from its previous response, to the next response, and of the
+// deviation from that (as TCP estimates round trips).  With adaptive timing (ATAT1, ATAT2) a
+// request waits for that plus a margin, no longer than the ATST timeout, instead of the full
+// timeout.  Until a module has answered a few times, and again after a request to it gets no
+// response within the learned bound, it's the ATST timeout.
+//
+class ResponseTiming {
+private:
+    struct Module {
+        uint32_t mean = 0;          // us
+        uint32_t deviation = 0;     // us
+        ulong samples = 0;
+        ulong misses = 0;
+    };
+    Module modules[0x100];
+
+public:
+    static constexpr ulong LEARN_SAMPLES = 4;
+
+    void record(byte target, uint32_t us) {
+        Module& m = modules[target];
+        if (m.samples++ == 0) {
+            m.mean = us;
+            m.deviation = us / 2;
+            return;
+        }
+        int32_t error = (int32_t)(us - m.mean);
+        m.mean += error / 8;
+        m.deviation += ((int32_t)abs(error) - (int32_t)m.deviation) / 4;
+    }
+
+    // no response within the learned bound: back to the timeout until it's learned again
+    void miss(byte target) {
+        modules[target].samples = 0;
+        modules[target].misses++;
+    }
+
+    // how long to wait for the next response (us); ATAT2 cuts it closer than ATAT1
+    uint32_t timeout(byte target, byte adaptive, uint32_t timeoutUs) const {
+        const Module& m = modules[target];
+        if (adaptive == 0 || m.samples < LEARN_SAMPLES)
+            return timeoutUs;
+        uint32_t bound = (adaptive == 1) ? m.mean + 4 * m.deviation + 10000 : m.mean + 2 * m.deviation + 5000;
+        return min(bound, timeoutUs);
+    }
+
+    // ATATS: a line per module with learned timing
+    std::string stats(const char* newline, byte adaptive, uint32_t timeoutUs) const {
+        std::string ret;
+        for (uint target = 0; target < 0x100; target++) {
+            const Module& m = modules[target];
+            if (m.samples == 0 && m.misses == 0)
+                continue;
+            if (ret.size() > 0)
+                ret += newline;
+            ret += HexUtil.hex((byte)target);
+            ret += " AVG " + Util.dec(m.mean / 1000.0f, 1, 1) + "ms DEV " + Util.dec(m.deviation / 1000.0f, 1, 1) + "ms";
+            ret += " WAIT " + std::to_string(timeout(target, adaptive, timeoutUs) / 1000) + "ms";
+            ret += " SAMPLES " + std::to_string(m.samples) + " MISSES " + std::to_string(m.misses);
+        }
+        return ret.size() > 0 ? ret : "NO DATA";
+    }
+
+    void clear() {
+        for (Module& m : modules)
+            m = Module();
+    }
+};
+
+ResponseTiming responseTiming;
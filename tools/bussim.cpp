@@ -0,0 +1,172 @@
+//
+// bussim: runs scripted scenarios on the simulated VPW bus (vpwbus.h) and checks what the
+// adapter's decoder makes of it
+//
+//   g++ -std=c++17 -O2 -o bussim bussim.cpp
+//
+//   bussim [-t ms] [-l load%] [-4] [-n glitches/s] [-s seed] [-w words.bin] [script]
+//
+//   -t  simulated time (default 10000 ms)
+//   -l  background traffic, as a share of the bus (default 70)
+//   -4  everything in 4X mode
+//   -n  noise glitches per second (up to 20us each)
+//   -s  random seed
+//   -w  write the receive words ((us << 1) | active, 32-bit little-endian) to a file
+//
+// Without a script: a PCM (10) and a TCM (18) answer physical requests after 2 and 3ms, a
+// broadcaster (486B10, higher priority) loads the bus, and the tester (the adapter's send path)
+// polls the PCM with 6C 10 F1 01 0C every 20ms.  See vpwscenario.h for the script format.
+//
+// The report compares the frames the decoder (VPW::receiveLoop's thresholds) got from the
+// receive words with the frames the transmitters actually got through, and gives the
+// tester's response latency (request queued to the answer's EOF) under contention.  Exits
+// with 1 if a frame not touched by noise was lost or decoded wrongly.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "vpwscenario.h"
+
+static double percentile(std::vector<uint64_t> v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p / 100 * v.size()))] / 1e6;
+}
+
+int main(int argc, char** argv) {
+    uint64_t duration = 10000 * VPW_MS;
+    unsigned load = 70;
+    bool mode4X = false;
+    double noise = 0;
+    uint32_t seed = 0;
+    const char* wordsFile = nullptr;
+    const char* scriptFile = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            duration = strtoull(argv[++i], nullptr, 10) * VPW_MS;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            load = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-4") == 0) {
+            mode4X = true;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            noise = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 0) | 1;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            wordsFile = argv[++i];
+        } else if (argv[i][0] != '-' && !scriptFile) {
+            scriptFile = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-t ms] [-l load%%] [-4] [-n glitches/s] [-s seed] [-w words.bin] [script]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    VpwScenario sim;
+    if (scriptFile) {
+        std::string error;
+        if (!sim.parse(scriptFile, error)) {
+            fprintf(stderr, "%s: %s\n", scriptFile, error.c_str());
+            return 2;
+        }
+    } else {
+        sim.defaults(load);
+        VpwTester* tester = sim.add(new VpwTester("tester", VpwFrame::parse("6C10F1010C"), 20 * VPW_MS));
+        tester->start(sim.bus, 10 * VPW_MS);
+        sim.testers.push_back(tester);
+        sim.noise.rate = noise;
+    }
+    if (seed)
+        sim.bus.seed = seed;
+    if (sim.duration == 0)
+        sim.duration = duration;
+    if (mode4X)
+        sim.setMode(true);
+    sim.start();
+
+    // the adapter's view: the receive words through the receiveLoop thresholds
+    VpwDecoder adapter;
+    FILE* out = wordsFile ? fopen(wordsFile, "wb") : nullptr;
+    if (wordsFile && !out) {
+        perror(wordsFile);
+        return 1;
+    }
+    uint64_t wordCount = 0;
+    sim.bus.words = [&](uint32_t word, uint64_t end) {
+        adapter.add(word, end);
+        wordCount++;
+        if (out) {
+            uint8_t b[4] = { (uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16), (uint8_t)(word >> 24) };
+            fwrite(b, 1, 4, out);
+        }
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    sim.bus.run(sim.duration);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    adapter.idle();
+    if (out)
+        fclose(out);
+
+    // match what got through against what was decoded, by SOF time
+    const auto& truth = sim.bus.sent;
+    const auto& decoded = adapter.frames;
+    size_t matched = 0, wrong = 0, missing = 0, extra = 0, disturbed = 0, invalid = 0;
+    size_t i = 0, j = 0;
+    while (i < truth.size() || j < decoded.size()) {
+        int64_t delta = (i < truth.size() && j < decoded.size()) ? (int64_t)decoded[j].sof - (int64_t)truth[i].sof : 0;
+        bool noisy = i < truth.size() && sim.noise.disturbs(truth[i].sof, truth[i].end + 300 * VPW_US);
+        if (i < truth.size() && j < decoded.size() && llabs(delta) <= 10 * (int64_t)VPW_US) {
+            if (decoded[j].bytes == truth[i].frame.bytes)
+                matched++;
+            else if (noisy)
+                disturbed++;
+            else
+                wrong++;
+            i++;
+            j++;
+        } else if (j < decoded.size() && (i >= truth.size() || delta < 0)) {
+            if (!VpwFrame{ decoded[j].bytes }.valid())
+                invalid++; // noise that looked like a frame
+            else
+                extra++;
+            j++;
+        } else {
+            if (noisy)
+                disturbed++;
+            else
+                missing++;
+            i++;
+        }
+    }
+
+    double simulated = sim.duration / 1e9;
+    printf("simulated %.1fs in %.3fs (%.0fx real time), %llu events, %llu words\n", simulated, wall, simulated / wall,
+            (unsigned long long)sim.bus.events, (unsigned long long)wordCount);
+    printf("bus load %.1f%%, %zu frames sent\n", sim.bus.load(), truth.size());
+    for (auto& t : sim.transmitters) {
+        printf("  %-10s sent %llu, lost arbitration %llu, queued %zu\n", t->name.c_str(),
+                (unsigned long long)t->framesSent, (unsigned long long)t->arbitrationLost, t->queued());
+    }
+    if (sim.noise.glitches || sim.noise.disturbed.size())
+        printf("noise: %llu glitches, %zu disturbances\n", (unsigned long long)sim.noise.glitches, sim.noise.disturbed.size());
+    printf("decode: %zu matched, %zu wrong, %zu missing, %zu extra, %zu disturbed by noise, %zu invalid fragments\n",
+            matched, wrong, missing, extra, disturbed, invalid);
+    printf("        runts %zu, breaks %zu, unexpected SOF %zu, unexpected EOF %zu, mode switches %zu\n",
+            adapter.runts, adapter.breaks, adapter.unexpectedSOF, adapter.unexpectedEOF, adapter.modeSwitches);
+    for (VpwTester* t : sim.testers) {
+        const auto& l = t->latencies;
+        uint64_t total = 0;
+        for (uint64_t v : l)
+            total += v;
+        printf("%s latency: n %zu, avg %.2fms, p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms, %llu timed out\n",
+                t->name.c_str(), l.size(), l.empty() ? 0 : total / 1e6 / l.size(), percentile(l, 50), percentile(l, 90),
+                percentile(l, 99), percentile(l, 100), (unsigned long long)t->timeouts);
+    }
+    return (wrong || missing || extra) ? 1 : 0;
+}
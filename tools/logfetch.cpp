@@ -0,0 +1,206 @@
+//
+// logfetch: downloads an SD log over the adapter's serial port with ATLOGD (see logblock.h)
+//
+//   g++ -std=c++17 -O2 -o logfetch logfetch.cpp
+//
+//   logfetch [-b baud] [-t start[-end]] [-h hdr[,hdr...]] [-c] <port> <log number> <output>
+//
+//   -b  baud rate of a UART port (ignored by USB CDC ports, which always run at USB speed)
+//   -t  only records in this time window (epoch seconds), found on the device
+//   -h  only frames starting with one of these headers (1-3 hex bytes each)
+//   -c  continue an earlier download into an existing output file
+//
+// Blocks that fail their CRC, gaps and stalls stop the transfer, which is then resumed from
+// the last good offset.  The output is the .log/.vpb file itself (or the filtered subset).
+//
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+#include "../logblock.h"
+
+static speed_t speed(long baud) {
+    switch (baud) {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+        case 3000000: return B3000000;
+        default:      return 0;
+    }
+}
+
+static bool configure(int fd, long baud) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return false;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    speed_t s = speed(baud);
+    if (s == 0) {
+        fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return false;
+    }
+    cfsetispeed(&tio, s);
+    cfsetospeed(&tio, s);
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+static void send(int fd, const std::string& text) {
+    if (write(fd, text.data(), text.size()) != (ssize_t)text.size())
+        perror("write");
+}
+
+// reads whatever arrives within timeout milliseconds; returns false on timeout
+static bool receive(int fd, std::vector<uint8_t>& buffer, int timeout) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    if (select(fd + 1, &set, nullptr, nullptr, &tv) <= 0)
+        return false;
+    uint8_t data[4096];
+    ssize_t n = read(fd, data, sizeof(data));
+    if (n <= 0)
+        return false;
+    buffer.insert(buffer.end(), data, data + n);
+    return true;
+}
+
+// stops a download in progress and discards everything up to the prompt
+static void stop(int fd) {
+    send(fd, "\r");
+    std::vector<uint8_t> junk;
+    while (receive(fd, junk, 500))
+        junk.clear();
+}
+
+int main(int argc, char** argv) {
+    long baud = 115200;
+    std::string filter;
+    bool resume = false;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baud = strtol(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            filter += std::string(" T") + argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            filter += std::string(" H") + argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            resume = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 3) {
+        fprintf(stderr, "usage: %s [-b baud] [-t start[-end]] [-h hdr[,hdr...]] [-c] <port> <log number> <output>\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(args[0], O_RDWR | O_NOCTTY);
+    if (fd < 0 || !configure(fd, baud)) {
+        perror(args[0]);
+        return 1;
+    }
+    FILE* out = fopen(args[2], resume ? "ab" : "wb");
+    if (!out) {
+        perror(args[2]);
+        return 1;
+    }
+    fseek(out, 0, SEEK_END);
+    uint32_t expected = resume ? ftell(out) : 0;
+
+    stop(fd);
+    send(fd, "ATE0\r");
+    stop(fd);
+
+    auto started = std::chrono::steady_clock::now();
+    uint32_t first = expected;
+    int retries = 0;
+    bool done = false;
+    bool announced = false;
+    while (!done && retries <= 10) {
+        send(fd, "ATLOGD " + std::string(args[1]) + " O" + std::to_string(expected) + filter + "\r");
+        std::vector<uint8_t> buffer;
+        std::string text; // anything outside blocks, for error responses
+        bool failed = false;
+        while (!done && !failed) {
+            if (!receive(fd, buffer, 3000)) {
+                fprintf(stderr, "timed out at offset %u\n", expected);
+                failed = true;
+                break;
+            }
+            size_t used;
+            LogBlock::Parsed block;
+            while ((used = LogBlock::parse(buffer.data(), buffer.size(), block)) > 0 || block.status != 0) {
+                if (block.status == 0) {
+                    text.append(buffer.begin(), buffer.begin() + used);
+                } else if (block.status < 0) {
+                    fprintf(stderr, "CRC error at offset %u\n", expected);
+                    failed = true;
+                } else if (block.type == LOGBLOCK_BEGIN && block.length >= 5) {
+                    if (!announced) {
+                        uint32_t size = block.payload[0] | (block.payload[1] << 8) | (block.payload[2] << 16) | ((uint32_t)block.payload[3] << 24);
+                        fprintf(stderr, "%.*s: %u bytes%s\n", (int)block.length - 5, (const char*)block.payload + 5, size,
+                            (block.payload[4] & LOGBLOCK_FILTERED) ? " (filtered)" : "");
+                        announced = true;
+                    }
+                } else if (block.type == LOGBLOCK_DATA) {
+                    if (block.offset > expected) {
+                        fprintf(stderr, "gap at offset %u\n", expected);
+                        failed = true;
+                    } else if (block.offset + block.length > expected) {
+                        size_t skip = expected - block.offset;
+                        fwrite(block.payload + skip, 1, block.length - skip, out);
+                        expected += block.length - skip;
+                    }
+                } else if (block.type == LOGBLOCK_END && block.length >= 4) {
+                    uint32_t total = block.payload[0] | (block.payload[1] << 8) | (block.payload[2] << 16) | ((uint32_t)block.payload[3] << 24);
+                    if (total == expected) {
+                        done = true;
+                    } else {
+                        fprintf(stderr, "ended at %u, expected %u\n", total, expected);
+                        failed = true;
+                    }
+                }
+                buffer.erase(buffer.begin(), buffer.begin() + used);
+                if (done || failed)
+                    break;
+            }
+            if (!announced && (text.find("!ERROR") != std::string::npos || text.find("!CORRUPT") != std::string::npos || text.find("?") != std::string::npos)) {
+                fprintf(stderr, "%s", text.c_str());
+                return 1;
+            }
+        }
+        if (failed) {
+            stop(fd);
+            retries++;
+        }
+    }
+    fclose(out);
+    close(fd);
+    if (!done) {
+        fprintf(stderr, "giving up at offset %u (use -c to continue)\n", expected);
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    fprintf(stderr, "%u bytes in %.1f s (%.1f KB/s, %d retries)\n", expected - first, seconds, (expected - first) / 1024.0 / seconds, retries);
+    return 0;
+}
@@ -0,0 +1,598 @@
+#pragma once
+
+//
+// pioemu: a host-side emulator for one RP2040 PIO state machine, to run the programs in
+// vpw_pio.h against synthetic pin waveforms (see piosim.cpp)
+//
+// Covers the whole instruction set except side-set and MOV/OUT EXEC: JMP (all conditions),
+// WAIT (GPIO/PIN/IRQ), IN, OUT, PUSH, PULL, MOV (invert/bit-reverse), IRQ and SET, with delays,
+// wrap, autopush/autopull, FIFO joining and the fractional clock divider.  Time is counted in
+// system clock cycles; an instruction executes on each divided clock tick, reading inputs as
+// they were inputSync cycles earlier (the GPIO synchronizer).
+//
+// Inputs come from a PioInput, which may also report when they next change.  That allows two
+// fast paths: a WAIT on a pin skips straight to the tick that sees the edge, and a countdown
+// loop (a backward JMP that leaves everything but a decrementing X or Y unchanged, with no
+// pin/FIFO/IRQ activity) is fast-forwarded while its inputs are stable.  Set fastPath = false
+// to single-step everything, e.g. to check that both give the same results.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#define PIO_NEVER UINT64_MAX
+
+class PioInput {
+public:
+    virtual ~PioInput() {}
+    // GPIO levels at a given system clock cycle
+    virtual uint32_t read(uint64_t cycle) = 0;
+    // first cycle after 'cycle' at which read() may return something different
+    virtual uint64_t nextChange(uint64_t cycle) {
+        return cycle + 1;
+    }
+};
+
+// a recorded or synthetic waveform: levels from each edge's cycle until the next edge
+class PioWaveform : public PioInput {
+private:
+    size_t cursor = 0;
+
+    size_t find(uint64_t cycle) {
+        if (cursor >= edges.size() || edges[cursor].cycle > cycle)
+            cursor = 0;
+        while (cursor + 1 < edges.size() && edges[cursor + 1].cycle <= cycle)
+            cursor++;
+        return cursor;
+    }
+
+public:
+    struct Edge {
+        uint64_t cycle;
+        uint32_t pins;
+    };
+    std::vector<Edge> edges;
+    uint32_t initial = 0;
+
+    // adds an edge; levels must be added in time order
+    void add(uint64_t cycle, uint32_t pins) {
+        if (!edges.empty() && edges.back().cycle == cycle)
+            edges.back().pins = pins;
+        else if (edges.empty() ? pins != initial : pins != edges.back().pins)
+            edges.push_back({ cycle, pins });
+    }
+
+    uint32_t read(uint64_t cycle) override {
+        if (edges.empty() || edges[0].cycle > cycle)
+            return initial;
+        return edges[find(cycle)].pins;
+    }
+
+    uint64_t nextChange(uint64_t cycle) override {
+        if (edges.empty())
+            return PIO_NEVER;
+        if (edges[0].cycle > cycle)
+            return edges[0].cycle;
+        size_t i = find(cycle) + 1;
+        return i < edges.size() ? edges[i].cycle : PIO_NEVER;
+    }
+};
+
+struct PioConfig {
+    uint8_t wrapTarget = 0;
+    uint8_t wrap = 31;
+    uint16_t clkdivInt = 1;
+    uint8_t clkdivFrac = 0;        // 1/256ths
+    uint8_t inBase = 0;
+    uint8_t jmpPin = 0;
+    uint8_t setBase = 0;
+    uint8_t setCount = 0;
+    uint8_t outBase = 0;
+    uint8_t outCount = 0;
+    bool inShiftRight = true;
+    bool autopush = false;
+    uint8_t pushThreshold = 32;
+    bool outShiftRight = true;
+    bool autopull = false;
+    uint8_t pullThreshold = 32;
+    enum { JOIN_NONE, JOIN_TX, JOIN_RX } fifoJoin = JOIN_NONE;
+    uint8_t statusN = 0;           // MOV STATUS: all ones while the TX FIFO holds fewer words
+
+    // as sm_config_set_clkdiv() rounds it
+    void setClkdiv(float div) {
+        clkdivInt = (uint16_t)div;
+        clkdivFrac = (uint8_t)((div - clkdivInt) * 256);
+    }
+};
+
+enum PioStop {
+    PIO_UNTIL,      // reached the requested cycle
+    PIO_PUSHED,     // a word went into the RX FIFO
+    PIO_STALLED,    // waiting on a FIFO or an IRQ flag only the host can change
+    PIO_FAULT       // MOV/OUT EXEC, or a reserved encoding
+};
+
+class PioStateMachine {
+private:
+    struct Op {
+        uint8_t code;       // bits 15:13
+        uint8_t delay;
+        uint8_t a;          // JMP condition, IN source, OUT/MOV/SET destination, WAIT polarity
+        uint8_t b;          // MOV operation, WAIT source, PUSH/PULL/IRQ flags
+        uint8_t c;          // JMP address, bit count, MOV source, index, SET data
+    };
+
+    std::vector<Op> program;
+    PioConfig config;
+    PioInput& input;
+    uint32_t div256;        // clock divider in 1/256 cycles
+
+    uint32_t rxFifo[8], txFifo[8];
+    uint8_t rxHead = 0, rxCount = 0, txHead = 0, txCount = 0;
+    uint8_t rxSize, txSize;
+
+    // countdown loop detection
+    struct Snapshot {
+        bool valid = false;
+        uint8_t from, pc;
+        uint32_t x, y, isr, osr;
+        uint8_t isrCount, osrCount, irq;
+        uint64_t tick;
+        uint64_t effects;
+        uint64_t instructions;
+    } loop;
+    uint64_t effects = 0;   // anything a skipped iteration would have to repeat
+    bool compared = false;  // JMP X!=Y since the snapshot
+
+    static uint32_t reverse(uint32_t v) {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+        v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+        return (v >> 16) | (v << 16);
+    }
+
+    static uint32_t rotate(uint32_t v, uint8_t n) {
+        n &= 31;
+        return n ? (v >> n) | (v << (32 - n)) : v;
+    }
+
+    uint64_t cycleAt(uint64_t t) const {
+        return t * div256 >> 8;
+    }
+
+    // first tick at or after a cycle
+    uint64_t tickAt(uint64_t cycle) const {
+        return ((cycle << 8) + div256 - 1) / div256;
+    }
+
+    uint32_t pins() {
+        uint64_t c = cycle();
+        return input.read(c > inputSync ? c - inputSync : 0);
+    }
+
+    void writePins(uint8_t base, uint8_t count, uint32_t value, bool dirs) {
+        uint32_t mask = count >= 32 ? 0xFFFFFFFF : ((1u << count) - 1);
+        mask = rotate(mask, 32 - base);
+        value = rotate(value, 32 - base) & mask;
+        uint32_t& target = dirs ? pindirs : output;
+        uint32_t before = target;
+        target = (target & ~mask) | value;
+        effects++;
+        if (!dirs && target != before)
+            edges.push_back({ cycle(), target });
+    }
+
+    void mov(uint8_t dest, uint32_t value, bool& jumped) {
+        switch (dest) {
+            case 0: writePins(config.outBase, config.outCount, value, false); break;
+            case 1: x = value; break;
+            case 2: y = value; break;
+            case 5: pc = value & 31; jumped = true; break;
+            case 6: isr = value; isrCount = 0; break;
+            case 7: osr = value; osrCount = 0; break;
+            default: fault = true; break;
+        }
+    }
+
+    bool pushRx(uint32_t value) {
+        if (rxCount >= rxSize)
+            return false;
+        rxFifo[(rxHead + rxCount++) % rxSize] = value;
+        pushed = true;
+        effects++;
+        return true;
+    }
+
+    bool pullTx(uint32_t& value) {
+        if (txCount == 0)
+            return false;
+        value = txFifo[txHead];
+        txHead = (txHead + 1) % txSize;
+        txCount--;
+        effects++;
+        return true;
+    }
+
+    // ticks that can be skipped in a countdown loop that just came round to loop.pc again
+    uint64_t countdown(uint64_t untilTick) {
+        uint64_t period = tick - loop.tick;
+        bool countY;
+        if (loop.x == x && loop.y == y + 1)
+            countY = true;
+        else if (loop.y == y && loop.x == x + 1)
+            countY = false;
+        else
+            return 0;
+        if (loop.isr != isr || loop.osr != osr || loop.isrCount != isrCount || loop.osrCount != osrCount || loop.irq != irq)
+            return 0;
+        uint32_t& counter = countY ? y : x;
+        if (counter < 3 || period == 0)
+            return 0;
+        // the iterations read the pins from the snapshot on; they have to stay as they were
+        uint64_t from = cycleAt(loop.tick);
+        uint64_t change = input.nextChange(from > inputSync ? from - inputSync : 0);
+        uint64_t limit = untilTick;
+        if (change != PIO_NEVER)
+            limit = std::min(limit, tickAt(change + inputSync) - 1);
+        if (limit <= tick)
+            return 0;
+        uint64_t k = std::min((uint64_t)(counter - 2), (limit - tick) / period);
+        counter -= k;
+        instructions += k * (instructions - loop.instructions);
+        return k * period;
+    }
+
+    // executes the instruction at pc; returns false if it stalled
+    bool step(uint64_t untilTick) {
+        const Op& op = program[pc];
+        bool jumped = false;
+        uint32_t v = 0;
+        uint8_t n = op.c ? op.c : 32;
+        switch (op.code) {
+            case 0: { // JMP
+                bool take;
+                switch (op.a) {
+                    case 0: take = true; break;
+                    case 1: take = (x == 0); break;
+                    case 2: take = (x-- != 0); break;
+                    case 3: take = (y == 0); break;
+                    case 4: take = (y-- != 0); break;
+                    case 5: take = (x != y); compared = true; break;
+                    case 6: take = (pins() >> config.jmpPin) & 1; break;
+                    default: take = osrCount < (config.pullThreshold ? config.pullThreshold : 32); break;
+                }
+                if (take) {
+                    uint8_t from = pc;
+                    pc = op.c;
+                    jumped = true;
+                    if (fastPath && op.c <= from)
+                        backwardJump(from, untilTick);
+                }
+                break;
+            }
+            case 1: { // WAIT
+                bool level;
+                uint8_t index = op.c;
+                switch (op.b) {
+                    case 0: level = (pins() >> index) & 1; break;
+                    case 1: level = (pins() >> ((config.inBase + index) & 31)) & 1; break;
+                    case 2: level = (irq >> (index & 7)) & 1; break;
+                    default: fault = true; return false;
+                }
+                if (level != (op.a != 0)) {
+                    waiting = (op.b == 2) ? WAIT_HOST : WAIT_PIN;
+                    return false;
+                }
+                if (op.b == 2) {
+                    irq &= ~(1 << (index & 7));
+                    effects++;
+                }
+                break;
+            }
+            case 2: { // IN
+                uint8_t threshold = config.pushThreshold ? config.pushThreshold : 32;
+                if (config.autopush && isrCount + n >= threshold && rxCount >= rxSize) {
+                    waiting = WAIT_HOST;
+                    return false;
+                }
+                switch (op.a) {
+                    case 0: v = rotate(pins(), config.inBase); break;
+                    case 1: v = x; break;
+                    case 2: v = y; break;
+                    case 3: v = 0; break;
+                    case 6: v = isr; break;
+                    case 7: v = osr; break;
+                    default: fault = true; return false;
+                }
+                if (n < 32)
+                    v &= (1u << n) - 1;
+                if (n == 32)
+                    isr = v;
+                else if (config.inShiftRight)
+                    isr = (isr >> n) | (v << (32 - n));
+                else
+                    isr = (isr << n) | v;
+                isrCount = std::min(32, isrCount + n);
+                if (config.autopush && isrCount >= threshold) {
+                    pushRx(isr);
+                    isr = 0;
+                    isrCount = 0;
+                }
+                break;
+            }
+            case 3: { // OUT
+                uint8_t threshold = config.pullThreshold ? config.pullThreshold : 32;
+                if (config.autopull && osrCount >= threshold) {
+                    if (!pullTx(osr)) {
+                        waiting = WAIT_HOST;
+                        return false;
+                    }
+                    osrCount = 0;
+                }
+                if (n == 32) {
+                    v = osr;
+                    osr = 0;
+                } else if (config.outShiftRight) {
+                    v = osr & ((1u << n) - 1);
+                    osr >>= n;
+                } else {
+                    v = osr >> (32 - n);
+                    osr <<= n;
+                }
+                osrCount = std::min(32, osrCount + n);
+                switch (op.a) {
+                    case 0: writePins(config.outBase, config.outCount, v, false); break;
+                    case 1: x = v; break;
+                    case 2: y = v; break;
+                    case 3: break;
+                    case 4: writePins(config.outBase, config.outCount, v, true); break;
+                    case 5: pc = v & 31; jumped = true; break;
+                    case 6: isr = v; isrCount = n; break;
+                    default: fault = true; return false;
+                }
+                break;
+            }
+            case 4: { // PUSH / PULL
+                bool ifFlag = op.b & 2, block = op.b & 1;
+                if (op.a == 0) {
+                    if (ifFlag && isrCount < (config.pushThreshold ? config.pushThreshold : 32))
+                        break;
+                    if (!pushRx(isr)) {
+                        if (block) {
+                            waiting = WAIT_HOST;
+                            return false;
+                        }
+                        rxDropped++;
+                    }
+                    isr = 0;
+                    isrCount = 0;
+                } else {
+                    if (ifFlag && osrCount < (config.pullThreshold ? config.pullThreshold : 32))
+                        break;
+                    if (!pullTx(osr)) {
+                        if (block) {
+                            waiting = WAIT_HOST;
+                            return false;
+                        }
+                        osr = x;
+                    }
+                    osrCount = 0;
+                }
+                break;
+            }
+            case 5: { // MOV
+                switch (op.c) {
+                    case 0: v = rotate(pins(), config.inBase); break;
+                    case 1: v = x; break;
+                    case 2: v = y; break;
+                    case 3: v = 0; break;
+                    case 5: v = txCount < config.statusN ? 0xFFFFFFFF : 0; break;
+                    case 6: v = isr; break;
+                    case 7: v = osr; break;
+                    default: fault = true; return false;
+                }
+                if (op.b == 1)
+                    v = ~v;
+                else if (op.b == 2)
+                    v = reverse(v);
+                mov(op.a, v, jumped);
+                if (fault)
+                    return false;
+                break;
+            }
+            case 6: { // IRQ
+                uint8_t index = op.c & 7;
+                if (op.b & 2) {
+                    irq &= ~(1 << index);
+                } else {
+                    if (!irqWaiting) {
+                        irq |= 1 << index;
+                        irqRaised[index]++;
+                    }
+                    if ((op.b & 1) && (irq >> index) & 1) {
+                        irqWaiting = true;
+                        waiting = WAIT_HOST;
+                        return false;
+                    }
+                    irqWaiting = false;
+                }
+                effects++;
+                break;
+            }
+            case 7: { // SET
+                switch (op.a) {
+                    case 0: writePins(config.setBase, config.setCount, op.c, false); break;
+                    case 1: x = op.c; break;
+                    case 2: y = op.c; break;
+                    case 4: writePins(config.setBase, config.setCount, op.c, true); break;
+                    default: fault = true; return false;
+                }
+                break;
+            }
+        }
+        waiting = WAIT_NONE;
+        if (!jumped)
+            pc = (pc == config.wrap) ? config.wrapTarget : (pc + 1) & 31;
+        tick += op.delay;
+        return true;
+    }
+
+    void backwardJump(uint8_t from, uint64_t untilTick) {
+        // the jump completes this tick; compare the state with the last time round
+        if (loop.valid && loop.from == from && loop.pc == pc && loop.effects == effects && !compared) {
+            uint64_t skip = countdown(untilTick);
+            tick += skip;
+            skipped += skip;
+        }
+        loop.valid = true;
+        loop.from = from;
+        loop.pc = pc;
+        loop.x = x;
+        loop.y = y;
+        loop.isr = isr;
+        loop.osr = osr;
+        loop.isrCount = isrCount;
+        loop.osrCount = osrCount;
+        loop.irq = irq;
+        loop.tick = tick;
+        loop.effects = effects;
+        loop.instructions = instructions;
+        compared = false;
+    }
+
+public:
+    enum { WAIT_NONE, WAIT_PIN, WAIT_HOST } waiting = WAIT_NONE;
+
+    uint8_t pc = 0;
+    uint32_t x = 0, y = 0, isr = 0, osr = 0;
+    uint8_t isrCount = 0;
+    uint8_t osrCount = 32;      // empty
+    uint32_t output = 0;        // levels driven by SET/OUT/MOV PINS
+    uint32_t pindirs = 0;
+    uint8_t irq = 0;
+    bool irqWaiting = false;
+    bool fault = false;
+    bool pushed = false;
+
+    uint64_t tick = 0;          // divided clock ticks since start
+    uint32_t inputSync = 2;     // cycles of input synchronizer latency (0 = bypassed)
+    bool fastPath = true;
+
+    // output edges (cycle, levels of all pins)
+    std::vector<PioWaveform::Edge> edges;
+
+    // statistics
+    uint64_t instructions = 0;
+    uint64_t skipped = 0;       // ticks fast-forwarded
+    uint64_t rxDropped = 0;     // PUSH NOBLOCK with the RX FIFO full
+    uint64_t irqRaised[8] = {};
+
+    PioStateMachine(const uint16_t* instructions, size_t length, const PioConfig& config, PioInput& input, uint8_t origin = 0) :
+            config(config), input(input) {
+        program.resize(32);
+        for (size_t i = 0; i < length && origin + i < 32; i++) {
+            uint16_t w = instructions[i];
+            Op& op = program[origin + i];
+            op.code = w >> 13;
+            op.delay = (w >> 8) & 0x1F;
+            op.a = (w >> 5) & 7;
+            op.b = (w >> 3) & 3;
+            op.c = w & 0x1F;
+            switch (op.code) {
+                case 0: // JMP: address is relative to the origin
+                    op.c = (op.c + origin) & 31;
+                    break;
+                case 1: // WAIT: polarity, source, index
+                    op.a = (w >> 7) & 1;
+                    op.b = (w >> 5) & 3;
+                    break;
+                case 4: // PUSH/PULL: direction, if-full/empty and block
+                    op.a = (w >> 7) & 1;
+                    op.b = (w >> 5) & 3;
+                    break;
+                case 5: // MOV: destination, operation, source
+                    op.c = w & 7;
+                    if (op.a == 4)
+                        op.a = 8; // EXEC
+                    break;
+                case 6: // IRQ: clear, wait, index
+                    op.b = (w >> 5) & 3;
+                    break;
+            }
+        }
+        // wrap is given relative to the program, as in the .pio file
+        this->config.wrap = (config.wrap + origin) & 31;
+        this->config.wrapTarget = (config.wrapTarget + origin) & 31;
+        rxSize = config.fifoJoin == PioConfig::JOIN_RX ? 8 : config.fifoJoin == PioConfig::JOIN_TX ? 0 : 4;
+        txSize = config.fifoJoin == PioConfig::JOIN_TX ? 8 : config.fifoJoin == PioConfig::JOIN_RX ? 0 : 4;
+        div256 = (config.clkdivInt ? config.clkdivInt : 65536) * 256 + config.clkdivFrac;
+        pc = origin;
+    }
+
+    uint64_t cycle() const {
+        return cycleAt(tick);
+    }
+
+    bool put(uint32_t value) {
+        if (txCount >= txSize)
+            return false;
+        txFifo[(txHead + txCount++) % txSize] = value;
+        return true;
+    }
+
+    bool get(uint32_t& value) {
+        if (rxCount == 0)
+            return false;
+        value = rxFifo[rxHead];
+        rxHead = (rxHead + 1) % rxSize;
+        rxCount--;
+        return true;
+    }
+
+    size_t rxLevel() const { return rxCount; }
+    size_t txLevel() const { return txCount; }
+
+    void clearIrq(uint8_t index) {
+        irq &= ~(1 << (index & 7));
+    }
+
+    // Runs until the given cycle, or until something the host has to deal with: a push to the RX
+    // FIFO, or a stall on a FIFO/IRQ (time then jumps to the given cycle, as nothing on this
+    // state machine's side can end the stall).
+    PioStop run(uint64_t until) {
+        uint64_t untilTick = tickAt(until);
+        pushed = false;
+        while (tick < untilTick) {
+            if (fault)
+                return PIO_FAULT;
+            if (step(untilTick)) {
+                instructions++;
+                tick++;
+                if (pushed)
+                    return PIO_PUSHED;
+                continue;
+            }
+            if (fault)
+                return PIO_FAULT;
+            if (waiting == WAIT_HOST) {
+                tick = untilTick;
+                return PIO_STALLED;
+            }
+            // WAIT on a pin: skip to the first tick that can see it change
+            tick++;
+            if (fastPath) {
+                uint64_t c = cycle();
+                uint64_t change = input.nextChange(c > inputSync ? c - inputSync : 0);
+                uint64_t next = (change == PIO_NEVER) ? untilTick : std::min(untilTick, tickAt(change + inputSync));
+                if (next > tick) {
+                    skipped += next - tick;
+                    tick = next;
+                }
+            }
+        }
+        return PIO_UNTIL;
+    }
+};
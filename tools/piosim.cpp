@@ -0,0 +1,492 @@
+//
+// piosim: runs the receive and send PIO programs from vpw_pio.h in the host emulator (pioemu.h)
+// against synthetic bus waveforms, to check timing changes without a scope
+//
+//   g++ -std=c++17 -O2 -o piosim piosim.cpp
+//
+//   piosim [-n frames] [-s seed] [-j jitter us] [-d delay ns] [-S] [-v] [-b frames]
+//
+//   -n  random frames per test (default 200)
+//   -s  random seed
+//   -j  add up to +/- this many us to each pulse of the generated waveforms
+//   -d  transceiver loopback delay from the output pin to the input pin (default 1000 ns)
+//   -S  single-step everything (no fast paths)
+//   -v  print the RX FIFO words and send waveform of the first frame of each test
+//   -b  benchmark: time the receive program over this many frames, with and without fast paths
+//
+// For 1X and 4X, tests:
+//   receive    the RX FIFO words for generated frames match the pulse durations, and decode
+//              (with the thresholds of VPW::receiveLoop) to the same frames
+//   send       the send program, fed the words VPW::sendRaw writes, drives the nominal SOF/bit
+//              timing after waiting for an idle bus, and reports success
+//   loopback   the send program's waveform, received by the receive program, decodes to the frame
+//   congestion another node driving the bus during a passive bit (or before SOF) makes the send
+//              program stop driving and report congestion
+//
+// Exits with 1 if any test fails.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "pioemu.h"
+#include "vpwdecoder.h"
+#include "../vpw_pio.h"
+
+#define SYS_HZ  133000000   // "CPU Speed: 133 MHz"
+#define RX_PIN  0
+#define TX_PIN  1
+
+static uint64_t us(double t) {
+    return (uint64_t)(t * (SYS_HZ / 1000000));
+}
+
+static uint32_t seed = 0x2545F491;
+static int jitter = 0;
+static uint64_t loopbackDelay = us(1);
+static bool fastPath = true;
+static bool verbose = false;
+static int failures = 0;
+
+static uint32_t random32() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void fail(const char* test, const char* what, size_t frame) {
+    fprintf(stderr, "FAIL %s: %s (frame %zu)\n", test, what, frame);
+    failures++;
+}
+
+static std::vector<uint8_t> randomFrame() {
+    static const uint8_t crcPoly = 0x1D;
+    std::vector<uint8_t> frame;
+    size_t length = 4 + random32() % 9;
+    for (size_t i = 0; i < length; i++)
+        frame.push_back(random32() & 0xFF);
+    uint8_t crc = 0xFF;
+    for (uint8_t b : frame) {
+        crc ^= b;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x80) ? (crc << 1) ^ crcPoly : crc << 1;
+    }
+    frame.push_back(crc ^ 0xFF);
+    return frame;
+}
+
+// nominal pulses of a frame: (us, active); SOF, then bits alternating passive/active
+static std::vector<std::pair<double, bool>> pulses(const std::vector<uint8_t>& frame, bool mode4X) {
+    double div = mode4X ? 4 : 1;
+    std::vector<std::pair<double, bool>> ret;
+    ret.push_back({ 200 / div, true });
+    bool active = false;
+    for (uint8_t b : frame) {
+        for (int bit = 7; bit >= 0; bit--) {
+            bool one = (b >> bit) & 1;
+            ret.push_back({ ((one != active) ? 128 : 64) / div, active });
+            active = !active;
+        }
+    }
+    return ret;
+}
+
+// a bus waveform on RX_PIN: idle, then each frame followed by an IFS gap
+static PioWaveform waveform(const std::vector<std::vector<uint8_t>>& frames, bool mode4X,
+        std::vector<std::pair<double, bool>>* expected = nullptr) {
+    PioWaveform w;
+    uint64_t t = us(500);
+    double gap = mode4X ? 100 : 400;
+    if (expected)
+        expected->push_back({ 500, false });
+    for (const auto& frame : frames) {
+        for (auto p : pulses(frame, mode4X)) {
+            double d = p.first + (jitter ? (int)(random32() % (2 * jitter + 1)) - jitter : 0);
+            d = std::max(d, 2.0);
+            w.add(t, p.second ? (1 << RX_PIN) : 0);
+            t += us(d);
+            if (expected)
+                expected->push_back({ d, p.second });
+        }
+        w.add(t, 0);
+        t += us(gap);
+        if (expected)
+            expected->push_back({ gap, false });
+    }
+    w.add(t, 0);
+    return w;
+}
+
+static PioConfig receiveConfig() {
+    PioConfig c;
+    c.wrapTarget = vpw_receive_wrap_target;
+    c.wrap = vpw_receive_wrap;
+    c.setClkdiv((float)SYS_HZ / 5000000);
+    c.fifoJoin = PioConfig::JOIN_RX;
+    c.inShiftRight = false;
+    c.inBase = RX_PIN;
+    c.jmpPin = RX_PIN;
+    return c;
+}
+
+static PioConfig sendConfig(bool mode4X) {
+    PioConfig c;
+    c.wrapTarget = vpw_send_wrap_target;
+    c.wrap = vpw_send_wrap;
+    c.setClkdiv((float)SYS_HZ / (250000 * (mode4X ? 4 : 1)));
+    c.inShiftRight = false;
+    c.outShiftRight = false;
+    c.autopull = true;
+    c.jmpPin = RX_PIN;
+    c.setBase = TX_PIN;
+    c.setCount = 1;
+    return c;
+}
+
+// runs the receive program over a waveform; returns the RX FIFO words
+static std::vector<uint32_t> receive(PioInput& bus, uint64_t end, uint64_t* instructions = nullptr) {
+    PioStateMachine sm(vpw_receive_program_instructions, sizeof(vpw_receive_program_instructions) / 2, receiveConfig(), bus);
+    sm.fastPath = fastPath;
+    std::vector<uint32_t> words;
+    while (sm.run(end) != PIO_UNTIL) {
+        uint32_t w;
+        while (sm.get(w))
+            words.push_back(w);
+        sm.clearIrq(1); // as VPW::receiveHandler does
+    }
+    if (sm.rxDropped)
+        fprintf(stderr, "receive: %llu words dropped\n", (unsigned long long)sm.rxDropped);
+    if (instructions)
+        *instructions = sm.instructions;
+    return words;
+}
+
+static void testReceive(bool mode4X, size_t count) {
+    const char* name = mode4X ? "receive 4X" : "receive 1X";
+    std::vector<std::vector<uint8_t>> frames;
+    for (size_t i = 0; i < count; i++)
+        frames.push_back(randomFrame());
+    std::vector<std::pair<double, bool>> expected;
+    PioWaveform bus = waveform(frames, mode4X, &expected);
+    std::vector<uint32_t> words = receive(bus, bus.edges.back().cycle + us(1000));
+
+    // the last gap is still being counted at the end
+    if (words.size() != expected.size() - 1) {
+        fail(name, ("got " + std::to_string(words.size()) + " words, expected " + std::to_string(expected.size() - 1)).c_str(), 0);
+        return;
+    }
+    int minError = 0, maxError = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        if ((bool)(words[i] & 1) != expected[i].second) {
+            fail(name, "pulse level", i);
+            return;
+        }
+        int error = (int)(words[i] >> 1) - (int)(expected[i].first + 0.5);
+        minError = std::min(minError, error);
+        maxError = std::max(maxError, error);
+    }
+    if (verbose) {
+        printf("%s words:", name);
+        for (size_t i = 0; i < words.size() && i < 2 + 8 * frames[0].size() + 1; i++)
+            printf(" %u%c", words[i] >> 1, (words[i] & 1) ? 'A' : 'P');
+        printf("\n");
+    }
+    VpwDecoder decoder;
+    for (uint32_t w : words)
+        decoder.add(w);
+    decoder.idle();
+    bool same = decoder.frames.size() == frames.size();
+    for (size_t i = 0; same && i < frames.size(); i++)
+        same = decoder.frames[i].bytes == frames[i];
+    if (!same || decoder.runts || decoder.unexpectedEOF)
+        fail(name, "decoded frames differ", 0);
+    printf("%s: %zu frames, %zu words, duration error %d..%d us\n", name, frames.size(), words.size(), minError, maxError);
+    if (minError < -3 || maxError > 1)
+        fail(name, "duration error out of range", 0);
+}
+
+// the bus as seen on RX_PIN: another node's waveform, or'ed with our own output after the
+// transceiver delay
+class LoopbackBus : public PioInput {
+private:
+    size_t cursor = 0;
+
+    bool own(uint64_t cycle) {
+        if (!tx || cycle < loopbackDelay)
+            return false;
+        cycle -= loopbackDelay;
+        const auto& edges = tx->edges;
+        if (cursor >= edges.size() || (cursor > 0 && edges[cursor].cycle > cycle))
+            cursor = 0;
+        while (cursor < edges.size() && edges[cursor].cycle <= cycle)
+            cursor++;
+        return cursor > 0 && ((edges[cursor - 1].pins >> TX_PIN) & 1);
+    }
+
+public:
+    PioWaveform other;
+    PioStateMachine* tx = nullptr;
+
+    uint32_t read(uint64_t cycle) override {
+        return other.read(cycle) | (own(cycle) ? (1 << RX_PIN) : 0);
+    }
+
+    uint64_t nextChange(uint64_t cycle) override {
+        uint64_t next = other.nextChange(cycle);
+        if (tx) {
+            for (const auto& e : tx->edges) {
+                if (e.cycle + loopbackDelay > cycle) {
+                    next = std::min(next, e.cycle + loopbackDelay);
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+};
+
+// the words VPW::sendRaw writes to the TX FIFO
+static std::vector<uint32_t> sendWords(const std::vector<uint8_t>& data) {
+    std::vector<uint32_t> words;
+    size_t bytes = data.size();
+    uint8_t padding = (3 - (bytes % 4)) % 4;
+    uint32_t w = bytes;
+    uint8_t bits = 8;
+    for (size_t i = 0; i < bytes; i++) {
+        w = (w << 8) | data[i];
+        bits += 8;
+        if (bits == 32) {
+            words.push_back(w);
+            w = 0;
+            bits = 0;
+        }
+    }
+    if (padding > 0) {
+        w <<= 8 * padding;
+        words.push_back(w);
+    }
+    return words;
+}
+
+struct SendResult {
+    bool completed = false;
+    uint32_t status = 0;
+    std::vector<std::pair<double, bool>> driven;    // pulses on TX_PIN (us, active)
+    double sofDelay = -1;                           // us from the first word to SOF
+    PioWaveform waveform;                           // TX_PIN mapped onto RX_PIN, for loopback
+};
+
+static SendResult send(const std::vector<uint8_t>& frame, bool mode4X, LoopbackBus& bus) {
+    SendResult result;
+    PioStateMachine sm(vpw_send_program_instructions, sizeof(vpw_send_program_instructions) / 2, sendConfig(mode4X), bus);
+    sm.fastPath = fastPath;
+    bus.tx = &sm;
+    uint64_t start = us(100);
+    sm.run(start);
+    std::vector<uint32_t> words = sendWords(frame);
+    size_t next = 0;
+    uint64_t t = start;
+    uint64_t end = start + us(100000);
+    while (t < end) {
+        while (next < words.size() && sm.put(words[next]))
+            next++;
+        t = std::min(end, t + us(20)); // the CPU's put_blocking loop
+        PioStop stop = sm.run(t);
+        uint32_t w;
+        if (stop == PIO_PUSHED && sm.get(w)) {
+            result.completed = true;
+            result.status = w;
+            break;
+        }
+        if (stop == PIO_FAULT)
+            break;
+    }
+    sm.run(sm.cycle() + us(1000));
+    bus.tx = nullptr;
+
+    uint64_t last = 0;
+    bool level = false;
+    for (const auto& e : sm.edges) {
+        bool active = (e.pins >> TX_PIN) & 1;
+        if (active == level)
+            continue;
+        if (last > 0)
+            result.driven.push_back({ (e.cycle - last) / (double)us(1), level });
+        else
+            result.sofDelay = (e.cycle - start) / (double)us(1);
+        result.waveform.add(e.cycle, active ? (1 << RX_PIN) : 0);
+        last = e.cycle;
+        level = active;
+    }
+    result.waveform.add(sm.cycle(), 0);
+    return result;
+}
+
+static void testSend(bool mode4X, size_t count) {
+    const char* name = mode4X ? "send 4X" : "send 1X";
+    const char* loopName = mode4X ? "loopback 4X" : "loopback 1X";
+    double sofMin = 1e9, sofMax = 0;
+    for (size_t i = 0; i < count; i++) {
+        std::vector<uint8_t> frame = randomFrame();
+        LoopbackBus bus;
+        SendResult r = send(frame, mode4X, bus);
+        if (!r.completed || r.status == 0) {
+            fail(name, "no success status", i);
+            return;
+        }
+        auto expected = pulses(frame, mode4X);
+        // the last bit ends a tick early: the program leaves the loop without the next OUT
+        expected.back().first -= mode4X ? 1 : 4;
+        if (r.driven != expected) {
+            fail(name, "driven waveform differs from nominal", i);
+            if (verbose) {
+                for (size_t j = 0; j < r.driven.size() && j < expected.size(); j++)
+                    printf("  %zu: %.2f%c (%.2f%c)\n", j, r.driven[j].first, r.driven[j].second ? 'A' : 'P', expected[j].first, expected[j].second ? 'A' : 'P');
+            }
+            return;
+        }
+        sofMin = std::min(sofMin, r.sofDelay);
+        sofMax = std::max(sofMax, r.sofDelay);
+        if (verbose && i == 0) {
+            printf("%s waveform: SOF after %.2fus:", name, r.sofDelay);
+            for (auto p : r.driven)
+                printf(" %g%c", p.first, p.second ? 'A' : 'P');
+            printf("\n");
+        }
+
+        VpwDecoder decoder;
+        for (uint32_t w : receive(r.waveform, r.waveform.edges.back().cycle + us(1000)))
+            decoder.add(w);
+        decoder.idle();
+        if (decoder.frames.size() != 1 || decoder.frames[0].bytes != frame || decoder.runts || decoder.unexpectedEOF) {
+            fail(loopName, "decoded frame differs", i);
+            return;
+        }
+    }
+    printf("%s: %zu frames, nominal timing (last bit %dus short), SOF %.2f-%.2fus after the first word\n", name, count, mode4X ? 1 : 4, sofMin, sofMax);
+    printf("%s: %zu frames decoded\n", loopName, count);
+}
+
+static void testCongestion(bool mode4X, size_t count) {
+    const char* name = mode4X ? "congestion 4X" : "congestion 1X";
+    double div = mode4X ? 4 : 1;
+    size_t lost = 0, early = 0;
+    for (size_t i = 0; i < count; i++) {
+        std::vector<uint8_t> frame = randomFrame();
+        LoopbackBus bus;
+        auto p = pulses(frame, mode4X);
+        // our long (1) passive bits, which a node sending a 0 there ends early
+        std::vector<size_t> ones;
+        for (size_t j = 1; j < p.size(); j += 2) {
+            if (p[j].first > 96 / div)
+                ones.push_back(j);
+        }
+        bool beforeSOF = (i % 4 == 0) || ones.empty();
+        uint64_t start = us(100);
+        uint64_t at, length;
+        if (beforeSOF) {
+            // another frame's SOF during our 280us idle wait
+            at = start + us((20 + random32() % 200) / div);
+            length = us(200 / div);
+        } else {
+            // a node sending 0 where we send 1 goes active after a short passive bit
+            size_t bit = ones[random32() % ones.size()];
+            double t = 0;
+            for (size_t j = 0; j < bit; j++)
+                t += p[j].first;
+            LoopbackBus probe;
+            double sof = send(frame, mode4X, probe).sofDelay;
+            at = start + us(sof + t + 64 / div);
+            length = us(128 / div);
+        }
+        bus.other.add(at, 1 << RX_PIN);
+        bus.other.add(at + length, 0);
+        SendResult r = send(frame, mode4X, bus);
+        if (!r.completed || r.status != 0) {
+            fail(name, "no congestion reported", i);
+            return;
+        }
+        // nothing may be driven once the other node has the bus
+        uint64_t sof = r.sofDelay < 0 ? PIO_NEVER : start + us(r.sofDelay);
+        if (beforeSOF) {
+            if (sof != PIO_NEVER)
+                early++;
+        } else {
+            for (const auto& e : r.waveform.edges) {
+                if (e.cycle > at + length + us(64 / div) && e.pins)
+                    lost++;
+            }
+        }
+    }
+    if (early || lost)
+        fail(name, ("drove the bus after congestion " + std::to_string(early + lost) + " times").c_str(), 0);
+    else
+        printf("%s: %zu frames, none started or kept driving after losing the bus\n", name, count);
+}
+
+static void benchmark(size_t count) {
+    std::vector<std::vector<uint8_t>> frames;
+    for (size_t i = 0; i < count; i++)
+        frames.push_back(randomFrame());
+    PioWaveform bus = waveform(frames, false);
+    uint64_t end = bus.edges.back().cycle + us(1000);
+    std::vector<uint32_t> reference;
+    for (bool fast : { false, true }) {
+        fastPath = fast;
+        uint64_t instructions;
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<uint32_t> words = receive(bus, end, &instructions);
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        double simulated = end / (double)SYS_HZ;
+        printf("benchmark %s: %zu frames, %.1fs of bus in %.3fs (%.0fx real time), %.1fM instructions/s\n",
+                fast ? "fast path" : "single step", count, simulated, wall, simulated / wall, instructions / wall / 1e6);
+        if (!fast)
+            reference = words;
+        else if (words != reference)
+            fail("benchmark", "fast path words differ from single-stepped", 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t count = 200;
+    size_t bench = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 0);
+            if (seed == 0)
+                seed = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jitter = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            loopbackDelay = us(atof(argv[++i]) / 1000);
+        } else if (strcmp(argv[i], "-S") == 0) {
+            fastPath = false;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            bench = strtoul(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n frames] [-s seed] [-j jitter us] [-d delay ns] [-S] [-v] [-b frames]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (bench) {
+        benchmark(bench);
+    } else {
+        for (bool mode4X : { false, true }) {
+            testReceive(mode4X, count);
+            testSend(mode4X, count);
+            testCongestion(mode4X, count);
+        }
+    }
+    if (failures)
+        fprintf(stderr, "%d FAILED\n", failures);
+    return failures ? 1 : 0;
+}
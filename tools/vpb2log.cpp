@@ -0,0 +1,126 @@
+//
+// vpb2log: converts a binary .vpb SD log (compressed or not) back to the text .log format
+//
+//   g++ -std=c++17 -O2 -o vpb2log vpb2log.cpp
+//
+//   vpb2log [-s] [-t <epoch seconds>] <file.vpb> [output.log]
+//
+//   -s  print a summary (records, bytes per record, compression, time span) to stderr
+//   -t  start at the given time, using the file's time index to seek if it has one
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../vpb.h"
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// returns the offset of the last index point at or before the given time, or 0 if there is none
+static long seekIndex(FILE* in, uint32_t start) {
+    uint8_t trailer[8];
+    if (fseek(in, -8, SEEK_END) != 0 || fread(trailer, 1, 8, in) != 8 || memcmp(trailer + 4, VPB_TRAILER_MAGIC, 4) != 0)
+        return 0;
+    uint8_t head[8];
+    if (fseek(in, get32(trailer), SEEK_SET) != 0 || fread(head, 1, 8, in) != 8 || memcmp(head, VPB_INDEX_MAGIC, 4) != 0)
+        return 0;
+    long offset = 0;
+    for (uint32_t i = 0, count = get32(head + 4); i < count; i++) {
+        uint8_t entry[12];
+        if (fread(entry, 1, 12, in) != 12 || get32(entry + 4) > start)
+            break;
+        offset = get32(entry);
+    }
+    return offset;
+}
+
+int main(int argc, char** argv) {
+    bool summary = false;
+    bool seek = false;
+    uint32_t start = 0;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            summary = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seek = true;
+            start = strtoul(argv[++i], nullptr, 10);
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty() || files.size() > 2) {
+        fprintf(stderr, "usage: %s [-s] [-t <epoch seconds>] <file.vpb> [output.log]\n", argv[0]);
+        return 2;
+    }
+
+    FILE* in = fopen(files[0], "rb");
+    if (!in) {
+        perror(files[0]);
+        return 1;
+    }
+    FILE* out = files.size() > 1 ? fopen(files[1], "wb") : stdout;
+    if (!out) {
+        perror(files[1]);
+        return 1;
+    }
+
+    auto source = [in]() { return fgetc(in); };
+    VpbReader<decltype(source)> reader(source);
+    VpbHeader header;
+    if (!reader.header(header)) {
+        fprintf(stderr, "%s: not a VPB file\n", files[0]);
+        return 1;
+    }
+    long dataStart = ftell(in);
+    if (seek) {
+        long offset = seekIndex(in, start);
+        fseek(in, offset > 0 ? offset : dataStart, SEEK_SET);
+        dataStart = ftell(in);
+    }
+
+    unsigned long records = 0;
+    unsigned long frames = 0;
+    unsigned long repeats = 0;
+    unsigned long deltas = 0;
+    unsigned long textBytes = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    VpbRecord r;
+    while (reader.next(r)) {
+        if ((r.flags & VPB_SYNC) || (seek && r.sec < start))
+            continue;
+        if (records++ == 0)
+            first = r.sec;
+        last = r.sec;
+        if (r.frame.size() > 0)
+            frames++;
+        if (r.flags & VPB_REPEAT)
+            repeats++;
+        if (r.flags & VPB_DELTA)
+            deltas++;
+        std::string line = vpbText(r);
+        line += "\r\n";
+        textBytes += line.size();
+        fwrite(line.data(), 1, line.size(), out);
+    }
+
+    if (summary) {
+        long end = ftell(in);
+        fprintf(stderr, "firmware:      %s\n", header.firmware.c_str());
+        fprintf(stderr, "settings:      %s\n", header.settings.c_str());
+        fprintf(stderr, "records:       %lu (%lu frames)\n", records, frames);
+        fprintf(stderr, "record bytes:  %ld (%.1f per record)\n", end - dataStart, records ? (double)(end - dataStart) / records : 0.0);
+        fprintf(stderr, "compression:   %.2f:1 vs text (%lu repeated, %lu delta frames)\n", end > dataStart ? (double)textBytes / (end - dataStart) : 0.0, repeats, deltas);
+        fprintf(stderr, "time span:     %u - %u (%u s)\n", first, last, last - first);
+    }
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
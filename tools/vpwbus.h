@@ -0,0 +1,600 @@
+#pragma once
+
+//
+// vpwbus: a simulated wired-OR VPW bus at pulse resolution, for host-side end-to-end tests
+// (see bussim.cpp)
+//
+// Nodes drive the bus active or leave it passive; the bus level is the OR of them all.  Time
+// is in ns and only advances from one node event to the next, so a simulation runs as fast as
+// the events can be processed.  Each edge produces the word the receive PIO program would
+// push for the pulse that just ended ((us << 1) | active), which is what VPW::receiveLoop
+// consumes.
+//
+// VpwTransmitter sends frames the way the send PIO program does: it waits for the bus to stay
+// passive for the SOF delay, drives the SOF and the bits (1X or 4X), checks the bus towards
+// the end of each of its passive pulses and stops driving if another node has it active (a
+// lost arbitration, or a break), then tries again.  Nodes that start together therefore
+// arbitrate bitwise, and the bus carries the winner's frame.  ECUs, traffic generators, the
+// tester (the adapter's own send path) and noise are built on it; the bus decodes its own
+// traffic with the receiveLoop thresholds to hand completed frames to every node.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "vpwdecoder.h"
+
+#define VPW_NEVER UINT64_MAX
+#define VPW_US 1000ull
+#define VPW_MS 1000000ull
+
+class VpwBus;
+
+struct VpwFrame {
+    std::vector<uint8_t> bytes;
+    bool mode4X = false;
+
+    static uint8_t crc(const uint8_t* data, size_t length) {
+        uint8_t crc = 0xFF;
+        for (size_t i = 0; i < length; i++) {
+            crc ^= data[i];
+            for (int b = 0; b < 8; b++)
+                crc = (crc & 0x80) ? (crc << 1) ^ 0x1D : crc << 1;
+        }
+        return crc ^ 0xFF;
+    }
+
+    // from hex, appending the CRC
+    static VpwFrame parse(const std::string& hex, bool mode4X = false) {
+        VpwFrame f;
+        f.mode4X = mode4X;
+        std::string digits;
+        for (char c : hex) {
+            if (isxdigit((unsigned char)c))
+                digits += c;
+        }
+        for (size_t i = 0; i + 1 < digits.size(); i += 2)
+            f.bytes.push_back((uint8_t)strtoul(digits.substr(i, 2).c_str(), nullptr, 16));
+        f.bytes.push_back(crc(f.bytes.data(), f.bytes.size()));
+        return f;
+    }
+
+    bool valid() const {
+        return bytes.size() >= 2 && crc(bytes.data(), bytes.size() - 1) == bytes.back();
+    }
+};
+
+class VpwNode {
+public:
+    std::string name;
+    bool drive = false;             // active
+    uint64_t next = VPW_NEVER;      // time of the next event()
+
+    VpwNode(const std::string& name) : name(name) {}
+    virtual ~VpwNode() {}
+
+    virtual void event(VpwBus&) {}
+    virtual void edge(VpwBus&, bool /*active*/) {}
+    // a frame completed on the bus (including the node's own)
+    virtual void received(VpwBus&, const VpwDecoder::Frame&) {}
+};
+
+class VpwBus {
+private:
+    std::vector<VpwNode*> nodes;
+    VpwDecoder decoder;
+    uint64_t idleAt = VPW_NEVER;    // when a passive bus ends the frame in progress
+    size_t delivered = 0;
+
+public:
+    struct Sent {
+        VpwFrame frame;
+        VpwNode* node;
+        uint64_t sof;
+        uint64_t end;
+    };
+
+    uint64_t now = 0;
+    bool level = false;
+    uint64_t lastEdge = 0;
+    uint32_t seed = 0x2545F491;
+
+    // the receive words, with the time each pulse ended
+    std::function<void(uint32_t word, uint64_t end)> words;
+
+    // every frame a transmitter got through, in order (the ground truth)
+    std::vector<Sent> sent;
+    uint64_t activeTime = 0;
+    uint64_t idleTime = 0;          // passive beyond the EOF threshold
+    uint64_t events = 0;
+
+    uint32_t random() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    void add(VpwNode& node) {
+        nodes.push_back(&node);
+    }
+
+    // time of the next scheduled event (VPW_NEVER if none)
+    uint64_t next() const {
+        uint64_t t = idleAt;
+        for (VpwNode* n : nodes)
+            t = std::min(t, n->next);
+        return t;
+    }
+
+    void run(uint64_t until) {
+        while (true) {
+            uint64_t t = next();
+            if (t > until)
+                break;
+            now = t;
+            events++;
+            for (VpwNode* n : nodes) {
+                if (n->next == t) {
+                    n->next = VPW_NEVER;
+                    n->event(*this);
+                }
+            }
+            if (idleAt == t) {
+                idleAt = VPW_NEVER;
+                decoder.idle();
+                deliver();
+            }
+            update();
+        }
+        now = until;
+    }
+
+    // re-evaluates the wired OR after a node changed what it drives
+    void update() {
+        bool active = false;
+        for (VpwNode* n : nodes)
+            active |= n->drive;
+        if (active == level)
+            return;
+        uint64_t duration = now - lastEdge;
+        uint32_t word = (uint32_t)((duration / VPW_US) << 1) | (level ? 1 : 0);
+        uint64_t eof = (decoder.mode4X ? 240 / 4 : 240) * VPW_US;
+        if (level)
+            activeTime += duration;
+        else if (duration > eof)
+            idleTime += duration - eof;
+        decoder.add(word, now);
+        if (words)
+            words(word, now);
+        deliver();
+        level = active;
+        lastEdge = now;
+        // a passive bus past the EOF threshold completes the frame before the next edge
+        idleAt = active ? VPW_NEVER : now + (decoder.mode4X ? 240 / 4 : 240) * VPW_US + 1;
+        for (VpwNode* n : nodes)
+            n->edge(*this, active);
+    }
+
+    // share of the time the bus carried frames (SOF to EOF), in %
+    double load() const {
+        uint64_t eof = (decoder.mode4X ? 240 / 4 : 240) * VPW_US;
+        uint64_t idle = idleTime + (!level && now - lastEdge > eof ? now - lastEdge - eof : 0);
+        return now ? 100.0 - 100.0 * idle / now : 0;
+    }
+
+private:
+    void deliver() {
+        while (delivered < decoder.frames.size()) {
+            const VpwDecoder::Frame& f = decoder.frames[delivered++];
+            for (VpwNode* n : nodes)
+                n->received(*this, f);
+        }
+    }
+};
+
+//
+// TRANSMITTER
+//
+class VpwTransmitter : public VpwNode {
+private:
+    struct Pending {
+        uint64_t due;
+        VpwFrame frame;
+    };
+
+    enum { IDLE, WAITING, SENDING } state = IDLE;
+    std::deque<Pending> outbox;
+    std::vector<std::pair<uint64_t, bool>> pulses;  // (ns, active)
+    size_t pulse = 0;
+    uint64_t pulseEnd = 0;
+    uint64_t sof = 0;
+    bool checked = false;
+    uint64_t passiveSince = 0;
+    uint64_t start = VPW_NEVER;     // planned SOF
+
+    void build(const VpwFrame& frame) {
+        uint64_t div = frame.mode4X ? 4 : 1;
+        pulses.clear();
+        pulses.push_back({ 200 * VPW_US / div, true });
+        bool active = false;
+        for (uint8_t b : frame.bytes) {
+            for (int bit = 7; bit >= 0; bit--) {
+                bool one = (b >> bit) & 1;
+                pulses.push_back({ ((one != active) ? 128 : 64) * VPW_US / div, active });
+                active = !active;
+            }
+        }
+    }
+
+    uint64_t div() const {
+        return outbox.front().frame.mode4X ? 4 : 1;
+    }
+
+    // plans the SOF of the frame at the head of the outbox: the send program starts waiting
+    // when the words are written, and sends once the bus has been passive for the whole wait
+    void schedule(VpwBus& bus) {
+        if (outbox.empty()) {
+            state = IDLE;
+            next = wake;
+            return;
+        }
+        state = WAITING;
+        if (bus.level) {
+            start = VPW_NEVER; // edge() plans again once the bus is passive
+        } else {
+            start = std::max(outbox.front().due, passiveSince) + sofDelay / div();
+            start = std::max(start + (jitter ? bus.random() % jitter : 0), bus.now);
+        }
+        next = std::min(start, wake);
+    }
+
+    void drivePulse(VpwBus& bus) {
+        drive = pulses[pulse].second;
+        pulseEnd = bus.now + pulses[pulse].first;
+        checked = drive;
+        pulseNext();
+    }
+
+    // the send program looks at the bus shortly before the end of each passive pulse
+    void pulseNext() {
+        next = std::min(checked ? pulseEnd : pulseEnd - checkLead / div(), wake);
+    }
+
+protected:
+    uint64_t wake = VPW_NEVER;      // for subclasses: onWake() is called at this time
+
+    virtual void onWake(VpwBus&) {}
+    virtual void sent(VpwBus&, const VpwFrame&, uint64_t /*sof*/) {}
+    virtual void lost(VpwBus&, const VpwFrame&) {}   // only without retry
+
+public:
+    uint64_t sofDelay = 308 * VPW_US;   // measured from the send program (piosim)
+    uint64_t checkLead = 8 * VPW_US;
+    uint64_t sample = 4 * VPW_US;       // the send program's clock: it misses an SOF younger than this
+    uint32_t jitter = 2000;             // ns of random delay before SOF (the CPU)
+    bool retry = true;                  // after losing arbitration (the send program gives up)
+
+    // statistics
+    uint64_t framesSent = 0;
+    uint64_t arbitrationLost = 0;
+
+    VpwTransmitter(const std::string& name) : VpwNode(name) {}
+
+    // queues a frame to go out no earlier than 'due'
+    void send(VpwBus& bus, const VpwFrame& frame, uint64_t due) {
+        // in order of due time, behind the frame being sent
+        auto first = outbox.begin() + (state == SENDING ? 1 : 0);
+        auto it = outbox.end();
+        while (it != first && (it - 1)->due > due)
+            --it;
+        outbox.insert(it, { due, frame });
+        if (state != SENDING)
+            schedule(bus);
+    }
+
+    size_t queued() const {
+        return outbox.size();
+    }
+
+    void setWake(VpwBus&, uint64_t at) {
+        wake = at;
+        if (state == IDLE)
+            next = wake;
+        else
+            next = std::min(next, wake);
+    }
+
+    void event(VpwBus& bus) override {
+        if (bus.now >= wake) {
+            wake = VPW_NEVER;
+            onWake(bus);
+        }
+        switch (state) {
+            case IDLE:
+                if (!outbox.empty())
+                    schedule(bus);
+                else
+                    next = wake;
+                break;
+            case WAITING:
+                if ((bus.level && bus.now - bus.lastEdge >= sample / div()) || bus.now < start) {
+                    if (bus.now >= start)
+                        schedule(bus);
+                    else
+                        next = std::min(start, wake);
+                    break;
+                }
+                build(outbox.front().frame);
+                state = SENDING;
+                pulse = 0;
+                sof = bus.now;
+                drivePulse(bus);
+                break;
+            case SENDING:
+                if (bus.now < pulseEnd) {
+                    if (!checked && bus.now >= pulseEnd - checkLead / div()) {
+                        checked = true;
+                        if (bus.level) {
+                            // another node is active while we are passive: stop and retry
+                            arbitrationLost++;
+                            drive = false;
+                            if (!retry) {
+                                VpwFrame frame = outbox.front().frame;
+                                outbox.pop_front();
+                                state = IDLE;
+                                lost(bus, frame);
+                            }
+                            schedule(bus);
+                            break;
+                        }
+                    }
+                    pulseNext();
+                    break;
+                }
+                if (++pulse < pulses.size()) {
+                    drivePulse(bus);
+                    break;
+                }
+                drive = false;
+                framesSent++;
+                bus.sent.push_back({ outbox.front().frame, this, sof, bus.now });
+                {
+                    VpwFrame frame = outbox.front().frame;
+                    outbox.pop_front();
+                    state = IDLE;
+                    sent(bus, frame, sof);
+                }
+                if (state == IDLE)
+                    schedule(bus);
+                break;
+        }
+    }
+
+    void edge(VpwBus& bus, bool active) override {
+        if (!active)
+            passiveSince = bus.now;
+        // another node starting just before our SOF goes unnoticed: both send and arbitrate
+        if (state == WAITING && !(active && start != VPW_NEVER && start < bus.now + sample / div()))
+            schedule(bus);
+    }
+};
+
+//
+// ECU: answers requests addressed to it after a processing delay
+//
+class VpwEcu : public VpwTransmitter {
+private:
+    std::map<std::vector<uint8_t>, std::vector<VpwFrame>> responses;
+
+public:
+    uint8_t address;
+    uint64_t delay;                 // ns from the request's EOF to queueing the response
+    bool answerAll = true;          // generic positive response to requests without a script
+    uint64_t requests = 0;
+
+    VpwEcu(const std::string& name, uint8_t address, uint64_t delay = 2 * VPW_MS) :
+            VpwTransmitter(name), address(address), delay(delay) {}
+
+    // a request (without its CRC) and the frames that answer it
+    void respond(const std::string& request, const std::string& response) {
+        VpwFrame r = VpwFrame::parse(request);
+        r.bytes.pop_back();
+        responses[r.bytes].push_back(VpwFrame::parse(response));
+    }
+
+    void received(VpwBus& bus, const VpwDecoder::Frame& frame) override {
+        const auto& b = frame.bytes;
+        if (b.size() < 4 || b[1] != address || !VpwFrame{ b }.valid())
+            return;
+        requests++;
+        std::vector<uint8_t> request(b.begin(), b.end() - 1);
+        auto match = responses.find(request);
+        if (match != responses.end()) {
+            for (VpwFrame r : match->second) {
+                r.mode4X = frame.mode4X;
+                send(bus, r, bus.now + delay);
+            }
+        } else if (answerAll && (b[0] & 0x04)) {
+            // physical request: <prio> <target> <source> <mode> [data] -> mode + 0x40, echoed data
+            std::vector<uint8_t> r = { b[0], b[2], address, (uint8_t)(b[3] + 0x40) };
+            r.insert(r.end(), b.begin() + 4, b.end() - 1);
+            r.push_back(bus.random() & 0xFF);
+            r.push_back(bus.random() & 0xFF);
+            VpwFrame f;
+            f.bytes = r;
+            f.bytes.push_back(VpwFrame::crc(r.data(), r.size()));
+            f.mode4X = frame.mode4X;
+            send(bus, f, bus.now + delay);
+        }
+    }
+};
+
+//
+// TRAFFIC GENERATOR: random frames with a fixed header at a rate (frames/s) or a bus load (%)
+//
+class VpwTraffic : public VpwTransmitter {
+private:
+    VpwFrame frame() {
+        VpwFrame f;
+        f.bytes = header;
+        size_t length = minPayload + (maxPayload > minPayload ? bus->random() % (maxPayload - minPayload + 1) : 0);
+        for (size_t i = 0; i < length; i++)
+            f.bytes.push_back(bus->random() & 0xFF);
+        f.bytes.push_back(VpwFrame::crc(f.bytes.data(), f.bytes.size()));
+        f.mode4X = mode4X;
+        return f;
+    }
+
+    // approximate bus time of a frame, for load-based pacing
+    uint64_t airtime(const VpwFrame& f) const {
+        return ((200 + f.bytes.size() * 8 * 96 + 300) * VPW_US) / (f.mode4X ? 4 : 1);
+    }
+
+protected:
+    void onWake(VpwBus& bus) override {
+        // keep one frame queued; a frame that can't get on the bus delays the next
+        if (queued() < 2) {
+            VpwFrame f = frame();
+            send(bus, f, bus.now);
+            uint64_t period = rate ? VPW_MS * 1000 / rate : airtime(f) * 100 / std::max(load, 1u);
+            setWake(bus, bus.now + period);
+        } else {
+            setWake(bus, bus.now + VPW_MS);
+        }
+    }
+
+public:
+    VpwBus* bus;
+    std::vector<uint8_t> header;
+    unsigned rate = 0;          // frames/s, or 0 for load
+    unsigned load = 50;
+    size_t minPayload = 1;
+    size_t maxPayload = 8;
+    bool mode4X = false;
+
+    VpwTraffic(const std::string& name, VpwBus& bus, const std::vector<uint8_t>& header) :
+            VpwTransmitter(name), bus(&bus), header(header) {}
+
+    void start(uint64_t at) {
+        setWake(*bus, at);
+    }
+};
+
+//
+// TESTER: the adapter's send path, polling a request and timing the responses
+//
+class VpwTester : public VpwTransmitter {
+private:
+    uint64_t requestedAt = VPW_NEVER;   // queued, waiting for the response
+
+protected:
+    // polls every period, or once the previous request is answered or has timed out
+    void onWake(VpwBus& bus) override {
+        if (requestedAt != VPW_NEVER) {
+            if (bus.now < requestedAt + timeout) {
+                setWake(bus, requestedAt + timeout);
+                return;
+            }
+            timeouts++;
+        }
+        request.mode4X = mode4X;
+        send(bus, request, bus.now);
+        requestedAt = bus.now;
+        setWake(bus, bus.now + period);
+    }
+
+public:
+    VpwFrame request;
+    uint64_t period;
+    uint64_t timeout = 200 * VPW_MS;    // the ELM default (ATST32)
+    bool mode4X = false;
+    std::vector<uint64_t> latencies;    // ns from queueing the request to the response's EOF
+    uint64_t timeouts = 0;
+
+    VpwTester(const std::string& name, const VpwFrame& request, uint64_t period) :
+            VpwTransmitter(name), request(request), period(period) {}
+
+    void start(VpwBus& bus, uint64_t at) {
+        setWake(bus, at);
+    }
+
+    void received(VpwBus& bus, const VpwDecoder::Frame& frame) override {
+        const auto& q = request.bytes;
+        const auto& r = frame.bytes;
+        if (requestedAt == VPW_NEVER || r.size() < 4 || q.size() < 4)
+            return;
+        if (r[1] == q[2] && r[2] == q[1] && r[3] == (uint8_t)(q[3] + 0x40)) {
+            latencies.push_back(bus.now - requestedAt);
+            setWake(bus, std::max(bus.now, requestedAt + period));
+            requestedAt = VPW_NEVER;
+        }
+    }
+};
+
+//
+// NOISE: glitches (short active spikes, seen as runts or corrupted bits) and breaks
+//
+class VpwNoise : public VpwNode {
+private:
+    uint64_t until = 0;
+
+    void plan(VpwBus& bus) {
+        if (rate == 0) {
+            next = breakAt;
+            return;
+        }
+        // exponential gaps between glitches
+        double u = (bus.random() + 1.0) / 4294967297.0;
+        next = std::min(breakAt, bus.now + (uint64_t)(-std::log(u) * 1e9 / rate));
+    }
+
+public:
+    double rate = 0;                // glitches/s
+    uint64_t maxGlitch = 20 * VPW_US;
+    uint64_t breakAt = VPW_NEVER;
+    uint64_t breakLength = 500 * VPW_US;
+
+    // bus intervals disturbed, to tell corrupted frames from decode errors
+    std::vector<std::pair<uint64_t, uint64_t>> disturbed;
+    uint64_t glitches = 0;
+    uint64_t breaks = 0;
+
+    VpwNoise() : VpwNode("noise") {}
+
+    void start(VpwBus& bus) {
+        plan(bus);
+    }
+
+    void event(VpwBus& bus) override {
+        if (drive) {
+            drive = false;
+            plan(bus);
+            return;
+        }
+        uint64_t length;
+        if (bus.now >= breakAt) {
+            breakAt = VPW_NEVER;
+            length = breakLength;
+            breaks++;
+        } else {
+            length = 1 + bus.random() % maxGlitch;
+            glitches++;
+        }
+        drive = true;
+        next = bus.now + length;
+        disturbed.push_back({ bus.now, next });
+    }
+
+    bool disturbs(uint64_t from, uint64_t to) const {
+        auto it = std::lower_bound(disturbed.begin(), disturbed.end(), std::make_pair(from, (uint64_t)0));
+        if (it != disturbed.begin() && (it - 1)->second >= from)
+            return true;
+        return it != disturbed.end() && it->first <= to;
+    }
+};
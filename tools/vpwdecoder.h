@@ -0,0 +1,122 @@
+#pragma once
+
+//
+// vpwdecoder: VPW::receiveLoop's pulse classification on the host, for the tools that need to
+// check what the adapter would make of a stream of receive words ((us << 1) | active)
+//
+// The thresholds, the 1X/4X switching and the frame/bit bookkeeping follow vpw_receive.ino;
+// instead of the encoded queue it keeps the decoded frames and counts the error events.
+//
+
+#include <cstdint>
+#include <vector>
+
+class VpwDecoder {
+private:
+    bool inFrame = false;
+    uint8_t byte = 0;
+    int bitCount = 0;
+    unsigned frameBits = 0;
+    uint64_t sof = 0;
+
+    void eof() {
+        if (bitCount > 0)
+            unexpectedEOF++;
+        if (inFrame)
+            frames.push_back({ current, sof, mode4X });
+        reset();
+    }
+
+    void reset() {
+        inFrame = false;
+        current.clear();
+        bitCount = 0;
+        frameBits = 0;
+    }
+
+public:
+    struct Frame {
+        std::vector<uint8_t> bytes;
+        uint64_t sof;           // time the SOF pulse started, in the units given to add()
+        bool mode4X;
+    };
+
+    bool mode4X = false;
+    std::vector<Frame> frames;
+    std::vector<uint8_t> current;
+
+    // events
+    size_t runts = 0;
+    size_t breaks = 0;
+    size_t highs = 0;           // bus stuck active
+    size_t unexpectedSOF = 0;
+    size_t unexpectedEOF = 0;   // a partial byte before EOF
+    size_t modeSwitches = 0;
+
+    // a receive word, and (optionally) the time the pulse ended, in ns
+    void add(uint32_t word, uint64_t end = 0) {
+        bool active = word & 1;
+        uint32_t diff = word >> 1;
+        uint64_t start = end - (uint64_t)diff * 1000;
+
+        if (!inFrame && !frameBits) {
+            if (diff > 163 && diff <= 239) {
+                if (mode4X)
+                    modeSwitches++;
+                mode4X = false;
+            } else if (diff > 163 / 4 && diff <= 239 / 4) {
+                if (!mode4X)
+                    modeSwitches++;
+                mode4X = true;
+            }
+        }
+        if (mode4X) {
+            diff *= 4;
+            if (diff > 240 && diff <= 1000 && active) {
+                diff /= 4;
+                mode4X = false;
+                modeSwitches++;
+            }
+        }
+
+        if (diff > 240) {
+            if (diff <= (mode4X ? 4000u : 1000u) && active) {
+                breaks++;
+                reset();
+            } else if (!active) {
+                eof();
+            } else {
+                highs++;
+            }
+        } else if (diff > 160) {
+            if (active) {
+                if (inFrame || frameBits > 0)
+                    unexpectedSOF++;
+                reset();
+                inFrame = true;
+                sof = start;
+            }
+        } else if (diff > 96) {
+            bit(!active);
+        } else if (diff > 32) {
+            bit(active);
+        } else {
+            runts++;
+        }
+    }
+
+    void bit(bool b) {
+        frameBits++;
+        byte = (byte << 1) | (b ? 1 : 0);
+        if (++bitCount == 8) {
+            bitCount = 0;
+            current.push_back(byte);
+        }
+    }
+
+    // no more pulses for a while: the frame in progress ends (receiveLoop's idle EOT)
+    void idle() {
+        if (inFrame)
+            eof();
+    }
+};
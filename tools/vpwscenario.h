@@ -0,0 +1,374 @@
+#pragma once
+
+//
+// vpwscenario: builds a simulated bus (vpwbus.h) from a script, for bussim and the host
+// build's virtual adapter (host/vpwpty.cpp)
+//
+// One directive per line (# comments):
+//
+//   seed <n>
+//   ecu <name> <address> [delay <us>]              answers physical requests to the address
+//   respond <ecu> <request hex> = <response hex>   a scripted answer (CRCs are added)
+//   traffic <name> <header hex> <n>/s|<n>% [<min>-<max> data bytes]
+//   tester <name> <request hex> every <ms>         polls and times the answers
+//   replay <name> <file.log|file.vpb> [<speed>%] [loop]
+//   noise <glitches/s> [<max us>]
+//   at <ms> break [<us>]                           drive a break
+//   at <ms> mode 1x|4x                             switch every node's mode
+//   at <ms> send <node> <hex>                      one frame from a node
+//   run <ms>
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "vpwbus.h"
+#include "../vpb.h"
+
+//
+// SCRIPT: timed actions, and the break driver
+//
+class VpwScript : public VpwNode {
+private:
+    struct Action {
+        uint64_t at;
+        std::string what;
+        std::vector<std::string> args;
+    };
+    std::vector<Action> actions;
+    size_t done = 0;
+    uint64_t breakEnd = 0;
+
+public:
+    std::function<void(VpwBus&, const std::string&, const std::vector<std::string>&)> handler;
+
+    VpwScript() : VpwNode("script") {}
+
+    void add(uint64_t at, const std::string& what, const std::vector<std::string>& args) {
+        auto it = actions.end();
+        while (it != actions.begin() && (it - 1)->at > at)
+            --it;
+        actions.insert(it, { at, what, args });
+        next = actions[done].at;
+    }
+
+    void breakFor(VpwBus& bus, uint64_t length) {
+        drive = true;
+        breakEnd = bus.now + length;
+    }
+
+    void event(VpwBus& bus) override {
+        if (drive && bus.now >= breakEnd)
+            drive = false;
+        while (done < actions.size() && actions[done].at <= bus.now) {
+            handler(bus, actions[done].what, actions[done].args);
+            done++;
+        }
+        next = done < actions.size() ? actions[done].at : VPW_NEVER;
+        if (drive)
+            next = std::min(next, breakEnd);
+    }
+};
+
+//
+// LOG PLAYER: the frames of an SD log (.log or .vpb) at their original relative timing
+//
+class VpwLogPlayer : public VpwTransmitter {
+private:
+    struct Entry {
+        uint64_t time;      // ns from the first frame
+        VpwFrame frame;
+    };
+    std::vector<Entry> entries;
+    size_t position = 0;
+    uint64_t offset = 0;    // bus time of the first frame in this pass
+
+    // "<sec>.<usec>\t[1X] 48 6B 10 ...[\t<text>]", as LogReplay reads it
+    static bool parseLine(const std::string& line, int64_t& us, VpwFrame& frame) {
+        const char* p = line.c_str();
+        char* end;
+        int64_t sec = strtoll(p, &end, 10);
+        if (end == p || *end != '.')
+            return false;
+        int64_t usec = strtoll(end + 1, &end, 10);
+        if (*end != '\t')
+            return false;
+        p = end + 1;
+        frame = VpwFrame();
+        if (p[0] == '[' && p[1] && p[2] == 'X' && p[3] == ']') {
+            frame.mode4X = (p[1] == '4');
+            p += 4;
+        } else if (strncmp(p, "[--]", 4) == 0) {
+            p += 4;
+        }
+        while (*p == ' ')
+            p++;
+        while (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) &&
+                (p[2] == ' ' || p[2] == '\t' || p[2] == '\r' || p[2] == '\n' || p[2] == 0)) {
+            frame.bytes.push_back((uint8_t)strtoul(std::string(p, 2).c_str(), nullptr, 16));
+            p += 2;
+            while (*p == ' ')
+                p++;
+        }
+        us = sec * 1000000 + usec;
+        return !frame.bytes.empty();
+    }
+
+    void add(int64_t us, const VpwFrame& frame, int64_t& first) {
+        if (first < 0)
+            first = us;
+        entries.push_back({ (uint64_t)std::max<int64_t>(0, us - first) * VPW_US * 100 / speed, frame });
+    }
+
+protected:
+    // queues what is due within the next 100ms
+    void onWake(VpwBus& bus) override {
+        if (entries.empty())
+            return;
+        while (position < entries.size() && offset + entries[position].time < bus.now + 100 * VPW_MS) {
+            send(bus, entries[position].frame, offset + entries[position].time);
+            position++;
+        }
+        if (position == entries.size()) {
+            if (!loop)
+                return;
+            offset += entries.back().time + 100 * VPW_MS;
+            position = 0;
+            passes++;
+        }
+        setWake(bus, std::max(bus.now + VPW_MS, offset + entries[position].time - 50 * VPW_MS));
+    }
+
+public:
+    unsigned speed = 100;   // percent
+    bool loop = false;
+    uint64_t passes = 0;
+
+    VpwLogPlayer(const std::string& name) : VpwTransmitter(name) {
+        jitter = 0;
+    }
+
+    // reads the whole log; false if it can't be read or has no frames
+    bool load(const std::string& filename) {
+        entries.clear();
+        int64_t first = -1;
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".vpb") == 0) {
+            FILE* f = fopen(filename.c_str(), "rb");
+            if (!f)
+                return false;
+            auto source = [f]() { return fgetc(f); };
+            VpbReader<decltype(source)> reader(source);
+            VpbHeader header;
+            VpbRecord r;
+            if (reader.header(header)) {
+                while (reader.next(r)) {
+                    if ((r.flags & VPB_SYNC) || r.frame.empty())
+                        continue;
+                    VpwFrame frame;
+                    frame.bytes = r.frame;
+                    frame.mode4X = (r.mode() == 4);
+                    add((int64_t)r.sec * 1000000 + r.usec, frame, first);
+                }
+            }
+            fclose(f);
+        } else {
+            std::ifstream in(filename);
+            if (!in)
+                return false;
+            std::string line;
+            int64_t us;
+            VpwFrame frame;
+            while (std::getline(in, line)) {
+                if (parseLine(line, us, frame))
+                    add(us, frame, first);
+            }
+        }
+        return !entries.empty();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    void start(VpwBus& bus, uint64_t at) {
+        offset = at;
+        position = 0;
+        setWake(bus, at);
+    }
+};
+
+//
+// SCENARIO: the nodes of a script on one bus
+//
+class VpwScenario {
+private:
+    static std::vector<uint8_t> hexBytes(const std::string& hex) {
+        VpwFrame f = VpwFrame::parse(hex);
+        f.bytes.pop_back();
+        return f.bytes;
+    }
+
+public:
+    VpwBus bus;
+    VpwNoise noise;
+    VpwScript script;
+    std::vector<std::unique_ptr<VpwTransmitter>> transmitters;
+    std::vector<VpwEcu*> ecus;
+    std::vector<VpwTraffic*> traffic;
+    std::vector<VpwTester*> testers;
+    uint64_t duration = 0;  // from "run", 0 if not given
+    bool mode4X = false;
+
+    VpwScenario() {
+        script.handler = [this](VpwBus& bus, const std::string& what, const std::vector<std::string>& args) {
+            if (what == "break") {
+                uint64_t length = args.empty() ? 500 * VPW_US : strtoull(args[0].c_str(), nullptr, 10) * VPW_US;
+                script.breakFor(bus, length);
+                noise.disturbed.push_back({ bus.now, bus.now + length });
+            } else if (what == "mode") {
+                setMode(args[0] == "4x" || args[0] == "4X");
+            } else if (what == "send") {
+                find(args[0])->send(bus, VpwFrame::parse(args[1], mode4X), bus.now);
+            }
+        };
+    }
+
+    VpwScenario(const VpwScenario&) = delete;
+    VpwScenario& operator=(const VpwScenario&) = delete;
+
+    VpwTransmitter* find(const std::string& name) {
+        for (auto& t : transmitters) {
+            if (t->name == name)
+                return t.get();
+        }
+        return nullptr;
+    }
+
+    template <class T>
+    T* add(T* node) {
+        transmitters.emplace_back(node);
+        bus.add(*node);
+        return node;
+    }
+
+    void setMode(bool x4) {
+        mode4X = x4;
+        for (VpwTraffic* t : traffic)
+            t->mode4X = x4;
+        for (VpwTester* t : testers)
+            t->mode4X = x4;
+    }
+
+    // false with the offending line in error
+    bool parse(std::istream& in, std::string& error) {
+        std::string line;
+        int number = 0;
+        while (std::getline(in, line)) {
+            number++;
+            size_t hash = line.find('#');
+            if (hash != std::string::npos)
+                line.erase(hash);
+            std::istringstream words(line);
+            std::vector<std::string> w;
+            std::string word;
+            while (words >> word)
+                w.push_back(word);
+            if (w.empty())
+                continue;
+            bool ok = true;
+            const std::string& cmd = w[0];
+            if (cmd == "seed" && w.size() == 2) {
+                bus.seed = strtoul(w[1].c_str(), nullptr, 0) | 1;
+            } else if (cmd == "ecu" && (w.size() == 3 || (w.size() == 5 && w[3] == "delay"))) {
+                uint64_t delay = w.size() == 5 ? strtoull(w[4].c_str(), nullptr, 10) * VPW_US : 2 * VPW_MS;
+                ecus.push_back(add(new VpwEcu(w[1], (uint8_t)strtoul(w[2].c_str(), nullptr, 16), delay)));
+            } else if (cmd == "respond" && w.size() == 5 && w[3] == "=") {
+                VpwEcu* ecu = dynamic_cast<VpwEcu*>(find(w[1]));
+                ok = ecu != nullptr;
+                if (ok)
+                    ecu->respond(w[2], w[4]);
+            } else if (cmd == "traffic" && (w.size() == 4 || w.size() == 5)) {
+                VpwTraffic* t = add(new VpwTraffic(w[1], bus, hexBytes(w[2])));
+                unsigned n = strtoul(w[3].c_str(), nullptr, 10);
+                if (w[3].find('%') != std::string::npos)
+                    t->load = n;
+                else
+                    t->rate = n;
+                if (w.size() == 5 && sscanf(w[4].c_str(), "%zu-%zu", &t->minPayload, &t->maxPayload) != 2)
+                    ok = false;
+                t->start(VPW_MS);
+                traffic.push_back(t);
+            } else if (cmd == "tester" && w.size() == 5 && w[3] == "every") {
+                VpwTester* t = add(new VpwTester(w[1], VpwFrame::parse(w[2]), strtoull(w[4].c_str(), nullptr, 10) * VPW_MS));
+                t->start(bus, 10 * VPW_MS);
+                testers.push_back(t);
+            } else if (cmd == "replay" && w.size() >= 3 && w.size() <= 5) {
+                VpwLogPlayer* p = add(new VpwLogPlayer(w[1]));
+                for (size_t i = 3; i < w.size(); i++) {
+                    if (w[i] == "loop")
+                        p->loop = true;
+                    else if (w[i].find('%') != std::string::npos)
+                        p->speed = std::max(1ul, strtoul(w[i].c_str(), nullptr, 10));
+                    else
+                        ok = false;
+                }
+                ok = ok && p->load(w[2]);
+                if (ok)
+                    p->start(bus, VPW_MS);
+            } else if (cmd == "noise" && (w.size() == 2 || w.size() == 3)) {
+                noise.rate = atof(w[1].c_str());
+                if (w.size() == 3)
+                    noise.maxGlitch = strtoull(w[2].c_str(), nullptr, 10) * VPW_US;
+            } else if (cmd == "at" && w.size() >= 3) {
+                uint64_t at = strtoull(w[1].c_str(), nullptr, 10) * VPW_MS;
+                std::vector<std::string> args(w.begin() + 3, w.end());
+                ok = (w[2] == "break" && args.size() <= 1) || (w[2] == "mode" && args.size() == 1) ||
+                        (w[2] == "send" && args.size() == 2 && find(args[0]));
+                if (ok)
+                    script.add(at, w[2], args);
+            } else if (cmd == "run" && w.size() == 2) {
+                duration = strtoull(w[1].c_str(), nullptr, 10) * VPW_MS;
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                error = "line " + std::to_string(number) + ": " + line;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse(const char* filename, std::string& error) {
+        std::ifstream in(filename);
+        if (!in) {
+            error = std::string("can't open ") + filename;
+            return false;
+        }
+        return parse(in, error);
+    }
+
+    // a PCM (10) and a TCM (18) answering physical requests after 2 and 3ms, and a
+    // broadcaster (486B10, higher priority than diagnostics) taking load% of the bus
+    void defaults(unsigned load) {
+        ecus.push_back(add(new VpwEcu("PCM", 0x10, 2 * VPW_MS)));
+        ecus.push_back(add(new VpwEcu("TCM", 0x18, 3 * VPW_MS)));
+        if (load > 0) {
+            VpwTraffic* t = add(new VpwTraffic("broadcast", bus, { 0x48, 0x6B, 0x10 }));
+            t->load = load;
+            t->start(VPW_MS);
+            traffic.push_back(t);
+        }
+    }
+
+    // adds the noise and script drivers once everything else is on the bus
+    void start() {
+        bus.add(noise);
+        bus.add(script);
+        noise.start(bus);
+    }
+};
@@ -63,7 +63,7 @@ struct Util {
     }
     std::string dec(ulong x, byte digits) {
       char dec[32];
-      snprintf(dec, sizeof(dec), "%0*d", min(digits, 31), x);
+      snprintf(dec, sizeof(dec), "%0*lu", min(digits, 31), x);
       return std::string(dec);
     }
     std::string dec(float x, byte leading, byte decimals) {
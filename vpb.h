@@ -0,0 +1,416 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//
+// VPB: compact binary log format (shared by the firmware and the host tools in tools/)
+//
+//   header:   "VPB1"|"VPB2" <epoch sec:4> <epoch usec:4> <firmware: len8 + text> <settings: len16 + text>
+//   records:  <length:1> <flags:1> <delta usec: zigzag LEB128> <payload>
+//             length counts the flags, delta and payload bytes; a zero length ends the records
+//   index:    "VPBX" <count:4> { <offset:4> <sec:4> <usec:4> } ... <index offset:4> "VPBI"
+//
+// Each record's delta is relative to the previous record.  A SYNC record carries an absolute
+// <sec:4> <usec:4> payload and restarts the chain; the logger writes one whenever a file is
+// (re)opened and at every index point, and each index entry points at one, so a reader can
+// start decoding at any indexed offset.  The index is only present once the file has been
+// rotated; readers fall back to a sequential scan without it.
+//
+// VPB2 files are compressed against a small dictionary holding the last frame seen for each
+// header (the first three bytes).  A frame that repeats its dictionary entry is stored as just
+// the slot number (REPEAT); a frame of the same length is stored as the slot, a bitmask of the
+// bytes that changed and those bytes (DELTA).  Anything else is stored in full and replaces the
+// dictionary entry, evicting slots round-robin once all are in use.  Both sides clear the
+// dictionary at every SYNC record so decoding can still start at any index point.
+//
+// Multi-byte values are little-endian.
+//
+
+#define VPB_MAGIC         "VPB1"
+#define VPB_MAGIC_DELTA   "VPB2"
+#define VPB_INDEX_MAGIC   "VPBX"
+#define VPB_TRAILER_MAGIC "VPBI"
+
+#ifndef VPB_INDEX_INTERVAL
+#define VPB_INDEX_INTERVAL 5 // seconds between index points (doubles whenever the index fills)
+#endif
+
+#ifndef VPB_INDEX_SIZE
+#define VPB_INDEX_SIZE 256
+#endif
+
+#ifndef VPB_DICTIONARY_SIZE
+#define VPB_DICTIONARY_SIZE 48 // headers remembered for compression
+#endif
+
+#ifndef VPB_DICTIONARY_FRAME
+#define VPB_DICTIONARY_FRAME 16 // longer frames are always stored in full
+#endif
+
+enum vpbFlags : uint8_t {
+    VPB_MODE_MASK = 0x03, // 0 = unspecified, 1 = 1X, 2 = 4X
+    VPB_FRAME     = 0x04, // payload has frame bytes (preceded by a length byte if VPB_TEXT is also set)
+    VPB_TEXT      = 0x08, // payload has (the rest is) text, e.g. notifications or [BREAK]
+    VPB_SYNC      = 0x10, // payload is an absolute timestamp
+    VPB_DELTA     = 0x20, // payload is <slot> <changed-byte mask> <changed bytes> (VPB2)
+    VPB_REPEAT    = 0x40  // payload is <slot>: the frame is unchanged (VPB2)
+};
+
+struct VpbIndexEntry {
+    uint32_t offset;
+    uint32_t sec;
+    uint32_t usec;
+};
+
+struct VpbRecord {
+    uint8_t flags = 0;
+    uint32_t sec = 0;
+    uint32_t usec = 0;
+    std::vector<uint8_t> frame;
+    std::string text;
+
+    // 1 = 1X, 4 = 4X, 0 = unspecified (same as Message::mode)
+    uint8_t mode() const {
+        uint8_t m = flags & VPB_MODE_MASK;
+        return m == 2 ? 4 : m;
+    }
+};
+
+struct VpbHeader {
+    uint32_t sec = 0;
+    uint32_t usec = 0;
+    std::string firmware;
+    std::string settings;
+};
+
+//
+// Last frame per header, kept identically by the encoder and the reader (about 1KB)
+//
+class VpbDictionary {
+private:
+    struct Slot {
+        uint8_t length = 0; // 0 = unused
+        uint8_t frame[VPB_DICTIONARY_FRAME];
+    };
+    Slot slots[VPB_DICTIONARY_SIZE];
+    uint8_t next = 0;
+
+    static size_t keyLength(size_t length) {
+        return length < 3 ? length : 3;
+    }
+
+public:
+    void clear() {
+        for (Slot& slot : slots)
+            slot.length = 0;
+        next = 0;
+    }
+
+    // slot holding a frame with the same header, or -1
+    int find(const uint8_t* frame, size_t length) const {
+        size_t key = keyLength(length);
+        for (int i = 0; i < VPB_DICTIONARY_SIZE; i++) {
+            const Slot& slot = slots[i];
+            if (slot.length >= key && slot.length > 0 && memcmp(slot.frame, frame, key) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    const uint8_t* frame(int slot) const {
+        return slots[slot].frame;
+    }
+
+    size_t length(int slot) const {
+        return slots[slot].length;
+    }
+
+    // records a frame that was stored in full (or rebuilt from a delta)
+    void update(int slot, const uint8_t* frame, size_t length) {
+        if (length == 0 || length > VPB_DICTIONARY_FRAME)
+            return;
+        if (slot < 0) {
+            slot = next;
+            next = (next + 1) % VPB_DICTIONARY_SIZE;
+        }
+        slots[slot].length = length;
+        memcpy(slots[slot].frame, frame, length);
+    }
+};
+
+class VpbEncoder {
+private:
+    uint32_t lastSec = 0;
+    uint32_t lastUsec = 0;
+    VpbDictionary dictionary;
+
+    static void put32(std::vector<uint8_t>& out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out.push_back((value >> (8 * i)) & 0xFF);
+    }
+
+public:
+    bool compress = true; // must match the magic passed to header()
+
+    static void header(std::vector<uint8_t>& out, uint32_t sec, uint32_t usec, const std::string& firmware, const std::string& settings, bool compress = true) {
+        out.insert(out.end(), (compress ? VPB_MAGIC_DELTA : VPB_MAGIC), (compress ? VPB_MAGIC_DELTA : VPB_MAGIC) + 4);
+        put32(out, sec);
+        put32(out, usec);
+        size_t fw = firmware.size() < 0xFF ? firmware.size() : 0xFF;
+        out.push_back(fw);
+        out.insert(out.end(), firmware.begin(), firmware.begin() + fw);
+        size_t st = settings.size() < 0xFFFF ? settings.size() : 0xFFFF;
+        out.push_back(st & 0xFF);
+        out.push_back(st >> 8);
+        out.insert(out.end(), settings.begin(), settings.begin() + st);
+    }
+
+    void sync(std::vector<uint8_t>& out, uint32_t sec, uint32_t usec) {
+        out.push_back(10);
+        out.push_back(VPB_SYNC);
+        out.push_back(0);
+        put32(out, sec);
+        put32(out, usec);
+        lastSec = sec;
+        lastUsec = usec;
+        dictionary.clear();
+    }
+
+    // appends one record; returns false (and appends nothing) if it can't fit in a record
+    bool record(std::vector<uint8_t>& out, uint32_t sec, uint32_t usec, uint8_t mode, const uint8_t* frame, size_t frameSize, const char* text, size_t textSize) {
+        uint8_t flags = (mode == 4 ? 2 : mode == 1 ? 1 : 0);
+        if (frameSize > 0)
+            flags |= VPB_FRAME;
+        if (textSize > 0)
+            flags |= VPB_TEXT;
+
+        int64_t delta = ((int64_t)sec - lastSec) * 1000000 + ((int64_t)usec - lastUsec);
+        uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+        uint8_t varint[10];
+        size_t varintSize = 0;
+        do {
+            varint[varintSize] = zigzag & 0x7F;
+            zigzag >>= 7;
+            if (zigzag)
+                varint[varintSize] |= 0x80;
+            varintSize++;
+        } while (zigzag);
+
+        int slot = (compress && frameSize > 0) ? dictionary.find(frame, frameSize) : -1;
+        const uint8_t* previous = nullptr;
+        uint8_t mask[(VPB_DICTIONARY_FRAME + 7) / 8] = {};
+        size_t changed = 0;
+        size_t maskSize = 0;
+        if (slot >= 0 && textSize == 0 && dictionary.length(slot) == frameSize) {
+            previous = dictionary.frame(slot);
+            for (size_t i = 0; i < frameSize; i++) {
+                if (frame[i] != previous[i]) {
+                    mask[i / 8] |= 1 << (i % 8);
+                    changed++;
+                }
+            }
+            maskSize = changed ? (frameSize + 7) / 8 : 0;
+            // a delta has to be smaller than the frame, or it's stored in full
+            if (changed && 1 + maskSize + changed >= frameSize)
+                previous = nullptr;
+        }
+        if (previous) {
+            // same header, same length: store only what changed
+            out.push_back(1 + varintSize + 1 + maskSize + changed);
+            out.push_back((flags & VPB_MODE_MASK) | (changed ? VPB_DELTA : VPB_REPEAT));
+            out.insert(out.end(), varint, varint + varintSize);
+            out.push_back(slot);
+            out.insert(out.end(), mask, mask + maskSize);
+            for (size_t i = 0; i < frameSize && changed; i++) {
+                if (frame[i] != previous[i])
+                    out.push_back(frame[i]);
+            }
+            dictionary.update(slot, frame, frameSize);
+            lastSec = sec;
+            lastUsec = usec;
+            return true;
+        }
+
+        size_t length = 1 + varintSize + frameSize + textSize + ((frameSize && textSize) ? 1 : 0);
+        if (length > 0xFF)
+            return false;
+
+        out.push_back(length);
+        out.push_back(flags);
+        out.insert(out.end(), varint, varint + varintSize);
+        if (frameSize && textSize)
+            out.push_back(frameSize);
+        out.insert(out.end(), frame, frame + frameSize);
+        out.insert(out.end(), text, text + textSize);
+        if (compress)
+            dictionary.update(slot, frame, frameSize);
+        lastSec = sec;
+        lastUsec = usec;
+        return true;
+    }
+
+    // blockOffset is the file offset at which this block will be written
+    static void index(std::vector<uint8_t>& out, uint32_t blockOffset, const std::vector<VpbIndexEntry>& entries) {
+        out.push_back(0); // end of records
+        out.insert(out.end(), VPB_INDEX_MAGIC, VPB_INDEX_MAGIC + 4);
+        put32(out, entries.size());
+        for (const VpbIndexEntry& e : entries) {
+            put32(out, e.offset);
+            put32(out, e.sec);
+            put32(out, e.usec);
+        }
+        put32(out, blockOffset + 1);
+        out.insert(out.end(), VPB_TRAILER_MAGIC, VPB_TRAILER_MAGIC + 4);
+    }
+};
+
+//
+// Sequential decoder; Source is any callable returning the next byte, or -1 at end of file
+//
+template <typename Source>
+class VpbReader {
+private:
+    Source& source;
+    uint32_t lastSec = 0;
+    uint32_t lastUsec = 0;
+    bool compressed = false;
+    VpbDictionary dictionary;
+
+    bool get(uint8_t* data, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            int c = source();
+            if (c < 0)
+                return false;
+            data[i] = c;
+        }
+        return true;
+    }
+
+    static uint32_t get32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+public:
+    VpbReader(Source& source) : source(source) { }
+
+    // for a record stream without a file header (e.g. a flash log sector)
+    VpbReader(Source& source, bool compressed) : source(source), compressed(compressed) { }
+
+    bool header(VpbHeader& h) {
+        uint8_t buffer[0x100];
+        if (!get(buffer, 13))
+            return false;
+        compressed = memcmp(buffer, VPB_MAGIC_DELTA, 4) == 0;
+        if (!compressed && memcmp(buffer, VPB_MAGIC, 4) != 0)
+            return false;
+        h.sec = lastSec = get32(buffer + 4);
+        h.usec = lastUsec = get32(buffer + 8);
+        h.firmware.resize(buffer[12]);
+        if (!get((uint8_t*)h.firmware.data(), h.firmware.size()))
+            return false;
+        uint8_t length[2];
+        if (!get(length, 2))
+            return false;
+        h.settings.resize(length[0] | (length[1] << 8));
+        return get((uint8_t*)h.settings.data(), h.settings.size());
+    }
+
+    // returns false at the end of the records (or of a truncated file)
+    bool next(VpbRecord& r) {
+        uint8_t buffer[0x100];
+        if (!get(buffer, 1) || buffer[0] == 0)
+            return false;
+        size_t length = buffer[0];
+        if (!get(buffer, length))
+            return false;
+
+        r.flags = buffer[0];
+        size_t pos = 1;
+        uint64_t zigzag = 0;
+        for (int shift = 0; pos < length; shift += 7) {
+            uint8_t b = buffer[pos++];
+            zigzag |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        int64_t delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+
+        if (r.flags & VPB_SYNC) {
+            if (length < pos + 8)
+                return false;
+            lastSec = get32(buffer + pos);
+            lastUsec = get32(buffer + pos + 4);
+            dictionary.clear();
+        } else {
+            int64_t us = (int64_t)lastUsec + delta;
+            int64_t carry = (us >= 0) ? us / 1000000 : -((999999 - us) / 1000000);
+            lastSec += carry;
+            lastUsec = us - carry * 1000000;
+        }
+        r.sec = lastSec;
+        r.usec = lastUsec;
+
+        if (r.flags & (VPB_DELTA | VPB_REPEAT)) {
+            if (pos >= length || buffer[pos] >= VPB_DICTIONARY_SIZE)
+                return false;
+            int slot = buffer[pos++];
+            size_t frameSize = dictionary.length(slot);
+            r.frame.assign(dictionary.frame(slot), dictionary.frame(slot) + frameSize);
+            if (r.flags & VPB_DELTA) {
+                const uint8_t* mask = buffer + pos;
+                pos += (frameSize + 7) / 8;
+                for (size_t i = 0; i < frameSize && pos <= length; i++) {
+                    if (mask[i / 8] & (1 << (i % 8)))
+                        r.frame[i] = (pos < length) ? buffer[pos++] : 0;
+                }
+            }
+            r.text.clear();
+            dictionary.update(slot, r.frame.data(), r.frame.size());
+            return true;
+        }
+
+        size_t frameSize = 0;
+        if ((r.flags & VPB_FRAME) && (r.flags & VPB_TEXT))
+            frameSize = (pos < length) ? buffer[pos++] : 0;
+        else if (r.flags & VPB_FRAME)
+            frameSize = length - pos;
+        if (r.flags & VPB_SYNC)
+            frameSize = 0;
+        frameSize = (pos + frameSize <= length) ? frameSize : length - pos;
+        r.frame.assign(buffer + pos, buffer + pos + frameSize);
+        pos += frameSize;
+        r.text.assign((const char*)buffer + pos, (r.flags & VPB_TEXT) ? length - pos : 0);
+        if (compressed && frameSize > 0)
+            dictionary.update(dictionary.find(r.frame.data(), frameSize), r.frame.data(), frameSize);
+        return true;
+    }
+};
+
+//
+// Text line for a record, matching the SD text log (Message::tostring with 10-digit seconds,
+// headers, spaces and the [1X]/[4X] mode tag), without the line terminator
+//
+inline std::string vpbText(const VpbRecord& r) {
+    static const char* hexDigits = "0123456789ABCDEF";
+    char ts[24];
+    snprintf(ts, sizeof(ts), "%010lu.%06lu\t", (unsigned long)r.sec, (unsigned long)r.usec);
+    std::string ret(ts);
+    if (r.frame.size() > 0) {
+        uint8_t mode = r.mode();
+        ret += (mode == 4 ? "[4X] " : mode == 1 ? "[1X] " : "[--] ");
+        for (size_t i = 0; i < r.frame.size(); i++) {
+            if (i > 0)
+                ret += ' ';
+            ret += hexDigits[r.frame[i] >> 4];
+            ret += hexDigits[r.frame[i] & 0x0F];
+        }
+        if (r.text.size() > 0)
+            ret += '\t';
+    }
+    ret += r.text;
+    return ret;
+}
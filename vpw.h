@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hardware/pio.h"
+#include "clock.h"
 #include "pins.h"
 #include "vpw_led.h"
 #include "j1850.h"
@@ -28,6 +29,8 @@ enum wildcardEncoding : byte {
   W_TIMESTAMP = 0xFF
 };
 
+#define VPW_SOF_DELAY_US 280 // passive bus the send program waits for before SOF (1X; a quarter of this at 4X)
+
 enum sendVPW_status_t : byte {
   SEND_VPW_STATUS_CONGESTION = 0,
   SEND_VPW_STATUS_OK = 1,
@@ -61,6 +64,14 @@ class VPW {
     static inline bool USE_TIMESTAMP = true;
     static inline bool SEND_4X = false;
 
+    // set by sendRaw: micros() at the SOF of the last frame sent, and attempts lost to congestion
+    static inline volatile uint lastSOF = 0;
+    static inline volatile ulong congestionRetries = 0;
+
+    // micros() at the last pulse the decoder took from the bus (for FlashLog, which parks core 0)
+    static inline volatile uint lastActivity = 0;
+    static ulong rxOverruns();
+
     static void reset();
     
     static bool sendRaw(const byte* data, uint16_t bytes, bool send4X = VPW::SEND_4X);
@@ -72,6 +83,11 @@ class VPW {
 
     static bool available();
     static bool idle();
+
+    // feeds pulses (in the receive program's format) to the decoder, as if from the bus (see loadgen.h)
+    static void inject(const uint* pulses, size_t count);
+    static size_t rawDepth();
+    static size_t encodedDepth();
         
     static void setReceiveLedHandler(led_handler_t handler);
 
@@ -97,7 +113,7 @@ bool VPW::begin() {
   _smSend = beginSend();
   _smReceive = beginReceive();
 
-  ok = (_smSend != -1 && _smReceive != -1);
+  ok = (_smSend != (uint)-1 && _smReceive != (uint)-1);
   return ok;
 }
 
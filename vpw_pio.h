@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+
+//
+// PIO PROGRAMS
+//
+// The receive and send state machine programs, shared by vpw_receive.ino/vpw_send.ino and the
+// host-side PIO emulator (tools/pioemu.h), so the exact opcodes loaded on the device can be run
+// against synthetic waveforms on a PC.
+//
+
+#define vpw_receive_wrap_target 2
+#define vpw_receive_wrap 23
+
+//
+// WITH CLOCK DIVIDER SET TO CPU HZ / 5000000, EACH INSTRUCTION TAKES 200ns
+//
+static const uint16_t vpw_receive_program_instructions[] = {
+    0xa04b, //  0: mov    y, !null                   
+    0x2020, //  1: wait   0 pin, 0                   
+            //     .wrap_target
+    0xa0c3, //  2: mov    isr, null                  ; count LOW duration
+    0x4001, //  3: in     pins, 1                    
+    0xa026, //  4: mov    x, isr                     
+    0x0048, //  5: jmp    x--, 8                     
+    0x0082, //  6: jmp    y--, 2                     
+    0x20a0, //  7: wait   1 pin, 0                   
+    0xa0ca, //  8: mov    isr, !y                    ; got HIGH edge
+    0xa04b, //  9: mov    y, !null                   
+    0x4061, // 10: in     null, 1                    ; shift out MSB of counter, make LSB of result 0 for pin low
+    0x8000, // 11: push   noblock                    
+    0xc001, // 12: irq    nowait 1                   
+    0xa0c3, // 13: mov    isr, null                  ; count HIGH duration
+    0x4001, // 14: in     pins, 1                    
+    0xa026, // 15: mov    x, isr                     
+    0x0033, // 16: jmp    !x, 19                     ; sure would be nice if we had a JMP !PINS instruction...
+    0x008d, // 17: jmp    y--, 13                    
+    0x2020, // 18: wait   0 pin, 0                   
+    0xa0ca, // 19: mov    isr, !y                    ; got LOW edge
+    0xa04b, // 20: mov    y, !null                   
+    0x4041, // 21: in     y, 1                       ; shift out MSB of counter, make LSB of result 1 for pin high
+    0x8000, // 22: push   noblock                    
+    0xc001, // 23: irq    nowait 1                   
+            //     .wrap
+};
+
+#define vpw_send_wrap_target 0
+#define vpw_send_wrap 30
+
+//
+// WITH CLOCK DIVIDER SET TO CPU HZ /  250000, EACH INSTRUCTION TAKES 4us (1X MODE)
+// WITH CLOCK DIVIDER SET TO CPU HZ / 1000000, EACH INSTRUCTION TAKES 1us (4X MODE)
+//
+
+static const uint16_t vpw_send_program_instructions[] = {
+    //      .wrap_target
+    //      start:
+    0xe000, //  0: set    pins, 0       ; passive
+    0x6048, //  1: out    y, 8          ; read # of bit pairs in message (1 byte = 4)
+    0x0060, //  2: jmp    !y, 0         ; if # bytes is zero, ignore
+    //      multiply_by_4:
+    0x4048, //  3: in     y, 8          ; if successful, isr return value will be > 0
+    0x4062, //  4: in     null, 2
+    0xa046, //  5: mov    y, isr
+    0x0087, //  6: jmp    y--, 7        ; subtract 1 from byte count since the loop runs before decrementing
+    //      subtracted:
+    0xe036, //  7: set    x, 22         ; wait for 280us of passive bus
+    //      wait_280:
+    0x01da, //  8: jmp    pin, 26  [1]  ; check for congestion
+    0x0048, //  9: jmp    x--, 8
+    0x00da, // 10: jmp    pin, 26       ; double-check for congestion
+    //      sof:
+    0xe001, // 11: set    pins, 1       ; active for 200us (SOF)
+    0xe136, // 12: set    x, 22    [1]
+    //      wait_200:
+    0x014d, // 13: jmp    x--, 13  [1]
+    //      loop_data:
+    0x6021, // 14: out    x, 1          ; read next bit (passive)
+    0xec00, // 15: set    pins, 0  [12] ; passive for 64us
+    0x0032, // 16: jmp    !x, 18
+    0xaf42, // 17: nop             [15] ; wait another ~64us if bit is 1
+    //      passive_short:
+    0x00db, // 18: jmp    pin, 27       ; check for congestion
+    0x6021, // 19: out    x, 1          ; read next bit (active)
+    0xec01, // 20: set    pins, 1  [12] ; active for 64us
+    0x0057, // 21: jmp    x--, 23
+    0xaf42, // 22: nop             [15] ; wait another 64us if bit is 0
+    //      active_short:
+    0x008e, // 23: jmp    y--, 14
+    //      complete:
+    0xe000, // 24: set    pins, 0       ; passive
+    0x001e, // 25: jmp    30
+    //      congestion:
+    0x6021, // 26: out    x, 1          ; discard unused passive bit
+    //      congestion_in_loop:
+    0x6021, // 27: out    x, 1          ; discard unused active bit
+    0x009a, // 28: jmp    y--, 26
+    0xa0c3, // 29: mov    isr, null     ; clear isr so return value will == 0
+    //      finish:
+    0x8020, // 30: push   block         ; send return value in isr to cpu
+    //      .wrap
+};
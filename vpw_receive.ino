@@ -2,6 +2,7 @@
 #include <cstring>
 #include "vpw.h"
 #include "pins.h"
+#include "vpw_pio.h"
 
 byte vpwByteBuffer = 0;
 byte vpwBitCount = 0;
@@ -17,41 +18,6 @@ ulong VPW::getMessagesReceived() { return vpwMessagesReceived; }
 std::deque<uint> rawQueue;
 std::deque<byte> encodedQueue;
 
-#define vpw_receive_wrap_target 2
-#define vpw_receive_wrap 23
-
-//
-// WITH CLOCK DIVIDER SET TO CPU HZ / 5000000, EACH INSTRUCTION TAKES 200ns
-//
-static const uint16_t vpw_receive_program_instructions[] = {
-    0xa04b, //  0: mov    y, !null                   
-    0x2020, //  1: wait   0 pin, 0                   
-            //     .wrap_target
-    0xa0c3, //  2: mov    isr, null                  ; count LOW duration
-    0x4001, //  3: in     pins, 1                    
-    0xa026, //  4: mov    x, isr                     
-    0x0048, //  5: jmp    x--, 8                     
-    0x0082, //  6: jmp    y--, 2                     
-    0x20a0, //  7: wait   1 pin, 0                   
-    0xa0ca, //  8: mov    isr, !y                    ; got HIGH edge
-    0xa04b, //  9: mov    y, !null                   
-    0x4061, // 10: in     null, 1                    ; shift out MSB of counter, make LSB of result 0 for pin low
-    0x8000, // 11: push   noblock                    
-    0xc001, // 12: irq    nowait 1                   
-    0xa0c3, // 13: mov    isr, null                  ; count HIGH duration
-    0x4001, // 14: in     pins, 1                    
-    0xa026, // 15: mov    x, isr                     
-    0x0033, // 16: jmp    !x, 19                     ; sure would be nice if we had a JMP !PINS instruction...
-    0x008d, // 17: jmp    y--, 13                    
-    0x2020, // 18: wait   0 pin, 0                   
-    0xa0ca, // 19: mov    isr, !y                    ; got LOW edge
-    0xa04b, // 20: mov    y, !null                   
-    0x4041, // 21: in     y, 1                       ; shift out MSB of counter, make LSB of result 1 for pin high
-    0x8000, // 22: push   noblock                    
-    0xc001, // 23: irq    nowait 1                   
-            //     .wrap
-};
-
 static const struct pio_program vpw_receive_program = {
     .instructions = vpw_receive_program_instructions,
     .length = 24,
@@ -70,8 +36,8 @@ uint VPW::beginReceive() {
     // sanity check and initialize state machine
     if (!pio_can_add_program(pio, &vpw_receive_program))
         return -1;
-    uint sm = pio_claim_unused_sm(pio, true);
-    if (sm == -1)
+    int sm = pio_claim_unused_sm(pio, true);
+    if (sm < 0)
         return -1;
 
     // load program
@@ -121,6 +87,20 @@ void VPW::reset() {
     encodedQueue.clear();
 }
 
+void VPW::inject(const uint* pulses, size_t count) {
+    noInterrupts(); // receiveHandler pushes to the same queue
+    rawQueue.insert(rawQueue.end(), pulses, pulses + count);
+    interrupts();
+}
+
+size_t VPW::rawDepth() {
+    return rawQueue.size();
+}
+
+size_t VPW::encodedDepth() {
+    return encodedQueue.size();
+}
+
 inline void VPW::receiveHandler() {
   static uint value;
   do {
@@ -133,17 +113,15 @@ inline void VPW::receiveHandler() {
 }
 
 bool VPW::receiveLoop() {
-  static bool proceed;
   static bool active;
   static ulong diff;
-  static ulong lastActivity = 0;
   static bool activityThisLoop;
   static bool receive4x = false;
 
   activityThisLoop = false;
   
   while (!VPW::idle()) {
-    lastActivity = micros();
+    lastActivity = Clock::micros();
     activityThisLoop = true;
     
     diff = rawQueue.front();
@@ -212,7 +190,7 @@ bool VPW::receiveLoop() {
   }
   
   if (vpwInFrame && VPW::idle()) {
-    diff = (micros() - lastActivity) & 32767;
+    diff = (Clock::micros() - lastActivity) & 32767;
     if (diff > 240 && active) {
       vpw_eof();
       push2encoded(W_EOT);
@@ -243,10 +221,22 @@ void debug(const char* text) {
   push2encoded(W_DEBUG_STRING);
   size_t length = std::strlen(text);
   push2(length);
-  for (int i = 0; i < length; i++)
+  for (size_t i = 0; i < length; i++)
     push2(text[i]);
 }
 
+// Pulses lost because the receive FIFO was full (core 0 didn't empty it in time): the state
+// machine flags it in FDEBUG, and each check that finds the flag counts one
+ulong VPW::rxOverruns() {
+  static ulong overruns = 0;
+  uint32_t stall = 1u << (PIO_FDEBUG_RXSTALL_LSB + _smReceive);
+  if (_pioReceive->fdebug & stall) {
+    _pioReceive->fdebug = stall; // write 1 to clear
+    overruns++;
+  }
+  return overruns;
+}
+
 bool VPW::idle() {
   return rawQueue.size() == 0;
 }
@@ -295,9 +285,7 @@ void push2timestamp() {
 }
 
 struct timeval VPW::getTimestamp() {
-    static struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv;    
+    return Clock::now();
 }
 
 struct timeval VPW::popTimestamp() {
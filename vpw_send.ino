@@ -1,62 +1,6 @@
 #include "pins.h"
 #include "vpw.h"
-
-#define vpw_send_wrap_target 0
-#define vpw_send_wrap 30
-
-//
-// WITH CLOCK DIVIDER SET TO CPU HZ /  250000, EACH INSTRUCTION TAKES 4us (1X MODE)
-// WITH CLOCK DIVIDER SET TO CPU HZ / 1000000, EACH INSTRUCTION TAKES 1us (4X MODE)
-//
-
-static const uint16_t vpw_send_program_instructions[] = {
-    //      .wrap_target
-    //      start:
-    0xe000, //  0: set    pins, 0       ; passive
-    0x6048, //  1: out    y, 8          ; read # of bit pairs in message (1 byte = 4)
-    0x0060, //  2: jmp    !y, 0         ; if # bytes is zero, ignore
-    //      multiply_by_4:
-    0x4048, //  3: in     y, 8          ; if successful, isr return value will be > 0
-    0x4062, //  4: in     null, 2
-    0xa046, //  5: mov    y, isr
-    0x0087, //  6: jmp    y--, 7        ; subtract 1 from byte count since the loop runs before decrementing
-    //      subtracted:
-    0xe036, //  7: set    x, 22         ; wait for 280us of passive bus
-    //      wait_280:
-    0x01da, //  8: jmp    pin, 26  [1]  ; check for congestion
-    0x0048, //  9: jmp    x--, 8
-    0x00da, // 10: jmp    pin, 26       ; double-check for congestion
-    //      sof:
-    0xe001, // 11: set    pins, 1       ; active for 200us (SOF)
-    0xe136, // 12: set    x, 22    [1]
-    //      wait_200:
-    0x014d, // 13: jmp    x--, 13  [1]
-    //      loop_data:
-    0x6021, // 14: out    x, 1          ; read next bit (passive)
-    0xec00, // 15: set    pins, 0  [12] ; passive for 64us
-    0x0032, // 16: jmp    !x, 18
-    0xaf42, // 17: nop             [15] ; wait another ~64us if bit is 1
-    //      passive_short:
-    0x00db, // 18: jmp    pin, 27       ; check for congestion
-    0x6021, // 19: out    x, 1          ; read next bit (active)
-    0xec01, // 20: set    pins, 1  [12] ; active for 64us
-    0x0057, // 21: jmp    x--, 23
-    0xaf42, // 22: nop             [15] ; wait another 64us if bit is 0
-    //      active_short:
-    0x008e, // 23: jmp    y--, 14
-    //      complete:
-    0xe000, // 24: set    pins, 0       ; passive
-    0x001e, // 25: jmp    30
-    //      congestion:
-    0x6021, // 26: out    x, 1          ; discard unused passive bit
-    //      congestion_in_loop:
-    0x6021, // 27: out    x, 1          ; discard unused active bit
-    0x009a, // 28: jmp    y--, 26
-    0xa0c3, // 29: mov    isr, null     ; clear isr so return value will == 0
-    //      finish:
-    0x8020, // 30: push   block         ; send return value in isr to cpu
-    //      .wrap
-};
+#include "vpw_pio.h"
 
 static const struct pio_program vpw_send_program = {
     .instructions = vpw_send_program_instructions,
@@ -82,8 +26,8 @@ uint VPW::beginSend() {
     // initialize state machine
     if (!pio_can_add_program(pio, &vpw_send_program))
         return -1;
-    uint sm = pio_claim_unused_sm(pio, true);
-    if (sm == -1)
+    int sm = pio_claim_unused_sm(pio, true);
+    if (sm < 0)
         return -1;
 
     // load program
@@ -121,10 +65,10 @@ uint VPW::beginSend() {
 static volatile bool sending = false;
 
 bool VPW::sendRaw(const byte* data, uint16_t bytes, bool send4X) {
-  if (_smSend == -1 || data == NULL || bytes == 0)
+  if (_smSend == (uint)-1 || data == NULL || bytes == 0)
     return false;
   sending = true;
-  uint timeout = millis();
+  uint timeout = Clock::millis();
   bool congestion = false;
 
   // set PIO clock speed for 1x or 4x
@@ -138,9 +82,10 @@ bool VPW::sendRaw(const byte* data, uint16_t bytes, bool send4X) {
   
   // enable + wait 80us according to MC33390 datasheet
   digitalWriteFast(PIN_VPW_ENABLE, HIGH);
-  delayMicroseconds(80);
+  Clock::delayMicroseconds(80);
 
-  while (millis() - timeout < 1000 /* ONE SECOND TIMEOUT */) {
+  while (Clock::millis() - timeout < 1000 /* ONE SECOND TIMEOUT */) {
+    uint attempt = Clock::micros();
     byte padding = (3 - (bytes % 4)) % 4;
     uint w = bytes;
     byte bits = 8;
@@ -163,6 +108,7 @@ bool VPW::sendRaw(const byte* data, uint16_t bytes, bool send4X) {
     
     // PIO sends 1 for successful send, 0 for congestion
     if (pio_sm_get_blocking(_pioSend, _smSend) > 0) {
+      lastSOF = attempt + (send4X ? VPW_SOF_DELAY_US / 4 : VPW_SOF_DELAY_US);
       digitalWriteFast(PIN_VPW_ENABLE, LOW); // disable transceiver
       digitalWriteFast(PIN_VPW_MODE, LOW); // 1X
       if (_ledHandler)
@@ -171,6 +117,7 @@ bool VPW::sendRaw(const byte* data, uint16_t bytes, bool send4X) {
       return true;
     }
     congestion = true;
+    congestionRetries = congestionRetries + 1;
     sending = false;
   }
   